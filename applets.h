@@ -151,14 +151,25 @@ static const struct applet_t {
 	case 'C': no_colors(); break; \
 	default: applet ## _usage(EXIT_FAILURE); break;
 
+/* for applets that can do their work in parallel, goes before the
+ * common options, jobs remains 0 when it isn't given */
+#define JOBS_LONG_OPT \
+	{"jobs",       a_argument, NULL, 0x2}
+#define JOBS_OPT_HELP \
+	"Number of parallel jobs to use"
+#define JOBS_GETOPTS_CASE \
+	case 0x2: jobs = parse_jobs(optarg); break;
+
 extern char *portarch;
 extern char *portroot;
 extern int verbose;
 extern int quiet;
+extern int jobs;
 extern char pretend;
 extern char *config_protect;
 extern char *config_protect_mask;
 extern char *portvdb;
+extern char *portcachedir;
 extern char *portlogdir;
 extern char *pkg_install_mask;
 extern char *binhost;
@@ -174,6 +185,7 @@ extern int twidth;
 
 void no_colors(void);
 void setup_quiet(void);
+int parse_jobs(const char *arg);
 void version_barf(void);
 void usage(int status, const char *flags, struct option const opts[],
       const char * const help[], const char *desc, int blabber);
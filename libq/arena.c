@@ -0,0 +1,184 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#include "main.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <xalloc.h>
+
+#include "arena.h"
+
+/* A simple bump allocator: allocations are carved out of chunks, and
+ * can only be released all at once, or back to a previously taken mark.
+ * This avoids the malloc overhead (both in time and space) for many
+ * small objects with a shared lifetime, such as the keys of a set. */
+
+#define ARENA_CHUNK_MIN  512
+#define ARENA_CHUNK_MAX  (64 * 1024)
+#define ARENA_ALIGN      sizeof(void *)
+
+struct arena_chunk {
+	struct arena_chunk *prev;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct arena {
+	struct arena_chunk *chunk;
+	struct arena_chunk *spare;  /* released chunks, for reuse */
+	size_t nextsize;
+};
+
+arena *
+create_arena(void)
+{
+	arena *ret = xzalloc(sizeof(*ret));
+	ret->nextsize = ARENA_CHUNK_MIN;
+	return ret;
+}
+
+static void *
+arena_alloc_int(arena *a, size_t size, size_t align)
+{
+	struct arena_chunk *c = a->chunk;
+	size_t pos = 0;
+
+	if (c != NULL)
+		pos = (c->used + align - 1) & ~(align - 1);
+
+	if (c == NULL || pos + size > c->size) {
+		if (a->spare != NULL && a->spare->size >= size) {
+			/* reuse what was released before */
+			c = a->spare;
+			a->spare = c->prev;
+		} else {
+			size_t csize = a->nextsize;
+
+			/* grow chunks as the arena gets used more, big allocations
+			 * get a chunk of their own */
+			if (a->nextsize < ARENA_CHUNK_MAX)
+				a->nextsize *= 2;
+			if (csize < size)
+				csize = size;
+
+			c = xmalloc(sizeof(*c) + csize);
+			c->size = csize;
+		}
+		c->used = 0;
+		c->prev = a->chunk;
+		a->chunk = c;
+		pos = 0;
+	}
+
+	c->used = pos + size;
+	return c->data + pos;
+}
+
+/* returns size bytes of memory, aligned for any pointer type */
+void *
+arena_alloc(arena *a, size_t size)
+{
+	return arena_alloc_int(a, size, ARENA_ALIGN);
+}
+
+char *
+arena_strdup(arena *a, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *ret = arena_alloc_int(a, len, 1);
+
+	memcpy(ret, s, len);
+	return ret;
+}
+
+/* returns the current position, which can be used to release all
+ * allocations made after it at once */
+arena_pos
+arena_mark(arena *a)
+{
+	arena_pos ret;
+
+	ret.chunk = a->chunk;
+	ret.used = a->chunk == NULL ? 0 : a->chunk->used;
+	return ret;
+}
+
+/* release all allocations made since pos was taken, marks must be
+ * released in reverse order, releasing to a mark that was already
+ * released (by an older mark) is a no-op */
+void
+arena_release(arena *a, arena_pos pos)
+{
+	struct arena_chunk *c;
+
+	/* ensure pos is still in use, so we never grow the arena back */
+	for (c = a->chunk; c != NULL && c != pos.chunk; c = c->prev)
+		;
+	if (c != pos.chunk || (c != NULL && c->used < pos.used))
+		return;
+
+	while ((c = a->chunk) != pos.chunk) {
+		a->chunk = c->prev;
+		if (c->size > ARENA_CHUNK_MAX) {
+			free(c);
+		} else {
+			c->prev = a->spare;
+			a->spare = c;
+		}
+	}
+	if (c != NULL)
+		c->used = pos.used;
+}
+
+/* release all memory handed out, but retain the largest chunk such that
+ * reuse doesn't immediately need to allocate again */
+void
+clear_arena(arena *a)
+{
+	struct arena_chunk *c;
+	struct arena_chunk *keep = NULL;
+
+	/* consider the spare chunks too */
+	while ((c = a->spare) != NULL) {
+		a->spare = c->prev;
+		c->prev = a->chunk;
+		a->chunk = c;
+	}
+
+	while ((c = a->chunk) != NULL) {
+		a->chunk = c->prev;
+		if (keep == NULL || c->size > keep->size) {
+			if (keep != NULL)
+				free(keep);
+			keep = c;
+		} else {
+			free(c);
+		}
+	}
+
+	if (keep != NULL) {
+		keep->prev = NULL;
+		keep->used = 0;
+		a->chunk = keep;
+	}
+}
+
+void
+free_arena(arena *a)
+{
+	struct arena_chunk *c;
+
+	while ((c = a->chunk) != NULL) {
+		a->chunk = c->prev;
+		free(c);
+	}
+	while ((c = a->spare) != NULL) {
+		a->spare = c->prev;
+		free(c);
+	}
+	free(a);
+}
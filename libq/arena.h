@@ -0,0 +1,25 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H 1
+
+#include <stddef.h>
+
+typedef struct arena arena;
+typedef struct {
+	void *chunk;
+	size_t used;
+} arena_pos;
+
+arena *create_arena(void);
+void *arena_alloc(arena *a, size_t size);
+char *arena_strdup(arena *a, const char *s);
+arena_pos arena_mark(arena *a);
+void arena_release(arena *a, arena_pos pos);
+void clear_arena(arena *a);
+void free_arena(arena *a);
+
+#endif
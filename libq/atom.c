@@ -17,6 +17,8 @@
 #include <ctype.h>
 #include <xalloc.h>
 
+#include "set.h"
+
 const char * const atom_suffixes_str[] = {
 	"_alpha", "_beta", "_pre", "_rc", "_/*bogus*/", "_p"
 };
@@ -39,6 +41,82 @@ const char * const atom_op_str[] = {
 
 const char * const booga[] = {"!!!", "!=", "==", ">", "<"};
 
+/* appends n to key as a length byte followed by its significant bytes
+ * in big-endian order, such that memcmp orders numbers correctly */
+static size_t
+atom_version_key_num(unsigned char *key, size_t len, size_t size, uint64_t n)
+{
+	unsigned char b[sizeof(n)];
+	size_t i;
+
+	for (i = 0; n != 0; n >>= 8)
+		b[i++] = n & 0xff;
+	if (len < size)
+		key[len] = (unsigned char)i;
+	len++;
+	while (i-- > 0) {
+		if (len < size)
+			key[len] = b[i];
+		len++;
+	}
+
+	return len;
+}
+
+/* encodes the version of atom into key, such that memcmp on two keys
+ * gives the same ordering as atom_compare does for plain versions,
+ * returns the length of the key, which may exceed size, in which case
+ * key is incomplete
+ * layout: numeric components, 0, letter, suffixes, PR_int (4 bytes) */
+static size_t
+atom_version_key(const depend_atom *atom, unsigned char *key, size_t size)
+{
+	const atom_suffix *sfx;
+	const char *s;
+	size_t len = 0;
+	size_t zlen = 0;
+	uint64_t n;
+	size_t z;
+#define append_key(X) do { if (len < size) key[len] = (X); len++; } while (0)
+
+	/* numeric components, atom_compare considers the component with
+	 * the most leading zeros older, unless it is zero, and missing
+	 * components equal to zero, hence trailing zeros are dropped */
+	for (s = atom->PV; s != NULL; s = strchr(s, '.')) {
+		if (*s == '.')
+			s++;
+		n = atoll(s);
+		if (n == 0) {
+			append_key(1);
+			continue;
+		}
+		for (z = 0; s[z] == '0'; z++)
+			;
+		append_key(0xff - (z < 0xfd ? z : 0xfd));
+		len = atom_version_key_num(key, len, size, n);
+		zlen = len;
+	}
+	len = zlen;
+	append_key(0);
+
+	append_key((unsigned char)atom->letter);
+
+	/* suffixes, always terminated by VER_NORM */
+	sfx = atom->suffixes;
+	do {
+		append_key((unsigned char)sfx->suffix);
+		len = atom_version_key_num(key, len, size, sfx->sint);
+	} while ((sfx++)->suffix != VER_NORM);
+
+	append_key((atom->PR_int >> 24) & 0xff);
+	append_key((atom->PR_int >> 16) & 0xff);
+	append_key((atom->PR_int >>  8) & 0xff);
+	append_key( atom->PR_int        & 0xff);
+#undef append_key
+
+	return len;
+}
+
 /* split string into individual components, known as an atom
  * for a definition of which variable contains what, see:
  * https://dev.gentoo.org/~ulm/pms/head/pms.html#x1-10800011 */
@@ -355,6 +433,70 @@ atom_explode(const char *atom)
 	return ret;
 }
 
+/* returns the version key of atom, which is computed the first time it
+ * is compared, rather than by atom_explode, for many atoms never are,
+ * atoms may be shared between threads (atom_intern), so the first key
+ * published wins */
+static const atom_vkey *
+atom_get_vkey(const depend_atom *atom)
+{
+	atom_vkey *ret = __atomic_load_n(&atom->vkey, __ATOMIC_ACQUIRE);
+	atom_vkey *exp = NULL;
+	unsigned char key[64];
+	size_t len;
+
+	if (ret != NULL)
+		return ret;
+
+	len = atom_version_key(atom, key, sizeof(key));
+	ret = xmalloc(sizeof(*ret) + len);
+	ret->len = len;
+	if (len <= sizeof(key))
+		memcpy(ret->key, key, len);
+	else
+		atom_version_key(atom, ret->key, len);
+
+	if (!__atomic_compare_exchange_n(&((depend_atom *)atom)->vkey, &exp, ret,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		free(ret);
+		ret = exp;
+	}
+
+	return ret;
+}
+
+/* atoms handed out by atom_intern, keyed by their source string */
+static set *atom_intern_set = NULL;
+
+/* returns the exploded atom for the given string, shared with all
+ * other callers asking for the same string, hence it must not be
+ * modified, release with atom_implode as usual
+ * the same atoms are often seen many times, e.g. in the depend
+ * strings of a tree, this saves exploding them over and over again */
+depend_atom *
+atom_intern(const char *atom)
+{
+	depend_atom *ret;
+
+#pragma omp critical (atom_intern)
+	{
+		if (atom_intern_set == NULL)
+			atom_intern_set = create_set();
+
+		ret = get_set(atom, atom_intern_set);
+		if (ret == NULL) {
+			ret = atom_explode(atom);
+			ret->refcnt = 1;  /* reference held by the set */
+			add_set_value(atom, ret, atom_intern_set);
+		}
+#pragma omp atomic
+		ret->refcnt++;
+	}
+
+	return ret;
+}
+
 depend_atom *
 atom_clone(depend_atom *atom)
 {
@@ -367,6 +509,7 @@ atom_clone(depend_atom *atom)
 	size_t nlen = 0;
 	size_t slen = 0;
 	size_t rlen = 0;
+	atom_vkey *vkey;
 
 	if (atom->REPO != NULL)
 		rlen = strlen(atom->REPO) + 1;
@@ -426,7 +569,7 @@ atom_clone(depend_atom *atom)
 
 	ret->blocker = atom->blocker;
 	ret->pfx_op = atom->pfx_op;
-	ret->sfx_op = atom->pfx_op;
+	ret->sfx_op = atom->sfx_op;
 	ret->PR_int = atom->PR_int;
 	ret->letter = atom->letter;
 	ret->slotdep = atom->slotdep;
@@ -439,6 +582,12 @@ atom_clone(depend_atom *atom)
 		memcpy(ret->suffixes, atom->suffixes, sizeof(ret->suffixes[0]) * slen);
 	}
 
+	vkey = __atomic_load_n(&atom->vkey, __ATOMIC_ACQUIRE);
+	if (vkey != NULL) {
+		ret->vkey = xmalloc(sizeof(*vkey) + vkey->len);
+		memcpy(ret->vkey, vkey, sizeof(*vkey) + vkey->len);
+	}
+
 	if (atom->usedeps) {
 		atom_usedep *w;
 		atom_usedep *n = NULL;
@@ -446,7 +595,7 @@ atom_clone(depend_atom *atom)
 		for (w = atom->usedeps; w != NULL; w = w->next) {
 			nlen = w->use != NULL ? strlen(w->use) + 1 : 0;
 			if (n == NULL) {
-				atom->usedeps = n = xmalloc(sizeof(*n) + nlen);
+				ret->usedeps = n = xmalloc(sizeof(*n) + nlen);
 			} else {
 				n = n->next = xmalloc(sizeof(*n) + nlen);
 			}
@@ -466,12 +615,19 @@ atom_implode(depend_atom *atom)
 {
 	if (!atom)
 		errf("Atom is empty !");
+	if (atom->refcnt > 0) {
+		/* interned, the intern set keeps its own reference */
+#pragma omp atomic
+		atom->refcnt--;
+		return;
+	}
 	while (atom->usedeps != NULL) {
 		atom_usedep *n = atom->usedeps->next;
 		free(atom->usedeps);
 		atom->usedeps = n;
 	}
 	free(atom->suffixes);
+	free(atom->vkey);
 	free(atom);
 }
 
@@ -664,6 +820,27 @@ atom_compare(const depend_atom *data, const depend_atom *query)
 			ver_bits |= (1 << 2);
 	}
 
+	/* plain version comparisons can use the version keys, the last 4
+	 * bytes of which hold the revision; callers like qlop strip PV from
+	 * exploded atoms, so only use the keys when PV is set */
+	if (data->PV != NULL && query->PV != NULL && sfx_op != ATOM_OP_STAR) {
+		const atom_vkey *k1 = atom_get_vkey(data);
+		const atom_vkey *k2 = atom_get_vkey(query);
+		size_t l1 = k1->len;
+		size_t l2 = k2->len;
+		int r;
+
+		if (pfx_op == ATOM_OP_PV_EQUAL) {
+			l1 -= 4;
+			l2 -= 4;
+		}
+		r = memcmp(k1->key, k2->key, l1 < l2 ? l1 : l2);
+		if (r == 0)
+			r = l1 < l2 ? -1 : l1 > l2 ? 1 : 0;
+		return _atom_compare_match(r < 0 ? OLDER : r > 0 ? NEWER : EQUAL,
+				pfx_op);
+	}
+
 	/* check version */
 	if (data->PV && query->PV) {
 		char *s1, *s2;
@@ -971,8 +1148,9 @@ atom_format_r(
 }
 
 /* versions that use an internal buffer, which is suitable for most
- * scenarios */
+ * scenarios, the buffer is per thread for parallel tree traversals */
 static char _atom_buf[BUFSIZ];
+#pragma omp threadprivate(_atom_buf)
 char *
 atom_to_string(depend_atom *a)
 {
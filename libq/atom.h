@@ -67,6 +67,12 @@ typedef struct _atom_usedep {
 	atom_usecond sfx_cond;
 } atom_usedep;
 
+/* memcmp-able encoding of PV + PR, see atom_compare */
+typedef struct {
+	size_t len;
+	unsigned char key[];
+} atom_vkey;
+
 typedef struct {
 	atom_blocker blocker;
 	atom_operator pfx_op;
@@ -78,6 +84,7 @@ typedef struct {
 	unsigned int PR_int;
 	char letter;
 	atom_suffix *suffixes;
+	atom_vkey *vkey;      /* computed on first comparison */
 	char *PVR;
 	char *P;
 	atom_usedep *usedeps;
@@ -85,6 +92,7 @@ typedef struct {
 	char *SUBSLOT;
 	atom_slotdep slotdep;
 	char *REPO;
+	unsigned int refcnt;  /* non-zero for interned atoms */
 } depend_atom;
 
 extern const char * const booga[];
@@ -97,6 +105,7 @@ typedef enum {
 } atom_equality;
 
 depend_atom *atom_explode(const char *atom);
+depend_atom *atom_intern(const char *atom);
 depend_atom *atom_clone(depend_atom *atom);
 void atom_implode(depend_atom *atom);
 atom_equality atom_compare(const depend_atom *a1, const depend_atom *a2);
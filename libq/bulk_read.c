@@ -0,0 +1,472 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ *
+ * Reading of many, mostly small, files at once.  Scanning trees and
+ * Manifests means opening and reading loads of files, which on cold
+ * caches, and NFS in particular, is bound by the latency of each of
+ * those calls rather than by bandwidth.  With io_uring, the opens and
+ * reads of a batch of files are all submitted at once, and files are
+ * handed out as their reads complete.  Where io_uring isn't available,
+ * the blocking calls are spread over a few threads instead.
+ */
+
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xalloc.h>
+#ifdef _OPENMP
+# include <omp.h>
+#else
+# define omp_in_parallel() 0
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+/* openat and read operations arrived in 5.6, together with this flag */
+# if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#  define BULK_READ_USE_URING 1
+# endif
+#endif
+
+#include "bulk_read.h"
+
+/* number of operations in flight at most */
+#define BULK_READ_DEPTH 64
+/* completions report sizes as int, so don't read more in one go */
+#define BULK_READ_MAXSIZE (1 << 30)
+
+/* whether the contents of f are to be read for the callback */
+static bool
+bulk_read_wanted(const bulk_read_file *f, size_t maxsize)
+{
+	return S_ISREG(f->st.st_mode) && (size_t)f->st.st_size <= maxsize;
+}
+
+/* hands f to the callback, and releases what it left over */
+static void
+bulk_read_done(bulk_read_file *f, bulk_read_cb cb, void *priv)
+{
+	cb(f, priv);
+	free(f->data);
+	f->data = NULL;
+	if (f->fd >= 0)
+		close(f->fd);
+	f->fd = -1;
+}
+
+/* finishes the read of the contents of f which returned res, the read
+ * asks for a byte more than the size, if that byte is there, the file
+ * grew meanwhile, if it's short, the file shrunk or its size isn't real
+ * (like for files in sysfs), either way it's left to the callback to
+ * read */
+static void
+bulk_read_got(bulk_read_file *f, int res)
+{
+	if (res < 0)
+		f->err = -res;
+	if (res != f->st.st_size) {
+		free(f->data);
+		f->data = NULL;
+		f->len = 0;
+	} else {
+		f->len = (size_t)res;
+	}
+}
+
+static void
+bulk_read_sync_one(
+		int dfd,
+		bulk_read_file *f,
+		size_t maxsize,
+		bulk_read_cb cb,
+		void *priv)
+{
+	ssize_t rlen;
+
+	f->fd = openat(dfd, f->name, O_RDONLY | O_CLOEXEC);
+	if (f->fd == -1) {
+		f->err = errno;
+	} else if (fstat(f->fd, &f->st) != 0) {
+		f->err = errno;
+	} else if (bulk_read_wanted(f, maxsize)) {
+		f->data = xmalloc(f->st.st_size + 1);
+		do {
+			rlen = pread(f->fd, f->data, f->st.st_size + 1, 0);
+		} while (rlen < 0 && errno == EINTR);
+		bulk_read_got(f, rlen < 0 ? -errno : (int)rlen);
+	}
+
+	bulk_read_done(f, cb, priv);
+}
+
+/* the blocking version, in threads unless we're in a parallel region
+ * already, in which case the other threads have work of their own */
+static void
+bulk_read_sync(
+		int dfd,
+		bulk_read_file *files,
+		size_t cnt,
+		size_t maxsize,
+		bulk_read_cb cb,
+		void *priv)
+{
+	size_t i;
+
+#pragma omp parallel for schedule(dynamic) if (cnt > 1 && !omp_in_parallel())
+	for (i = 0; i < cnt; i++)
+		bulk_read_sync_one(dfd, &files[i], maxsize, cb, priv);
+}
+
+#ifdef BULK_READ_USE_URING
+struct bulk_ring {
+	int fd;
+	unsigned int entries;
+	unsigned char *ring;
+	size_t ringlen;
+	size_t sqeslen;
+	unsigned int tail;     /* our view of the submission tail */
+	unsigned int pending;  /* entries not yet taken by the kernel */
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	struct bulk_ring *next;
+};
+
+/* rings cannot be shared between threads, so each thread sets up its
+ * own on first use, which is kept until the process exits, all of them
+ * are listed in bulk_rings such that they can be released then */
+static struct bulk_ring *bulk_ring;
+static bool bulk_ring_tried;
+#pragma omp threadprivate(bulk_ring, bulk_ring_tried)
+static struct bulk_ring *bulk_rings;
+
+static void
+bulk_ring_free(struct bulk_ring *r)
+{
+	struct bulk_ring **rp;
+
+#pragma omp critical(bulk_rings)
+	for (rp = &bulk_rings; *rp != NULL; rp = &(*rp)->next) {
+		if (*rp == r) {
+			*rp = r->next;
+			break;
+		}
+	}
+
+	munmap(r->sqes, r->sqeslen);
+	munmap(r->ring, r->ringlen);
+	close(r->fd);
+	free(r);
+}
+
+static void
+bulk_ring_free_all(void)
+{
+	while (bulk_rings != NULL)
+		bulk_ring_free(bulk_rings);
+}
+
+static struct bulk_ring *
+bulk_ring_setup(void)
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	struct bulk_ring *r;
+	unsigned char *ring;
+	void *sqes;
+	size_t ringlen;
+	size_t sqeslen;
+	bool ok;
+	bool first;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = (int)syscall(__NR_io_uring_setup, BULK_READ_DEPTH, &p);
+	if (fd < 0)
+		return NULL;
+
+	/* kernels can have io_uring without the operations we need */
+	probe = xzalloc(sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+	ok = syscall(__NR_io_uring_register, fd,
+				IORING_REGISTER_PROBE, probe, 256) == 0 &&
+		probe->last_op >= IORING_OP_READ &&
+		(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+		(p.features & IORING_FEAT_SINGLE_MMAP);
+	free(probe);
+	if (!ok) {
+		close(fd);
+		return NULL;
+	}
+
+	ringlen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	if (ringlen < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		ringlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring = mmap(NULL, ringlen,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqeslen,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		munmap(ring, ringlen);
+		close(fd);
+		return NULL;
+	}
+
+	r = xzalloc(sizeof(*r));
+	r->fd = fd;
+	r->entries = p.sq_entries;
+	r->ring = ring;
+	r->ringlen = ringlen;
+	r->sqeslen = sqeslen;
+	r->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(ring + p.sq_off.array);
+	r->cq_head = (unsigned int *)(ring + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	r->sqes = sqes;
+	r->tail = *r->sq_tail;
+
+#pragma omp critical(bulk_rings)
+	{
+		first = bulk_rings == NULL;
+		r->next = bulk_rings;
+		bulk_rings = r;
+	}
+	if (first)
+		atexit(bulk_ring_free_all);
+
+	return r;
+}
+
+static struct io_uring_sqe *
+bulk_ring_sqe(struct bulk_ring *r, unsigned char opcode, int fd,
+		const void *addr, unsigned int len, uint64_t user_data)
+{
+	unsigned int idx = r->tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)addr;
+	sqe->len = len;
+	sqe->user_data = user_data;
+	r->sq_array[idx] = idx;
+	r->tail++;
+	r->pending++;
+
+	return sqe;
+}
+
+/* submits what was queued, and waits for at least one completion,
+ * returns false when the ring is unusable */
+static bool
+bulk_ring_enter(struct bulk_ring *r)
+{
+	long ret;
+
+	__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, r->pending, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+	/* we never have more in flight than the ring holds, so anything
+	 * else means the ring is unusable, with reads possibly ongoing */
+	if (ret < 0)
+		return false;
+	r->pending -= (unsigned int)ret;
+	return true;
+}
+
+/* user_data of operations: index of the file, and what it is doing */
+#define BULK_OP_OPEN 0
+#define BULK_OP_READ 1
+#define BULK_OP_DATA(I, O) (((uint64_t)(I) << 1) | (O))
+
+/* returns false when the ring failed, after the files it didn't finish
+ * were read the blocking way, the ring is released then */
+static bool
+bulk_read_uring(
+		struct bulk_ring *r,
+		int dfd,
+		bulk_read_file *files,
+		size_t cnt,
+		size_t maxsize,
+		bulk_read_cb cb,
+		void *priv)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	bulk_read_file *f;
+	unsigned int inflight = 0;
+	unsigned int head;
+	unsigned int tail;
+	bool *fin;
+	size_t next = 0;
+	size_t done = 0;
+	size_t i;
+	size_t left;
+	int res;
+
+	fin = xzalloc(sizeof(fin[0]) * cnt);
+	while (done < cnt) {
+		for (; next < cnt && inflight < r->entries; next++, inflight++) {
+			sqe = bulk_ring_sqe(r, IORING_OP_OPENAT, dfd, files[next].name,
+					0, BULK_OP_DATA(next, BULK_OP_OPEN));
+			sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		}
+
+		if (!bulk_ring_enter(r))
+			break;
+
+		head = *r->cq_head;
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &r->cqes[head & *r->cq_mask];
+			f = &files[cqe->user_data >> 1];
+			res = cqe->res;
+			inflight--;
+
+			if ((cqe->user_data & 1) == BULK_OP_OPEN) {
+				if (res < 0) {
+					f->err = -res;
+				} else {
+					f->fd = res;
+					if (fstat(f->fd, &f->st) != 0) {
+						f->err = errno;
+					} else if (bulk_read_wanted(f, maxsize)) {
+						/* the read takes over the slot of the open */
+						f->data = xmalloc(f->st.st_size + 1);
+						sqe = bulk_ring_sqe(r, IORING_OP_READ, f->fd,
+								f->data, f->st.st_size + 1,
+								BULK_OP_DATA(f->idx, BULK_OP_READ));
+						sqe->off = 0;
+						inflight++;
+						continue;
+					}
+				}
+			} else {
+				bulk_read_got(f, res);
+			}
+
+			bulk_read_done(f, cb, priv);
+			fin[f->idx] = true;
+			done++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	if (done == cnt) {
+		free(fin);
+		return true;
+	}
+
+	/* the kernel may still be writing to the buffers and opening files
+	 * of what was submitted, so these are abandoned rather than freed or
+	 * closed, and the files are read again from scratch */
+	for (i = 0, left = 0; i < cnt; i++) {
+		if (fin[i])
+			continue;
+		f = &files[i];
+		if (i < next) {
+			f->err = 0;
+			f->fd = -1;
+			memset(&f->st, 0, sizeof(f->st));
+			f->data = NULL;
+			f->len = 0;
+		}
+		files[left++] = *f;
+	}
+	free(fin);
+	bulk_ring_free(r);
+
+	bulk_read_sync(dfd, files, left, maxsize, cb, priv);
+	return false;
+}
+#endif
+
+/**
+ * Opens and reads the cnt files in names, relative to dfd, and calls
+ * cb for each of them, in the order the reads complete.  Regular files
+ * of up to maxsize bytes are read in their entirety, for others data is
+ * NULL, and the callback reads fd itself if it needs to.  With the
+ * threaded implementation, cb may be called from several threads at the
+ * same time.  Returns false if impl cannot be used on this system.
+ */
+bool
+bulk_read_files_impl(
+		int dfd,
+		const char *const *names,
+		size_t cnt,
+		size_t maxsize,
+		bulk_read_cb cb,
+		void *priv,
+		enum bulk_read_impl impl)
+{
+	bulk_read_file *files;
+#ifdef BULK_READ_USE_URING
+	struct bulk_ring *r = NULL;
+#endif
+	size_t i;
+
+#ifdef BULK_READ_USE_URING
+	if (impl != BULK_READ_SYNC) {
+		if (!bulk_ring_tried) {
+			bulk_ring = bulk_ring_setup();
+			bulk_ring_tried = true;
+		}
+		r = bulk_ring;
+	}
+	if (impl == BULK_READ_URING && r == NULL)
+		return false;
+#else
+	if (impl == BULK_READ_URING)
+		return false;
+#endif
+
+	if (cnt == 0)
+		return true;
+	if (maxsize > BULK_READ_MAXSIZE)
+		maxsize = BULK_READ_MAXSIZE;
+
+	files = xzalloc(sizeof(files[0]) * cnt);
+	for (i = 0; i < cnt; i++) {
+		files[i].idx = i;
+		files[i].name = names[i];
+		files[i].fd = -1;
+	}
+
+#ifdef BULK_READ_USE_URING
+	if (r != NULL) {
+		if (!bulk_read_uring(r, dfd, files, cnt, maxsize, cb, priv))
+			bulk_ring = NULL;
+	} else
+#endif
+		bulk_read_sync(dfd, files, cnt, maxsize, cb, priv);
+
+	free(files);
+	return true;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#ifndef _BULK_READ_H
+#define _BULK_READ_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+enum bulk_read_impl {
+	BULK_READ_AUTO = 0,  /* io_uring when possible, else threads */
+	BULK_READ_SYNC,      /* open and read in (OpenMP) threads */
+	BULK_READ_URING      /* batched submission through io_uring */
+};
+
+/* a file as handed to the callback of bulk_read_files */
+typedef struct bulk_read_file {
+	size_t idx;           /* index of the file in names */
+	const char *name;
+	int err;              /* errno of opening or reading, if non-zero */
+	int fd;               /* open read-only, at offset 0 */
+	struct stat st;
+	unsigned char *data;  /* contents when not larger than maxsize */
+	size_t len;
+} bulk_read_file;
+
+/* data and fd are released after the callback returns, unless it
+ * takes them, by setting them to NULL and -1 respectively */
+typedef void (*bulk_read_cb)(bulk_read_file *f, void *priv);
+
+bool bulk_read_files_impl(int dfd, const char *const *names, size_t cnt,
+		size_t maxsize, bulk_read_cb cb, void *priv,
+		enum bulk_read_impl impl);
+#define bulk_read_files(D, N, C, M, F, P) \
+	bulk_read_files_impl(D, N, C, M, F, P, BULK_READ_AUTO)
+
+#endif
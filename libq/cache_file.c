@@ -0,0 +1,88 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#include "main.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache_file.h"
+
+/* opens cachedir, which like what is cached is relative to ROOT, for
+ * use with the functions below, returns -1 when no cachedir is set or
+ * it doesn't exist */
+int
+cache_dir_open(int root_fd, const char *cachedir)
+{
+	if (cachedir == NULL || *cachedir == '\0')
+		return -1;
+	while (*cachedir == '/')
+		cachedir++;
+	if (*cachedir == '\0')
+		cachedir = ".";
+	return openat(root_fd, cachedir,
+			O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_PATH);
+}
+
+/* maps fname from dir_fd read-only, returns NULL when it doesn't exist
+ * or is shorter than minlen, unmap the result using munmap(data, len) */
+void *
+cache_file_map(int dir_fd, const char *fname, size_t minlen, size_t *len)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = openat(dir_fd, fname, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)minlen ||
+			st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	*len = (size_t)st.st_size;
+	return data;
+}
+
+/* replaces fname in dir_fd with data, such that readers see either the
+ * old or the new file in full */
+bool
+cache_file_write(int dir_fd, const char *fname, const void *data, size_t len)
+{
+	char tmpname[_Q_PATH_MAX];
+	ssize_t wlen;
+	size_t off;
+	int fd;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", fname, (int)getpid());
+	fd = openat(dir_fd, tmpname,
+			O_WRONLY | O_CREAT | O_EXCL | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return false;
+
+	for (off = 0; off < len; off += wlen) {
+		wlen = write(fd, (const char *)data + off, len - off);
+		if (wlen <= 0)
+			break;
+	}
+	if (close(fd) != 0 || off != len ||
+			renameat(dir_fd, tmpname, dir_fd, fname) != 0)
+	{
+		unlinkat(dir_fd, tmpname, 0);
+		return false;
+	}
+
+	return true;
+}
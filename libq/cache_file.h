@@ -0,0 +1,18 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#ifndef _CACHE_FILE_H
+#define _CACHE_FILE_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int cache_dir_open(int root_fd, const char *cachedir);
+void *cache_file_map(int dir_fd, const char *fname, size_t minlen,
+		size_t *len);
+bool cache_file_write(int dir_fd, const char *fname,
+		const void *data, size_t len);
+
+#endif
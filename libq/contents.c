@@ -22,6 +22,7 @@ contents_entry *
 contents_parse_line(char *line)
 {
 	static contents_entry e;
+#pragma omp threadprivate(e)
 	char *p;
 
 	if (line == NULL || *line == '\0' || *line == '\n')
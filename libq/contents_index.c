@@ -0,0 +1,653 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#include "main.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <xalloc.h>
+
+#include "basename.h"
+#include "cache_file.h"
+#include "contents.h"
+#include "contents_index.h"
+#include "set.h"
+#include "tree.h"
+
+/* The contents index maps the basename of every file, dir and symlink
+ * recorded in the CONTENTS of installed packages to the packages that
+ * own them.  Since qfile matches on basename first, and only then
+ * considers the directory (which may involve symlinks), this allows to
+ * only look at the CONTENTS of those packages that can possibly match.
+ * The file is mmap()ed and used as is:
+ *   header | categories[ncats] | packages[npkgs] |
+ *   names[nslots] | entries[nents] | string table
+ * names is an open addressing hash table, each used slot points to a
+ * chain of entries (linking a name to a package) through their next
+ * member.  Entries of a single package are stored consecutively, such
+ * that they can be reused for unchanged packages when updating.  The
+ * mtimes of the VDB, categories and packages are used to find out if
+ * anything changed. */
+
+#define CONTENTS_INDEX_FILE    "contents.idx"
+#define CONTENTS_INDEX_MAGIC   "Q-CNTIDX"
+#define CONTENTS_INDEX_VERSION 1
+#define CONTENTS_INDEX_NONE    ((uint32_t)-1)
+
+struct contents_index_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t ncats;
+	uint32_t npkgs;
+	uint32_t nslots;
+	uint32_t nents;
+	uint32_t pad;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t size;
+};
+
+struct contents_index_cat {
+	uint32_t name;
+	uint32_t pkgs;
+	uint32_t npkgs;
+	uint32_t pad;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+struct contents_index_pkg {
+	uint32_t name;
+	uint32_t ents;
+	uint32_t nents;
+	uint32_t pad;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+struct contents_index_slot {
+	uint32_t name;
+	uint32_t first;
+};
+
+struct contents_index_ent {
+	uint32_t name;
+	uint32_t pkg;
+	uint32_t next;
+};
+
+struct contents_index {
+	char *data;
+	size_t len;
+	bool mapped;
+	const struct contents_index_hdr *hdr;
+	const struct contents_index_cat *cats;
+	const struct contents_index_pkg *pkgs;
+	const struct contents_index_slot *slots;
+	const struct contents_index_ent *ents;
+	const char *strs;
+	size_t strslen;
+};
+
+/* in-memory representation used while (re)building the index */
+struct contents_index_build {
+	struct contents_index_cat *cats;
+	size_t ncats;
+	size_t catssize;
+	struct contents_index_pkg *pkgs;
+	size_t npkgs;
+	size_t pkgssize;
+	struct contents_index_slot *slots;
+	uint32_t *slotpkgs;  /* last package that added the name */
+	size_t nslots;
+	size_t nnames;
+	struct contents_index_ent *ents;
+	size_t nents;
+	size_t entssize;
+	char *strs;
+	size_t strslen;
+	size_t strssize;
+	contents_index *old;
+	size_t ocat;
+	time_t start;
+	bool incomplete;
+};
+
+static bool
+contents_index_setup(contents_index *idx)
+{
+	const struct contents_index_hdr *hdr;
+	size_t off;
+	size_t n;
+
+	if (idx->len < sizeof(*hdr))
+		return false;
+	hdr = idx->hdr = (const struct contents_index_hdr *)idx->data;
+	if (memcmp(hdr->magic, CONTENTS_INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+			hdr->version != CONTENTS_INDEX_VERSION ||
+			hdr->size != idx->len ||
+			hdr->nslots == 0 ||
+			(hdr->nslots & (hdr->nslots - 1)) != 0)
+		return false;
+
+	off = sizeof(*hdr);
+	idx->cats = (const struct contents_index_cat *)(idx->data + off);
+	off += sizeof(*idx->cats) * hdr->ncats;
+	idx->pkgs = (const struct contents_index_pkg *)(idx->data + off);
+	off += sizeof(*idx->pkgs) * hdr->npkgs;
+	idx->slots = (const struct contents_index_slot *)(idx->data + off);
+	off += sizeof(*idx->slots) * hdr->nslots;
+	idx->ents = (const struct contents_index_ent *)(idx->data + off);
+	off += sizeof(*idx->ents) * hdr->nents;
+	if (off >= idx->len)
+		return false;
+	idx->strs = idx->data + off;
+	idx->strslen = idx->len - off;
+	if (idx->strs[idx->strslen - 1] != '\0')
+		return false;
+
+	/* make sure a damaged file cannot lead us outside of it, or into
+	 * an endless loop while following chains */
+	for (n = 0; n < hdr->ncats; n++) {
+		if (idx->cats[n].name >= idx->strslen ||
+				idx->cats[n].pkgs > hdr->npkgs ||
+				idx->cats[n].npkgs > hdr->npkgs - idx->cats[n].pkgs)
+			return false;
+	}
+	for (n = 0; n < hdr->npkgs; n++) {
+		if (idx->pkgs[n].name >= idx->strslen ||
+				idx->pkgs[n].ents > hdr->nents ||
+				idx->pkgs[n].nents > hdr->nents - idx->pkgs[n].ents)
+			return false;
+	}
+	for (n = 0; n < hdr->nslots; n++) {
+		if (idx->slots[n].name == CONTENTS_INDEX_NONE)
+			continue;
+		if (idx->slots[n].name >= idx->strslen ||
+				(idx->slots[n].first != CONTENTS_INDEX_NONE &&
+				 idx->slots[n].first >= hdr->nents))
+			return false;
+	}
+	for (n = 0; n < hdr->nents; n++) {
+		if (idx->ents[n].name >= idx->strslen ||
+				idx->ents[n].pkg >= hdr->npkgs ||
+				(idx->ents[n].next != CONTENTS_INDEX_NONE &&
+				 idx->ents[n].next >= n))
+			return false;
+	}
+
+	return true;
+}
+
+static contents_index *
+contents_index_load(int cache_fd)
+{
+	contents_index *ret;
+	size_t len;
+	void *data;
+
+	data = cache_file_map(cache_fd, CONTENTS_INDEX_FILE,
+			sizeof(struct contents_index_hdr), &len);
+	if (data == NULL)
+		return NULL;
+
+	ret = xzalloc(sizeof(*ret));
+	ret->data = data;
+	ret->len = len;
+	ret->mapped = true;
+	if (!contents_index_setup(ret)) {
+		contents_index_close(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+void
+contents_index_close(contents_index *idx)
+{
+	if (idx->mapped)
+		munmap(idx->data, idx->len);
+	else
+		free(idx->data);
+	free(idx);
+}
+
+/* an mtime of 0 means unknown, and never matches */
+static bool
+contents_index_mtime_eq(const struct stat *st, int64_t sec, int64_t nsec)
+{
+	return (sec != 0 || nsec != 0) &&
+		st->st_mtim.tv_sec == sec && st->st_mtim.tv_nsec == nsec;
+}
+
+/* store an mtime, unless it is so recent that a modification directly
+ * following it could go unnoticed because it gets the same mtime */
+static void
+contents_index_mtime_set(
+		const struct stat *st,
+		time_t start,
+		int64_t *sec,
+		int64_t *nsec)
+{
+	if (st->st_mtim.tv_sec >= start) {
+		*sec = 0;
+		*nsec = 0;
+	} else {
+		*sec = st->st_mtim.tv_sec;
+		*nsec = st->st_mtim.tv_nsec;
+	}
+}
+
+/* returns whether none of the categories and packages in the VDB
+ * changed since the index was written */
+static bool
+contents_index_fresh(contents_index *idx, int vdb_fd, const struct stat *vst)
+{
+	const struct contents_index_cat *cat;
+	const struct contents_index_pkg *pkg;
+	struct stat st;
+	size_t n;
+	size_t p;
+	int cat_fd;
+
+	if (!contents_index_mtime_eq(vst, idx->hdr->mtime_sec, idx->hdr->mtime_nsec))
+		return false;
+
+	for (n = 0; n < idx->hdr->ncats; n++) {
+		cat = &idx->cats[n];
+		cat_fd = openat(vdb_fd, idx->strs + cat->name,
+				O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_PATH);
+		if (cat_fd == -1)
+			return false;
+		if (fstat(cat_fd, &st) != 0 ||
+				!contents_index_mtime_eq(&st, cat->mtime_sec, cat->mtime_nsec))
+		{
+			close(cat_fd);
+			return false;
+		}
+		for (p = 0; p < cat->npkgs; p++) {
+			pkg = &idx->pkgs[cat->pkgs + p];
+			if (fstatat(cat_fd, idx->strs + pkg->name, &st, 0) != 0 ||
+					!contents_index_mtime_eq(&st,
+						pkg->mtime_sec, pkg->mtime_nsec))
+			{
+				close(cat_fd);
+				return false;
+			}
+		}
+		close(cat_fd);
+	}
+
+	return true;
+}
+
+static size_t
+contents_index_cat_find(contents_index *idx, const char *name)
+{
+	size_t n;
+
+	for (n = 0; n < idx->hdr->ncats; n++)
+		if (strcmp(idx->strs + idx->cats[n].name, name) == 0)
+			return n;
+
+	return CONTENTS_INDEX_NONE;
+}
+
+static size_t
+contents_index_pkg_find(contents_index *idx, size_t cat, const char *name)
+{
+	const struct contents_index_cat *c = &idx->cats[cat];
+	size_t n;
+
+	for (n = c->pkgs; n < c->pkgs + c->npkgs; n++)
+		if (strcmp(idx->strs + idx->pkgs[n].name, name) == 0)
+			return n;
+
+	return CONTENTS_INDEX_NONE;
+}
+
+static uint32_t
+contents_index_build_str(struct contents_index_build *b, const char *s)
+{
+	uint32_t ret = (uint32_t)b->strslen;
+	size_t len = strlen(s);
+
+	if (b->strslen + len + 1 > b->strssize) {
+		b->strssize = ((b->strslen + len + 1) + BUFSIZE - 1) & -BUFSIZE;
+		b->strssize *= 2;
+		b->strs = xrealloc(b->strs, b->strssize);
+	}
+	memcpy(b->strs + b->strslen, s, len + 1);
+	b->strslen += len + 1;
+
+	return ret;
+}
+
+static void
+contents_index_build_grow(struct contents_index_build *b)
+{
+	struct contents_index_slot *oslots = b->slots;
+	uint32_t *oslotpkgs = b->slotpkgs;
+	size_t onslots = b->nslots;
+	size_t mask;
+	size_t n;
+	size_t i;
+
+	b->nslots = onslots == 0 ? 1024 : onslots * 2;
+	b->slots = xmalloc(sizeof(b->slots[0]) * b->nslots);
+	memset(b->slots, 0xff, sizeof(b->slots[0]) * b->nslots);
+	b->slotpkgs = xmalloc(sizeof(b->slotpkgs[0]) * b->nslots);
+
+	mask = b->nslots - 1;
+	for (n = 0; n < onslots; n++) {
+		if (oslots[n].name == CONTENTS_INDEX_NONE)
+			continue;
+		i = fnv1a32(b->strs + oslots[n].name) & mask;
+		while (b->slots[i].name != CONTENTS_INDEX_NONE)
+			i = (i + 1) & mask;
+		b->slots[i] = oslots[n];
+		b->slotpkgs[i] = oslotpkgs[n];
+	}
+
+	free(oslots);
+	free(oslotpkgs);
+}
+
+/* record that the last added package has a file called name */
+static void
+contents_index_build_ent(struct contents_index_build *b, const char *name)
+{
+	struct contents_index_ent *ent;
+	uint32_t pkg = (uint32_t)(b->npkgs - 1);
+	size_t mask;
+	size_t i;
+
+	if (b->nnames * 2 >= b->nslots)
+		contents_index_build_grow(b);
+
+	mask = b->nslots - 1;
+	for (i = fnv1a32(name) & mask;
+			b->slots[i].name != CONTENTS_INDEX_NONE;
+			i = (i + 1) & mask)
+	{
+		if (strcmp(b->strs + b->slots[i].name, name) == 0)
+			break;
+	}
+
+	if (b->slots[i].name == CONTENTS_INDEX_NONE) {
+		b->slots[i].name = contents_index_build_str(b, name);
+		b->slots[i].first = CONTENTS_INDEX_NONE;
+		b->nnames++;
+	} else if (b->slotpkgs[i] == pkg) {
+		return;  /* many packages have multiple files with equal names */
+	}
+	b->slotpkgs[i] = pkg;
+
+	if (b->nents == b->entssize) {
+		b->entssize += 4096;
+		b->ents = xrealloc(b->ents, sizeof(b->ents[0]) * b->entssize);
+	}
+	ent = &b->ents[b->nents];
+	ent->name = b->slots[i].name;
+	ent->pkg = pkg;
+	ent->next = b->slots[i].first;
+	b->slots[i].first = (uint32_t)b->nents++;
+	b->pkgs[pkg].nents++;
+}
+
+static int
+contents_index_build_cb(tree_pkg_ctx *pkg_ctx, void *priv)
+{
+	struct contents_index_build *b = priv;
+	tree_cat_ctx *cat_ctx = pkg_ctx->cat_ctx;
+	contents_index *old = b->old;
+	struct contents_index_cat *cat;
+	struct contents_index_pkg *pkg;
+	contents_entry *e;
+	struct stat st;
+	size_t opkg;
+	size_t n;
+	char *line;
+	char *savep;
+
+	/* packages of a category are served consecutively */
+	if (b->ncats == 0 ||
+			strcmp(b->strs + b->cats[b->ncats - 1].name, cat_ctx->name) != 0)
+	{
+		if (fstat(cat_ctx->fd, &st) != 0) {
+			b->incomplete = true;
+			return 0;
+		}
+		if (b->ncats == b->catssize) {
+			b->catssize += 64;
+			b->cats = xrealloc(b->cats, sizeof(b->cats[0]) * b->catssize);
+		}
+		cat = &b->cats[b->ncats++];
+		memset(cat, 0, sizeof(*cat));
+		cat->name = contents_index_build_str(b, cat_ctx->name);
+		cat->pkgs = (uint32_t)b->npkgs;
+		contents_index_mtime_set(&st, b->start,
+				&cat->mtime_sec, &cat->mtime_nsec);
+		b->ocat = old == NULL ?
+			CONTENTS_INDEX_NONE : contents_index_cat_find(old, cat_ctx->name);
+	}
+	cat = &b->cats[b->ncats - 1];
+
+	/* grab the mtime before reading CONTENTS, such that we notice
+	 * modifications made while we read it */
+	if (fstatat(cat_ctx->fd, pkg_ctx->name, &st, 0) != 0) {
+		b->incomplete = true;
+		return 0;
+	}
+	if (b->npkgs == b->pkgssize) {
+		b->pkgssize += 256;
+		b->pkgs = xrealloc(b->pkgs, sizeof(b->pkgs[0]) * b->pkgssize);
+	}
+	pkg = &b->pkgs[b->npkgs++];
+	memset(pkg, 0, sizeof(*pkg));
+	pkg->name = contents_index_build_str(b, pkg_ctx->name);
+	pkg->ents = (uint32_t)b->nents;
+	contents_index_mtime_set(&st, b->start, &pkg->mtime_sec, &pkg->mtime_nsec);
+	cat->npkgs++;
+
+	/* reuse what we know about unchanged packages */
+	opkg = b->ocat == CONTENTS_INDEX_NONE ?
+		CONTENTS_INDEX_NONE : contents_index_pkg_find(old, b->ocat, pkg_ctx->name);
+	if (opkg != CONTENTS_INDEX_NONE &&
+			contents_index_mtime_eq(&st,
+				old->pkgs[opkg].mtime_sec, old->pkgs[opkg].mtime_nsec))
+	{
+		const struct contents_index_pkg *op = &old->pkgs[opkg];
+
+		for (n = op->ents; n < op->ents + op->nents; n++)
+			contents_index_build_ent(b, old->strs + old->ents[n].name);
+		return 0;
+	}
+
+	line = tree_pkg_meta_get(pkg_ctx, CONTENTS);
+	if (line == NULL)
+		return 0;
+
+	for (; (line = strtok_r(line, "\n", &savep)) != NULL; line = NULL) {
+		e = contents_parse_line(line);
+		if (e == NULL)
+			continue;
+		contents_index_build_ent(b, basename(e->name));
+	}
+
+	return 0;
+}
+
+static contents_index *
+contents_index_build(contents_index *old, tree_ctx *vdb, const struct stat *vst)
+{
+	struct contents_index_build b;
+	struct contents_index_hdr hdr;
+	contents_index *ret;
+	size_t off;
+
+	memset(&b, 0, sizeof(b));
+	b.old = old;
+	b.ocat = CONTENTS_INDEX_NONE;
+	b.start = time(NULL);
+	contents_index_build_str(&b, "");  /* avoid an empty string table */
+	contents_index_build_grow(&b);
+
+	tree_foreach_pkg_fast(vdb, contents_index_build_cb, &b, NULL);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CONTENTS_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = CONTENTS_INDEX_VERSION;
+	hdr.ncats = (uint32_t)b.ncats;
+	hdr.npkgs = (uint32_t)b.npkgs;
+	hdr.nslots = (uint32_t)b.nslots;
+	hdr.nents = (uint32_t)b.nents;
+	/* force an update next time if we missed something */
+	if (!b.incomplete)
+		contents_index_mtime_set(vst, b.start,
+				&hdr.mtime_sec, &hdr.mtime_nsec);
+	hdr.size = sizeof(hdr) +
+		(sizeof(b.cats[0]) * b.ncats) +
+		(sizeof(b.pkgs[0]) * b.npkgs) +
+		(sizeof(b.slots[0]) * b.nslots) +
+		(sizeof(b.ents[0]) * b.nents) +
+		b.strslen;
+
+	/* serialise into the same layout as the file uses */
+	ret = xzalloc(sizeof(*ret));
+	ret->len = hdr.size;
+	ret->data = xmalloc(ret->len);
+	ret->mapped = false;
+	off = 0;
+#define append(P, L) \
+	memcpy(ret->data + off, P, L); \
+	off += L
+	append(&hdr, sizeof(hdr));
+	append(b.cats, sizeof(b.cats[0]) * b.ncats);
+	append(b.pkgs, sizeof(b.pkgs[0]) * b.npkgs);
+	append(b.slots, sizeof(b.slots[0]) * b.nslots);
+	append(b.ents, sizeof(b.ents[0]) * b.nents);
+	append(b.strs, b.strslen);
+#undef append
+
+	free(b.cats);
+	free(b.pkgs);
+	free(b.slots);
+	free(b.slotpkgs);
+	free(b.ents);
+	free(b.strs);
+
+	if (!contents_index_setup(ret)) {
+		/* should be impossible */
+		contents_index_close(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+/* opens the contents index for the given VDB, the index is only used
+ * when cachedir (relative to the VDB's root) exists, it is brought up
+ * to date when necessary, or rebuilt from scratch when requested */
+contents_index *
+contents_index_open(tree_ctx *vdb, const char *cachedir, bool rebuild)
+{
+	contents_index *old = NULL;
+	contents_index *ret;
+	struct stat vst;
+	int cache_fd;
+
+	cache_fd = cache_dir_open(vdb->portroot_fd, cachedir);
+	if (cache_fd == -1)
+		return NULL;
+
+	if (fstat(vdb->tree_fd, &vst) != 0) {
+		close(cache_fd);
+		return NULL;
+	}
+
+	if (!rebuild) {
+		old = contents_index_load(cache_fd);
+		if (old != NULL && contents_index_fresh(old, vdb->tree_fd, &vst)) {
+			close(cache_fd);
+			return old;
+		}
+	}
+
+	/* if we cannot store the result, building an index costs more than
+	 * just searching through all CONTENTS once */
+	if (faccessat(cache_fd, ".", W_OK, AT_EACCESS) != 0) {
+		if (old != NULL)
+			contents_index_close(old);
+		close(cache_fd);
+		return NULL;
+	}
+
+	ret = contents_index_build(old, vdb, &vst);
+	if (old != NULL)
+		contents_index_close(old);
+	if (ret != NULL)
+		cache_file_write(cache_fd, CONTENTS_INDEX_FILE, ret->data, ret->len);
+	close(cache_fd);
+
+	return ret;
+}
+
+/* adds CAT/PF for all packages that have a file called name (basename)
+ * in their CONTENTS to pkgs */
+set *
+contents_index_find(contents_index *idx, const char *name, set *pkgs)
+{
+	const struct contents_index_slot *slot;
+	const struct contents_index_pkg *pkg;
+	const struct contents_index_cat *cat;
+	char buf[_Q_PATH_MAX];
+	size_t mask = idx->hdr->nslots - 1;
+	size_t i;
+	size_t n;
+	size_t c;
+	uint32_t e;
+
+	if (pkgs == NULL)
+		pkgs = create_set();
+
+	for (i = fnv1a32(name) & mask, n = 0;
+			n < idx->hdr->nslots;
+			i = (i + 1) & mask, n++)
+	{
+		slot = &idx->slots[i];
+		if (slot->name == CONTENTS_INDEX_NONE)
+			break;
+		if (strcmp(idx->strs + slot->name, name) != 0)
+			continue;
+
+		for (e = slot->first;
+				e != CONTENTS_INDEX_NONE;
+				e = idx->ents[e].next)
+		{
+			pkg = &idx->pkgs[idx->ents[e].pkg];
+			/* packages are stored per category, in order */
+			for (c = 0; c < idx->hdr->ncats; c++) {
+				cat = &idx->cats[c];
+				if (idx->ents[e].pkg >= cat->pkgs &&
+						idx->ents[e].pkg < cat->pkgs + cat->npkgs)
+					break;
+			}
+			if (c == idx->hdr->ncats)
+				continue;
+			snprintf(buf, sizeof(buf), "%s/%s",
+					idx->strs + cat->name, idx->strs + pkg->name);
+			pkgs = add_set_unique(buf, pkgs, NULL);
+		}
+		break;
+	}
+
+	return pkgs;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#ifndef _CONTENTS_INDEX_H
+#define _CONTENTS_INDEX_H 1
+
+#include <stdbool.h>
+
+#include "set.h"
+#include "tree.h"
+
+typedef struct contents_index contents_index;
+
+contents_index *contents_index_open(tree_ctx *vdb, const char *cachedir,
+		bool rebuild);
+void contents_index_close(contents_index *idx);
+set *contents_index_find(contents_index *idx, const char *name, set *pkgs);
+
+#endif
@@ -52,7 +52,7 @@ _dep_grow_node(dep_type type, const char *info, size_t info_len)
 		ret->info = ((char*)ret) + sizeof(*ret);
 		memcpy(ret->info, info, info_len);
 		if (type == DEP_NORM)
-			ret->atom = atom_explode(ret->info);
+			ret->atom = atom_intern(ret->info);
 	}
 
 	return ret;
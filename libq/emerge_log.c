@@ -0,0 +1,722 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#include "main.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xalloc.h>
+
+#include "atom.h"
+#include "cache_file.h"
+#include "emerge_log.h"
+#include "set.h"
+
+/* The emerge.log index holds the lines of the log that qlop acts upon,
+ * such that it doesn't have to read and parse the entire log each time
+ * it runs.  Like the VDB index, it is laid out to be mmap()ed and used
+ * as is:
+ *   header | events[nevs] | string table
+ * The string table holds the CAT/PN of the packages events are about.
+ * The log is only ever appended to, hence the index covers it up to
+ * some offset, from which it is extended on a next run.  To detect the
+ * log was replaced, rotated or truncated, the device and inode of the
+ * log are recorded together with a checksum of the bytes right before
+ * the indexed offset. */
+
+#define EMERGE_LOG_INDEX_MAGIC   "Q-ELOGIX"
+#define EMERGE_LOG_INDEX_VERSION 1
+#define EMERGE_LOG_INDEX_ABSENT  ((uint32_t)-1)
+#define EMERGE_LOG_SUMLEN        64
+
+#define EMERGE_LOG_INDEX_HASLAST (1 << 0)
+
+struct emerge_log_index_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t nevs;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t end;       /* offset in the log up to which it is indexed */
+	uint64_t endsum;    /* FNV1a64 of the bytes right before end */
+	int64_t maxtime;    /* highest time of all lines indexed */
+	int64_t lasttime;   /* time of the last line having one */
+	uint64_t size;
+};
+
+struct emerge_log_index {
+	char *data;
+	size_t len;
+	bool mapped;
+	const struct emerge_log_index_hdr *hdr;
+	const emerge_log_ev *evs;
+	const char *strs;
+	size_t strslen;
+};
+
+/* in-memory representation used while extending the index */
+struct emerge_log_index_build {
+	struct emerge_log_index_hdr hdr;
+	emerge_log_ev *evs;
+	size_t nevs;
+	size_t evssize;
+	char *strs;
+	size_t strslen;
+	size_t strssize;
+	set *pkgs;
+};
+
+/* Lines of the log are read the way qlop always did, using fgets() with
+ * a BUFSIZ buffer, overly long lines hence end up as multiple "lines".
+ * The log is read in large chunks, in which the lines are located with
+ * memchr(), which is vectorised in any libc worth its salt, only the
+ * lines of interest need copying by the caller.  The log is not mapped,
+ * since logrotate's copytruncate, or anything else truncating it while
+ * we read, would raise SIGBUS on access of what is no longer there.
+ * Regular files are read using pread(), such that readers don't depend
+ * on, nor change, the offset of fd, anything else, such as the output
+ * of a decompressor, can only be read from where it is. */
+#define EMERGE_LOG_READER_BUFSIZE (16 * BUFSIZ)
+
+struct emerge_log_reader {
+	int fd;
+	char *data;
+	size_t len;    /* of data */
+	size_t pos;    /* in data of the next line */
+	off_t base;    /* offset in the log of data */
+	bool seekable;
+	bool eof;
+};
+
+/* opens a reader of the lines from offset off of the log open at fd,
+ * fd is not owned by the reader, and should not be read from while it
+ * is in use */
+emerge_log_reader *
+emerge_log_reader_open(int fd, off_t off)
+{
+	emerge_log_reader *ret = xzalloc(sizeof(*ret));
+	struct stat st;
+
+	ret->fd = fd;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		ret->seekable = true;
+	} else if (off > 0 && lseek(fd, off, SEEK_SET) != off) {
+		free(ret);
+		return NULL;
+	}
+	ret->data = xmalloc(EMERGE_LOG_READER_BUFSIZE);
+	ret->base = off;
+
+	return ret;
+}
+
+/* retrieves the next line, which is not NUL-terminated, and only valid
+ * until the next call */
+bool
+emerge_log_reader_next(emerge_log_reader *r, const char **line, size_t *len)
+{
+	const char *nl;
+	size_t avail;
+	size_t n;
+	ssize_t rlen;
+
+	while (true) {
+		avail = r->len - r->pos;
+		n = avail < BUFSIZ - 1 ? avail : BUFSIZ - 1;
+		nl = n == 0 ? NULL : memchr(r->data + r->pos, '\n', n);
+		if (nl != NULL || n == BUFSIZ - 1 || (n > 0 && r->eof))
+			break;
+		if (r->eof)
+			return false;
+
+		/* need more data, retain what we have */
+		memmove(r->data, r->data + r->pos, avail);
+		r->base += r->pos;
+		r->pos = 0;
+		r->len = avail;
+		if (r->seekable)
+			rlen = pread(r->fd, r->data + r->len,
+					EMERGE_LOG_READER_BUFSIZE - r->len,
+					r->base + (off_t)r->len);
+		else
+			rlen = read(r->fd, r->data + r->len,
+					EMERGE_LOG_READER_BUFSIZE - r->len);
+		if (rlen <= 0)
+			r->eof = true;
+		else
+			r->len += rlen;
+	}
+
+	*line = r->data + r->pos;
+	*len = nl != NULL ? (size_t)(nl - *line) + 1 : n;
+	r->pos += *len;
+
+	return true;
+}
+
+/* returns the offset in the log of the next line */
+off_t
+emerge_log_reader_tell(emerge_log_reader *r)
+{
+	return r->base + (off_t)r->pos;
+}
+
+void
+emerge_log_reader_close(emerge_log_reader *r)
+{
+	free(r->data);
+	free(r);
+}
+
+/* returns the command to decompress the log open at fd with, if it is
+ * compressed, like logrotate can do, rotated logs can be read as well */
+const char *
+emerge_log_decompressor(int fd)
+{
+	unsigned char magic[6];
+	ssize_t mlen;
+
+	mlen = pread(fd, magic, sizeof(magic), 0);
+	if (mlen >= 2 && magic[0] == 037 && magic[1] == 0213)
+		return "gzip -dc";
+	if (mlen >= 3 && magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h')
+		return "bzip2 -dc";
+	if (mlen >= 6 && magic[0] == 0xFD && magic[1] == '7' &&
+			magic[2] == 'z' && magic[3] == 'X' && magic[4] == 'Z' &&
+			magic[5] == 0x00)
+		return "xz -dc";
+	if (mlen >= 4 && magic[0] >= 0x22 && magic[0] <= 0x28 &&
+			magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+		return "zstd -dc";
+
+	return NULL;
+}
+
+/* splits line in its time and the rest following the colon after it,
+ * like strchr() and atol() on the line would do, returns false if the
+ * line has no time */
+bool
+emerge_log_line_time(
+		const char *line,
+		size_t len,
+		int64_t *time,
+		const char **rest)
+{
+	const char *p;
+
+	p = memchr(line, ':', len);
+	if (p == NULL || memchr(line, '\0', p - line) != NULL)
+		return false;
+
+	/* atol() stops at the colon at the latest */
+	*time = (int64_t)atol(line);
+	*rest = p + 1;
+
+	return true;
+}
+
+#define strpfx(X, Y)  (len < sizeof(Y) - 1 || memcmp(X, Y, sizeof(Y) - 1))
+
+/* returns what the line is about, p points just after the colon
+ * following the timestamp, len is what remains of the line */
+enum emerge_log_ev_type
+emerge_log_line_type(const char *p, size_t len)
+{
+	if (len < 2 || p[0] != ' ')
+		return EMERGE_LOG_NONE;
+	if (p[1] == ' ') {
+		if (strpfx(p, "  *** emerge ") == 0)
+			return EMERGE_LOG_EMERGE;
+		if (strpfx(p, "  *** exiting ") == 0)
+			return EMERGE_LOG_EXITING;
+		if (strpfx(p, "  *** terminating.") == 0)
+			return EMERGE_LOG_TERMINATING;
+		if (len == sizeof("  === sync\n") - 1 &&
+				memcmp(p, "  === sync\n", len) == 0)
+			return EMERGE_LOG_SYNC_START;
+		if (strpfx(p, "  >>> emerge ") == 0)
+			return EMERGE_LOG_MERGE_START;
+		if (strpfx(p, "  ::: completed emerge (") == 0)
+			return EMERGE_LOG_MERGE_END;
+		if (strpfx(p, "  === Unmerging... (") == 0)
+			return EMERGE_LOG_AUTOCLEAN_START;
+		if (strpfx(p, "  >>> unmerge success: ") == 0)
+			return EMERGE_LOG_UNMERGE_END;
+	} else {
+		if (strpfx(p, " === Sync completed ") == 0)
+			return EMERGE_LOG_SYNC_END;
+		if (strpfx(p, " === Unmerging... (") == 0)
+			return EMERGE_LOG_UNMERGE_START;
+	}
+
+	return EMERGE_LOG_NONE;
+}
+
+#undef strpfx
+
+/* retrieves the CAT/PN of the package an (un)merge line is about,
+ * exactly like qlop has always determined it, for the lines ending an
+ * (un)merge, the package is taken from the same position as for the
+ * starting line it must match */
+bool
+emerge_log_line_pkg(
+		const char *p,
+		enum emerge_log_ev_type type,
+		char *ret,
+		size_t retlen)
+{
+	char buf[BUFSIZ];
+	const char *q;
+	depend_atom *atom;
+
+	switch (type) {
+		case EMERGE_LOG_MERGE_START:
+			if ((q = strchr(p + 13, ')')) == NULL)
+				return false;
+			p = q + 2;
+			q = strchr(p, ' ');
+			break;
+		case EMERGE_LOG_MERGE_END:
+			if ((q = strchr(p + 23, ')')) == NULL)
+				return false;
+			p = q + 2;
+			q = strchr(p, ' ');
+			break;
+		case EMERGE_LOG_UNMERGE_START:
+		case EMERGE_LOG_AUTOCLEAN_START:
+			if (p[1] == ' ')
+				p++;
+			p += 19;
+			q = strchr(p, ')');
+			break;
+		case EMERGE_LOG_UNMERGE_END:
+			p += 23;
+			q = strchr(p, '\n');
+			break;
+		default:
+			return false;
+	}
+	if (q == NULL || (size_t)(q - p) >= sizeof(buf))
+		return false;
+
+	memcpy(buf, p, q - p);
+	buf[q - p] = '\0';
+	/* the same versions appear many times in a log */
+	if ((atom = atom_intern(buf)) == NULL)
+		return false;
+	snprintf(ret, retlen, "%s/%s", atom->CATEGORY, atom->PN);
+	atom_implode(atom);
+
+	return true;
+}
+
+static bool
+emerge_log_index_setup(emerge_log_index *idx)
+{
+	const emerge_log_ev *ev;
+	size_t off;
+	size_t n;
+
+	if (idx->len < sizeof(*idx->hdr))
+		return false;
+	idx->hdr = (const struct emerge_log_index_hdr *)idx->data;
+	if (memcmp(idx->hdr->magic, EMERGE_LOG_INDEX_MAGIC,
+				sizeof(idx->hdr->magic)) != 0 ||
+			idx->hdr->version != EMERGE_LOG_INDEX_VERSION ||
+			idx->hdr->size != idx->len ||
+			idx->hdr->nevs > (idx->len - sizeof(*idx->hdr)) /
+				sizeof(*idx->evs))
+		return false;
+
+	off = sizeof(*idx->hdr);
+	idx->evs = (const emerge_log_ev *)(idx->data + off);
+	off += sizeof(*idx->evs) * idx->hdr->nevs;
+	if (off >= idx->len)
+		return false;
+	idx->strs = idx->data + off;
+	idx->strslen = idx->len - off;
+	if (idx->strs[idx->strslen - 1] != '\0')
+		return false;
+
+	/* ensure nothing points outside of the index or log, such that a
+	 * damaged file cannot lead us astray */
+	for (n = 0; n < idx->hdr->nevs; n++) {
+		ev = &idx->evs[n];
+		if ((ev->pkg != EMERGE_LOG_INDEX_ABSENT &&
+					ev->pkg >= idx->strslen) ||
+				ev->len == 0 || ev->len >= BUFSIZ ||
+				ev->off + ev->len > idx->hdr->end ||
+				ev->type == EMERGE_LOG_NONE ||
+				ev->type > EMERGE_LOG_UNMERGE_END)
+			return false;
+	}
+
+	return true;
+}
+
+void
+emerge_log_index_close(emerge_log_index *idx)
+{
+	if (idx->mapped)
+		munmap(idx->data, idx->len);
+	else
+		free(idx->data);
+	free(idx);
+}
+
+static emerge_log_index *
+emerge_log_index_load(int cache_fd, const char *fname)
+{
+	emerge_log_index *ret;
+	size_t len;
+	void *data;
+
+	data = cache_file_map(cache_fd, fname,
+			sizeof(struct emerge_log_index_hdr), &len);
+	if (data == NULL)
+		return NULL;
+
+	ret = xzalloc(sizeof(*ret));
+	ret->data = data;
+	ret->len = len;
+	ret->mapped = true;
+	if (!emerge_log_index_setup(ret)) {
+		emerge_log_index_close(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+/* computes the checksum of the bytes of the log right before end, such
+ * that whatever covers the log up to end can tell the log was replaced,
+ * rotated or truncated in the meantime */
+bool
+emerge_log_sum(int log_fd, uint64_t end, uint64_t *ret)
+{
+	unsigned char buf[EMERGE_LOG_SUMLEN];
+	uint64_t hash = 14695981039346656037ULL;
+	size_t len;
+	size_t n;
+
+	len = end < sizeof(buf) ? (size_t)end : sizeof(buf);
+	if (len > 0 && pread(log_fd, buf, len, end - len) != (ssize_t)len)
+		return false;
+	for (n = 0; n < len; n++) {
+		hash ^= buf[n];
+		hash *= 1099511628211ULL;
+	}
+	*ret = hash;
+
+	return true;
+}
+
+/* returns whether idx covers (a prefix of) the log described by st */
+static bool
+emerge_log_index_valid(emerge_log_index *idx, int log_fd,
+		const struct stat *st)
+{
+	uint64_t sum;
+
+	return idx->hdr->dev == (uint64_t)st->st_dev &&
+		idx->hdr->ino == (uint64_t)st->st_ino &&
+		idx->hdr->end <= (uint64_t)st->st_size &&
+		emerge_log_sum(log_fd, idx->hdr->end, &sum) &&
+		sum == idx->hdr->endsum;
+}
+
+static uint32_t
+emerge_log_index_build_str(struct emerge_log_index_build *b, const char *s)
+{
+	uint32_t ret = (uint32_t)b->strslen;
+	size_t len = strlen(s);
+
+	if (b->strslen + len + 1 > b->strssize) {
+		b->strssize = ((b->strslen + len + 1) + BUFSIZE - 1) & -BUFSIZE;
+		b->strssize *= 2;
+		b->strs = xrealloc(b->strs, b->strssize);
+	}
+	memcpy(b->strs + b->strslen, s, len + 1);
+	b->strslen += len + 1;
+
+	return ret;
+}
+
+static uint32_t
+emerge_log_index_build_pkg(struct emerge_log_index_build *b, const char *pkg)
+{
+	void *val;
+	uintptr_t ret;
+
+	/* values are offset + 1, for get_set can't return a NULL value */
+	if ((val = get_set(pkg, b->pkgs)) == NULL) {
+		ret = (uintptr_t)emerge_log_index_build_str(b, pkg) + 1;
+		add_set_value(pkg, (void *)ret, b->pkgs);
+	} else {
+		ret = (uintptr_t)val;
+	}
+
+	return (uint32_t)(ret - 1);
+}
+
+/* indexes the lines of the log from where old ended */
+static emerge_log_index *
+emerge_log_index_build(emerge_log_index *old, int log_fd,
+		const struct stat *st)
+{
+	struct emerge_log_index_build b;
+	emerge_log_index *ret;
+	emerge_log_ev *ev;
+	emerge_log_reader *r;
+	char buf[BUFSIZ];
+	char pkg[BUFSIZ];
+	const char *line;
+	const char *p;
+	size_t len;
+	size_t n;
+	int64_t time;
+	enum emerge_log_ev_type type;
+
+	memset(&b, 0, sizeof(b));
+	b.pkgs = create_set();
+	if (old != NULL) {
+		b.hdr = *old->hdr;
+		b.nevs = b.evssize = old->hdr->nevs;
+		b.evs = xmalloc(sizeof(b.evs[0]) * (b.evssize + 1));
+		memcpy(b.evs, old->evs, sizeof(b.evs[0]) * b.nevs);
+		b.strssize = old->strslen;
+		b.strs = xmalloc(b.strssize);
+		memcpy(b.strs, old->strs, old->strslen);
+		b.strslen = old->strslen;
+		for (n = 1; n < b.strslen; n += strlen(b.strs + n) + 1)
+			add_set_value(b.strs + n, (void *)((uintptr_t)n + 1), b.pkgs);
+	} else {
+		memcpy(b.hdr.magic, EMERGE_LOG_INDEX_MAGIC, sizeof(b.hdr.magic));
+		b.hdr.version = EMERGE_LOG_INDEX_VERSION;
+		b.hdr.maxtime = INT64_MIN;
+		emerge_log_index_build_str(&b, "");  /* avoid an empty table */
+	}
+	b.hdr.dev = (uint64_t)st->st_dev;
+	b.hdr.ino = (uint64_t)st->st_ino;
+
+	r = emerge_log_reader_open(log_fd, (off_t)b.hdr.end);
+	while (r != NULL && emerge_log_reader_next(r, &line, &len)) {
+		/* stop at a line that is still being written, reading it
+		 * later on would render a different line */
+		if (len < BUFSIZ - 1 && line[len - 1] != '\n')
+			break;
+
+		if (emerge_log_line_time(line, len, &time, &p)) {
+			type = emerge_log_line_type(p, len - (p - line));
+			if (type != EMERGE_LOG_NONE) {
+				if (b.nevs == b.evssize) {
+					b.evssize += 4096;
+					b.evs = xrealloc(b.evs, sizeof(b.evs[0]) * b.evssize);
+				}
+				ev = &b.evs[b.nevs++];
+				memset(ev, 0, sizeof(*ev));
+				ev->time = time;
+				ev->maxprev = b.hdr.maxtime;
+				ev->off = b.hdr.end;
+				ev->len = (uint32_t)len;
+				ev->type = (uint32_t)type;
+
+				memcpy(buf, p, len - (p - line));
+				buf[len - (p - line)] = '\0';
+				ev->pkg = emerge_log_line_pkg(buf, type, pkg, sizeof(pkg)) ?
+					emerge_log_index_build_pkg(&b, pkg) :
+					EMERGE_LOG_INDEX_ABSENT;
+			}
+
+			if (time > b.hdr.maxtime)
+				b.hdr.maxtime = time;
+			b.hdr.lasttime = time;
+			b.hdr.flags |= EMERGE_LOG_INDEX_HASLAST;
+		}
+
+		b.hdr.end += len;
+	}
+	if (r != NULL)
+		emerge_log_reader_close(r);
+	free_set(b.pkgs);
+
+	ret = NULL;
+	if (emerge_log_sum(log_fd, b.hdr.end, &b.hdr.endsum)) {
+		b.hdr.nevs = b.nevs;
+		b.hdr.size = sizeof(b.hdr) + (sizeof(b.evs[0]) * b.nevs) + b.strslen;
+
+		/* serialise into the same layout as the file uses */
+		ret = xzalloc(sizeof(*ret));
+		ret->len = b.hdr.size;
+		ret->data = xmalloc(ret->len);
+		ret->mapped = false;
+		memcpy(ret->data, &b.hdr, sizeof(b.hdr));
+		memcpy(ret->data + sizeof(b.hdr), b.evs, sizeof(b.evs[0]) * b.nevs);
+		memcpy(ret->data + sizeof(b.hdr) + (sizeof(b.evs[0]) * b.nevs),
+				b.strs, b.strslen);
+		if (!emerge_log_index_setup(ret)) {
+			/* should be impossible */
+			emerge_log_index_close(ret);
+			ret = NULL;
+		}
+	}
+
+	free(b.evs);
+	free(b.strs);
+
+	return ret;
+}
+
+/* opens the index for the log named name (as opened at log_fd), the
+ * index is only used when cachedir (relative to portroot_fd) exists,
+ * and is extended to cover the log as far as possible, if it can be
+ * written, the part of the log beyond emerge_log_index_end() is for the
+ * caller to read */
+emerge_log_index *
+emerge_log_index_open(
+		int portroot_fd,
+		const char *cachedir,
+		const char *name,
+		int log_fd)
+{
+	emerge_log_index *old;
+	emerge_log_index *ret;
+	struct stat st;
+	char fname[32];
+	int cache_fd;
+
+	cache_fd = cache_dir_open(portroot_fd, cachedir);
+	if (cache_fd == -1)
+		return NULL;
+
+	if (fstat(log_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(cache_fd);
+		return NULL;
+	}
+
+	/* the index is checked against the log itself */
+	snprintf(fname, sizeof(fname), "emerge-log-%08x.idx", fnv1a32(name));
+
+	old = emerge_log_index_load(cache_fd, fname);
+	if (old != NULL && !emerge_log_index_valid(old, log_fd, &st)) {
+		emerge_log_index_close(old);
+		old = NULL;
+	}
+	if (old != NULL && old->hdr->end == (uint64_t)st.st_size) {
+		close(cache_fd);
+		return old;
+	}
+
+	/* if we cannot store the result, building doesn't make sense, as
+	 * it costs about as much as just reading the log directly */
+	if (faccessat(cache_fd, ".", W_OK, AT_EACCESS) != 0) {
+		close(cache_fd);
+		return old;
+	}
+
+	ret = emerge_log_index_build(old, log_fd, &st);
+	if (ret != NULL &&
+			(old == NULL || ret->hdr->end != old->hdr->end))
+		cache_file_write(cache_fd, fname, ret->data, ret->len);
+	if (old != NULL)
+		emerge_log_index_close(old);
+	close(cache_fd);
+
+	return ret;
+}
+
+size_t
+emerge_log_index_cnt(emerge_log_index *idx)
+{
+	return idx->hdr->nevs;
+}
+
+const emerge_log_ev *
+emerge_log_index_ev(emerge_log_index *idx, size_t n)
+{
+	return &idx->evs[n];
+}
+
+/* returns the CAT/PN of the package ev is about, or NULL */
+const char *
+emerge_log_index_pkg(emerge_log_index *idx, const emerge_log_ev *ev)
+{
+	if (ev->pkg == EMERGE_LOG_INDEX_ABSENT)
+		return NULL;
+	return idx->strs + ev->pkg;
+}
+
+/* returns the first event at which the highest time seen in the log is
+ * at least time, all events before it have an earlier time, and are
+ * preceded by earlier times only */
+size_t
+emerge_log_index_find(emerge_log_index *idx, int64_t time)
+{
+	const emerge_log_ev *ev;
+	size_t lo = 0;
+	size_t hi = idx->hdr->nevs;
+	size_t mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		ev = &idx->evs[mid];
+		if (ev->time >= time || ev->maxprev >= time)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+/* returns the first event of a line at offset off or beyond */
+size_t
+emerge_log_index_seek(emerge_log_index *idx, off_t off)
+{
+	size_t lo = 0;
+	size_t hi = idx->hdr->nevs;
+	size_t mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if (idx->evs[mid].off >= (uint64_t)off)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+/* returns the offset up to which the log is indexed */
+off_t
+emerge_log_index_end(emerge_log_index *idx)
+{
+	return (off_t)idx->hdr->end;
+}
+
+/* returns the highest time of all the lines indexed */
+int64_t
+emerge_log_index_maxtime(emerge_log_index *idx)
+{
+	return idx->hdr->maxtime;
+}
+
+/* retrieves the time of the last indexed line with a time, if any */
+bool
+emerge_log_index_lasttime(emerge_log_index *idx, int64_t *time)
+{
+	if (!(idx->hdr->flags & EMERGE_LOG_INDEX_HASLAST))
+		return false;
+	*time = idx->hdr->lasttime;
+	return true;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#ifndef _EMERGE_LOG_H
+#define _EMERGE_LOG_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* the lines from emerge.log that are of interest, identified by what
+ * follows the timestamp and colon */
+enum emerge_log_ev_type {
+	EMERGE_LOG_NONE = 0,
+	EMERGE_LOG_EMERGE,           /* "  *** emerge " */
+	EMERGE_LOG_EXITING,          /* "  *** exiting " */
+	EMERGE_LOG_TERMINATING,      /* "  *** terminating." */
+	EMERGE_LOG_SYNC_START,       /* "  === sync\n" */
+	EMERGE_LOG_SYNC_END,         /* " === Sync completed " */
+	EMERGE_LOG_MERGE_START,      /* "  >>> emerge " */
+	EMERGE_LOG_MERGE_END,        /* "  ::: completed emerge (" */
+	EMERGE_LOG_UNMERGE_START,    /* " === Unmerging... (" */
+	EMERGE_LOG_AUTOCLEAN_START,  /* "  === Unmerging... (" */
+	EMERGE_LOG_UNMERGE_END,      /* "  >>> unmerge success: " */
+};
+
+/* an indexed line, lines are read the way fgets() with a BUFSIZ
+ * buffer does, so overly long lines end up as multiple "lines" */
+typedef struct emerge_log_ev {
+	int64_t time;      /* atol() of the line */
+	int64_t maxprev;   /* highest time of all lines before this one */
+	uint64_t off;      /* of the line in the log */
+	uint32_t len;      /* of the line, including its newline */
+	uint32_t pkg;      /* CAT/PN the line is about, see below */
+	uint32_t type;     /* enum emerge_log_ev_type */
+	uint32_t pad;
+} emerge_log_ev;
+
+typedef struct emerge_log_index emerge_log_index;
+
+typedef struct emerge_log_reader emerge_log_reader;
+
+emerge_log_reader *emerge_log_reader_open(int fd, off_t off);
+bool emerge_log_reader_next(emerge_log_reader *r,
+		const char **line, size_t *len);
+off_t emerge_log_reader_tell(emerge_log_reader *r);
+void emerge_log_reader_close(emerge_log_reader *r);
+const char *emerge_log_decompressor(int fd);
+bool emerge_log_sum(int log_fd, uint64_t end, uint64_t *ret);
+
+bool emerge_log_line_time(const char *line, size_t len,
+		int64_t *time, const char **rest);
+enum emerge_log_ev_type emerge_log_line_type(const char *p, size_t len);
+bool emerge_log_line_pkg(const char *p, enum emerge_log_ev_type type,
+		char *ret, size_t retlen);
+
+emerge_log_index *emerge_log_index_open(int portroot_fd, const char *cachedir,
+		const char *name, int log_fd);
+void emerge_log_index_close(emerge_log_index *idx);
+size_t emerge_log_index_cnt(emerge_log_index *idx);
+const emerge_log_ev *emerge_log_index_ev(emerge_log_index *idx, size_t n);
+const char *emerge_log_index_pkg(emerge_log_index *idx,
+		const emerge_log_ev *ev);
+size_t emerge_log_index_find(emerge_log_index *idx, int64_t time);
+size_t emerge_log_index_seek(emerge_log_index *idx, off_t off);
+off_t emerge_log_index_end(emerge_log_index *idx);
+int64_t emerge_log_index_maxtime(emerge_log_index *idx);
+bool emerge_log_index_lasttime(emerge_log_index *idx, int64_t *time);
+
+#endif
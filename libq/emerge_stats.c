@@ -0,0 +1,787 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#include "main.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xalloc.h>
+
+#include "atom.h"
+#include "cache_file.h"
+#include "eat_file.h"
+#include "emerge_log.h"
+#include "emerge_stats.h"
+#include "set.h"
+#include "xarray.h"
+
+/* The merge statistics record, per CAT/PN and per CAT/PF, how long the
+ * (un)merges found in emerge.log took, pairing their start and end the
+ * way qlop -a does, such that durations can be predicted without
+ * reading the log.  The syncs are recorded likewise.  Like the log, the
+ * statistics are only ever extended from the offset in the log they
+ * cover up to, which is why (un)merges and syncs that started but
+ * didn't finish yet are kept as well.  It is a text file, with after a
+ * header line identifying the log, a state line:
+ *   S dev ino end endsum tlast syncstart
+ * which is validated against the log like its index is (see
+ * emerge_log.c), followed by a line for each package:
+ *   {M,U,S}{N,F} cnt sum sumsq ewma max n duration... CAT/P{N,F}
+ * with M for merges, U for unmerges, S for syncs (as package "sync"),
+ * N and F for per CAT/PN and per CAT/PF, and the last n durations,
+ * oldest first, and a line for each (un)merge in progress:
+ *   P {M,U} tbegin CAT/PN CAT/PF id
+ * id being the part of the line that must match its end. */
+
+#define EMERGE_STATS_MAGIC   "Q-MERGESTATS"
+#define EMERGE_STATS_VERSION 2
+#define EMERGE_STATS_EWMA    4  /* the last duration weighs for 1/N */
+
+#define EMERGE_STATS_PN 0
+#define EMERGE_STATS_PF 1
+
+#define EMERGE_STATS_KINDS 3  /* enum emerge_stats_kind */
+
+struct emerge_stats_pend {
+	int64_t tbegin;
+	char *pn;
+	char *pf;
+	struct emerge_stats_pend *prev;  /* earlier start with the same id */
+};
+
+struct emerge_stats_pends {
+	struct emerge_stats_pend *top;
+};
+
+struct emerge_stats {
+	set *ents[EMERGE_STATS_KINDS][2];  /* kind, per PN or PF */
+	set *pends[2];     /* (un)merge, per id */
+	int64_t tlast;     /* highest time seen in the log */
+	int64_t syncstart; /* of the sync in progress, if any */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t end;      /* offset in the log up to which it is covered */
+	uint64_t endsum;   /* checksum of the bytes right before end */
+};
+
+static const char emerge_stats_kinds[] = "MUS";
+
+emerge_stats *
+emerge_stats_new(void)
+{
+	emerge_stats *ret = xzalloc(sizeof(*ret));
+	int k;
+
+	for (k = 0; k < EMERGE_STATS_KINDS; k++) {
+		ret->ents[k][EMERGE_STATS_PN] = create_set();
+		ret->ents[k][EMERGE_STATS_PF] = create_set();
+	}
+	for (k = 0; k < 2; k++)
+		ret->pends[k] = create_set();
+
+	return ret;
+}
+
+/* forgets everything, such that the log is read from the start */
+static void
+emerge_stats_clear(emerge_stats *st)
+{
+	DECLARE_ARRAY(vals);
+	struct emerge_stats_pends *ps;
+	struct emerge_stats_pend *pe;
+	emerge_stats_ent *e;
+	size_t i;
+	int k;
+	int b;
+
+	for (k = 0; k < EMERGE_STATS_KINDS; k++) {
+		for (b = 0; b < 2; b++) {
+			values_set(st->ents[k][b], vals);
+			array_for_each(vals, i, e)
+				free(e);
+			xarrayfree_int(vals);
+			clear_set(st->ents[k][b]);
+		}
+	}
+	for (k = 0; k < 2; k++) {
+		values_set(st->pends[k], vals);
+		array_for_each(vals, i, ps) {
+			while ((pe = ps->top) != NULL) {
+				ps->top = pe->prev;
+				free(pe->pn);
+				free(pe->pf);
+				free(pe);
+			}
+			free(ps);
+		}
+		xarrayfree_int(vals);
+		clear_set(st->pends[k]);
+	}
+	st->tlast = 0;
+	st->syncstart = 0;
+	st->dev = 0;
+	st->ino = 0;
+	st->end = 0;
+	st->endsum = 0;
+}
+
+void
+emerge_stats_close(emerge_stats *st)
+{
+	int k;
+
+	if (st == NULL)
+		return;
+
+	emerge_stats_clear(st);
+	for (k = 0; k < EMERGE_STATS_KINDS; k++) {
+		free_set(st->ents[k][EMERGE_STATS_PN]);
+		free_set(st->ents[k][EMERGE_STATS_PF]);
+	}
+	for (k = 0; k < 2; k++)
+		free_set(st->pends[k]);
+	free(st);
+}
+
+static emerge_stats_ent *
+emerge_stats_ent_get(emerge_stats *st, int kind, int by, const char *pkg)
+{
+	emerge_stats_ent *e;
+
+	if ((e = get_set(pkg, st->ents[kind][by])) == NULL) {
+		e = xzalloc(sizeof(*e));
+		add_set_value(pkg, e, st->ents[kind][by]);
+		e->pkg = contains_set(pkg, st->ents[kind][by]);
+	}
+
+	return e;
+}
+
+static void
+emerge_stats_record(emerge_stats *st, int kind, int by,
+		const char *pkg, int64_t elapsed)
+{
+	emerge_stats_ent *e = emerge_stats_ent_get(st, kind, by, pkg);
+
+	e->last[e->cnt % EMERGE_STATS_NLAST] = elapsed;
+	e->cnt++;
+	e->sum += elapsed;
+	e->sumsq += (double)elapsed * (double)elapsed;
+	if (e->cnt == 1)
+		e->ewma = elapsed;
+	else
+		e->ewma += (elapsed - e->ewma) / EMERGE_STATS_EWMA;
+	if (elapsed > e->max)
+		e->max = elapsed;
+}
+
+static void
+emerge_stats_push(emerge_stats *st, int kind, const char *id,
+		int64_t tbegin, const char *pn, const char *pf)
+{
+	struct emerge_stats_pends *ps;
+	struct emerge_stats_pend *pe;
+
+	if ((ps = get_set(id, st->pends[kind])) == NULL) {
+		ps = xzalloc(sizeof(*ps));
+		add_set_value(id, ps, st->pends[kind]);
+	}
+
+	pe = xmalloc(sizeof(*pe));
+	pe->tbegin = tbegin;
+	pe->pn = xstrdup(pn);
+	pe->pf = xstrdup(pf);
+	pe->prev = ps->top;
+	ps->top = pe;
+}
+
+/* an end matches the most recent start with the same id */
+static void
+emerge_stats_pop(emerge_stats *st, int kind, const char *id, int64_t tend)
+{
+	struct emerge_stats_pends *ps;
+	struct emerge_stats_pend *pe;
+
+	if ((ps = get_set(id, st->pends[kind])) == NULL ||
+			(pe = ps->top) == NULL)
+		return;
+	ps->top = pe->prev;
+
+	emerge_stats_record(st, kind, EMERGE_STATS_PN, pe->pn, tend - pe->tbegin);
+	emerge_stats_record(st, kind, EMERGE_STATS_PF, pe->pf, tend - pe->tbegin);
+	free(pe->pn);
+	free(pe->pf);
+	free(pe);
+}
+
+/* processes a line of type, p points just after the colon following
+ * the timestamp, the lines considered and how they are paired are
+ * exactly like qlop -a does */
+static void
+emerge_stats_event(emerge_stats *st, int64_t time,
+		enum emerge_log_ev_type type, const char *p, size_t len)
+{
+	char buf[BUFSIZ];
+	char pn[BUFSIZ];
+	char pf[BUFSIZ];
+	depend_atom *atom;
+	char *q;
+	char *r;
+
+	switch (type) {
+		case EMERGE_LOG_SYNC_START:
+			st->syncstart = time;
+			return;
+		case EMERGE_LOG_SYNC_END:
+			/* sync without start, exclude */
+			if (st->syncstart != 0)
+				emerge_stats_record(st, EMERGE_STATS_SYNC, EMERGE_STATS_PN,
+						"sync", time - st->syncstart);
+			st->syncstart = 0;
+			return;
+		case EMERGE_LOG_MERGE_START:
+			if (len < 14 || p[13] != '(')
+				return;
+			break;
+		case EMERGE_LOG_MERGE_END:
+		case EMERGE_LOG_UNMERGE_START:
+		case EMERGE_LOG_UNMERGE_END:
+			break;
+		default:
+			return;
+	}
+
+	/* the line itself is irrelevant to matching ends with starts */
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	memcpy(buf, p, len);
+	if (len > 0 && buf[len - 1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	switch (type) {
+		case EMERGE_LOG_MERGE_START:
+			/* "  >>> emerge (1 of 2) CAT/PF to /" */
+			if ((q = strchr(buf + 14, ')')) == NULL || q[1] == '\0')
+				return;
+			q += 2;
+			if ((r = strchr(q, ' ')) == NULL)
+				return;
+			*r = '\0';
+			atom = atom_intern(q);
+			*r = ' ';
+			if (atom == NULL)
+				return;
+			snprintf(pn, sizeof(pn), "%s/%s", atom->CATEGORY, atom->PN);
+			snprintf(pf, sizeof(pf), "%s/%s", atom->CATEGORY, atom->PF);
+			atom_implode(atom);
+			emerge_stats_push(st, EMERGE_STATS_MERGE, buf + 6, time, pn, pf);
+			break;
+		case EMERGE_LOG_MERGE_END:
+			/* "  ::: completed emerge (1 of 2) CAT/PF to /" */
+			emerge_stats_pop(st, EMERGE_STATS_MERGE, buf + 16, time);
+			break;
+		case EMERGE_LOG_UNMERGE_START:
+			/* " === Unmerging... (CAT/PF)" */
+			q = buf + 19;
+			if ((r = strchr(q, ')')) == NULL)
+				return;
+			*r = '\0';
+			if ((atom = atom_intern(q)) == NULL)
+				return;
+			snprintf(pn, sizeof(pn), "%s/%s", atom->CATEGORY, atom->PN);
+			snprintf(pf, sizeof(pf), "%s/%s", atom->CATEGORY, atom->PF);
+			atom_implode(atom);
+			emerge_stats_push(st, EMERGE_STATS_UNMERGE, q, time, pn, pf);
+			break;
+		case EMERGE_LOG_UNMERGE_END:
+			/* "  >>> unmerge success: CAT/PF" */
+			emerge_stats_pop(st, EMERGE_STATS_UNMERGE, buf + 23, time);
+			break;
+		default:
+			break;
+	}
+}
+
+/* processes the next line of the log, for logs that are not covered by
+ * a statistics file, such as compressed ones */
+void
+emerge_stats_line(emerge_stats *st, const char *line, size_t len)
+{
+	const char *p;
+	int64_t time;
+
+	if (!emerge_log_line_time(line, len, &time, &p))
+		return;
+	/* like qlop, ignore anything that goes back in time */
+	if (time < st->tlast)
+		return;
+	st->tlast = time;
+
+	len -= p - line;
+	emerge_stats_event(st, time, emerge_log_line_type(p, len), p, len);
+}
+
+/* parses the statistics file, which must be for name, any damage
+ * results in nothing being loaded, for what is loaded must match the
+ * state of the log */
+static bool
+emerge_stats_load(emerge_stats *st, int cache_fd, const char *fname,
+		const char *name)
+{
+	char *data = NULL;
+	size_t datalen = 0;
+	char *p;
+	char *q;
+	char *nl;
+	char *pn;
+	emerge_stats_ent *e;
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned long long end;
+	unsigned long long endsum;
+	unsigned long long cnt;
+	long long sum;
+	double sumsq;
+	long long ewma;
+	long long max;
+	long long d;
+	unsigned int n;
+	unsigned int i;
+	int kind;
+	int by;
+	int pos;
+	bool ret = false;
+
+	if (!eat_file_at(cache_fd, fname, &data, &datalen))
+		goto done;
+
+	/* header: magic version name */
+	p = data;
+	if ((nl = strchr(p, '\n')) == NULL)
+		goto done;
+	*nl = '\0';
+	if (sscanf(p, EMERGE_STATS_MAGIC " %u %n", &n, &pos) != 1 ||
+			n != EMERGE_STATS_VERSION ||
+			strcmp(p + pos, name) != 0)
+		goto done;
+	p = nl + 1;
+
+	/* state: S dev ino end endsum tlast syncstart */
+	if ((nl = strchr(p, '\n')) == NULL)
+		goto done;
+	*nl = '\0';
+	if (sscanf(p, "S %llu %llu %llu %llu %lld %lld",
+				&dev, &ino, &end, &endsum, &d, &sum) != 6)
+		goto done;
+	st->syncstart = (int64_t)sum;
+	st->dev = (uint64_t)dev;
+	st->ino = (uint64_t)ino;
+	st->end = (uint64_t)end;
+	st->endsum = (uint64_t)endsum;
+	st->tlast = (int64_t)d;
+	p = nl + 1;
+
+	for (; (nl = strchr(p, '\n')) != NULL; p = nl + 1) {
+		*nl = '\0';
+		if (p[0] == 'P') {
+			/* P kind tbegin CAT/PN CAT/PF id */
+			if (p[1] != ' ' || p[2] == '\0' || p[3] != ' ' ||
+					(q = strchr(emerge_stats_kinds, p[2])) == NULL ||
+					q - emerge_stats_kinds >= 2)
+				goto done;
+			kind = (int)(q - emerge_stats_kinds);
+			if (sscanf(p + 4, "%lld %n", &d, &pos) != 1)
+				goto done;
+			pn = p + 4 + pos;
+			if ((q = strchr(pn, ' ')) == NULL)
+				goto done;
+			*q++ = '\0';
+			if ((p = strchr(q, ' ')) == NULL)
+				goto done;
+			*p++ = '\0';
+			emerge_stats_push(st, kind, p, (int64_t)d, pn, q);
+			continue;
+		}
+
+		/* {M,U,S}{N,F} cnt sum sumsq ewma max n duration... CAT/P{N,F} */
+		if (p[0] == '\0' || (p[1] != 'N' && p[1] != 'F') || p[2] != ' ' ||
+				(q = strchr(emerge_stats_kinds, p[0])) == NULL)
+			goto done;
+		kind = (int)(q - emerge_stats_kinds);
+		by = p[1] == 'N' ? EMERGE_STATS_PN : EMERGE_STATS_PF;
+		if (sscanf(p + 3, "%llu %lld %lf %lld %lld %u %n",
+					&cnt, &sum, &sumsq, &ewma, &max, &n, &pos) != 6 ||
+				cnt == 0 || n > EMERGE_STATS_NLAST ||
+				n != (cnt < EMERGE_STATS_NLAST ? cnt : EMERGE_STATS_NLAST))
+			goto done;
+		p += 3 + pos;
+		e = xzalloc(sizeof(*e));
+		e->cnt = (size_t)cnt;
+		e->sum = (int64_t)sum;
+		e->sumsq = sumsq;
+		e->ewma = (int64_t)ewma;
+		e->max = (int64_t)max;
+		for (i = 0; i < n; i++) {
+			if (sscanf(p, "%lld %n", &d, &pos) != 1) {
+				free(e);
+				goto done;
+			}
+			e->last[(e->cnt - n + i) % EMERGE_STATS_NLAST] = (int64_t)d;
+			p += pos;
+		}
+		if (*p == '\0' || add_set_value(p, e, st->ents[kind][by]) != NULL) {
+			free(e);
+			goto done;
+		}
+		e->pkg = contains_set(p, st->ents[kind][by]);
+	}
+
+	ret = *p == '\0';
+ done:
+	free(data);
+	if (!ret)
+		emerge_stats_clear(st);
+
+	return ret;
+}
+
+static void
+emerge_stats_write(emerge_stats *st, int cache_fd, const char *fname,
+		const char *name)
+{
+	DECLARE_ARRAY(pes);
+	struct emerge_stats_pends *ps;
+	struct emerge_stats_pend *pe;
+	const emerge_stats_ent *e;
+	char tmpname[64];
+	char **keys;
+	size_t nkeys;
+	size_t i;
+	size_t j;
+	size_t n;
+	int kind;
+	int by;
+	int fd;
+	FILE *fp;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", fname, (int)getpid());
+	fd = openat(cache_fd, tmpname,
+			O_WRONLY | O_CREAT | O_EXCL | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlinkat(cache_fd, tmpname, 0);
+		return;
+	}
+
+	fprintf(fp, "%s %d %s\n", EMERGE_STATS_MAGIC, EMERGE_STATS_VERSION, name);
+	fprintf(fp, "S %llu %llu %llu %llu %lld %lld\n",
+			(unsigned long long)st->dev, (unsigned long long)st->ino,
+			(unsigned long long)st->end, (unsigned long long)st->endsum,
+			(long long)st->tlast, (long long)st->syncstart);
+
+	for (kind = 0; kind < EMERGE_STATS_KINDS; kind++) {
+		for (by = 0; by < 2; by++) {
+			nkeys = list_set(st->ents[kind][by], &keys);
+			for (i = 0; i < nkeys; i++) {
+				e = get_set(keys[i], st->ents[kind][by]);
+				n = e->cnt < EMERGE_STATS_NLAST ? e->cnt : EMERGE_STATS_NLAST;
+				fprintf(fp, "%c%c %zu %lld %.17g %lld %lld %zu",
+						emerge_stats_kinds[kind],
+						by == EMERGE_STATS_PN ? 'N' : 'F',
+						e->cnt, (long long)e->sum, e->sumsq,
+						(long long)e->ewma, (long long)e->max, n);
+				for (j = 0; j < n; j++)
+					fprintf(fp, " %lld", (long long)
+							e->last[(e->cnt - n + j) % EMERGE_STATS_NLAST]);
+				fprintf(fp, " %s\n", keys[i]);
+			}
+			free(keys);
+		}
+
+		if (kind >= 2)
+			continue;
+
+		/* the starts with the same id are written oldest first, for
+		 * loading them pushes them in that order */
+		nkeys = list_set(st->pends[kind], &keys);
+		for (i = 0; i < nkeys; i++) {
+			ps = get_set(keys[i], st->pends[kind]);
+			for (pe = ps->top; pe != NULL; pe = pe->prev)
+				xarraypush_ptr(pes, pe);
+			array_for_each_rev(pes, j, pe)
+				fprintf(fp, "P %c %lld %s %s %s\n",
+						emerge_stats_kinds[kind], (long long)pe->tbegin,
+						pe->pn, pe->pf, keys[i]);
+			xarrayfree_int(pes);
+		}
+		free(keys);
+	}
+
+	if (fclose(fp) != 0 ||
+			renameat(cache_fd, tmpname, cache_fd, fname) != 0)
+		unlinkat(cache_fd, tmpname, 0);
+}
+
+/* extends the statistics with the part of the log from where they end
+ * on, using the index of the log for what it covers */
+static void
+emerge_stats_update(emerge_stats *st, int portroot_fd, const char *cachedir,
+		const char *name, int log_fd)
+{
+	emerge_log_index *idx;
+	emerge_log_reader *r;
+	const emerge_log_ev *ev;
+	const char *line;
+	const char *p;
+	char buf[BUFSIZ];
+	size_t len;
+	size_t cnt;
+	size_t n;
+	int64_t time;
+
+	idx = emerge_log_index_open(portroot_fd, cachedir, name, log_fd);
+	if (idx != NULL && (uint64_t)emerge_log_index_end(idx) > st->end) {
+		/* only the lines that can start or end an (un)merge or sync
+		 * need reading, the times of all others are accounted for */
+		cnt = emerge_log_index_cnt(idx);
+		for (n = emerge_log_index_seek(idx, (off_t)st->end); n < cnt; n++) {
+			ev = emerge_log_index_ev(idx, n);
+			if (ev->maxprev > st->tlast)
+				st->tlast = ev->maxprev;
+			if (ev->time < st->tlast)
+				continue;
+			st->tlast = ev->time;
+
+			switch (ev->type) {
+				case EMERGE_LOG_SYNC_START:
+				case EMERGE_LOG_SYNC_END:
+				case EMERGE_LOG_MERGE_START:
+				case EMERGE_LOG_MERGE_END:
+				case EMERGE_LOG_UNMERGE_START:
+				case EMERGE_LOG_UNMERGE_END:
+					break;
+				default:
+					continue;
+			}
+			len = ev->len;
+			if (pread(log_fd, buf, len, (off_t)ev->off) != (ssize_t)len ||
+					!emerge_log_line_time(buf, len, &time, &p))
+				continue;
+			len -= p - buf;
+			emerge_stats_event(st, time,
+					(enum emerge_log_ev_type)ev->type, p, len);
+		}
+		if (emerge_log_index_maxtime(idx) > st->tlast)
+			st->tlast = emerge_log_index_maxtime(idx);
+		st->end = (uint64_t)emerge_log_index_end(idx);
+	}
+	if (idx != NULL)
+		emerge_log_index_close(idx);
+
+	r = emerge_log_reader_open(log_fd, (off_t)st->end);
+	while (r != NULL && emerge_log_reader_next(r, &line, &len)) {
+		/* stop at a line that is still being written, like the index
+		 * does, for it is to be read as a whole next time */
+		if (len < BUFSIZ - 1 && line[len - 1] != '\n')
+			break;
+		emerge_stats_line(st, line, len);
+		st->end += len;
+	}
+	if (r != NULL)
+		emerge_log_reader_close(r);
+}
+
+/* opens the statistics for the log named name (as opened at log_fd),
+ * which are brought up to date with the log, they are kept in cachedir
+ * (relative to portroot_fd) if it exists, and otherwise computed from
+ * the entire log, returns NULL if the log isn't a regular file */
+emerge_stats *
+emerge_stats_open(
+		int portroot_fd,
+		const char *cachedir,
+		const char *name,
+		int log_fd)
+{
+	emerge_stats *ret;
+	struct stat st;
+	uint64_t sum;
+	uint64_t end;
+	char fname[32];
+	int cache_fd;
+
+	if (fstat(log_fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	cache_fd = cache_dir_open(portroot_fd, cachedir);
+
+	/* name itself is stored in the header */
+	snprintf(fname, sizeof(fname), "merge-stats-%08x.cache", fnv1a32(name));
+
+	ret = emerge_stats_new();
+	if (cache_fd != -1 && emerge_stats_load(ret, cache_fd, fname, name) &&
+			(ret->dev != (uint64_t)st.st_dev ||
+			 ret->ino != (uint64_t)st.st_ino ||
+			 ret->end > (uint64_t)st.st_size ||
+			 !emerge_log_sum(log_fd, ret->end, &sum) ||
+			 sum != ret->endsum))
+		emerge_stats_clear(ret);  /* log was replaced, start over */
+	ret->dev = (uint64_t)st.st_dev;
+	ret->ino = (uint64_t)st.st_ino;
+
+	end = ret->end;
+	if (end < (uint64_t)st.st_size)
+		emerge_stats_update(ret, portroot_fd, cachedir, name, log_fd);
+	if (cache_fd != -1) {
+		if (ret->end != end &&
+				faccessat(cache_fd, ".", W_OK, AT_EACCESS) == 0 &&
+				emerge_log_sum(log_fd, ret->end, &ret->endsum))
+			emerge_stats_write(ret, cache_fd, fname, name);
+		close(cache_fd);
+	}
+
+	return ret;
+}
+
+/* adds the durations recorded in src to those in dst, as if the log of
+ * src followed that of dst, what is in progress in src is ignored */
+void
+emerge_stats_merge(emerge_stats *dst, emerge_stats *src)
+{
+	DECLARE_ARRAY(vals);
+	emerge_stats_ent *s;
+	emerge_stats_ent *d;
+	size_t cnt;
+	size_t n;
+	size_t i;
+	size_t j;
+	int k;
+	int b;
+
+	for (k = 0; k < EMERGE_STATS_KINDS; k++) {
+		for (b = 0; b < 2; b++) {
+			values_set(src->ents[k][b], vals);
+			array_for_each(vals, i, s) {
+				d = emerge_stats_ent_get(dst, k, b, s->pkg);
+				cnt = d->cnt + s->cnt;
+				/* the most recent durations are those of src */
+				n = s->cnt < EMERGE_STATS_NLAST ? s->cnt : EMERGE_STATS_NLAST;
+				for (j = s->cnt - n; j < s->cnt; j++)
+					d->last[(d->cnt + j) % EMERGE_STATS_NLAST] =
+						s->last[j % EMERGE_STATS_NLAST];
+				/* the moving averages are weighed by what they cover */
+				d->ewma = (int64_t)(((double)d->ewma * (double)d->cnt +
+							(double)s->ewma * (double)s->cnt) / (double)cnt);
+				d->cnt = cnt;
+				d->sum += s->sum;
+				d->sumsq += s->sumsq;
+				if (s->max > d->max)
+					d->max = s->max;
+			}
+			xarrayfree_int(vals);
+		}
+	}
+}
+
+/* resets ret to the statistics for all packages of kind, per CAT/PF if
+ * perversion is set, per CAT/PN otherwise, and returns their number */
+size_t
+emerge_stats_values(
+		emerge_stats *st,
+		enum emerge_stats_kind kind,
+		bool perversion,
+		array_t *ret)
+{
+	return values_set(st->ents[kind][perversion ?
+			EMERGE_STATS_PF : EMERGE_STATS_PN], ret);
+}
+
+/* returns the statistics for the package atom describes, those for its
+ * version if it is for a specific one and these exist, when atom has no
+ * category, it must match a single package */
+const emerge_stats_ent *
+emerge_stats_get(
+		emerge_stats *st,
+		enum emerge_stats_kind kind,
+		const depend_atom *atom)
+{
+	const emerge_stats_ent *ret;
+	const char *cat = atom->CATEGORY;
+	const char *q;
+	char buf[BUFSIZ];
+	char **keys;
+	size_t nkeys;
+	size_t i;
+	int catlen = cat == NULL ? 0 : (int)strlen(cat);
+
+	if (cat == NULL) {
+		nkeys = list_set(st->ents[kind][EMERGE_STATS_PN], &keys);
+		for (i = 0; i < nkeys; i++) {
+			if ((q = strchr(keys[i], '/')) == NULL ||
+					strcmp(q + 1, atom->PN) != 0)
+				continue;
+			if (cat != NULL) {
+				cat = NULL;  /* ambiguous */
+				break;
+			}
+			cat = keys[i];
+			catlen = (int)(q - keys[i]);
+		}
+		free(keys);  /* the keys themselves remain */
+		if (cat == NULL)
+			return NULL;
+	}
+
+	if (atom->PV != NULL &&
+			(atom->pfx_op == ATOM_OP_NONE || atom->pfx_op == ATOM_OP_EQUAL))
+	{
+		snprintf(buf, sizeof(buf), "%.*s/%s", catlen, cat, atom->PF);
+		ret = get_set(buf, st->ents[kind][EMERGE_STATS_PF]);
+		if (ret != NULL)
+			return ret;
+	}
+	snprintf(buf, sizeof(buf), "%.*s/%s", catlen, cat, atom->PN);
+
+	return get_set(buf, st->ents[kind][EMERGE_STATS_PN]);
+}
+
+/* the average, like qlop -a reports */
+int64_t
+emerge_stats_mean(const emerge_stats_ent *e)
+{
+	return e->sum / (int64_t)e->cnt;
+}
+
+int64_t
+emerge_stats_stddev(const emerge_stats_ent *e)
+{
+	double mean = (double)e->sum / (double)e->cnt;
+	double var = (e->sumsq / (double)e->cnt) - (mean * mean);
+	double sd;
+
+	/* rounding can make the variance of near equal durations negative */
+	if (var <= 0.0)
+		return 0;
+
+	sd = sqrt(var);
+	return (int64_t)sd;
+}
+
+/* the expected duration of a next (un)merge, which is the moving
+ * average that favours the recent durations, for those reflect changes
+ * in the package and the machine building it best */
+int64_t
+emerge_stats_predict(const emerge_stats_ent *e)
+{
+	return e->ewma;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#ifndef _EMERGE_STATS_H
+#define _EMERGE_STATS_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atom.h"
+#include "xarray.h"
+
+#define EMERGE_STATS_NLAST 8
+
+enum emerge_stats_kind {
+	EMERGE_STATS_MERGE = 0,
+	EMERGE_STATS_UNMERGE,
+	EMERGE_STATS_SYNC,
+};
+
+/* the durations (in seconds) of the (un)merges of a package */
+typedef struct emerge_stats_ent {
+	const char *pkg;  /* CAT/PN, CAT/PF or sync */
+	size_t cnt;
+	int64_t sum;
+	double sumsq;
+	int64_t ewma;
+	int64_t max;
+	int64_t last[EMERGE_STATS_NLAST];  /* most recent at (cnt - 1) % N */
+} emerge_stats_ent;
+
+typedef struct emerge_stats emerge_stats;
+
+emerge_stats *emerge_stats_new(void);
+emerge_stats *emerge_stats_open(int portroot_fd, const char *cachedir,
+		const char *name, int log_fd);
+void emerge_stats_line(emerge_stats *st, const char *line, size_t len);
+void emerge_stats_close(emerge_stats *st);
+void emerge_stats_merge(emerge_stats *dst, emerge_stats *src);
+size_t emerge_stats_values(emerge_stats *st, enum emerge_stats_kind kind,
+		bool perversion, array_t *ret);
+const emerge_stats_ent *emerge_stats_get(emerge_stats *st,
+		enum emerge_stats_kind kind, const depend_atom *atom);
+int64_t emerge_stats_mean(const emerge_stats_ent *e);
+int64_t emerge_stats_stddev(const emerge_stats_ent *e);
+int64_t emerge_stats_predict(const emerge_stats_ent *e);
+
+#endif
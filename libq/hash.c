@@ -19,11 +19,21 @@
 #else
 # include "hash_md5_sha1.h"
 #endif
-#ifdef HAVE_BLAKE2B
-# include <blake2.h>
+
+#include <errno.h>
+#include <unistd.h>
+#ifdef _OPENMP
+# include <omp.h>
+#else
+# define omp_get_max_threads() 1
+# define omp_get_num_threads() 1
+# define omp_get_thread_num()  0
+# define omp_in_parallel()     0
 #endif
 
+#include "bulk_read.h"
 #include "hash.h"
+#include "hash_blake2b.h"
 
 void
 hash_hex(char *out, const unsigned char *buf, const int length)
@@ -104,30 +114,9 @@ hash_hex(char *out, const unsigned char *buf, const int length)
 	}
 }
 
-/**
- * Computes the hashes for file fname and writes the hex-representation
- * for those hashes into the address space pointed to by the return
- * pointers for these hashes.  The caller should ensure enough space is
- * available.  Only those hashes which are in the global hashes variable
- * are computed, the address space pointed to for non-used hashes are
- * left untouched, e.g. they can be NULL.  The number of bytes read from
- * the file pointed to by fname is returned in the flen argument.
- */
-int
-hash_multiple_file_fd(
-		int fd,
-		char *md5,
-		char *sha1,
-		char *sha256,
-		char *sha512,
-		char *whrlpl,
-		char *blak2b,
-		size_t *flen,
-		int hashes)
-{
-	FILE *f;
-	char data[8192];
-	size_t len;
+/* state for all hashes computed over a single stream of data */
+struct hash_state {
+	int hashes;
 #ifdef HAVE_SSL
 	MD5_CTX m5;
 	SHA_CTX s1;
@@ -137,159 +126,291 @@ hash_multiple_file_fd(
 #else
 	struct md5_ctx_t m5;
 	struct sha1_ctx_t s1;
-	(void)sha256;
-	(void)sha512;
-	(void)whrlpl;
-#endif
-#ifdef HAVE_BLAKE2B
-	blake2b_state bl2b;
-#else
-	(void)blak2b;
 #endif
+	hash_blake2b_ctx bl2b;
+};
 
-	if ((f = fdopen(fd, "r")) == NULL)
-		return -1;
+/* the hashes in the order they are assigned to threads, slowest first
+ * such that with less threads than hashes the work is spread best */
+static const int hash_order[] = {
+	HASH_WHIRLPOOL,
+	HASH_SHA256,
+	HASH_SHA512,
+	HASH_BLAKE2B,
+	HASH_SHA1,
+	HASH_MD5,
+};
+
+/* files smaller than this are hashed by the calling thread alone, for
+ * them starting threads costs more than it gains */
+#define HASH_PARALLEL_MIN  (4 * 1024 * 1024)
+/* size of the chunks read, and of each of the two buffers used while
+ * hashing in parallel */
+#define HASH_CHUNK_SIZE    (64 * 1024)
+#define HASH_BLOCK_SIZE    (1024 * 1024)
+/* files up to this size are read whole when hashing many files */
+#define HASH_BATCH_MAX     (64 * 1024)
+
+/* number of threads worth using for hashes: one per hash, plus one for
+ * reading, but only when there is more than a single hash to compute */
+static int
+hash_threads(int hashes)
+{
+	size_t i;
+	int n = 0;
 
+	for (i = 0; i < ARRAY_SIZE(hash_order); i++)
+		if (hashes & hash_order[i])
+			n++;
+	if (n < 2)
+		return 1;
+	n++;
+	return n < omp_get_max_threads() ? n : omp_get_max_threads();
+}
+
+static void
+hash_state_init(struct hash_state *st, int hashes)
+{
+	st->hashes = hashes;
 #ifdef HAVE_SSL
-	MD5_Init(&m5);
-	SHA1_Init(&s1);
-	SHA256_Init(&s256);
-	SHA512_Init(&s512);
-	WHIRLPOOL_Init(&whrl);
+	if (hashes & HASH_MD5)
+		MD5_Init(&st->m5);
+	if (hashes & HASH_SHA1)
+		SHA1_Init(&st->s1);
+	if (hashes & HASH_SHA256)
+		SHA256_Init(&st->s256);
+	if (hashes & HASH_SHA512)
+		SHA512_Init(&st->s512);
+	if (hashes & HASH_WHIRLPOOL)
+		WHIRLPOOL_Init(&st->whrl);
 #else
-	md5_begin(&m5);
-	sha1_begin(&s1);
-#endif
-#ifdef HAVE_BLAKE2B
-	blake2b_init(&bl2b, BLAKE2B_OUTBYTES);
+	if (hashes & HASH_MD5)
+		md5_begin(&st->m5);
+	if (hashes & HASH_SHA1)
+		sha1_begin(&st->s1);
 #endif
+	if (hashes & HASH_BLAKE2B)
+		hash_blake2b_init(&st->bl2b, HASH_BLAKE2B_OUTBYTES);
+}
 
-	*flen = 0;
-	while ((len = fread(data, 1, sizeof(data), f)) > 0) {
-		*flen += len;
-#pragma omp parallel sections
-		{
+/* feeds data to the hashes in which, which should all be in st */
+static void
+hash_state_update(struct hash_state *st, int which,
+		const unsigned char *data, size_t len)
+{
+	which &= st->hashes;
 #ifdef HAVE_SSL
-#pragma omp section
-			{
-				if (hashes & HASH_MD5)
-					MD5_Update(&m5, data, len);
-			}
-#pragma omp section
-			{
-				if (hashes & HASH_SHA1)
-					SHA1_Update(&s1, data, len);
-			}
-#pragma omp section
-			{
-				if (hashes & HASH_SHA256)
-					SHA256_Update(&s256, data, len);
-			}
-#pragma omp section
-			{
-				if (hashes & HASH_SHA512)
-					SHA512_Update(&s512, data, len);
-			}
-#pragma omp section
-			{
-				if (hashes & HASH_WHIRLPOOL)
-					WHIRLPOOL_Update(&whrl, data, len);
-			}
+	if (which & HASH_MD5)
+		MD5_Update(&st->m5, data, len);
+	if (which & HASH_SHA1)
+		SHA1_Update(&st->s1, data, len);
+	if (which & HASH_SHA256)
+		SHA256_Update(&st->s256, data, len);
+	if (which & HASH_SHA512)
+		SHA512_Update(&st->s512, data, len);
+	if (which & HASH_WHIRLPOOL)
+		WHIRLPOOL_Update(&st->whrl, data, len);
 #else
-#pragma omp section
-			{
-				if (hashes & HASH_MD5)
-					md5_hash(data, len, &m5);
-			}
-#pragma omp section
-			{
-				if (hashes & HASH_SHA1)
-					sha1_hash(data, len, &s1);
-			}
+	if (which & HASH_MD5)
+		md5_hash(data, len, &st->m5);
+	if (which & HASH_SHA1)
+		sha1_hash(data, len, &st->s1);
 #endif
-#ifdef HAVE_BLAKE2B
-#pragma omp section
-			{
-				if (hashes & HASH_BLAKE2B)
-					blake2b_update(&bl2b, (unsigned char *)data, len);
-			}
+	if (which & HASH_BLAKE2B)
+		hash_blake2b_update(&st->bl2b, data, len);
+}
+
+static void
+hash_state_final(
+		struct hash_state *st,
+		char *md5,
+		char *sha1,
+		char *sha256,
+		char *sha512,
+		char *whrlpl,
+		char *blak2b)
+{
+	unsigned char buf[64];
+
+#ifdef HAVE_SSL
+	if (st->hashes & HASH_MD5) {
+		MD5_Final(buf, &st->m5);
+		hash_hex(md5, buf, MD5_DIGEST_LENGTH);
+	}
+	if (st->hashes & HASH_SHA1) {
+		SHA1_Final(buf, &st->s1);
+		hash_hex(sha1, buf, SHA_DIGEST_LENGTH);
+	}
+	if (st->hashes & HASH_SHA256) {
+		SHA256_Final(buf, &st->s256);
+		hash_hex(sha256, buf, SHA256_DIGEST_LENGTH);
+	}
+	if (st->hashes & HASH_SHA512) {
+		SHA512_Final(buf, &st->s512);
+		hash_hex(sha512, buf, SHA512_DIGEST_LENGTH);
+	}
+	if (st->hashes & HASH_WHIRLPOOL) {
+		WHIRLPOOL_Final(buf, &st->whrl);
+		hash_hex(whrlpl, buf, WHIRLPOOL_DIGEST_LENGTH);
+	}
+#else
+	(void)sha256;
+	(void)sha512;
+	(void)whrlpl;
+	if (st->hashes & HASH_MD5) {
+		md5_end(buf, &st->m5);
+		hash_hex(md5, buf, 16);
+	}
+	if (st->hashes & HASH_SHA1) {
+		sha1_end(buf, &st->s1);
+		hash_hex(sha1, buf, 20);
+	}
 #endif
+	if (st->hashes & HASH_BLAKE2B) {
+		hash_blake2b_final(&st->bl2b, buf);
+		hash_hex(blak2b, buf, HASH_BLAKE2B_OUTBYTES);
+	}
+}
+
+/* reads up to len bytes, less only at EOF, returns -1 on error */
+static ssize_t
+hash_read(int fd, unsigned char *buf, size_t len)
+{
+	size_t have = 0;
+	ssize_t rlen;
+
+	while (have < len) {
+		rlen = read(fd, buf + have, len - have);
+		if (rlen == 0)
+			break;
+		if (rlen < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
+		have += rlen;
 	}
-	fclose(f);
 
-#pragma omp parallel sections
+	return (ssize_t)have;
+}
+
+/* hashes large files with a thread per hash (or a few hashes per
+ * thread when there are less threads), which stay around for the
+ * entire file, while the reading of the next block happens alongside */
+static int
+hash_state_parallel(struct hash_state *st, int fd, size_t *flen)
+{
+	unsigned char *buf[2];
+	ssize_t len[2];
+	bool failed = false;
+
+	buf[0] = xmalloc(HASH_BLOCK_SIZE * 2);
+	buf[1] = buf[0] + HASH_BLOCK_SIZE;
+
+	len[0] = hash_read(fd, buf[0], HASH_BLOCK_SIZE);
+	if (len[0] < 0) {
+		free(buf[0]);
+		return -1;
+	}
+
+#pragma omp parallel num_threads(hash_threads(st->hashes))
 	{
-#ifdef HAVE_SSL
-#pragma omp section
-		{
-			if (hashes & HASH_MD5) {
-				unsigned char md5buf[MD5_DIGEST_LENGTH];
-				MD5_Final(md5buf, &m5);
-				hash_hex(md5, md5buf, MD5_DIGEST_LENGTH);
-			}
-		}
-#pragma omp section
-		{
-			if (hashes & HASH_SHA1) {
-				unsigned char sha1buf[SHA_DIGEST_LENGTH];
-				SHA1_Final(sha1buf, &s1);
-				hash_hex(sha1, sha1buf, SHA_DIGEST_LENGTH);
-			}
-		}
-#pragma omp section
-		{
-			if (hashes & HASH_SHA256) {
-				unsigned char sha256buf[SHA256_DIGEST_LENGTH];
-				SHA256_Final(sha256buf, &s256);
-				hash_hex(sha256, sha256buf, SHA256_DIGEST_LENGTH);
-			}
-		}
-#pragma omp section
-		{
-			if (hashes & HASH_SHA512) {
-				unsigned char sha512buf[SHA512_DIGEST_LENGTH];
-				SHA512_Final(sha512buf, &s512);
-				hash_hex(sha512, sha512buf, SHA512_DIGEST_LENGTH);
-			}
-		}
-#pragma omp section
-		{
-			if (hashes & HASH_WHIRLPOOL) {
-				unsigned char whrlplbuf[WHIRLPOOL_DIGEST_LENGTH];
-				WHIRLPOOL_Final(whrlplbuf, &whrl);
-				hash_hex(whrlpl, whrlplbuf, WHIRLPOOL_DIGEST_LENGTH);
-			}
-		}
-#else
-#pragma omp section
-		{
-			if (hashes & HASH_MD5) {
-				unsigned char md5buf[16];
-				md5_end(md5buf, &m5);
-				hash_hex(md5, md5buf, 16);
-			}
+		int tid = omp_get_thread_num();
+		int nthr = omp_get_num_threads();
+		int mine = 0;
+		int cur;
+		size_t i;
+		size_t n;
+
+		/* thread 0 reads, the others split the hashes amongst them,
+		 * unless there is nobody else */
+		for (i = 0, n = 0; i < ARRAY_SIZE(hash_order); i++) {
+			if (!(st->hashes & hash_order[i]))
+				continue;
+			if (nthr == 1 || (int)(n++ % (nthr - 1)) + 1 == tid)
+				mine |= hash_order[i];
 		}
-#pragma omp section
-		{
-			if (hashes & HASH_SHA1) {
-				unsigned char sha1buf[20];
-				sha1_end(sha1buf, &s1);
-				hash_hex(sha1, sha1buf, 20);
+
+		for (cur = 0; len[cur] > 0; cur ^= 1) {
+			if (tid == 0) {
+				*flen += len[cur];
+				len[cur ^ 1] = 0;
+				if (len[cur] == HASH_BLOCK_SIZE) {
+					len[cur ^ 1] =
+						hash_read(fd, buf[cur ^ 1], HASH_BLOCK_SIZE);
+					if (len[cur ^ 1] < 0) {
+						failed = true;
+						len[cur ^ 1] = 0;
+					}
+				}
 			}
+			hash_state_update(st, mine, buf[cur], len[cur]);
+			/* the next block is there, and nobody uses this one */
+#pragma omp barrier
 		}
+	}
+
+	free(buf[0]);
+	return failed ? -1 : 0;
+}
+
+/**
+ * Computes the hashes for file fname and writes the hex-representation
+ * for those hashes into the address space pointed to by the return
+ * pointers for these hashes.  The caller should ensure enough space is
+ * available.  Only those hashes which are in the global hashes variable
+ * are computed, the address space pointed to for non-used hashes are
+ * left untouched, e.g. they can be NULL.  The number of bytes read from
+ * the file pointed to by fname is returned in the flen argument.
+ * Small files, and any file when called from a parallel region, are
+ * hashed by the calling thread, large files are hashed in parallel.
+ * On success, fd is closed.
+ */
+int
+hash_multiple_file_fd(
+		int fd,
+		char *md5,
+		char *sha1,
+		char *sha256,
+		char *sha512,
+		char *whrlpl,
+		char *blak2b,
+		size_t *flen,
+		int hashes)
+{
+	struct hash_state st;
+	struct stat s;
+	unsigned char data[HASH_CHUNK_SIZE];
+	ssize_t len;
+	bool parallel;
+
+#ifndef HAVE_SSL
+	hashes &= HASH_MD5 | HASH_SHA1 | HASH_BLAKE2B;
 #endif
-#ifdef HAVE_BLAKE2B
-#pragma omp section
-		{
-			if (hashes & HASH_BLAKE2B) {
-				unsigned char blak2bbuf[BLAKE2B_OUTBYTES];
-				blake2b_final(&bl2b, blak2bbuf, BLAKE2B_OUTBYTES);
-				hash_hex(blak2b, blak2bbuf, BLAKE2B_OUTBYTES);
-			}
+	hash_state_init(&st, hashes);
+
+	/* when already running in parallel, all threads are busy */
+	parallel = hash_threads(hashes) > 1 && !omp_in_parallel() &&
+		fstat(fd, &s) == 0 && S_ISREG(s.st_mode) &&
+		s.st_size >= HASH_PARALLEL_MIN;
+
+	*flen = 0;
+	if (parallel) {
+		if (hash_state_parallel(&st, fd, flen) != 0)
+			return -1;
+	} else {
+		while ((len = hash_read(fd, data, sizeof(data))) > 0) {
+			*flen += len;
+			hash_state_update(&st, hashes, data, len);
+			if (len < (ssize_t)sizeof(data))
+				break;
 		}
-#endif
+		if (len < 0)
+			return -1;
 	}
+	close(fd);
+
+	hash_state_final(&st, md5, sha1, sha256, sha512, whrlpl, blak2b);
 
 	return 0;
 }
@@ -323,11 +444,112 @@ hash_multiple_file_at_cb(
 	ret = hash_multiple_file_fd(fd, md5, sha1, sha256, sha512,
 			whrlpl, blak2b, flen, hashes);
 
-	close(fd);
+	/* on success fd was closed already, closing it again could hit a
+	 * file just opened by another thread */
+	if (ret != 0)
+		close(fd);
 	return ret;
 }
 
+struct hash_files_batch {
+	hash_file_ent *ents;
+	unsigned char **bufs;
+	int hashes;
+};
+
+static void
+hash_files_cb(bulk_read_file *f, void *priv)
+{
+	struct hash_files_batch *b = priv;
+	hash_file_ent *e = &b->ents[f->idx];
+	struct hash_state st;
+
+	e->flen = 0;
+	e->ret = -1;
+	if (f->err != 0)
+		return;
+
+	/* large or special files are read by chunk, as usual */
+	if (f->data == NULL) {
+		e->ret = hash_multiple_file_fd(f->fd, e->md5, e->sha1, e->sha256,
+				e->sha512, e->whrlpl, e->blak2b, &e->flen, b->hashes);
+		if (e->ret == 0)
+			f->fd = -1;
+		return;
+	}
+
+	/* all but BLAKE2b right away, it is done for all files at once */
+	hash_state_init(&st, b->hashes & ~HASH_BLAKE2B);
+	hash_state_update(&st, b->hashes, f->data, f->len);
+	hash_state_final(&st, e->md5, e->sha1, e->sha256,
+			e->sha512, e->whrlpl, e->blak2b);
+	e->flen = f->len;
+	e->ret = 0;
+	if (b->hashes & HASH_BLAKE2B) {
+		b->bufs[f->idx] = f->data;
+		f->data = NULL;
+	}
+}
+
+/**
+ * Computes the hashes for each of the nents files in ents, relative to
+ * dfd, like hash_multiple_file_at_cb does for a single file, setting
+ * ret in each entry to its outcome.  The files are read using
+ * bulk_read_files, and hashed as their contents arrive.  Small files
+ * are read in their entirety, such that their BLAKE2b digests can be
+ * computed several at a time.
+ */
+void
+hash_multiple_files(int dfd, hash_file_ent *ents, size_t nents, int hashes)
+{
+	struct hash_files_batch b;
+	const char **names = xmalloc(sizeof(names[0]) * nents);
+	const unsigned char **bdata = xmalloc(sizeof(bdata[0]) * nents);
+	size_t *blen = xmalloc(sizeof(blen[0]) * nents);
+	size_t *bent = xmalloc(sizeof(bent[0]) * nents);
+	unsigned char (*bout)[HASH_BLAKE2B_OUTBYTES];
+	size_t nbufs = 0;
+	size_t i;
+
+#ifndef HAVE_SSL
+	hashes &= HASH_MD5 | HASH_SHA1 | HASH_BLAKE2B;
+#endif
+
+	b.ents = ents;
+	b.bufs = xzalloc(sizeof(b.bufs[0]) * nents);
+	b.hashes = hashes;
+	for (i = 0; i < nents; i++)
+		names[i] = ents[i].name;
+	bulk_read_files(dfd, names, nents, HASH_BATCH_MAX, hash_files_cb, &b);
+
+	for (i = 0; i < nents; i++) {
+		if (b.bufs[i] == NULL)
+			continue;
+		bdata[nbufs] = b.bufs[i];
+		blen[nbufs] = ents[i].flen;
+		bent[nbufs] = i;
+		nbufs++;
+	}
+
+	if (nbufs > 0) {
+		bout = xmalloc(sizeof(bout[0]) * nbufs);
+		hash_blake2b_many(bdata, blen, nbufs, bout);
+		for (i = 0; i < nbufs; i++)
+			hash_hex(ents[bent[i]].blak2b, bout[i], HASH_BLAKE2B_OUTBYTES);
+		free(bout);
+	}
+
+	for (i = 0; i < nents; i++)
+		free(b.bufs[i]);
+	free(b.bufs);
+	free(names);
+	free(bdata);
+	free(blen);
+	free(bent);
+}
+
 static char _hash_file_buf[128 + 1];
+#pragma omp threadprivate(_hash_file_buf)
 char *
 hash_file_at_cb(int pfd, const char *fname, int hash, hash_cb_t cb)
 {
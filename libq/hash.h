@@ -41,6 +41,22 @@ int hash_multiple_file_at_cb(
 	hash_multiple_file_at_cb(AT_FDCWD, f, NULL, m, s1, s2, s5, w, b, l, h)
 #define hash_compute_file(f, s2, s5, w, b, l, h) \
 	hash_multiple_file_at_cb(AT_FDCWD, f, NULL, NULL, NULL, s2, s5, w, b, l, h)
+
+/* a file to hash with hash_multiple_files */
+typedef struct hash_file_ent {
+	const char *name;
+	char md5[32 + 1];
+	char sha1[40 + 1];
+	char sha256[64 + 1];
+	char sha512[128 + 1];
+	char whrlpl[128 + 1];
+	char blak2b[128 + 1];
+	size_t flen;
+	int ret;
+} hash_file_ent;
+void hash_multiple_files(int dfd, hash_file_ent *ents, size_t nents,
+		int hashes);
+
 char *hash_file_at_cb(int pfd, const char *filename, int hash_algo, hash_cb_t cb);
 #define hash_file(f, h) hash_file_at_cb(AT_FDCWD, f, h, NULL)
 #define hash_file_at(fd, f, h) hash_file_at_cb(fd, f, h, NULL)
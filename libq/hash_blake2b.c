@@ -0,0 +1,680 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ *
+ * BLAKE2b as specified in RFC 7693, unkeyed and without salt or
+ * personalisation, as used for Manifests.  The compression function
+ * comes in a portable reference version, and versions for x86 CPUs with
+ * SSSE3 or AVX2, of which the best supported one is picked at runtime.
+ */
+
+#include "main.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <xalloc.h>
+
+#include "hash_blake2b.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+		(defined(__GNUC__) || defined(__clang__))
+# define HASH_BLAKE2B_X86 1
+# include <immintrin.h>
+#endif
+
+static const uint64_t blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const unsigned char blake2b_sigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+static inline uint64_t
+blake2b_load64(const unsigned char *p)
+{
+	return (uint64_t)p[0]       | (uint64_t)p[1] << 8  |
+		   (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+		   (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+		   (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint64_t
+blake2b_rotr64(uint64_t w, unsigned int c)
+{
+	return (w >> c) | (w << (64 - c));
+}
+
+#define BLAKE2B_G(r, i, a, b, c, d) \
+	do { \
+		a = a + b + m[blake2b_sigma[r][2 * i + 0]]; \
+		d = blake2b_rotr64(d ^ a, 32); \
+		c = c + d; \
+		b = blake2b_rotr64(b ^ c, 24); \
+		a = a + b + m[blake2b_sigma[r][2 * i + 1]]; \
+		d = blake2b_rotr64(d ^ a, 16); \
+		c = c + d; \
+		b = blake2b_rotr64(b ^ c, 63); \
+	} while (0)
+
+static void
+blake2b_compress_ref(
+		uint64_t *h,
+		const unsigned char *block,
+		uint64_t t0,
+		uint64_t t1,
+		uint64_t f0)
+{
+	uint64_t m[16];
+	uint64_t v[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		m[i] = blake2b_load64(block + i * 8);
+	for (i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = blake2b_iv[i];
+	}
+	v[12] ^= t0;
+	v[13] ^= t1;
+	v[14] ^= f0;
+
+	for (i = 0; i < 12; i++) {
+		BLAKE2B_G(i, 0, v[0], v[4], v[ 8], v[12]);
+		BLAKE2B_G(i, 1, v[1], v[5], v[ 9], v[13]);
+		BLAKE2B_G(i, 2, v[2], v[6], v[10], v[14]);
+		BLAKE2B_G(i, 3, v[3], v[7], v[11], v[15]);
+		BLAKE2B_G(i, 4, v[0], v[5], v[10], v[15]);
+		BLAKE2B_G(i, 5, v[1], v[6], v[11], v[12]);
+		BLAKE2B_G(i, 6, v[2], v[7], v[ 8], v[13]);
+		BLAKE2B_G(i, 7, v[3], v[4], v[ 9], v[14]);
+	}
+
+	for (i = 0; i < 8; i++)
+		h[i] ^= v[i] ^ v[i + 8];
+}
+
+#ifdef HASH_BLAKE2B_X86
+/* The SIMD versions keep the 4x4 state matrix in rows, such that the
+ * four G functions of a column (or diagonal) step run side by side.
+ * Between the column and diagonal steps, rows 2-4 are rotated to line
+ * up the diagonals as columns, and back again afterwards. */
+
+__attribute__((target("ssse3")))
+static void
+blake2b_compress_ssse3(
+		uint64_t *h,
+		const unsigned char *block,
+		uint64_t t0,
+		uint64_t t1,
+		uint64_t f0)
+{
+	const __m128i r16 = _mm_setr_epi8(
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	const __m128i r24 = _mm_setr_epi8(
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	uint64_t m[16];
+	__m128i row1l, row1h, row2l, row2h, row3l, row3h, row4l, row4h;
+	__m128i b0, b1, t;
+	const unsigned char *s;
+	int i;
+
+	memcpy(m, block, sizeof(m));
+
+	row1l = _mm_loadu_si128((const __m128i *)&h[0]);
+	row1h = _mm_loadu_si128((const __m128i *)&h[2]);
+	row2l = _mm_loadu_si128((const __m128i *)&h[4]);
+	row2h = _mm_loadu_si128((const __m128i *)&h[6]);
+	row3l = _mm_loadu_si128((const __m128i *)&blake2b_iv[0]);
+	row3h = _mm_loadu_si128((const __m128i *)&blake2b_iv[2]);
+	row4l = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&blake2b_iv[4]),
+			_mm_set_epi64x((long long)t1, (long long)t0));
+	row4h = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&blake2b_iv[6]),
+			_mm_set_epi64x(0, (long long)f0));
+
+#define BLAKE2B_ADD_SSSE3(a, b) \
+	do { \
+		a##l = _mm_add_epi64(a##l, b##l); \
+		a##h = _mm_add_epi64(a##h, b##h); \
+	} while (0)
+#define BLAKE2B_XOR_SSSE3(a, b) \
+	do { \
+		a##l = _mm_xor_si128(a##l, b##l); \
+		a##h = _mm_xor_si128(a##h, b##h); \
+	} while (0)
+#define BLAKE2B_G1_SSSE3(xl, xh) \
+	do { \
+		row1l = _mm_add_epi64(row1l, xl); \
+		row1h = _mm_add_epi64(row1h, xh); \
+		BLAKE2B_ADD_SSSE3(row1, row2); \
+		BLAKE2B_XOR_SSSE3(row4, row1); \
+		row4l = _mm_shuffle_epi32(row4l, _MM_SHUFFLE(2, 3, 0, 1)); \
+		row4h = _mm_shuffle_epi32(row4h, _MM_SHUFFLE(2, 3, 0, 1)); \
+		BLAKE2B_ADD_SSSE3(row3, row4); \
+		BLAKE2B_XOR_SSSE3(row2, row3); \
+		row2l = _mm_shuffle_epi8(row2l, r24); \
+		row2h = _mm_shuffle_epi8(row2h, r24); \
+	} while (0)
+#define BLAKE2B_G2_SSSE3(xl, xh) \
+	do { \
+		row1l = _mm_add_epi64(row1l, xl); \
+		row1h = _mm_add_epi64(row1h, xh); \
+		BLAKE2B_ADD_SSSE3(row1, row2); \
+		BLAKE2B_XOR_SSSE3(row4, row1); \
+		row4l = _mm_shuffle_epi8(row4l, r16); \
+		row4h = _mm_shuffle_epi8(row4h, r16); \
+		BLAKE2B_ADD_SSSE3(row3, row4); \
+		BLAKE2B_XOR_SSSE3(row2, row3); \
+		row2l = _mm_xor_si128(_mm_srli_epi64(row2l, 63), \
+				_mm_add_epi64(row2l, row2l)); \
+		row2h = _mm_xor_si128(_mm_srli_epi64(row2h, 63), \
+				_mm_add_epi64(row2h, row2h)); \
+	} while (0)
+#define BLAKE2B_MSG_SSSE3(w0, w1) \
+	_mm_set_epi64x((long long)m[s[w1]], (long long)m[s[w0]])
+
+	for (i = 0; i < 12; i++) {
+		s = blake2b_sigma[i];
+
+		/* columns */
+		b0 = BLAKE2B_MSG_SSSE3(0, 2);
+		b1 = BLAKE2B_MSG_SSSE3(4, 6);
+		BLAKE2B_G1_SSSE3(b0, b1);
+		b0 = BLAKE2B_MSG_SSSE3(1, 3);
+		b1 = BLAKE2B_MSG_SSSE3(5, 7);
+		BLAKE2B_G2_SSSE3(b0, b1);
+
+		/* diagonalise */
+		b0 = _mm_alignr_epi8(row2h, row2l, 8);
+		b1 = _mm_alignr_epi8(row2l, row2h, 8);
+		row2l = b0;
+		row2h = b1;
+		t = row3l;
+		row3l = row3h;
+		row3h = t;
+		b0 = _mm_alignr_epi8(row4h, row4l, 8);
+		b1 = _mm_alignr_epi8(row4l, row4h, 8);
+		row4l = b1;
+		row4h = b0;
+
+		/* diagonals */
+		b0 = BLAKE2B_MSG_SSSE3(8, 10);
+		b1 = BLAKE2B_MSG_SSSE3(12, 14);
+		BLAKE2B_G1_SSSE3(b0, b1);
+		b0 = BLAKE2B_MSG_SSSE3(9, 11);
+		b1 = BLAKE2B_MSG_SSSE3(13, 15);
+		BLAKE2B_G2_SSSE3(b0, b1);
+
+		/* undiagonalise */
+		b0 = _mm_alignr_epi8(row2l, row2h, 8);
+		b1 = _mm_alignr_epi8(row2h, row2l, 8);
+		row2l = b0;
+		row2h = b1;
+		t = row3l;
+		row3l = row3h;
+		row3h = t;
+		b0 = _mm_alignr_epi8(row4l, row4h, 8);
+		b1 = _mm_alignr_epi8(row4h, row4l, 8);
+		row4l = b1;
+		row4h = b0;
+	}
+
+#undef BLAKE2B_MSG_SSSE3
+#undef BLAKE2B_G2_SSSE3
+#undef BLAKE2B_G1_SSSE3
+#undef BLAKE2B_XOR_SSSE3
+#undef BLAKE2B_ADD_SSSE3
+
+	row1l = _mm_xor_si128(row1l, row3l);
+	row1h = _mm_xor_si128(row1h, row3h);
+	row2l = _mm_xor_si128(row2l, row4l);
+	row2h = _mm_xor_si128(row2h, row4h);
+	_mm_storeu_si128((__m128i *)&h[0],
+			_mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[0]), row1l));
+	_mm_storeu_si128((__m128i *)&h[2],
+			_mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[2]), row1h));
+	_mm_storeu_si128((__m128i *)&h[4],
+			_mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[4]), row2l));
+	_mm_storeu_si128((__m128i *)&h[6],
+			_mm_xor_si128(_mm_loadu_si128((const __m128i *)&h[6]), row2h));
+}
+
+__attribute__((target("avx2")))
+static void
+blake2b_compress_avx2(
+		uint64_t *h,
+		const unsigned char *block,
+		uint64_t t0,
+		uint64_t t1,
+		uint64_t f0)
+{
+	const __m256i r16 = _mm256_setr_epi8(
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	const __m256i r24 = _mm256_setr_epi8(
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	uint64_t m[16];
+	__m256i row1, row2, row3, row4;
+	__m256i b;
+	const unsigned char *s;
+	int i;
+
+	memcpy(m, block, sizeof(m));
+
+	row1 = _mm256_loadu_si256((const __m256i *)&h[0]);
+	row2 = _mm256_loadu_si256((const __m256i *)&h[4]);
+	row3 = _mm256_loadu_si256((const __m256i *)&blake2b_iv[0]);
+	row4 = _mm256_xor_si256(
+			_mm256_loadu_si256((const __m256i *)&blake2b_iv[4]),
+			_mm256_set_epi64x(0, (long long)f0, (long long)t1, (long long)t0));
+
+#define BLAKE2B_G1_AVX2(x) \
+	do { \
+		row1 = _mm256_add_epi64(_mm256_add_epi64(row1, row2), x); \
+		row4 = _mm256_xor_si256(row4, row1); \
+		row4 = _mm256_shuffle_epi32(row4, _MM_SHUFFLE(2, 3, 0, 1)); \
+		row3 = _mm256_add_epi64(row3, row4); \
+		row2 = _mm256_xor_si256(row2, row3); \
+		row2 = _mm256_shuffle_epi8(row2, r24); \
+	} while (0)
+#define BLAKE2B_G2_AVX2(x) \
+	do { \
+		row1 = _mm256_add_epi64(_mm256_add_epi64(row1, row2), x); \
+		row4 = _mm256_xor_si256(row4, row1); \
+		row4 = _mm256_shuffle_epi8(row4, r16); \
+		row3 = _mm256_add_epi64(row3, row4); \
+		row2 = _mm256_xor_si256(row2, row3); \
+		row2 = _mm256_xor_si256(_mm256_srli_epi64(row2, 63), \
+				_mm256_add_epi64(row2, row2)); \
+	} while (0)
+#define BLAKE2B_MSG_AVX2(w0, w1, w2, w3) \
+	_mm256_set_epi64x((long long)m[s[w3]], (long long)m[s[w2]], \
+			(long long)m[s[w1]], (long long)m[s[w0]])
+
+	for (i = 0; i < 12; i++) {
+		s = blake2b_sigma[i];
+
+		/* columns */
+		b = BLAKE2B_MSG_AVX2(0, 2, 4, 6);
+		BLAKE2B_G1_AVX2(b);
+		b = BLAKE2B_MSG_AVX2(1, 3, 5, 7);
+		BLAKE2B_G2_AVX2(b);
+
+		/* diagonalise */
+		row2 = _mm256_permute4x64_epi64(row2, _MM_SHUFFLE(0, 3, 2, 1));
+		row3 = _mm256_permute4x64_epi64(row3, _MM_SHUFFLE(1, 0, 3, 2));
+		row4 = _mm256_permute4x64_epi64(row4, _MM_SHUFFLE(2, 1, 0, 3));
+
+		/* diagonals */
+		b = BLAKE2B_MSG_AVX2(8, 10, 12, 14);
+		BLAKE2B_G1_AVX2(b);
+		b = BLAKE2B_MSG_AVX2(9, 11, 13, 15);
+		BLAKE2B_G2_AVX2(b);
+
+		/* undiagonalise */
+		row2 = _mm256_permute4x64_epi64(row2, _MM_SHUFFLE(2, 1, 0, 3));
+		row3 = _mm256_permute4x64_epi64(row3, _MM_SHUFFLE(1, 0, 3, 2));
+		row4 = _mm256_permute4x64_epi64(row4, _MM_SHUFFLE(0, 3, 2, 1));
+	}
+
+#undef BLAKE2B_MSG_AVX2
+#undef BLAKE2B_G2_AVX2
+#undef BLAKE2B_G1_AVX2
+
+	_mm256_storeu_si256((__m256i *)&h[0],
+			_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&h[0]),
+				_mm256_xor_si256(row1, row3)));
+	_mm256_storeu_si256((__m256i *)&h[4],
+			_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&h[4]),
+				_mm256_xor_si256(row2, row4)));
+}
+
+/* Four independent messages at once, each of the 64-bit lanes of a
+ * register belongs to another message.  This way there is no shuffling
+ * of the state between column and diagonal steps, but the message
+ * blocks need to be transposed instead. */
+__attribute__((target("avx2")))
+static void
+blake2b_compress_4way(
+		__m256i *h,
+		const unsigned char *const *block,
+		__m256i t0,
+		__m256i f0)
+{
+	const __m256i r16 = _mm256_setr_epi8(
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	const __m256i r24 = _mm256_setr_epi8(
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	__m256i m[16];
+	__m256i v[16];
+	__m256i a, b, c, d;
+	const unsigned char *s;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		a = _mm256_unpacklo_epi64(
+				_mm256_loadu_si256((const __m256i *)(block[0] + i * 32)),
+				_mm256_loadu_si256((const __m256i *)(block[1] + i * 32)));
+		b = _mm256_unpackhi_epi64(
+				_mm256_loadu_si256((const __m256i *)(block[0] + i * 32)),
+				_mm256_loadu_si256((const __m256i *)(block[1] + i * 32)));
+		c = _mm256_unpacklo_epi64(
+				_mm256_loadu_si256((const __m256i *)(block[2] + i * 32)),
+				_mm256_loadu_si256((const __m256i *)(block[3] + i * 32)));
+		d = _mm256_unpackhi_epi64(
+				_mm256_loadu_si256((const __m256i *)(block[2] + i * 32)),
+				_mm256_loadu_si256((const __m256i *)(block[3] + i * 32)));
+		m[i * 4 + 0] = _mm256_permute2x128_si256(a, c, 0x20);
+		m[i * 4 + 1] = _mm256_permute2x128_si256(b, d, 0x20);
+		m[i * 4 + 2] = _mm256_permute2x128_si256(a, c, 0x31);
+		m[i * 4 + 3] = _mm256_permute2x128_si256(b, d, 0x31);
+	}
+
+	for (i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = _mm256_set1_epi64x((long long)blake2b_iv[i]);
+	}
+	v[12] = _mm256_xor_si256(v[12], t0);
+	v[14] = _mm256_xor_si256(v[14], f0);
+
+#define BLAKE2B_G_4WAY(j, w, x, y, z) \
+	do { \
+		v[w] = _mm256_add_epi64(_mm256_add_epi64(v[w], v[x]), \
+				m[s[2 * j + 0]]); \
+		v[z] = _mm256_shuffle_epi32(_mm256_xor_si256(v[z], v[w]), \
+				_MM_SHUFFLE(2, 3, 0, 1)); \
+		v[y] = _mm256_add_epi64(v[y], v[z]); \
+		v[x] = _mm256_shuffle_epi8(_mm256_xor_si256(v[x], v[y]), r24); \
+		v[w] = _mm256_add_epi64(_mm256_add_epi64(v[w], v[x]), \
+				m[s[2 * j + 1]]); \
+		v[z] = _mm256_shuffle_epi8(_mm256_xor_si256(v[z], v[w]), r16); \
+		v[y] = _mm256_add_epi64(v[y], v[z]); \
+		v[x] = _mm256_xor_si256(v[x], v[y]); \
+		v[x] = _mm256_xor_si256(_mm256_srli_epi64(v[x], 63), \
+				_mm256_add_epi64(v[x], v[x])); \
+	} while (0)
+
+	for (i = 0; i < 12; i++) {
+		s = blake2b_sigma[i];
+		BLAKE2B_G_4WAY(0, 0, 4,  8, 12);
+		BLAKE2B_G_4WAY(1, 1, 5,  9, 13);
+		BLAKE2B_G_4WAY(2, 2, 6, 10, 14);
+		BLAKE2B_G_4WAY(3, 3, 7, 11, 15);
+		BLAKE2B_G_4WAY(4, 0, 5, 10, 15);
+		BLAKE2B_G_4WAY(5, 1, 6, 11, 12);
+		BLAKE2B_G_4WAY(6, 2, 7,  8, 13);
+		BLAKE2B_G_4WAY(7, 3, 4,  9, 14);
+	}
+
+#undef BLAKE2B_G_4WAY
+
+	for (i = 0; i < 8; i++)
+		h[i] = _mm256_xor_si256(h[i], _mm256_xor_si256(v[i], v[i + 8]));
+}
+
+/* computes the digests of up to four complete messages, lanes without
+ * a message (cnt < 4) are run on an empty one, the result discarded */
+__attribute__((target("avx2")))
+static void
+blake2b_many_4way(
+		const unsigned char *const *data,
+		const size_t *len,
+		size_t cnt,
+		unsigned char (*out)[HASH_BLAKE2B_OUTBYTES])
+{
+	unsigned char last[4][HASH_BLAKE2B_BLOCKBYTES];
+	const unsigned char *block[4];
+	size_t nblocks[4];
+	size_t maxblocks = 0;
+	uint64_t t[4];
+	uint64_t f[4];
+	uint64_t on[4];
+	uint64_t hv[8][4];
+	__m256i h[8];
+	__m256i prev[8];
+	__m256i active;
+	size_t k;
+	size_t l;
+	size_t rest;
+	int i;
+
+	for (l = 0; l < 4; l++) {
+		nblocks[l] = 0;
+		if (l < cnt) {
+			nblocks[l] = len[l] == 0 ? 1 :
+				(len[l] + HASH_BLAKE2B_BLOCKBYTES - 1) /
+				HASH_BLAKE2B_BLOCKBYTES;
+			if (nblocks[l] > maxblocks)
+				maxblocks = nblocks[l];
+		}
+	}
+
+	for (i = 0; i < 8; i++)
+		h[i] = _mm256_set1_epi64x((long long)blake2b_iv[i]);
+	/* parameter block: digest length, no key, fanout 1, depth 1 */
+	h[0] = _mm256_xor_si256(h[0],
+			_mm256_set1_epi64x(0x01010000LL ^ HASH_BLAKE2B_OUTBYTES));
+
+	for (k = 0; k < maxblocks; k++) {
+		for (l = 0; l < 4; l++) {
+			t[l] = 0;
+			f[l] = 0;
+			on[l] = 0;
+			if (k + 1 < nblocks[l]) {
+				block[l] = data[l] + k * HASH_BLAKE2B_BLOCKBYTES;
+				t[l] = (k + 1) * HASH_BLAKE2B_BLOCKBYTES;
+				on[l] = ~0ULL;
+			} else {
+				/* the final block is padded with zeros, as are the
+				 * blocks of lanes that are done already */
+				rest = 0;
+				if (k + 1 == nblocks[l]) {
+					rest = len[l] - k * HASH_BLAKE2B_BLOCKBYTES;
+					memcpy(last[l], data[l] + k * HASH_BLAKE2B_BLOCKBYTES,
+							rest);
+					t[l] = len[l];
+					f[l] = ~0ULL;
+					on[l] = ~0ULL;
+				}
+				memset(last[l] + rest, 0, HASH_BLAKE2B_BLOCKBYTES - rest);
+				block[l] = last[l];
+			}
+		}
+
+		for (i = 0; i < 8; i++)
+			prev[i] = h[i];
+		blake2b_compress_4way(h, block,
+				_mm256_loadu_si256((const __m256i *)t),
+				_mm256_loadu_si256((const __m256i *)f));
+		active = _mm256_loadu_si256((const __m256i *)on);
+		for (i = 0; i < 8; i++)
+			h[i] = _mm256_blendv_epi8(prev[i], h[i], active);
+	}
+
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *)hv[i], h[i]);
+	for (l = 0; l < cnt; l++)
+		for (i = 0; i < 64; i++)
+			out[l][i] = (unsigned char)(hv[i / 8][l] >> (8 * (i % 8)));
+}
+#endif
+
+/* sets up ctx for a digest of outlen bytes using the compression
+ * function impl, returns false if impl cannot be used on this CPU */
+bool
+hash_blake2b_init_impl(
+		hash_blake2b_ctx *ctx,
+		size_t outlen,
+		enum hash_blake2b_impl impl)
+{
+	int i;
+
+	ctx->compress = NULL;
+	switch (impl) {
+		case HASH_BLAKE2B_AUTO:
+#ifdef HASH_BLAKE2B_X86
+			if (__builtin_cpu_supports("avx2"))
+				ctx->compress = blake2b_compress_avx2;
+			else if (__builtin_cpu_supports("ssse3"))
+				ctx->compress = blake2b_compress_ssse3;
+			else
+#endif
+				ctx->compress = blake2b_compress_ref;
+			break;
+		case HASH_BLAKE2B_REF:
+			ctx->compress = blake2b_compress_ref;
+			break;
+#ifdef HASH_BLAKE2B_X86
+		case HASH_BLAKE2B_SSSE3:
+			if (__builtin_cpu_supports("ssse3"))
+				ctx->compress = blake2b_compress_ssse3;
+			break;
+		case HASH_BLAKE2B_AVX2:
+			if (__builtin_cpu_supports("avx2"))
+				ctx->compress = blake2b_compress_avx2;
+			break;
+#endif
+		default:
+			break;
+	}
+	if (ctx->compress == NULL)
+		return false;
+
+	if (outlen == 0 || outlen > HASH_BLAKE2B_OUTBYTES)
+		outlen = HASH_BLAKE2B_OUTBYTES;
+	for (i = 0; i < 8; i++)
+		ctx->h[i] = blake2b_iv[i];
+	/* parameter block: digest length, no key, fanout 1, depth 1 */
+	ctx->h[0] ^= 0x01010000ULL ^ (uint64_t)outlen;
+	ctx->t[0] = 0;
+	ctx->t[1] = 0;
+	ctx->buflen = 0;
+	ctx->outlen = outlen;
+
+	return true;
+}
+
+static inline void
+blake2b_increment(hash_blake2b_ctx *ctx, uint64_t inc)
+{
+	ctx->t[0] += inc;
+	if (ctx->t[0] < inc)
+		ctx->t[1]++;
+}
+
+void
+hash_blake2b_update(hash_blake2b_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *in = data;
+	size_t fill;
+
+	if (len == 0)
+		return;
+
+	/* the last block must be kept for final, which sets the final
+	 * flag, hence only compress what is followed by more data */
+	fill = HASH_BLAKE2B_BLOCKBYTES - ctx->buflen;
+	if (len > fill) {
+		memcpy(ctx->buf + ctx->buflen, in, fill);
+		blake2b_increment(ctx, HASH_BLAKE2B_BLOCKBYTES);
+		ctx->compress(ctx->h, ctx->buf, ctx->t[0], ctx->t[1], 0);
+		ctx->buflen = 0;
+		in += fill;
+		len -= fill;
+		while (len > HASH_BLAKE2B_BLOCKBYTES) {
+			blake2b_increment(ctx, HASH_BLAKE2B_BLOCKBYTES);
+			ctx->compress(ctx->h, in, ctx->t[0], ctx->t[1], 0);
+			in += HASH_BLAKE2B_BLOCKBYTES;
+			len -= HASH_BLAKE2B_BLOCKBYTES;
+		}
+	}
+	memcpy(ctx->buf + ctx->buflen, in, len);
+	ctx->buflen += len;
+}
+
+void
+hash_blake2b_final(hash_blake2b_ctx *ctx, unsigned char *out)
+{
+	unsigned char buf[HASH_BLAKE2B_OUTBYTES];
+	int i;
+	int j;
+
+	blake2b_increment(ctx, ctx->buflen);
+	memset(ctx->buf + ctx->buflen, 0,
+			HASH_BLAKE2B_BLOCKBYTES - ctx->buflen);
+	ctx->compress(ctx->h, ctx->buf, ctx->t[0], ctx->t[1], ~0ULL);
+
+	for (i = 0; i < 8; i++)
+		for (j = 0; j < 8; j++)
+			buf[i * 8 + j] = (unsigned char)(ctx->h[i] >> (8 * j));
+	memcpy(out, buf, ctx->outlen);
+}
+
+/* computes the digests of cnt messages in data of len bytes each, into
+ * out, when the CPU allows, four of them at the same time */
+void
+hash_blake2b_many(
+		const unsigned char *const *data,
+		const size_t *len,
+		size_t cnt,
+		unsigned char (*out)[HASH_BLAKE2B_OUTBYTES])
+{
+	hash_blake2b_ctx ctx;
+	size_t i;
+
+#ifdef HASH_BLAKE2B_X86
+	if (cnt > 1 && __builtin_cpu_supports("avx2")) {
+		const unsigned char *gdata[4];
+		size_t glen[4];
+		unsigned char gout[4][HASH_BLAKE2B_OUTBYTES];
+		size_t *order = xmalloc(sizeof(order[0]) * cnt);
+		size_t n;
+		size_t j;
+
+		/* order the messages by length, such that those processed
+		 * together take about as many blocks, and lanes idle little */
+		for (i = 0; i < cnt; i++) {
+			for (j = i; j > 0 && len[order[j - 1]] > len[i]; j--)
+				order[j] = order[j - 1];
+			order[j] = i;
+		}
+
+		for (i = 0; i < cnt; i += n) {
+			n = cnt - i < 4 ? cnt - i : 4;
+			for (j = 0; j < n; j++) {
+				gdata[j] = data[order[i + j]];
+				glen[j] = len[order[i + j]];
+			}
+			blake2b_many_4way(gdata, glen, n, gout);
+			for (j = 0; j < n; j++)
+				memcpy(out[order[i + j]], gout[j], HASH_BLAKE2B_OUTBYTES);
+		}
+
+		free(order);
+		return;
+	}
+#endif
+
+	for (i = 0; i < cnt; i++) {
+		hash_blake2b_init(&ctx, HASH_BLAKE2B_OUTBYTES);
+		hash_blake2b_update(&ctx, data[i], len[i]);
+		hash_blake2b_final(&ctx, out[i]);
+	}
+}
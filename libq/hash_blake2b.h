@@ -0,0 +1,42 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#ifndef _HASH_BLAKE2B_H
+#define _HASH_BLAKE2B_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_BLAKE2B_OUTBYTES   64
+#define HASH_BLAKE2B_BLOCKBYTES 128
+
+enum hash_blake2b_impl {
+	HASH_BLAKE2B_AUTO = 0,  /* best supported by the CPU */
+	HASH_BLAKE2B_REF,       /* portable reference */
+	HASH_BLAKE2B_SSSE3,
+	HASH_BLAKE2B_AVX2
+};
+
+typedef struct hash_blake2b_ctx {
+	uint64_t h[8];
+	uint64_t t[2];
+	unsigned char buf[HASH_BLAKE2B_BLOCKBYTES];
+	size_t buflen;
+	size_t outlen;
+	void (*compress)(uint64_t *h, const unsigned char *block,
+			uint64_t t0, uint64_t t1, uint64_t f0);
+} hash_blake2b_ctx;
+
+bool hash_blake2b_init_impl(hash_blake2b_ctx *ctx, size_t outlen,
+		enum hash_blake2b_impl impl);
+#define hash_blake2b_init(C, L) \
+	hash_blake2b_init_impl(C, L, HASH_BLAKE2B_AUTO)
+void hash_blake2b_update(hash_blake2b_ctx *ctx, const void *data, size_t len);
+void hash_blake2b_final(hash_blake2b_ctx *ctx, unsigned char *out);
+void hash_blake2b_many(const unsigned char *const *data, const size_t *len,
+		size_t cnt, unsigned char (*out)[HASH_BLAKE2B_OUTBYTES]);
+
+#endif
@@ -0,0 +1,352 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#include "main.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <xalloc.h>
+
+#include "cache_file.h"
+#include "eat_file.h"
+#include "hash.h"
+#include "hash_cache.h"
+#include "set.h"
+
+/* The hash cache records the digests computed for files, together with
+ * the inode, size and mtime of the file at that time, such that the
+ * digests of unchanged files can be reused instead of reading them
+ * again.  It is a text file, with after a header line identifying what
+ * the cache is for, a line per file:
+ *   inode size mtime_sec.mtime_nsec ctime_sec.ctime_nsec hashes digest... path
+ * hashes is the mask of the digests that follow, which are in the order
+ * of enum hash_impls.  While the cache is open, a new one is written
+ * holding just the files looked up or stored, such that entries for
+ * files that no longer exist don't linger, unless the cache is opened
+ * to keep the entries that weren't touched, for users that only visit
+ * part of the files. */
+
+#define HASH_CACHE_MAGIC   "Q-HASHCACHE"
+#define HASH_CACHE_VERSION 2
+
+/* length of the hex digest for each bit in enum hash_impls */
+static const size_t hash_cache_hexlen[] = {
+	32,   /* MD5 */
+	40,   /* SHA1 */
+	64,   /* SHA256 */
+	128,  /* SHA512 */
+	128,  /* WHIRLPOOL */
+	128,  /* BLAKE2B */
+};
+
+struct hash_cache_ent {
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	int hashes;
+	const char *digests[ARRAY_SIZE(hash_cache_hexlen)];
+	const char *path;
+	bool used;        /* written to the new cache already */
+};
+
+struct hash_cache {
+	char *data;
+	struct hash_cache_ent *ents;
+	size_t nents;
+	set *paths;
+	bool rebuild;
+	bool keep;
+	int dir_fd;
+	FILE *out;
+	char fname[32];
+	char tmpname[48];
+	time_t start;
+};
+
+/* parses the entries from the cache file, which must be for name, any
+ * damage ends the parsing, which just means less entries are found */
+static void
+hash_cache_load(hash_cache *hc, const char *name)
+{
+	size_t datalen = 0;
+	size_t nents;
+	size_t i;
+	char *p;
+	char *q;
+	char *nl;
+	struct hash_cache_ent *e;
+	unsigned long long ino;
+	long long size;
+	long long sec;
+	long nsec;
+	long long csec;
+	long cnsec;
+	int hashes;
+	int pos;
+
+	if (!eat_file_at(hc->dir_fd, hc->fname, &hc->data, &datalen)) {
+		free(hc->data);
+		hc->data = NULL;
+		return;
+	}
+
+	/* header: magic version name */
+	p = hc->data;
+	if ((nl = strchr(p, '\n')) == NULL)
+		return;
+	*nl = '\0';
+	if (sscanf(p, HASH_CACHE_MAGIC " %d %n", &hashes, &pos) != 1 ||
+			hashes != HASH_CACHE_VERSION ||
+			strcmp(p + pos, name) != 0)
+		return;
+	p = nl + 1;
+
+	for (nents = 0, q = p; (q = strchr(q, '\n')) != NULL; q++)
+		nents++;
+	hc->ents = xmalloc(sizeof(hc->ents[0]) * (nents + 1));
+
+	for (e = hc->ents; (nl = strchr(p, '\n')) != NULL; p = nl + 1) {
+		*nl = '\0';
+		if (sscanf(p, "%llu %lld %lld.%ld %lld.%ld %x %n",
+					&ino, &size, &sec, &nsec, &csec, &cnsec,
+					&hashes, &pos) != 7)
+			return;
+		e->ino = (uint64_t)ino;
+		e->size = (int64_t)size;
+		e->mtime_sec = (int64_t)sec;
+		e->mtime_nsec = (int64_t)nsec;
+		e->ctime_sec = (int64_t)csec;
+		e->ctime_nsec = (int64_t)cnsec;
+		e->hashes = hashes;
+		e->used = false;
+		p += pos;
+		for (i = 0; i < ARRAY_SIZE(hash_cache_hexlen); i++) {
+			e->digests[i] = NULL;
+			if (!(hashes & (1 << i)))
+				continue;
+			q = strchr(p, ' ');
+			if (q == NULL || (size_t)(q - p) != hash_cache_hexlen[i])
+				return;
+			*q = '\0';
+			e->digests[i] = p;
+			p = q + 1;
+		}
+		if (*p == '\0')
+			return;
+		e->path = p;
+		add_set_value(p, e, hc->paths);
+		e++;
+		hc->nents++;
+	}
+}
+
+/* opens the hash cache for name (e.g. the path of the tree the files
+ * belong to), the cache is only used when cachedir (relative to
+ * root_fd) exists and is writable, when rebuild is set, the existing
+ * cache is ignored, but a new one is still written, when keep is set,
+ * entries that weren't looked up or stored are retained in it */
+hash_cache *
+hash_cache_open(int root_fd, const char *cachedir, const char *name,
+		bool rebuild, bool keep)
+{
+	hash_cache *ret;
+	int dir_fd;
+	int fd;
+
+	dir_fd = cache_dir_open(root_fd, cachedir);
+	if (dir_fd == -1)
+		return NULL;
+	if (faccessat(dir_fd, ".", W_OK, AT_EACCESS) != 0) {
+		close(dir_fd);
+		return NULL;
+	}
+
+	ret = xzalloc(sizeof(*ret));
+	ret->dir_fd = dir_fd;
+	ret->paths = create_set();
+	ret->rebuild = rebuild;
+	ret->keep = keep;
+	time(&ret->start);
+
+	/* name itself is stored in the header */
+	snprintf(ret->fname, sizeof(ret->fname), "hashes-%08x.cache",
+			fnv1a32(name));
+	snprintf(ret->tmpname, sizeof(ret->tmpname), "%s.%d",
+			ret->fname, (int)getpid());
+
+	if (!rebuild || keep)
+		hash_cache_load(ret, name);
+
+	fd = openat(dir_fd, ret->tmpname,
+			O_WRONLY | O_CREAT | O_EXCL | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1 || (ret->out = fdopen(fd, "w")) == NULL) {
+		if (fd != -1) {
+			close(fd);
+			unlinkat(dir_fd, ret->tmpname, 0);
+		}
+		hash_cache_close(ret);
+		return NULL;
+	}
+	fprintf(ret->out, "%s %d %s\n", HASH_CACHE_MAGIC, HASH_CACHE_VERSION, name);
+
+	return ret;
+}
+
+/* replaces the cache with the entries stored while it was open */
+void
+hash_cache_close(hash_cache *hc)
+{
+	size_t i;
+
+	if (hc == NULL)
+		return;
+
+	if (hc->out != NULL) {
+		if (hc->keep) {
+			struct hash_cache_ent *e;
+			size_t n;
+
+			for (n = 0; n < hc->nents; n++) {
+				e = &hc->ents[n];
+				if (e->used)
+					continue;
+				fprintf(hc->out, "%llu %lld %lld.%09lld %lld.%09lld %x",
+						(unsigned long long)e->ino, (long long)e->size,
+						(long long)e->mtime_sec, (long long)e->mtime_nsec,
+						(long long)e->ctime_sec, (long long)e->ctime_nsec,
+						e->hashes);
+				for (i = 0; i < ARRAY_SIZE(hash_cache_hexlen); i++) {
+					if (e->hashes & (1 << i))
+						fprintf(hc->out, " %s", e->digests[i]);
+				}
+				fprintf(hc->out, " %s\n", e->path);
+			}
+		}
+		if (fclose(hc->out) != 0 ||
+				renameat(hc->dir_fd, hc->tmpname,
+					hc->dir_fd, hc->fname) != 0)
+			unlinkat(hc->dir_fd, hc->tmpname, 0);
+	}
+	close(hc->dir_fd);
+	free_set(hc->paths);
+	free(hc->ents);
+	free(hc->data);
+	free(hc);
+}
+
+/* retrieves the digests for hashes from the cache, if path, as described
+ * by st, is unchanged since they were stored, the entry is kept */
+bool
+hash_cache_lookup(
+		hash_cache *hc,
+		const char *path,
+		const struct stat *st,
+		char *md5,
+		char *sha1,
+		char *sha256,
+		char *sha512,
+		char *whrlpl,
+		char *blak2b,
+		int hashes)
+{
+	struct hash_cache_ent *e;
+	char *out[ARRAY_SIZE(hash_cache_hexlen)];
+	size_t i;
+
+	if (hc == NULL || hc->ents == NULL || hc->rebuild)
+		return false;
+
+	e = get_set(path, hc->paths);
+	if (e == NULL ||
+			(e->hashes & hashes) != hashes ||
+			e->ino != (uint64_t)st->st_ino ||
+			e->size != (int64_t)st->st_size ||
+			e->mtime_sec != (int64_t)st->st_mtim.tv_sec ||
+			e->mtime_nsec != (int64_t)st->st_mtim.tv_nsec ||
+			e->ctime_sec != (int64_t)st->st_ctim.tv_sec ||
+			e->ctime_nsec != (int64_t)st->st_ctim.tv_nsec)
+		return false;
+
+	out[0] = md5;
+	out[1] = sha1;
+	out[2] = sha256;
+	out[3] = sha512;
+	out[4] = whrlpl;
+	out[5] = blak2b;
+	for (i = 0; i < ARRAY_SIZE(hash_cache_hexlen); i++) {
+		if (hashes & (1 << i))
+			memcpy(out[i], e->digests[i], hash_cache_hexlen[i] + 1);
+	}
+
+	/* keep the digests we have, not just the ones asked for */
+	hash_cache_store(hc, path, st,
+			e->digests[0], e->digests[1], e->digests[2],
+			e->digests[3], e->digests[4], e->digests[5], e->hashes);
+
+	return true;
+}
+
+/* records the digests for hashes of path, as described by st */
+void
+hash_cache_store(
+		hash_cache *hc,
+		const char *path,
+		const struct stat *st,
+		const char *md5,
+		const char *sha1,
+		const char *sha256,
+		const char *sha512,
+		const char *whrlpl,
+		const char *blak2b,
+		int hashes)
+{
+	const char *in[ARRAY_SIZE(hash_cache_hexlen)];
+	struct hash_cache_ent *e;
+	size_t i;
+
+	/* a file modified right after it was hashed could keep the same
+	 * mtime, so don't trust anything that recent */
+	if (hc == NULL ||
+			st->st_mtim.tv_sec >= hc->start ||
+			st->st_ctim.tv_sec >= hc->start)
+		return;
+
+	in[0] = md5;
+	in[1] = sha1;
+	in[2] = sha256;
+	in[3] = sha512;
+	in[4] = whrlpl;
+	in[5] = blak2b;
+	for (i = 0; i < ARRAY_SIZE(hash_cache_hexlen); i++) {
+		if ((hashes & (1 << i)) &&
+				(in[i] == NULL || strlen(in[i]) != hash_cache_hexlen[i]))
+			hashes &= ~(1 << i);
+	}
+
+#pragma omp critical(hash_cache)
+	{
+		/* superseded, so don't retain the old entry */
+		if (hc->ents != NULL && (e = get_set(path, hc->paths)) != NULL)
+			e->used = true;
+		fprintf(hc->out, "%llu %lld %lld.%09ld %lld.%09ld %x",
+				(unsigned long long)st->st_ino, (long long)st->st_size,
+				(long long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec,
+				(long long)st->st_ctim.tv_sec, (long)st->st_ctim.tv_nsec,
+				hashes);
+		for (i = 0; i < ARRAY_SIZE(hash_cache_hexlen); i++) {
+			if (hashes & (1 << i))
+				fprintf(hc->out, " %s", in[i]);
+		}
+		fprintf(hc->out, " %s\n", path);
+	}
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#ifndef _HASH_CACHE_H
+#define _HASH_CACHE_H 1
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+typedef struct hash_cache hash_cache;
+
+hash_cache *hash_cache_open(int root_fd, const char *cachedir,
+		const char *name, bool rebuild, bool keep);
+void hash_cache_close(hash_cache *hc);
+bool hash_cache_lookup(hash_cache *hc, const char *path,
+		const struct stat *st, char *md5, char *sha1, char *sha256,
+		char *sha512, char *whrlpl, char *blak2b, int hashes);
+void hash_cache_store(hash_cache *hc, const char *path,
+		const struct stat *st, const char *md5, const char *sha1,
+		const char *sha256, const char *sha512, const char *whrlpl,
+		const char *blak2b, int hashes);
+
+#endif
@@ -40,6 +40,7 @@ make_human_readable_str(unsigned long long val,
 	const char *u;
 
 	static char str[21];		/* Sufficient for 64 bit unsigned integers. */
+#pragma omp threadprivate(str)
 
 	if (val == 0)
 		return "0";
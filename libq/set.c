@@ -1,5 +1,5 @@
 /*
- * Copyright 2005-2019 Gentoo Foundation
+ * Copyright 2005-2020 Gentoo Foundation
  * Distributed under the terms of the GNU General Public License v2
  *
  * Copyright 2005-2010 Ned Ludd        - <solar@gentoo.org>
@@ -15,50 +15,118 @@
 #include <string.h>
 #include <xalloc.h>
 
+#include "arena.h"
 #include "set.h"
 
-static unsigned int
+/* FNV1a32, also used to name files after what they cache */
+unsigned int
 fnv1a32(const char *s)
 {
 	unsigned int ret = 2166136261UL;
 	for (; *s != '\0'; s++)
-		ret = (ret ^ (unsigned int)*s) * 16777619;
+		ret = (ret ^ (unsigned char)*s) * 16777619;
 	return ret;
 }
 
+#define _SET_INIT_SIZE 32
+
+/* returns the slot holding name, or the empty slot where it should go */
+static set_elem *
+set_slot(set *q, const char *name, unsigned int hash)
+{
+	size_t mask = q->size - 1;
+	size_t i;
+	set_elem *w;
+
+	for (i = hash & mask; (w = &q->elems[i])->name != NULL; i = (i + 1) & mask)
+		if (w->hash == hash && strcmp(w->name, name) == 0)
+			break;
+
+	return w;
+}
+
+static set_elem *
+set_find(set *q, const char *name, unsigned int hash)
+{
+	set_elem *w;
+
+	if (q->len == 0)
+		return NULL;
+
+	w = set_slot(q, name, hash);
+	return w->name == NULL ? NULL : w;
+}
+
+static void
+set_grow(set *q)
+{
+	set_elem *oelems = q->elems;
+	size_t osize = q->size;
+	size_t mask;
+	size_t i;
+	size_t n;
+
+	q->size = osize == 0 ? _SET_INIT_SIZE : osize * 2;
+	q->elems = xzalloc(sizeof(*q->elems) * q->size);
+
+	mask = q->size - 1;
+	for (n = 0; n < osize; n++) {
+		if (oelems[n].name == NULL)
+			continue;
+		for (i = oelems[n].hash & mask;
+				q->elems[i].name != NULL;
+				i = (i + 1) & mask)
+			;
+		q->elems[i] = oelems[n];
+	}
+
+	free(oelems);
+}
+
+/* stores name in the first free slot for it, even if it already exists
+ * (which makes lookups find the previously added one first) */
+static set_elem *
+set_insert(set *q, const char *name, unsigned int hash, void *val)
+{
+	size_t mask;
+	size_t i;
+	set_elem *ll;
+
+	/* keep the load factor below 3/4 to keep probe sequences short */
+	if ((q->len + 1) * 4 > q->size * 3)
+		set_grow(q);
+
+	mask = q->size - 1;
+	for (i = hash & mask; q->elems[i].name != NULL; i = (i + 1) & mask)
+		;
+
+	ll = &q->elems[i];
+	ll->name = arena_strdup(q->names, name);
+	ll->hash = hash;
+	ll->val = val;
+
+	q->len++;
+	return ll;
+}
+
 /* create a set */
 set *
 create_set(void)
 {
-	return xzalloc(sizeof(set));
+	set *ret = xzalloc(sizeof(set));
+	ret->names = create_arena();
+	return ret;
 }
 
 /* add elem to a set (unpure: could add duplicates, basically hash) */
 set *
 add_set(const char *name, set *q)
 {
-	int pos;
-	set_elem *ll = xmalloc(sizeof(*ll));
-	set_elem *w;
-
 	if (q == NULL)
 		q = create_set();
 
-	ll->next = NULL;
-	ll->name = xstrdup(name);
-	ll->hash = fnv1a32(ll->name);
-	ll->val = NULL;
-
-	pos = ll->hash % _SET_HASH_SIZE;
-	if (q->buckets[pos] == NULL) {
-		q->buckets[pos] = ll;
-	} else {
-		for (w = q->buckets[pos]; w->next != NULL; w = w->next)
-			;
-		w->next = ll;
-	}
+	set_insert(q, name, fnv1a32(name), NULL);
 
-	q->len++;
 	return q;
 }
 
@@ -67,44 +135,17 @@ set *
 add_set_unique(const char *name, set *q, bool *unique)
 {
 	unsigned int hash;
-	int pos;
-	set_elem *ll;
-	set_elem *w;
 	bool uniq = false;
 
 	if (q == NULL)
 		q = create_set();
 
 	hash = fnv1a32(name);
-	pos = hash % _SET_HASH_SIZE;
-
-	if (q->buckets[pos] == NULL) {
-		q->buckets[pos] = ll = xmalloc(sizeof(*ll));
-		ll->next = NULL;
-		ll->name = xstrdup(name);
-		ll->hash = hash;
-		ll->val = NULL;
+	if (set_find(q, name, hash) == NULL) {
+		set_insert(q, name, hash, NULL);
 		uniq = true;
-	} else {
-		ll = NULL;
-		for (w = q->buckets[pos]; w != NULL; ll = w, w = w->next) {
-			if (w->hash == hash && strcmp(w->name, name) == 0) {
-				uniq = false;
-				break;
-			}
-		}
-		if (w == NULL) {
-			ll = ll->next = xmalloc(sizeof(*ll));
-			ll->next = NULL;
-			ll->name = xstrdup(name);
-			ll->hash = hash;
-			ll->val = NULL;
-			uniq = true;
-		}
 	}
 
-	if (uniq)
-		q->len++;
 	if (unique)
 		*unique = uniq;
 	return q;
@@ -116,35 +157,13 @@ void *
 add_set_value(const char *name, void *ptr, set *q)
 {
 	unsigned int hash;
-	int pos;
-	set_elem *ll;
 	set_elem *w;
 
 	hash = fnv1a32(name);
-	pos = hash % _SET_HASH_SIZE;
-
-	if (q->buckets[pos] == NULL) {
-		q->buckets[pos] = ll = xmalloc(sizeof(*ll));
-		ll->next = NULL;
-		ll->name = xstrdup(name);
-		ll->hash = hash;
-		ll->val = ptr;
-	} else {
-		ll = NULL;
-		for (w = q->buckets[pos]; w != NULL; ll = w, w = w->next) {
-			if (w->hash == hash && strcmp(w->name, name) == 0)
-				return w->val;
-		}
-		if (w == NULL) {
-			ll = ll->next = xmalloc(sizeof(*ll));
-			ll->next = NULL;
-			ll->name = xstrdup(name);
-			ll->hash = hash;
-			ll->val = ptr;
-		}
-	}
+	if ((w = set_find(q, name, hash)) != NULL)
+		return w->val;
 
-	q->len++;
+	set_insert(q, name, hash, ptr);
 	return NULL;
 }
 
@@ -153,25 +172,11 @@ add_set_value(const char *name, void *ptr, set *q)
 const char *
 contains_set(const char *name, set *q)
 {
-	unsigned int hash;
-	int pos;
 	set_elem *w;
-	const char *found;
 
-	hash = fnv1a32(name);
-	pos = hash % _SET_HASH_SIZE;
-
-	found = NULL;
-	if (q->buckets[pos] != NULL) {
-		for (w = q->buckets[pos]; w != NULL; w = w->next) {
-			if (w->hash == hash && strcmp(w->name, name) == 0) {
-				found = w->name;
-				break;
-			}
-		}
-	}
+	w = set_find(q, name, fnv1a32(name));
 
-	return found;
+	return w == NULL ? NULL : w->name;
 }
 
 /* returns the value for name, or NULL if not found (cannot
@@ -179,59 +184,54 @@ contains_set(const char *name, set *q)
 void *
 get_set(const char *name, set *q)
 {
-	unsigned int hash;
-	int pos;
 	set_elem *w;
 
-	hash = fnv1a32(name);
-	pos = hash % _SET_HASH_SIZE;
-
-	if (q->buckets[pos] != NULL) {
-		for (w = q->buckets[pos]; w != NULL; w = w->next) {
-			if (w->hash == hash && strcmp(w->name, name) == 0)
-				return w->val;
-		}
-	}
+	w = set_find(q, name, fnv1a32(name));
 
-	return NULL;
+	return w == NULL ? NULL : w->val;
 }
 
-/* remove elem from a set. matches ->name and frees name,item, returns
+/* remove elem from a set. matches ->name and removes it, returns
  * val if removed, NULL otherwise
  * note that when val isn't set, NULL is returned, so the caller should
  * use the removed argument to determine if something was removed from
- * the set. */
+ * the set.
+ * the internal copy of name is only released when the set is cleared */
 void *
 del_set(const char *s, set *q, bool *removed)
 {
-	unsigned int hash;
-	int pos;
-	set_elem *ll;
+	size_t mask;
+	size_t i;
+	size_t j;
+	size_t k;
 	set_elem *w;
 	void *ret;
 	bool rmd;
 
-	hash = fnv1a32(s);
-	pos = hash % _SET_HASH_SIZE;
-
 	ret = NULL;
 	rmd = false;
-	if (q->buckets[pos] != NULL) {
-		ll = NULL;
-		for (w = q->buckets[pos]; w != NULL; ll = w, w = w->next) {
-			if (w->hash == hash && strcmp(w->name, s) == 0) {
-				if (ll == NULL) {
-					q->buckets[pos] = w->next;
-				} else {
-					ll->next = w->next;
-				}
-				ret = w->val;
-				free(w->name);
-				free(w);
-				rmd = true;
-				break;
+	w = set_find(q, s, fnv1a32(s));
+	if (w != NULL) {
+		ret = w->val;
+		rmd = true;
+
+		/* shift back elements that follow in the probe sequence, such
+		 * that no gaps occur which would terminate lookups early */
+		mask = q->size - 1;
+		i = w - q->elems;
+		for (j = (i + 1) & mask;
+				q->elems[j].name != NULL;
+				j = (j + 1) & mask)
+		{
+			k = q->elems[j].hash & mask;
+			/* move if the preferred slot k isn't in (i, j] */
+			if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+				q->elems[i] = q->elems[j];
+				i = j;
 			}
 		}
+		q->elems[i].name = NULL;
+		q->elems[i].val = NULL;
 	}
 
 	if (rmd)
@@ -248,14 +248,13 @@ del_set(const char *s, set *q, bool *removed)
 size_t
 list_set(set *q, char ***l)
 {
-	int i;
-	set_elem *w;
+	size_t i;
 	char **ret;
 
 	ret = *l = xmalloc(sizeof(char *) * (q->len + 1));
-	for (i = 0; i < _SET_HASH_SIZE; i++) {
-		for (w = q->buckets[i]; w != NULL; w = w->next) {
-			*ret = w->name;
+	for (i = 0; i < q->size; i++) {
+		if (q->elems[i].name != NULL) {
+			*ret = q->elems[i].name;
 			ret++;
 		}
 	}
@@ -266,14 +265,13 @@ list_set(set *q, char ***l)
 size_t
 array_set(set *q, array_t *ret)
 {
-	int i;
-	set_elem *w;
+	size_t i;
 	array_t blank = array_init_decl;
 
 	*ret = blank;
-	for (i = 0; i < _SET_HASH_SIZE; i++) {
-		for (w = q->buckets[i]; w != NULL; w = w->next)
-			xarraypush_ptr(ret, w->name);
+	for (i = 0; i < q->size; i++) {
+		if (q->elems[i].name != NULL)
+			xarraypush_ptr(ret, q->elems[i].name);
 	}
 
 	return q->len;
@@ -282,14 +280,13 @@ array_set(set *q, array_t *ret)
 size_t
 values_set(set *q, array_t *ret)
 {
-	int i;
-	set_elem *w;
+	size_t i;
 	array_t blank = array_init_decl;
 
 	*ret = blank;
-	for (i = 0; i < _SET_HASH_SIZE; i++) {
-		for (w = q->buckets[i]; w != NULL; w = w->next)
-			xarraypush_ptr(ret, w->val);
+	for (i = 0; i < q->size; i++) {
+		if (q->elems[i].name != NULL)
+			xarraypush_ptr(ret, q->elems[i].val);
 	}
 
 	return q->len;
@@ -305,18 +302,9 @@ cnt_set(set *q)
 void
 clear_set(set *q)
 {
-	int i;
-	set_elem *w;
-	set_elem *e;
-
-	for (i = 0; i < _SET_HASH_SIZE; i++) {
-		for (w = q->buckets[i]; w != NULL; w = e) {
-			e = w->next;
-			free(w->name);
-			free(w);
-		}
-		q->buckets[i] = NULL;
-	}
+	if (q->elems != NULL)
+		memset(q->elems, 0, sizeof(*q->elems) * q->size);
+	clear_arena(q->names);
 	q->len = 0;
 }
 
@@ -324,7 +312,8 @@ clear_set(set *q)
 void
 free_set(set *q)
 {
-	clear_set(q);
+	free(q->elems);
+	free_arena(q->names);
 	free(q);
 }
 
@@ -332,12 +321,11 @@ free_set(set *q)
 static void
 print_set(const set *q)
 {
-	set_elem *w;
-	int i;
+	size_t i;
 
-	for (i = 0; i < _SET_HASH_SIZE; i++) {
-		for (w = q->buckets[i]; w != NULL; w = w->next)
-			puts(w->name);
+	for (i = 0; i < q->size; i++) {
+		if (q->elems[i].name != NULL)
+			puts(q->elems[i].name);
 	}
 }
 #endif
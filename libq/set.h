@@ -1,5 +1,5 @@
 /*
- * Copyright 2005-2019 Gentoo Foundation
+ * Copyright 2005-2020 Gentoo Foundation
  * Distributed under the terms of the GNU General Public License v2
  */
 
@@ -9,24 +9,28 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "xarray.h"
 
 typedef struct elem_t set_elem;
 typedef struct set_t set;
 
 struct elem_t {
-	char *name;
+	char *name;         /* NULL for unused slots */
 	unsigned int hash;  /* FNV1a32 */
 	void *val;
-	set_elem *next;
 };
 
-#define _SET_HASH_SIZE 128
+/* open addressing (linear probing) hash table, names are stored in the
+ * set's arena, thus remain valid until the set is cleared or freed */
 struct set_t {
-	set_elem *buckets[_SET_HASH_SIZE];
+	set_elem *elems;
+	size_t size;        /* always a power of 2 */
 	size_t len;
+	arena *names;
 };
 
+unsigned int fnv1a32(const char *s);
 set *create_set(void);
 set *add_set(const char *name, set *q);
 set *add_set_unique(const char *name, set *q, bool *unique);
@@ -14,6 +14,11 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <xalloc.h>
+#ifdef _OPENMP
+# include <omp.h>
+#else
+# define omp_get_thread_num() 0
+#endif
 
 #include "atom.h"
 #include "eat_file.h"
@@ -22,14 +27,20 @@
 #include "scandirat.h"
 #include "set.h"
 #include "tree.h"
+#include "vdb_index.h"
 #include "xpak.h"
 
 #include <ctype.h>
 #include <xalloc.h>
 
+const char *tree_cachedir = NULL;
+
+static int tree_filter_cat(const struct dirent *de);
+static int tree_filter_pkg(const struct dirent *de);
 static int tree_pkg_compar(const void *l, const void *r);
 static tree_pkg_ctx *tree_next_pkg_int(tree_cat_ctx *cat_ctx);
 static void tree_close_meta(tree_pkg_meta *cache);
+static void tree_packages_free(tree_ctx *ctx);
 
 static tree_ctx *
 tree_open_int(const char *sroot, const char *tdir, bool quiet)
@@ -60,6 +71,7 @@ tree_open_int(const char *sroot, const char *tdir, bool quiet)
 		goto cv_error;
 
 	ctx->do_sort = false;
+	ctx->mem = create_arena();
 	return ctx;
 
  cv_error:
@@ -123,8 +135,11 @@ tree_ctx *
 tree_open_vdb(const char *sroot, const char *svdb)
 {
 	tree_ctx *ret = tree_open_int(sroot, svdb, false);
-	if (ret != NULL)
+	if (ret != NULL) {
 		ret->cachetype = CACHE_VDB;
+		ret->vdb_idx = vdb_index_open(ret->portroot_fd, tree_cachedir,
+				ret->tree_fd, tree_filter_cat, tree_filter_pkg);
+	}
 	return ret;
 }
 
@@ -154,6 +169,11 @@ tree_open_binpkg(const char *sroot, const char *spkg)
 void
 tree_close(tree_ctx *ctx)
 {
+	/* everything is released at once below, closing categories in
+	 * arbitrary order must not try to release anything */
+	arena *mem = ctx->mem;
+	ctx->mem = NULL;
+
 	if (ctx->cache.categories != NULL) {
 		DECLARE_ARRAY(t);
 		size_t n;
@@ -180,10 +200,12 @@ tree_close(tree_ctx *ctx)
 		scandir_free(ctx->cat_de, ctx->cat_cnt);
 	if (ctx->repo != NULL)
 		free(ctx->repo);
+	tree_packages_free(ctx);
 	if (ctx->pkgs != NULL)
 		free(ctx->pkgs);
-	if (ctx->ebuilddir_ctx != NULL)
-		free(ctx->ebuilddir_ctx);
+	if (ctx->vdb_idx != NULL)
+		vdb_index_close(ctx->vdb_idx);
+	free_arena(mem);
 	free(ctx);
 }
 
@@ -229,10 +251,14 @@ tree_filter_cat(const struct dirent *de)
 	return i;
 }
 
+/* category and package contexts are allocated from the tree's arena,
+ * and released when the category is closed, hence categories of the
+ * same tree must be closed in reverse order of opening them */
 tree_cat_ctx *
 tree_open_cat(tree_ctx *ctx, const char *name)
 {
 	tree_cat_ctx *cat_ctx;
+	arena_pos mark;
 	int fd;
 	DIR *dir;
 
@@ -246,6 +272,7 @@ tree_open_cat(tree_ctx *ctx, const char *name)
 				cat_ctx->pkg_cur = 0;
 			} else {
 				rewinddir(cat_ctx->dir);
+				cat_ctx->vdb_pkg_cur = 0;
 			}
 			return cat_ctx;
 		}
@@ -262,7 +289,9 @@ tree_open_cat(tree_ctx *ctx, const char *name)
 		return NULL;
 	}
 
-	cat_ctx = xmalloc(sizeof(*cat_ctx));
+	mark = arena_mark(ctx->mem);
+	cat_ctx = arena_alloc(ctx->mem, sizeof(*cat_ctx));
+	cat_ctx->mark = mark;
 	cat_ctx->name = name;
 	cat_ctx->fd = fd;
 	cat_ctx->dir = dir;
@@ -270,6 +299,15 @@ tree_open_cat(tree_ctx *ctx, const char *name)
 	cat_ctx->pkg_ctxs = NULL;
 	cat_ctx->pkg_cur = 0;
 	cat_ctx->pkg_cnt = 0;
+	cat_ctx->vdb_cat = VDB_INDEX_NOTFOUND;
+	cat_ctx->vdb_pkg_cur = 0;
+	cat_ctx->ebuilddir_pkg_ctx = NULL;
+	cat_ctx->ebuilddir_cat_ctx = NULL;
+	cat_ctx->ebuilddir_ctx = NULL;
+	cat_ctx->out = stdout;
+	cat_ctx->worker = 0;
+	if (ctx->vdb_idx != NULL)
+		cat_ctx->vdb_cat = vdb_index_cat_find(ctx->vdb_idx, name);
 
 	if (ctx->cache.categories != NULL) {
 		add_set_value(name, cat_ctx, ctx->cache.categories);
@@ -280,13 +318,18 @@ tree_open_cat(tree_ctx *ctx, const char *name)
 	return cat_ctx;
 }
 
-static tree_cat_ctx *
-tree_next_cat(tree_ctx *ctx)
+static const char *
+tree_next_cat_name(tree_ctx *ctx)
 {
-	/* search for a category directory */
-	tree_cat_ctx *cat_ctx = NULL;
 	const struct dirent *de;
 
+	/* the index lists categories in the same order as scandirat does */
+	if (ctx->vdb_idx != NULL) {
+		if (ctx->cat_cur < vdb_index_cat_cnt(ctx->vdb_idx))
+			return vdb_index_cat_name(ctx->vdb_idx, ctx->cat_cur++);
+		return NULL;
+	}
+
 	if (ctx->do_sort) {
 		if (ctx->cat_de == NULL) {
 			ctx->cat_cnt = scandirat(ctx->tree_fd,
@@ -294,41 +337,39 @@ tree_next_cat(tree_ctx *ctx)
 			ctx->cat_cur = 0;
 		}
 
-		while (ctx->cat_cur < ctx->cat_cnt) {
-			de = ctx->cat_de[ctx->cat_cur++];
-
-			/* match if cat is requested */
-			if (ctx->query_atom != NULL && ctx->query_atom->CATEGORY != NULL &&
-					strcmp(ctx->query_atom->CATEGORY, de->d_name) != 0)
-				continue;
+		if (ctx->cat_cur < ctx->cat_cnt)
+			return ctx->cat_de[ctx->cat_cur++]->d_name;
+		return NULL;
+	}
 
-			cat_ctx = tree_open_cat(ctx, de->d_name);
-			if (!cat_ctx)
-				continue;
+	/* cheaper "streaming" variant */
+	do {
+		de = readdir(ctx->dir);
+		if (!de)
+			return NULL;
+	} while (tree_filter_cat(de) == 0);
 
-			break;
-		}
-	} else {
-		/* cheaper "streaming" variant */
-		do {
-			de = readdir(ctx->dir);
-			if (!de)
-				break;
+	return de->d_name;
+}
 
-			if (tree_filter_cat(de) == 0)
-				continue;
+static tree_cat_ctx *
+tree_next_cat(tree_ctx *ctx)
+{
+	/* search for a category directory */
+	tree_cat_ctx *cat_ctx = NULL;
+	const char *name;
 
-			/* match if cat is requested */
-			if (ctx->query_atom != NULL && ctx->query_atom->CATEGORY != NULL &&
-					strcmp(ctx->query_atom->CATEGORY, de->d_name) != 0)
-				continue;
+	while ((name = tree_next_cat_name(ctx)) != NULL) {
+		/* match if cat is requested */
+		if (ctx->query_atom != NULL && ctx->query_atom->CATEGORY != NULL &&
+				strcmp(ctx->query_atom->CATEGORY, name) != 0)
+			continue;
 
-			cat_ctx = tree_open_cat(ctx, de->d_name);
-			if (!cat_ctx)
-				continue;
+		cat_ctx = tree_open_cat(ctx, name);
+		if (!cat_ctx)
+			continue;
 
-			break;
-		} while (1);
+		break;
 	}
 
 	return cat_ctx;
@@ -337,6 +378,8 @@ tree_next_cat(tree_ctx *ctx)
 void
 tree_close_cat(tree_cat_ctx *cat_ctx)
 {
+	arena *mem = cat_ctx->ctx->mem;
+
 	if (cat_ctx->ctx->cache.categories != NULL &&
 			contains_set(cat_ctx->name, cat_ctx->ctx->cache.categories))
 		return;
@@ -350,7 +393,9 @@ tree_close_cat(tree_cat_ctx *cat_ctx)
 	/* close(ctx->fd); */
 	if (cat_ctx->ctx->do_sort)
 		free(cat_ctx->pkg_ctxs);
-	free(cat_ctx);
+	/* this frees cat_ctx and all of its pkgs */
+	if (mem != NULL)
+		arena_release(mem, cat_ctx->mark);
 }
 
 static int
@@ -388,7 +433,8 @@ tree_filter_pkg(const struct dirent *de)
 tree_pkg_ctx *
 tree_open_pkg(tree_cat_ctx *cat_ctx, const char *name)
 {
-	tree_pkg_ctx *pkg_ctx = xzalloc(sizeof(*pkg_ctx));
+	tree_pkg_ctx *pkg_ctx = arena_alloc(cat_ctx->ctx->mem, sizeof(*pkg_ctx));
+	memset(pkg_ctx, 0, sizeof(*pkg_ctx));
 	pkg_ctx->name = name;
 	pkg_ctx->repo = cat_ctx->ctx->repo;
 	pkg_ctx->fd = -1;
@@ -419,11 +465,34 @@ tree_pkg_compar(const void *l, const void *r)
 	return atom_compar_cb(al, ar);
 }
 
+static const char *
+tree_next_pkg_name(tree_cat_ctx *cat_ctx)
+{
+	const struct dirent *de;
+
+	if (cat_ctx->vdb_cat != VDB_INDEX_NOTFOUND) {
+		vdb_index *idx = cat_ctx->ctx->vdb_idx;
+
+		if (cat_ctx->vdb_pkg_cur < vdb_index_pkg_cnt(idx, cat_ctx->vdb_cat))
+			return vdb_index_pkg_name(idx, cat_ctx->vdb_cat,
+					cat_ctx->vdb_pkg_cur++);
+		return NULL;
+	}
+
+	do {
+		de = readdir(cat_ctx->dir);
+		if (!de)
+			return NULL;
+	} while (tree_filter_pkg(de) == 0);
+
+	return de->d_name;
+}
+
 static tree_pkg_ctx *
 tree_next_pkg_int(tree_cat_ctx *cat_ctx)
 {
 	tree_pkg_ctx *pkg_ctx = NULL;
-	const struct dirent *de;
+	const char *name;
 	depend_atom *qa = cat_ctx->ctx->query_atom;
 
 	if (cat_ctx->ctx->do_sort) {
@@ -431,12 +500,7 @@ tree_next_pkg_int(tree_cat_ctx *cat_ctx)
 			size_t pkg_size = 0;
 			cat_ctx->pkg_cnt = 0;
 			cat_ctx->pkg_cur = 0;
-			while ((de = readdir(cat_ctx->dir)) != NULL) {
-				char *name;
-
-				if (tree_filter_pkg(de) == 0)
-					continue;
-
+			while ((name = tree_next_pkg_name(cat_ctx)) != NULL) {
 				/* perform package name check, for we don't have an atom
 				 * yet, and creating it is expensive, which we better
 				 * defer to pkg time, and filter most stuff out here
@@ -444,7 +508,7 @@ tree_next_pkg_int(tree_cat_ctx *cat_ctx)
 				 * trying to deal with end of string or '-' here (which
 				 * still wouldn't be 100% because name rules are complex) */
 				if (qa != NULL && qa->PN != NULL &&
-						strncmp(qa->PN, de->d_name, strlen(qa->PN)) != 0)
+						strncmp(qa->PN, name, strlen(qa->PN)) != 0)
 					continue;
 
 				if (cat_ctx->pkg_cnt == pkg_size) {
@@ -453,13 +517,11 @@ tree_next_pkg_int(tree_cat_ctx *cat_ctx)
 								sizeof(*cat_ctx->pkg_ctxs) * pkg_size);
 				}
 
-				name = xstrdup(de->d_name);
 				pkg_ctx = cat_ctx->pkg_ctxs[cat_ctx->pkg_cnt++] =
-					tree_open_pkg(cat_ctx, name);
-				if (pkg_ctx == NULL) {
-					/* name was freed by tree_close_pkg on fail */
+					tree_open_pkg(cat_ctx,
+							arena_strdup(cat_ctx->ctx->mem, name));
+				if (pkg_ctx == NULL)
 					cat_ctx->pkg_cnt--;
-				}
 			}
 
 			if (cat_ctx->pkg_cnt > 1) {
@@ -472,30 +534,33 @@ tree_next_pkg_int(tree_cat_ctx *cat_ctx)
 		if (cat_ctx->pkg_cur < cat_ctx->pkg_cnt)
 			pkg_ctx = cat_ctx->pkg_ctxs[cat_ctx->pkg_cur++];
 	} else {
-		do {
-			de = readdir(cat_ctx->dir);
-			if (!de)
-				break;
-
-			if (tree_filter_pkg(de) == 0)
-				continue;
-
+		while ((name = tree_next_pkg_name(cat_ctx)) != NULL) {
 			/* perform package name check as for the sorted variant */
 			if (qa != NULL && qa->PN != NULL &&
-					strncmp(qa->PN, de->d_name, strlen(qa->PN)) != 0)
+					strncmp(qa->PN, name, strlen(qa->PN)) != 0)
 				continue;
 
-			pkg_ctx = tree_open_pkg(cat_ctx, de->d_name);
+			pkg_ctx = tree_open_pkg(cat_ctx, name);
 			if (!pkg_ctx)
 				continue;
 
 			break;
-		} while (1);
+		}
 	}
 
 	return pkg_ctx;
 }
 
+/* the package directory is never handed out, so must be closed here,
+ * unless the category cache owns it */
+static void
+tree_close_ebuilddir_pkg(tree_cat_ctx *cat_ctx)
+{
+	if (cat_ctx->ctx->cache.categories == NULL)
+		tree_close_pkg(cat_ctx->ebuilddir_pkg_ctx);
+	cat_ctx->ebuilddir_pkg_ctx = NULL;
+}
+
 tree_pkg_ctx *
 tree_next_pkg(tree_cat_ctx *cat_ctx)
 {
@@ -508,14 +573,18 @@ tree_next_pkg(tree_cat_ctx *cat_ctx)
 		/* serve *.ebuild files each as separate pkg_ctx with name set
 		 * to CAT/P like in VDB and metadata */
 		do {
-			if (ctx->ebuilddir_pkg_ctx == NULL) {
-				tree_ctx *pkgdir = ctx->ebuilddir_ctx;
-
-				if (pkgdir == NULL)
-					pkgdir = ctx->ebuilddir_ctx = xzalloc(sizeof(tree_ctx));
+			if (cat_ctx->ebuilddir_pkg_ctx == NULL) {
+				tree_ctx *pkgdir = cat_ctx->ebuilddir_ctx;
+
+				if (pkgdir == NULL) {
+					pkgdir = cat_ctx->ebuilddir_ctx =
+						arena_alloc(ctx->mem, sizeof(tree_ctx));
+					memset(pkgdir, 0, sizeof(*pkgdir));
+					pkgdir->mem = ctx->mem;
+				}
 
-				ctx->ebuilddir_pkg_ctx = tree_next_pkg_int(cat_ctx);
-				if (ctx->ebuilddir_pkg_ctx == NULL)
+				cat_ctx->ebuilddir_pkg_ctx = tree_next_pkg_int(cat_ctx);
+				if (cat_ctx->ebuilddir_pkg_ctx == NULL)
 					return NULL;
 
 				pkgdir->portroot_fd = -1;
@@ -524,24 +593,26 @@ tree_next_pkg(tree_cat_ctx *cat_ctx)
 				pkgdir->repo = ctx->repo;
 				pkgdir->cachetype = ctx->cachetype;
 
-				ctx->ebuilddir_cat_ctx =
-					tree_open_cat(pkgdir, ctx->ebuilddir_pkg_ctx->name);
+				cat_ctx->ebuilddir_cat_ctx =
+					tree_open_cat(pkgdir, cat_ctx->ebuilddir_pkg_ctx->name);
 
 				/* opening might fail if what we found wasn't a
 				 * directory or something */
-				if (ctx->ebuilddir_cat_ctx == NULL) {
-					ctx->ebuilddir_pkg_ctx = NULL;
+				if (cat_ctx->ebuilddir_cat_ctx == NULL) {
+					tree_close_ebuilddir_pkg(cat_ctx);
 					continue;
 				}
 
 				/* "zap" the pkg such that it looks like CAT/P */
-				ctx->ebuilddir_cat_ctx->name = cat_ctx->name;
+				cat_ctx->ebuilddir_cat_ctx->name = cat_ctx->name;
+				cat_ctx->ebuilddir_cat_ctx->out = cat_ctx->out;
+				cat_ctx->ebuilddir_cat_ctx->worker = cat_ctx->worker;
 			}
 
-			ret = tree_next_pkg_int(ctx->ebuilddir_cat_ctx);
+			ret = tree_next_pkg_int(cat_ctx->ebuilddir_cat_ctx);
 			if (ret == NULL) {
-				tree_close_cat(ctx->ebuilddir_cat_ctx);
-				ctx->ebuilddir_pkg_ctx = NULL;
+				tree_close_cat(cat_ctx->ebuilddir_cat_ctx);
+				tree_close_ebuilddir_pkg(cat_ctx);
 			} else {
 				if ((p = strstr(ret->name, ".ebuild")) == NULL) {
 					tree_close_pkg(ret);
@@ -584,6 +655,26 @@ tree_pkg_vdb_openat(
 	return openat(pkg_ctx->fd, file, flags | O_CLOEXEC, mode);
 }
 
+/* returns true if key for pkg_ctx is available from the VDB index, in
+ * which case val is set to its value, or NULL when absent */
+static bool
+tree_pkg_vdb_index_get(tree_pkg_ctx *pkg_ctx, const char *key, const char **val)
+{
+	tree_cat_ctx *cat_ctx = pkg_ctx->cat_ctx;
+	size_t pkg;
+
+	if (cat_ctx->vdb_cat == VDB_INDEX_NOTFOUND)
+		return false;
+
+	pkg = vdb_index_pkg_find(cat_ctx->ctx->vdb_idx,
+			cat_ctx->vdb_cat, pkg_ctx->name);
+	if (pkg == VDB_INDEX_NOTFOUND)
+		return false;
+
+	return vdb_index_pkg_get(cat_ctx->ctx->vdb_idx,
+			cat_ctx->vdb_cat, pkg, key, val);
+}
+
 static bool
 tree_pkg_vdb_eat(
 		tree_pkg_ctx *pkg_ctx,
@@ -593,6 +684,20 @@ tree_pkg_vdb_eat(
 {
 	int fd;
 	bool ret;
+	const char *val;
+
+	if (tree_pkg_vdb_index_get(pkg_ctx, file, &val)) {
+		size_t len = val == NULL ? 0 : strlen(val);
+
+		/* behave like eat_file_fd, which always returns a buffer */
+		if (*bufptr == NULL || *buflen < len + 1) {
+			*buflen = ((len + 1) + BUFSIZE - 1) & -BUFSIZE;
+			*bufptr = xrealloc(*bufptr, *buflen);
+		}
+		memcpy(*bufptr, val == NULL ? "" : val, len + 1);
+		rmspace(*bufptr);
+		return len > 0;
+	}
 
 	fd = tree_pkg_vdb_openat(pkg_ctx, file, O_RDONLY, 0);
 	ret = eat_file_fd(fd, bufptr, buflen);
@@ -604,33 +709,63 @@ tree_pkg_vdb_eat(
 	return ret;
 }
 
+/* Reads the file opened in pkg_ctx into a single allocation holding
+ * both the meta struct and the (NUL-terminated) file contents, which
+ * the readers below tokenise in place.  Plain read() is used, stdio
+ * would only add an extra buffer and copy, and mmap is more costly than
+ * a read for files as small as cache entries. */
 static tree_pkg_meta *
-tree_read_file_pms(tree_pkg_ctx *pkg_ctx)
+tree_read_file_data(tree_pkg_ctx *pkg_ctx, char **data)
 {
-	struct stat s;
-	char *ptr;
-	FILE *f;
 	tree_pkg_meta *ret = NULL;
-	size_t len;
-	char buf[_Q_PATH_MAX];
+	struct stat s;
+	ssize_t rd;
+	size_t pos;
+	char *p;
 
-	if ((f = fdopen(pkg_ctx->fd, "r")) == NULL)
-		goto err;
+	if (fstat(pkg_ctx->fd, &s) == 0) {
+		ret = xmalloc(sizeof(*ret) + s.st_size + 1);
+		memset(ret, 0, sizeof(*ret));
+		p = (char *)ret + sizeof(*ret);
 
-	if (fstat(pkg_ctx->fd, &s) != 0)
-		goto err;
+		for (pos = 0; pos < (size_t)s.st_size; pos += rd) {
+			rd = read(pkg_ctx->fd, p + pos, s.st_size - pos);
+			if (rd < 0 && errno == EINTR) {
+				rd = 0;
+				continue;
+			}
+			if (rd <= 0) {
+				free(ret);
+				ret = NULL;
+				break;
+			}
+		}
+		if (ret != NULL) {
+			p[s.st_size] = '\0';
+			*data = p;
+		}
+	}
 
-	len = sizeof(*ret) + s.st_size + 1;
-	ret = xzalloc(len);
-	ptr = (char*)ret + sizeof(*ret);
-	if ((off_t)fread(ptr, 1, s.st_size, f) != s.st_size)
-		goto err;
-	ptr[s.st_size] = '\0';
+	close(pkg_ctx->fd);
+	pkg_ctx->fd = -1;
+
+	return ret;
+}
+
+static tree_pkg_meta *
+tree_read_file_pms(tree_pkg_ctx *pkg_ctx)
+{
+	char *ptr;
+	tree_pkg_meta *ret;
+
+	if ((ret = tree_read_file_data(pkg_ctx, &ptr)) == NULL)
+		return NULL;
 
 	ret->Q_DEPEND = ptr;
 #define next_line(curr, next) \
 	if ((ptr = strchr(ret->Q_##curr, '\n')) == NULL) { \
-		warn("Invalid cache file for '%s'", buf); \
+		warn("Invalid cache file for '%s/%s'", \
+				pkg_ctx->cat_ctx->name, pkg_ctx->name); \
 		goto err; \
 	} \
 	ret->Q_##next = ptr+1; \
@@ -653,48 +788,37 @@ tree_read_file_pms(tree_pkg_ctx *pkg_ctx)
 #undef next_line
 	ptr = strchr(ptr+1, '\n');
 	if (ptr == NULL) {
-		warn("Invalid cache file for '%s' - could not find end of cache data",
-				buf);
+		warn("Invalid cache file for '%s/%s' - "
+				"could not find end of cache data",
+				pkg_ctx->cat_ctx->name, pkg_ctx->name);
 		goto err;
 	}
 	*ptr = '\0';
 
-	fclose(f);
-	pkg_ctx->fd = -1;
-
 	return ret;
 
 err:
-	if (f)
-		fclose(f);
-	pkg_ctx->fd = -1;
-	if (ret)
-		tree_close_meta(ret);
+	tree_close_meta(ret);
 	return NULL;
 }
 
+/* md5-cache entries are only read when lazy, the keys are looked up
+ * by tree_pkg_meta_lookup when they are asked for, such that keys that
+ * aren't used cost nothing */
 static tree_pkg_meta *
-tree_read_file_md5(tree_pkg_ctx *pkg_ctx)
+tree_read_file_md5(tree_pkg_ctx *pkg_ctx, bool lazy)
 {
-	struct stat s;
 	char *ptr, *endptr;
-	FILE *f;
-	tree_pkg_meta *ret = NULL;
-	size_t len;
-
-	if ((f = fdopen(pkg_ctx->fd, "r")) == NULL)
-		goto err;
+	tree_pkg_meta *ret;
 
-	if (fstat(pkg_ctx->fd, &s) != 0)
-		goto err;
+	if ((ret = tree_read_file_data(pkg_ctx, &ptr)) == NULL)
+		return NULL;
 
-	len = sizeof(*ret) + s.st_size + 1;
-	ret = xmalloc(len);
-	memset(ret, 0, sizeof(*ret));
-	ptr = (char *)ret + sizeof(*ret);
-	if ((off_t)fread(ptr, 1, s.st_size, f) != s.st_size)
-		goto err;
-	ptr[s.st_size] = '\0';
+	if (lazy) {
+		ret->Q__raw = ptr;
+		ret->Q__rawend = ptr + strlen(ptr);
+		return ret;
+	}
 
 	/* We have a block of key=value\n data.
 	 * KEY=VALUE\n
@@ -768,27 +892,58 @@ tree_read_file_md5(tree_pkg_ctx *pkg_ctx)
 #undef assign_var
 #undef assign_var_cmp
 
-	fclose(f);
-	pkg_ctx->fd = -1;
-
 	return ret;
 
 err:
-	if (f)
-		fclose(f);
-	pkg_ctx->fd = -1;
-	if (ret)
-		tree_close_meta(ret);
+	tree_close_meta(ret);
 	return NULL;
 }
 
+/* marks keys that were looked up, but aren't present in the raw data */
+static char tree_pkg_meta_absent[] = "";
+
+/* returns the value for key at offset in m, when m holds raw md5-cache
+ * data, the value is located first, and cached in m */
+static char *
+tree_pkg_meta_lookup(tree_pkg_meta *m, size_t offset, const char *keyn)
+{
+	char **key = (char **)((char *)&m->Q__data + offset);
+	size_t klen;
+	char *p;
+	char *v;
+
+	if (m->Q__raw == NULL)
+		return *key;
+
+	if (*key == NULL) {
+		/* look for KEY= at the start of a line, the start of lines
+		 * holding values already returned is NUL instead of newline */
+		*key = tree_pkg_meta_absent;
+		klen = strlen(keyn);
+		for (p = m->Q__raw;
+				p < m->Q__rawend &&
+				(p = memmem(p, m->Q__rawend - p, keyn, klen)) != NULL;
+				p += klen)
+		{
+			if ((p == m->Q__raw || p[-1] == '\n' || p[-1] == '\0') &&
+					p[klen] == '=')
+			{
+				v = p + klen + 1;
+				if ((p = memchr(v, '\n', m->Q__rawend - v)) != NULL)
+					*p = '\0';
+				*key = v;
+				break;
+			}
+		}
+	}
+
+	return *key == tree_pkg_meta_absent ? NULL : *key;
+}
+
 static tree_pkg_meta *
 tree_read_file_ebuild(tree_pkg_ctx *pkg_ctx)
 {
-	FILE *f;
-	struct stat s;
-	tree_pkg_meta *ret = NULL;
-	size_t len;
+	tree_pkg_meta *ret;
 	char *p;
 	char *q;
 	char *w;
@@ -796,19 +951,8 @@ tree_read_file_ebuild(tree_pkg_ctx *pkg_ctx)
 	bool esc;
 	bool findnl;
 
-	if ((f = fdopen(pkg_ctx->fd, "r")) == NULL)
-		goto err;
-
-	if (fstat(pkg_ctx->fd, &s) != 0)
-		goto err;
-
-	len = sizeof(*ret) + s.st_size + 1;
-	ret = xmalloc(len);
-	memset(ret, 0, sizeof(*ret));
-	p = (char *)ret + sizeof(*ret);
-	if ((off_t)fread(p, 1, s.st_size, f) != s.st_size)
-		goto err;
-	p[s.st_size] = '\0';
+	if ((ret = tree_read_file_data(pkg_ctx, &p)) == NULL)
+		return NULL;
 
 	do {
 		q = p;
@@ -889,18 +1033,43 @@ tree_read_file_ebuild(tree_pkg_ctx *pkg_ctx)
 			p++;
 	} while (p != NULL);
 
-	fclose(f);
-	pkg_ctx->fd = -1;
-
 	return ret;
+}
 
-err:
-	if (f)
-		fclose(f);
-	pkg_ctx->fd = -1;
-	if (ret)
-		tree_close_meta(ret);
-	return NULL;
+/* returns storage for size bytes at the end of m's data block, growing
+ * it when necessary, the caller is responsible for advancing the
+ * position after use */
+static char *
+tree_pkg_meta_reserve(tree_pkg_meta *m, size_t size)
+{
+	size_t pos;
+	size_t len;
+	char *p;
+
+	/* hijack unused members */
+	pos = (size_t)m->Q__eclasses_;
+	len = (size_t)m->Q__md5_;
+
+	if (len - pos < size) {
+		p = m->Q__data;
+		len += (((size - (len - pos)) / BUFSIZ) + 1) * BUFSIZ;
+		m->Q__data = xrealloc(m->Q__data, len);
+
+		/* re-position existing keys */
+		if (p != NULL && m->Q__data != p) {
+			char **newdata = (char **)m;
+			int elems = sizeof(tree_pkg_meta) / sizeof(char *);
+			while (elems-- > 1)  /* skip Q__data itself */
+				if (newdata[elems] != NULL)
+					newdata[elems] = m->Q__data + (newdata[elems] - p);
+		}
+
+		/* set after repositioning! */
+		m->Q__md5_ = (char *)len;
+		m->Q__eclasses_ = (char *)pos;
+	}
+
+	return m->Q__data + pos;
 }
 
 static void
@@ -915,7 +1084,6 @@ tree_read_file_binpkg_xpak_cb(
 	tree_pkg_meta *m = (tree_pkg_meta *)ctx;
 	char **key;
 	size_t pos;
-	size_t len;
 
 #define match_path(K) \
 	else if (pathname_len == (sizeof(#K) - 1) && strcmp(pathname, #K) == 0) \
@@ -949,33 +1117,13 @@ tree_read_file_binpkg_xpak_cb(
 
 	/* hijack unused members */
 	pos = (size_t)m->Q__eclasses_;
-	len = (size_t)m->Q__md5_;
 
 	/* trim whitespace (mostly trailing newline) */
 	while (isspace((int)data[data_offset + data_len - 1]))
 		data_len--;
 
-	if (len - pos < (size_t)(data_len + 1)) {
-		char *old_data = m->Q__data;
-		len += (((data_len + 1 - (len - pos)) / BUFSIZ) + 1) * BUFSIZ;
-		m->Q__data = xrealloc(m->Q__data, len);
-
-		/* re-position existing keys */
-		if (old_data != NULL && m->Q__data != old_data) {
-			char **newdata = (char **)m;
-			int elems = sizeof(tree_pkg_meta) / sizeof(char *);
-			while (elems-- > 1)  /* skip Q__data itself */
-				if (newdata[elems] != NULL)
-					newdata[elems] = m->Q__data + (newdata[elems] - old_data);
-		}
-
-		/* set after repositioning! */
-		m->Q__md5_ = (char *)len;
-		m->Q__eclasses_ = (char *)pos;
-	}
-
-	*key = m->Q__data + pos;
-	snprintf(*key, len - pos, "%.*s", data_len, data + data_offset);
+	*key = tree_pkg_meta_reserve(m, data_len + 1);
+	snprintf(*key, data_len + 1, "%.*s", data_len, data + data_offset);
 	pos += data_len + 1;
 	m->Q__eclasses_ = (char *)pos;
 }
@@ -996,29 +1144,8 @@ tree_read_file_binpkg(tree_pkg_ctx *pkg_ctx)
 		size_t fsize;
 		size_t needlen = 40 + 1 + 19 + 1;
 		size_t pos = (size_t)m->Q__eclasses_;
-		size_t len = (size_t)m->Q__md5_;
-
-		if (len - pos < needlen) {
-			char *old_data = m->Q__data;
-			len += (((needlen - (len - pos)) / BUFSIZ) + 1) * BUFSIZ;
-			m->Q__data = xrealloc(m->Q__data, len);
-
-			/* re-position existing keys */
-			if (old_data != NULL && m->Q__data != old_data) {
-				char **newdata = (char **)m;
-				int elems = sizeof(tree_pkg_meta) / sizeof(char *);
-				while (elems-- > 1)  /* skip Q__data itself */
-					if (newdata[elems] != NULL)
-						newdata[elems] =
-							m->Q__data + (newdata[elems] - old_data);
-			}
-
-			/* set after repositioning! */
-			m->Q__md5_ = (char *)len;
-			m->Q__eclasses_ = (char *)pos;
-		}
 
-		m->Q_SHA1 = m->Q__data + pos;
+		m->Q_SHA1 = tree_pkg_meta_reserve(m, needlen);
 		m->Q_SIZE = m->Q_SHA1 + 40 + 1;
 		pos += needlen;
 		m->Q__eclasses_ = (char *)pos;
@@ -1033,7 +1160,7 @@ tree_read_file_binpkg(tree_pkg_ctx *pkg_ctx)
 }
 
 static tree_pkg_meta *
-tree_pkg_read(tree_pkg_ctx *pkg_ctx)
+tree_pkg_read_int(tree_pkg_ctx *pkg_ctx, bool lazy)
 {
 	tree_ctx *ctx = pkg_ctx->cat_ctx->ctx;
 
@@ -1054,7 +1181,7 @@ tree_pkg_read(tree_pkg_ctx *pkg_ctx)
 	}
 
 	if (ctx->cachetype == CACHE_METADATA_MD5) {
-		return tree_read_file_md5(pkg_ctx);
+		return tree_read_file_md5(pkg_ctx, lazy);
 	} else if (ctx->cachetype == CACHE_METADATA_PMS) {
 		return tree_read_file_pms(pkg_ctx);
 	} else if (ctx->cachetype == CACHE_EBUILD) {
@@ -1062,13 +1189,21 @@ tree_pkg_read(tree_pkg_ctx *pkg_ctx)
 	} else if (ctx->cachetype == CACHE_BINPKGS) {
 		return tree_read_file_binpkg(pkg_ctx);
 	} else if (ctx->cachetype == CACHE_PACKAGES) {
-		return (tree_pkg_meta *)pkg_ctx->cat_ctx->ctx->pkgs;
+		return pkg_ctx->meta;  /* set by tree_foreach_packages */
 	}
 
 	warn("Unknown/unsupported metadata cache type!");
 	return NULL;
 }
 
+/* returns the metadata with all keys parsed, as needed for results
+ * that outlive pkg_ctx */
+static tree_pkg_meta *
+tree_pkg_read(tree_pkg_ctx *pkg_ctx)
+{
+	return tree_pkg_read_int(pkg_ctx, false);
+}
+
 static void
 tree_close_meta(tree_pkg_meta *cache)
 {
@@ -1097,13 +1232,30 @@ tree_pkg_meta_get_int(tree_pkg_ctx *pkg_ctx, size_t offset, const char *keyn)
 
 		/* just eat the file if we haven't yet */
 		if (*key == NULL) {
-			int fd = tree_pkg_vdb_openat(pkg_ctx, keyn, O_RDONLY, 0);
+			tree_pkg_meta *m = pkg_ctx->meta;
+			const char *val;
 			struct stat s;
 			size_t pos;
 			size_t len;
 			char *p;
-			tree_pkg_meta *m = pkg_ctx->meta;
+			int fd;
 
+			/* hijack unused members */
+			pos = (size_t)m->Q__eclasses_;
+
+			/* the index has most keys, saving us from opening them */
+			if (tree_pkg_vdb_index_get(pkg_ctx, keyn, &val)) {
+				if (val == NULL)
+					return NULL;
+				len = strlen(val);
+				p = *key = tree_pkg_meta_reserve(m, len + 1);
+				memcpy(p, val, len + 1);
+				pos += len + 1;
+				m->Q__eclasses_ = (char *)pos;
+				return *key;
+			}
+
+			fd = tree_pkg_vdb_openat(pkg_ctx, keyn, O_RDONLY, 0);
 			if (fd < 0)
 				return NULL;
 			if (fstat(fd, &s) != 0) {
@@ -1111,31 +1263,7 @@ tree_pkg_meta_get_int(tree_pkg_ctx *pkg_ctx, size_t offset, const char *keyn)
 				return NULL;
 			}
 
-			/* hijack unused members */
-			pos = (size_t)m->Q__eclasses_;
-			len = (size_t)m->Q__md5_;
-
-			/* TODO: this is an exact copy from tree_read_file_binpkg_xpak_cb */
-			if (len - pos < (size_t)(s.st_size + 1)) {
-				p = m->Q__data;
-				len += (((s.st_size + 1 - (len - pos)) / BUFSIZ) + 1) * BUFSIZ;
-				m->Q__data = xrealloc(m->Q__data, len);
-
-				/* re-position existing keys */
-				if (p != NULL && m->Q__data != p) {
-					char **newdata = (char **)m;
-					int elems = sizeof(tree_pkg_meta) / sizeof(char *);
-					while (elems-- > 1)  /* skip Q__data itself */
-						if (newdata[elems] != NULL)
-							newdata[elems] = m->Q__data + (newdata[elems] - p);
-				}
-
-				/* set after repositioning! */
-				m->Q__md5_ = (char *)len;
-				m->Q__eclasses_ = (char *)pos;
-			}
-
-			p = *key = m->Q__data + pos;
+			p = *key = tree_pkg_meta_reserve(m, s.st_size + 1);
 			if (read(fd, p, s.st_size) == (ssize_t)s.st_size) {
 				p[s.st_size] = '\0';
 				while (s.st_size > 0 && isspace((int)p[s.st_size - 1]))
@@ -1147,10 +1275,13 @@ tree_pkg_meta_get_int(tree_pkg_ctx *pkg_ctx, size_t offset, const char *keyn)
 		}
 	} else {
 		if (pkg_ctx->meta == NULL)
-			pkg_ctx->meta = tree_pkg_read(pkg_ctx);
+			pkg_ctx->meta = tree_pkg_read_int(pkg_ctx, true);
 		if (pkg_ctx->meta == NULL)
 			return NULL;
 
+		if (pkg_ctx->meta->Q__raw != NULL)
+			return tree_pkg_meta_lookup(pkg_ctx->meta, offset, keyn);
+
 		key = (char **)((char *)&pkg_ctx->meta->Q__data + offset);
 
 		/* Packages are nice, but also a bit daft, because they don't
@@ -1158,6 +1289,8 @@ tree_pkg_meta_get_int(tree_pkg_ctx *pkg_ctx, size_t offset, const char *keyn)
 		 * We cannot downgrade the tree execution to BINPKGS, because
 		 * we're running from tree_foreach_packages */
 		if (*key == NULL && ctx->cachetype == CACHE_PACKAGES) {
+			tree_pkg_meta *pmeta = pkg_ctx->meta;
+
 			ctx->cachetype = CACHE_BINPKGS;
 			pkg_ctx->fd = -1;
 			pkg_ctx->meta = tree_pkg_read(pkg_ctx);
@@ -1165,7 +1298,7 @@ tree_pkg_meta_get_int(tree_pkg_ctx *pkg_ctx, size_t offset, const char *keyn)
 			if (pkg_ctx->meta == NULL) {
 				/* hrmffff. */
 				pkg_ctx->fd = 0;
-				pkg_ctx->meta = tree_pkg_read(pkg_ctx);
+				pkg_ctx->meta = pmeta;
 			}
 			key = (char **)((char *)&pkg_ctx->meta->Q__data + offset);
 		}
@@ -1274,36 +1407,43 @@ tree_close_pkg(tree_pkg_ctx *pkg_ctx)
 	/* avoid freeing tree_ctx' repo */
 	if (pkg_ctx->cat_ctx->ctx->repo != pkg_ctx->repo)
 		free(pkg_ctx->repo);
-	if (pkg_ctx->cat_ctx->ctx->do_sort)
-		free((char *)pkg_ctx->name);
 	free(pkg_ctx->slot);
-	if (pkg_ctx->meta != NULL &&
-			(void *)pkg_ctx->meta != (void *)pkg_ctx->cat_ctx->ctx->pkgs)
+	if (pkg_ctx->meta != NULL)
 		tree_close_meta(pkg_ctx->meta);
-	free(pkg_ctx);
+	/* pkg_ctx and name are released along with the category */
 }
 
-static int
-tree_foreach_packages(tree_ctx *ctx, tree_pkg_cb callback, void *priv)
+/* an entry of the Packages file, entries are chained in file order
+ * and in addition per CATEGORY/PN for lookups by tree_match_atom */
+struct tree_pkgs_entry {
+	depend_atom *atom;
+	char *slot;
+	tree_pkg_meta meta;
+	struct tree_pkgs_entry *next;
+	struct tree_pkgs_entry *next_pn;
+};
+
+/* parse the Packages file once, all strings are NUL-terminated in place
+ * in ctx->pkgs, which hence must stay around until tree_close */
+static bool
+tree_packages_load(tree_ctx *ctx)
 {
 	char *p;
 	char *q;
 	char *c;
-	char pkgname[_Q_PATH_MAX];
+	char key[_Q_PATH_MAX];
 	size_t len;
-	int ret = 0;
-	depend_atom *query = ctx->query_atom;
-
-	/* reused for every entry */
-	tree_cat_ctx *cat = NULL;
-	tree_pkg_ctx pkg;
+	bool header = true;
+	struct tree_pkgs_entry **tail;
+	struct tree_pkgs_entry *ent;
+	struct tree_pkgs_entry *w;
 	tree_pkg_meta meta;
 	depend_atom *atom = NULL;
 
-	/* re-read the contents, this is necessary to make it possible to
-	 * call this function multiple times
-	 * TODO: generate an internal in-memory tree when cache is enabled */
-	if (ctx->pkgs == NULL || ctx->pkgs[0] == '\0') {
+	if (ctx->pkgs_index != NULL)
+		return true;
+
+	if (ctx->pkgs == NULL) {
 		int fd = openat(ctx->tree_fd, binpkg_packages, O_RDONLY | O_CLOEXEC);
 		if (!eat_file_fd(fd, &ctx->pkgs, &ctx->pkgslen)) {
 			if (ctx->pkgs != NULL) {
@@ -1311,11 +1451,14 @@ tree_foreach_packages(tree_ctx *ctx, tree_pkg_cb callback, void *priv)
 				ctx->pkgs = NULL;
 			}
 			close(fd);
-			return 1;
+			return false;
 		}
 		close(fd);
 	}
 
+	ctx->pkgs_index = create_set();
+	tail = &ctx->pkgs_ents;
+
 	p = ctx->pkgs;
 	len = strlen(ctx->pkgs);  /* sucks, need eat_file change */
 
@@ -1333,42 +1476,36 @@ tree_foreach_packages(tree_ctx *ctx, tree_pkg_cb callback, void *priv)
 
 		/* empty line, end of a block */
 		if (p == q) {
-			/* make callback with populated atom */
+			header = false;
 			if (atom != NULL) {
-				size_t pkgnamelen;
-
-				memset(&pkg, 0, sizeof(pkg));
-
-				/* store meta ptr in repo->pkgs, such that get_pkg_meta
-				 * can grab it from there (for free) */
-				c = ctx->pkgs;
-				ctx->pkgs = (char *)&meta;
-
-				if (cat == NULL || strcmp(cat->name, atom->CATEGORY) != 0)
-				{
-					if (cat != NULL) {
-						atom_implode((depend_atom *)cat->pkg_ctxs);
-						cat->pkg_ctxs = NULL;
-						tree_close_cat(cat);
+				ent = xzalloc(sizeof(*ent));
+				ent->atom = atom;
+				ent->meta = meta;
+
+				/* fill in SLOT and REPO up front, such that the atom
+				 * is complete and never has to be modified later on */
+				if (meta.Q_SLOT != NULL) {
+					ent->slot = xstrdup(meta.Q_SLOT);
+					atom->SLOT = ent->slot;
+					if ((c = strchr(ent->slot, '/')) != NULL) {
+						*c++ = '\0';
+						atom->SUBSLOT = c;
 					}
-					pkg.cat_ctx = cat = tree_open_cat(ctx, atom->CATEGORY);
-					cat->pkg_ctxs = (tree_pkg_ctx **)atom;  /* for name */
 				}
-				pkgnamelen = snprintf(pkgname, sizeof(pkgname),
-						"%s.tbz2", atom->PF);
-				pkgname[pkgnamelen - (sizeof(".tbz2") - 1)] = '\0';
-				pkg.name = pkgname;
-				pkg.slot = meta.Q_SLOT == NULL ? (char *)"0" : meta.Q_SLOT;
-				pkg.repo = ctx->repo;
-				pkg.atom = atom;
-				pkg.fd = 0;  /* intentional, meta has already been read */
-
-				/* do call callback with pkg_atom (populate cat and pkg) */
-				ret |= callback(&pkg, priv);
-
-				ctx->pkgs = c;
-				if (atom != (depend_atom *)cat->pkg_ctxs)
-					atom_implode(atom);
+				atom->REPO = meta.Q_repository != NULL ?
+					meta.Q_repository : ctx->repo;
+
+				*tail = ent;
+				tail = &ent->next;
+
+				snprintf(key, sizeof(key), "%s/%s",
+						atom->CATEGORY, atom->PN);
+				w = add_set_value(key, ent, ctx->pkgs_index);
+				if (w != NULL) {
+					while (w->next_pn != NULL)
+						w = w->next_pn;
+					w->next_pn = ent;
+				}
 			}
 
 			memset(&meta, 0, sizeof(meta));
@@ -1393,17 +1530,13 @@ tree_foreach_packages(tree_ctx *ctx, tree_pkg_cb callback, void *priv)
 			len--;
 		}
 
-		if (strcmp(p, "REPO") == 0) { /* from global section in older files */
-			ctx->repo = c;
+		if (header) {
+			if (strcmp(p, "REPO") == 0 && ctx->repo == NULL)
+				ctx->repo = xstrdup(c);  /* global in older files */
 		} else if (strcmp(p, "CPV") == 0) {
 			if (atom != NULL)
 				atom_implode(atom);
 			atom = atom_explode(c);
-			/* pretend this entry is bogus if it doesn't match query */
-			if (query != NULL && atom_compare(atom, query) != EQUAL) {
-				atom_implode(atom);
-				atom = NULL;
-			}
 #define match_key(X) match_key2(X,X)
 #define match_key2(X,Y) \
 		} else if (strcmp(p, #X) == 0) { \
@@ -1430,19 +1563,114 @@ tree_foreach_packages(tree_ctx *ctx, tree_pkg_cb callback, void *priv)
 		p = q;
 	} while (len > 0);
 
-	if (cat != NULL) {
-		atom_implode((depend_atom *)cat->pkg_ctxs);
-		cat->pkg_ctxs = NULL;
-		tree_close_cat(cat);
-	}
-
 	if (atom != NULL)
 		atom_implode(atom);
 
-	/* ensure we don't free a garbage pointer */
-	ctx->repo = NULL;
+	return true;
+}
+
+static void
+tree_packages_free(tree_ctx *ctx)
+{
+	struct tree_pkgs_entry *ent;
+
+	while ((ent = ctx->pkgs_ents) != NULL) {
+		ctx->pkgs_ents = ent->next;
+		atom_implode(ent->atom);
+		free(ent->slot);
+		free(ent);
+	}
+	if (ctx->pkgs_index != NULL)
+		free_set(ctx->pkgs_index);
+	ctx->pkgs_index = NULL;
+}
+
+/* returns the first entry to consider for query, when bypn is set, the
+ * remaining entries are found via next_pn instead of next */
+static struct tree_pkgs_entry *
+tree_packages_first(tree_ctx *ctx, depend_atom *query, bool *bypn)
+{
+	char key[_Q_PATH_MAX];
+
+	*bypn = false;
+	if (query == NULL || query->CATEGORY == NULL || query->PN == NULL ||
+			strchr(query->CATEGORY, '*') != NULL ||
+			strchr(query->PN, '*') != NULL)
+		return ctx->pkgs_ents;
+
+	*bypn = true;
+	snprintf(key, sizeof(key), "%s/%s", query->CATEGORY, query->PN);
+	return get_set(key, ctx->pkgs_index);
+}
+
+static int
+tree_foreach_packages(tree_ctx *ctx, tree_pkg_cb callback, void *priv)
+{
+	char pkgname[_Q_PATH_MAX];
+	size_t pkgnamelen;
+	int ret = 0;
+	bool bypn;
+	depend_atom *query = ctx->query_atom;
+	struct tree_pkgs_entry *ent;
+
+	/* reused for every entry */
+	tree_cat_ctx *cat = NULL;
+	tree_cat_ctx nocat;
+	tree_pkg_ctx pkg;
+
+	if (!tree_packages_load(ctx))
+		return 1;
+
+	for (ent = tree_packages_first(ctx, query, &bypn);
+			ent != NULL;
+			ent = bypn ? ent->next_pn : ent->next)
+	{
+		if (query != NULL && atom_compare(ent->atom, query) != EQUAL)
+			continue;
+
+		if (cat == NULL || strcmp(cat->name, ent->atom->CATEGORY) != 0) {
+			if (cat != NULL && cat != &nocat)
+				tree_close_cat(cat);
+			cat = tree_open_cat(ctx, ent->atom->CATEGORY);
+			if (cat == NULL) {
+				/* Packages can be used without the binpkgs, present
+				 * a category without any backing */
+				memset(&nocat, 0, sizeof(nocat));
+				nocat.name = ent->atom->CATEGORY;
+				nocat.fd = -1;
+				nocat.ctx = ctx;
+				nocat.vdb_cat = VDB_INDEX_NOTFOUND;
+				nocat.out = stdout;
+				cat = &nocat;
+			}
+		}
+
+		memset(&pkg, 0, sizeof(pkg));
+		pkgnamelen = snprintf(pkgname, sizeof(pkgname),
+				"%s.tbz2", ent->atom->PF);
+		pkgname[pkgnamelen - (sizeof(".tbz2") - 1)] = '\0';
+		pkg.name = pkgname;
+		pkg.cat_ctx = cat;
+		pkg.slot = ent->meta.Q_SLOT == NULL ? (char *)"0" : ent->meta.Q_SLOT;
+		pkg.repo = ent->atom->REPO;
+		pkg.atom = ent->atom;
+		pkg.meta = &ent->meta;
+		pkg.fd = 0;  /* intentional, meta has already been read */
+
+		/* do call callback with pkg_atom (populate cat and pkg) */
+		ret |= callback(&pkg, priv);
+
+		/* meta may have been replaced by the one from the binpkg */
+		if (pkg.meta != &ent->meta)
+			tree_close_meta(pkg.meta);
+		if (pkg.fd > 0)
+			close(pkg.fd);
+	}
+
+	if (cat != NULL && cat != &nocat)
+		tree_close_cat(cat);
+
 	ctx->do_sort = false;
-	ctx->pkgs[0] = '\0';
 
 	return ret;
 }
@@ -1487,6 +1715,118 @@ tree_foreach_pkg(tree_ctx *ctx, tree_pkg_cb callback, void *priv,
 	return ret;
 }
 
+/* Like tree_foreach_pkg, but categories are distributed over jobs
+ * threads.  Callbacks are called concurrently for packages of different
+ * categories, hence must protect any shared state they modify, or use
+ * pkg_ctx->cat_ctx->worker to index per-thread state.  Output must be
+ * written to pkg_ctx->cat_ctx->out, which is buffered per category and
+ * flushed to stdout in the same order a serial run would produce. */
+int
+tree_foreach_pkg_parallel(tree_ctx *ctx, tree_pkg_cb callback, void *priv,
+		bool sort, depend_atom *query, int jobs)
+{
+	struct tree_cat_out {
+		char *buf;
+		size_t len;
+		bool done;
+	} *outs;
+	DECLARE_ARRAY(cats);
+	tree_ctx *wctx;
+	const char *name;
+	size_t next;
+	ssize_t i;
+	int ret;
+
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+
+	/* the Packages file is a single stream, and the category cache
+	 * cannot be shared between threads */
+	if (jobs <= 1 || ctx->cachetype == CACHE_PACKAGES ||
+			ctx->cache.categories != NULL)
+		return tree_foreach_pkg(ctx, callback, priv, sort, query);
+
+	ctx->do_sort = sort;
+	ctx->query_atom = query;
+
+	/* collect the categories up front, such that they can be handed
+	 * out to the threads (and merged) in the order of a serial run */
+	while ((name = tree_next_cat_name(ctx)) != NULL) {
+		if (ctx->query_atom != NULL && ctx->query_atom->CATEGORY != NULL &&
+				strcmp(ctx->query_atom->CATEGORY, name) != 0)
+			continue;
+		xarraypush_str(cats, name);
+	}
+
+	outs = xzalloc(sizeof(*outs) * (array_cnt(cats) + 1));
+	next = 0;
+	ret = 0;
+
+	/* each thread needs its own arena to allocate from */
+	wctx = xmalloc(sizeof(*wctx) * jobs);
+	for (i = 0; i < jobs; i++) {
+		wctx[i] = *ctx;
+		wctx[i].mem = create_arena();
+	}
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(jobs) reduction(|:ret)
+	for (i = 0; i < (ssize_t)array_cnt(cats); i++) {
+		tree_cat_ctx *cat_ctx;
+		tree_pkg_ctx *pkg_ctx;
+		FILE *out;
+
+		out = open_memstream(&outs[i].buf, &outs[i].len);
+		if (out == NULL)
+			out = stdout;  /* unordered, but better than nothing */
+
+		cat_ctx = tree_open_cat(&wctx[omp_get_thread_num()],
+				array_get_elem(cats, i));
+		if (cat_ctx != NULL) {
+			cat_ctx->out = out;
+			cat_ctx->worker = omp_get_thread_num();
+			while ((pkg_ctx = tree_next_pkg(cat_ctx))) {
+				ret |= callback(pkg_ctx, priv);
+				tree_close_pkg(pkg_ctx);
+			}
+			tree_close_cat(cat_ctx);
+		}
+
+		if (out != stdout)
+			fclose(out);
+
+		/* write out all categories that are complete and next in line,
+		 * so output flows while the remaining ones are processed */
+#pragma omp critical(tree_foreach_pkg_parallel)
+		{
+			outs[i].done = true;
+			while (outs[next].done) {
+				if (outs[next].len > 0)
+					fwrite(outs[next].buf, 1, outs[next].len, stdout);
+				free(outs[next].buf);
+				next++;
+			}
+		}
+	}
+
+	for (i = 0; i < jobs; i++)
+		free_arena(wctx[i].mem);
+	free(wctx);
+	free(outs);
+	xarrayfree(cats);
+
+	/* allow foreach to be called again on the same open tree */
+	if (ctx->do_sort)
+		scandir_free(ctx->cat_de, ctx->cat_cnt);
+	else
+		rewinddir(ctx->dir);
+	ctx->cat_de = NULL;
+	ctx->cat_cur = 0;
+	ctx->cat_cnt = 0;
+	ctx->do_sort = 0;
+
+	return ret;
+}
+
 depend_atom *
 tree_get_atom(tree_pkg_ctx *pkg_ctx, bool complete)
 {
@@ -1514,13 +1854,20 @@ tree_get_atom(tree_pkg_ctx *pkg_ctx, bool complete)
 				pkg_ctx->atom->REPO = pkg_ctx->repo;
 			}
 		} else { /* metadata, ebuild, binpkg or Packages */
+			/* keep the metadata around, chances are the caller is
+			 * going to need some of it next */
 			tree_pkg_meta *meta = NULL;
 			if (pkg_ctx->atom->SLOT == NULL) {
 				if (pkg_ctx->slot == NULL) {
-					meta = tree_pkg_read(pkg_ctx);
+					char *slot;
+					if (pkg_ctx->meta == NULL)
+						pkg_ctx->meta = tree_pkg_read_int(pkg_ctx, true);
+					meta = pkg_ctx->meta;
 					if (meta != NULL) {
-						if (meta->Q_SLOT != NULL) {
-							pkg_ctx->slot = xstrdup(meta->Q_SLOT);
+						slot = tree_pkg_meta_lookup(meta,
+								offsetof(tree_pkg_meta, Q_SLOT), "SLOT");
+						if (slot != NULL) {
+							pkg_ctx->slot = xstrdup(slot);
 							pkg_ctx->slot_len = strlen(pkg_ctx->slot);
 						}
 					}
@@ -1530,8 +1877,9 @@ tree_get_atom(tree_pkg_ctx *pkg_ctx, bool complete)
 			/* repo is set from the tree, when found */
 			if (pkg_ctx->atom->REPO == NULL) {
 				if (pkg_ctx->repo == NULL && ctx->cachetype == CACHE_BINPKGS) {
-					if (meta == NULL)
-						meta = tree_pkg_read(pkg_ctx);
+					if (pkg_ctx->meta == NULL)
+						pkg_ctx->meta = tree_pkg_read(pkg_ctx);
+					meta = pkg_ctx->meta;
 					if (meta != NULL && meta->Q_repository != NULL) {
 						pkg_ctx->repo = xstrdup(meta->Q_repository);
 						pkg_ctx->repo_len = strlen(pkg_ctx->repo);
@@ -1539,9 +1887,6 @@ tree_get_atom(tree_pkg_ctx *pkg_ctx, bool complete)
 				}
 				pkg_ctx->atom->REPO = pkg_ctx->repo;
 			}
-
-			if (meta != NULL)
-				tree_close_meta(meta);
 		}
 
 		/* this is a bit atom territory, but since we pulled in SLOT we
@@ -1600,42 +1945,6 @@ struct tree_match_pkgs_cb_ctx {
 	tree_match_ctx *ret;
 };
 
-static int
-tree_match_atom_packages_cb(tree_pkg_ctx *ctx, void *priv)
-{
-	struct tree_match_pkgs_cb_ctx *rctx = priv;
-	depend_atom *a;
-	tree_match_ctx *n;
-
-	/* skip anything after finding first match */
-	if (rctx->flags & TREE_MATCH_FIRST && rctx->ret != NULL)
-		return 1;
-
-	a = tree_get_atom(ctx, rctx->flags & TREE_MATCH_FULL_ATOM);
-
-	/* skip virtual category if not requested */
-	if (!(rctx->flags & TREE_MATCH_VIRTUAL) &&
-			strcmp(a->CATEGORY, "virtual") == 0)
-		return 1;
-
-	n = xzalloc(sizeof(tree_match_ctx));
-	n->free_atom = true;
-	n->atom = atom_clone(a);
-	if (rctx->flags & TREE_MATCH_METADATA) {
-		n->meta = xmalloc(sizeof(*n->meta));
-		/* for Packages, all pointers to meta here are to the in memory
-		 * copy of the Packages file, so these pointers can just be
-		 * copied since the tree has to remain open, thus the pointers
-		 * will stay valid */
-		memcpy(n->meta, ctx->cat_ctx->ctx->pkgs, sizeof(*n->meta));
-	}
-
-	n->next = rctx->ret;
-	rctx->ret = n;
-
-	return 0;
-}
-
 static int
 tree_match_atom_binpkg_cb(tree_pkg_ctx *ctx, void *priv)
 {
@@ -1675,15 +1984,49 @@ tree_match_atom(tree_ctx *ctx, depend_atom *query, int flags)
 	depend_atom *atom;
 
 	if (ctx->cachetype == CACHE_PACKAGES) {
-		struct tree_match_pkgs_cb_ctx rctx;
+		struct tree_pkgs_entry *ent;
+		bool bypn;
+
 		/* Packages needs to be serviced separately because it doesn't
-		 * use a tree internally, but reads off of the Packages file */
-		rctx.flags = flags;
-		rctx.ret = NULL;
-		ctx->query_atom = query;
-		tree_foreach_packages(ctx, tree_match_atom_packages_cb, &rctx);
-		ctx->query_atom = NULL;
-		return rctx.ret;
+		 * use a tree internally, but the parsed Packages file, which
+		 * is indexed by CATEGORY/PN */
+		if (!tree_packages_load(ctx))
+			return NULL;
+
+		for (ent = tree_packages_first(ctx, query, &bypn);
+				ent != NULL;
+				ent = bypn ? ent->next_pn : ent->next)
+		{
+			tree_match_ctx *n;
+
+			/* skip virtual category if not requested */
+			if (!(flags & TREE_MATCH_VIRTUAL) &&
+					strcmp(ent->atom->CATEGORY, "virtual") == 0)
+				continue;
+
+			if (atom_compare(ent->atom, query) != EQUAL)
+				continue;
+
+			n = xzalloc(sizeof(tree_match_ctx));
+			n->free_atom = true;
+			n->atom = atom_clone(ent->atom);
+			if (flags & TREE_MATCH_METADATA) {
+				n->meta = xmalloc(sizeof(*n->meta));
+				/* all pointers in meta are to the in memory copy of
+				 * the Packages file, so these pointers can just be
+				 * copied since the tree has to remain open, thus the
+				 * pointers will stay valid */
+				memcpy(n->meta, &ent->meta, sizeof(*n->meta));
+			}
+
+			n->next = ret;
+			ret = n;
+
+			if (flags & TREE_MATCH_FIRST)
+				break;
+		}
+
+		return ret;
 	} else if (ctx->cachetype == CACHE_BINPKGS) {
 		struct tree_match_pkgs_cb_ctx rctx;
 		/* this sulks, but binpkgs modify the pkg_ctx->name to strip off
@@ -9,9 +9,12 @@
 #include <dirent.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
+#include "arena.h"
 #include "atom.h"
 #include "set.h"
+#include "vdb_index.h"
 
 typedef struct tree_ctx          tree_ctx;
 typedef struct tree_cat_ctx      tree_cat_ctx;
@@ -38,13 +41,14 @@ struct tree_ctx {
 		CACHE_PACKAGES,
 		CACHE_BINPKGS,
 	} cachetype:3;
-	tree_pkg_ctx *ebuilddir_pkg_ctx;
-	tree_cat_ctx *ebuilddir_cat_ctx;
-	tree_ctx *ebuilddir_ctx;
 	char *repo;
 	char *pkgs;
 	size_t pkgslen;
+	struct tree_pkgs_entry *pkgs_ents;
+	set *pkgs_index;
 	depend_atom *query_atom;
+	vdb_index *vdb_idx;
+	arena *mem;  /* category and package contexts */
 	struct tree_cache {
 		set *categories;
 	} cache;
@@ -59,6 +63,14 @@ struct tree_cat_ctx {
 	tree_pkg_ctx **pkg_ctxs;
 	size_t pkg_cnt;
 	size_t pkg_cur;
+	size_t vdb_cat;
+	size_t vdb_pkg_cur;
+	tree_pkg_ctx *ebuilddir_pkg_ctx;
+	tree_cat_ctx *ebuilddir_cat_ctx;
+	tree_ctx *ebuilddir_ctx;
+	arena_pos mark; /* releases all pkgs on close */
+	FILE *out;      /* stream callbacks should print to */
+	int worker;     /* thread handling this category, 0 when serial */
 };
 
 /* Package context */
@@ -107,6 +119,9 @@ struct tree_pkg_meta {
 	/* These are MD5-Cache only */
 	char *Q__eclasses_;
 	char *Q__md5_;
+	/* unparsed md5-cache data, keys are looked up on first access */
+	char *Q__raw;
+	char *Q__rawend;
 };
 
 /* Metadata.xml */
@@ -126,6 +141,9 @@ struct tree_match_ctx {
 	int free_atom;
 };
 
+/* directory (relative to root) holding the VDB index, when it exists */
+extern const char *tree_cachedir;
+
 /* foreach pkg callback function signature */
 typedef int (tree_pkg_cb)(tree_pkg_ctx *, void *priv);
 
@@ -145,6 +163,8 @@ void tree_close_metadata(tree_metadata_xml *meta_ctx);
 void tree_close_pkg(tree_pkg_ctx *pkg_ctx);
 int tree_foreach_pkg(tree_ctx *ctx, tree_pkg_cb callback, void *priv,
 		bool sort, depend_atom *query);
+int tree_foreach_pkg_parallel(tree_ctx *ctx, tree_pkg_cb callback, void *priv,
+		bool sort, depend_atom *query, int jobs);
 #define tree_foreach_pkg_fast(ctx, cb, priv, query) \
 	tree_foreach_pkg(ctx, cb, priv, false, query);
 #define tree_foreach_pkg_sorted(ctx, cb, priv, query) \
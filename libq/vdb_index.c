@@ -0,0 +1,641 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#include "main.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <xalloc.h>
+
+#include "cache_file.h"
+#include "scandirat.h"
+#include "vdb_index.h"
+
+/* The VDB index is a single file that holds for each installed package
+ * its name and the contents of a selection of (small) metadata files
+ * from its VDB directory.  It is laid out such that it can be mmap()ed
+ * and used as is:
+ *   header | categories[ncats] | packages[npkgs] | string table
+ * All numbers are in host byte-order, strings are referenced by their
+ * offset in the string table, and are NUL-terminated.  A package is
+ * considered up-to-date when the mtimes of its directory and category
+ * match the ones recorded, which works because the package manager
+ * replaces package directories on (un)merge, and writes a new file and
+ * renames it over the old one when it updates metadata in place (e.g.
+ * on slotmove), both of which change the mtime of a directory. */
+
+#define VDB_INDEX_FILE    "vdb.idx"
+#define VDB_INDEX_MAGIC   "Q-VDBIDX"
+#define VDB_INDEX_VERSION 2
+#define VDB_INDEX_ABSENT  ((uint32_t)-1)
+
+/* the files from the VDB stored in the index, CONTENTS is deliberately
+ * not in here, for it would make the index grow too big */
+static const char * const vdb_index_keys[] = {
+	"SLOT",
+	"repository",
+	"EAPI",
+	"USE",
+	"IUSE",
+	"LICENSE",
+	"KEYWORDS",
+	"DEPEND",
+	"RDEPEND",
+	"BDEPEND",
+	"PDEPEND",
+	"DEFINED_PHASES",
+	"REQUIRED_USE",
+	"EPREFIX",
+	"DESCRIPTION",
+	"HOMEPAGE",
+	"RESTRICT",
+	"PROPERTIES",
+	"INHERITED",
+};
+#define VDB_INDEX_NKEYS ARRAY_SIZE(vdb_index_keys)
+
+struct vdb_index_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nkeys;
+	uint32_t ncats;
+	uint32_t npkgs;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t size;
+};
+
+struct vdb_index_cat {
+	uint32_t name;
+	uint32_t pkgs;
+	uint32_t npkgs;
+	uint32_t pad;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+struct vdb_index_pkg {
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t name;
+	uint32_t keys[VDB_INDEX_NKEYS];
+};
+
+struct vdb_index {
+	char *data;
+	size_t len;
+	bool mapped;
+	const struct vdb_index_hdr *hdr;
+	const struct vdb_index_cat *cats;
+	const struct vdb_index_pkg *pkgs;
+	const char *strs;
+	size_t strslen;
+};
+
+/* in-memory representation used while (re)building the index */
+struct vdb_index_build {
+	struct vdb_index_cat *cats;
+	size_t ncats;
+	size_t catssize;
+	struct vdb_index_pkg *pkgs;
+	size_t npkgs;
+	size_t pkgssize;
+	char *strs;
+	size_t strslen;
+	size_t strssize;
+	time_t start;
+};
+
+static bool
+vdb_index_setup(vdb_index *idx)
+{
+	size_t off;
+	size_t n;
+	size_t k;
+
+	if (idx->len < sizeof(*idx->hdr))
+		return false;
+	idx->hdr = (const struct vdb_index_hdr *)idx->data;
+	if (memcmp(idx->hdr->magic, VDB_INDEX_MAGIC, sizeof(idx->hdr->magic)) != 0 ||
+			idx->hdr->version != VDB_INDEX_VERSION ||
+			idx->hdr->nkeys != VDB_INDEX_NKEYS ||
+			idx->hdr->size != idx->len)
+		return false;
+
+	off = sizeof(*idx->hdr);
+	idx->cats = (const struct vdb_index_cat *)(idx->data + off);
+	off += sizeof(*idx->cats) * idx->hdr->ncats;
+	idx->pkgs = (const struct vdb_index_pkg *)(idx->data + off);
+	off += sizeof(*idx->pkgs) * idx->hdr->npkgs;
+	if (off >= idx->len)
+		return false;
+	idx->strs = idx->data + off;
+	idx->strslen = idx->len - off;
+	if (idx->strs[idx->strslen - 1] != '\0')
+		return false;
+
+	/* ensure nothing points outside of the index, such that a damaged
+	 * file cannot lead us astray */
+	for (n = 0; n < idx->hdr->ncats; n++) {
+		if (idx->cats[n].name >= idx->strslen ||
+				idx->cats[n].pkgs > idx->hdr->npkgs ||
+				idx->cats[n].npkgs > idx->hdr->npkgs - idx->cats[n].pkgs)
+			return false;
+	}
+	for (n = 0; n < idx->hdr->npkgs; n++) {
+		if (idx->pkgs[n].name >= idx->strslen)
+			return false;
+		for (k = 0; k < VDB_INDEX_NKEYS; k++)
+			if (idx->pkgs[n].keys[k] != VDB_INDEX_ABSENT &&
+					idx->pkgs[n].keys[k] >= idx->strslen)
+				return false;
+	}
+
+	return true;
+}
+
+static vdb_index *
+vdb_index_load(int cache_fd)
+{
+	vdb_index *ret;
+	size_t len;
+	void *data;
+
+	data = cache_file_map(cache_fd, VDB_INDEX_FILE,
+			sizeof(struct vdb_index_hdr), &len);
+	if (data == NULL)
+		return NULL;
+
+	ret = xzalloc(sizeof(*ret));
+	ret->data = data;
+	ret->len = len;
+	ret->mapped = true;
+	if (!vdb_index_setup(ret)) {
+		vdb_index_close(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+void
+vdb_index_close(vdb_index *idx)
+{
+	if (idx->mapped)
+		munmap(idx->data, idx->len);
+	else
+		free(idx->data);
+	free(idx);
+}
+
+/* an mtime of 0 means unknown, and never matches */
+static bool
+vdb_index_mtime_eq(const struct stat *st, int64_t sec, int64_t nsec)
+{
+	return (sec != 0 || nsec != 0) &&
+		st->st_mtim.tv_sec == sec && st->st_mtim.tv_nsec == nsec;
+}
+
+/* store an mtime, unless it is so recent that a modification directly
+ * following it could go unnoticed because it gets the same mtime */
+static void
+vdb_index_mtime_set(
+		const struct stat *st,
+		time_t start,
+		int64_t *sec,
+		int64_t *nsec)
+{
+	if (st->st_mtim.tv_sec >= start) {
+		*sec = 0;
+		*nsec = 0;
+	} else {
+		*sec = st->st_mtim.tv_sec;
+		*nsec = st->st_mtim.tv_nsec;
+	}
+}
+
+/* returns whether the index reflects the current state of the VDB */
+static bool
+vdb_index_fresh(vdb_index *idx, int vdb_fd, const struct stat *vst)
+{
+	const struct vdb_index_cat *cat;
+	const struct vdb_index_pkg *pkg;
+	struct stat st;
+	size_t n;
+	size_t p;
+	int cat_fd;
+
+	if (!vdb_index_mtime_eq(vst, idx->hdr->mtime_sec, idx->hdr->mtime_nsec))
+		return false;
+
+	for (n = 0; n < idx->hdr->ncats; n++) {
+		cat = &idx->cats[n];
+		cat_fd = openat(vdb_fd, idx->strs + cat->name,
+				O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_PATH);
+		if (cat_fd == -1)
+			return false;
+		if (fstat(cat_fd, &st) != 0 ||
+				!vdb_index_mtime_eq(&st, cat->mtime_sec, cat->mtime_nsec))
+		{
+			close(cat_fd);
+			return false;
+		}
+		for (p = 0; p < cat->npkgs; p++) {
+			pkg = &idx->pkgs[cat->pkgs + p];
+			if (fstatat(cat_fd, idx->strs + pkg->name, &st, 0) != 0 ||
+					!vdb_index_mtime_eq(&st,
+						pkg->mtime_sec, pkg->mtime_nsec))
+			{
+				close(cat_fd);
+				return false;
+			}
+		}
+		close(cat_fd);
+	}
+
+	return true;
+}
+
+static uint32_t
+vdb_index_build_str(struct vdb_index_build *b, const char *s, size_t len)
+{
+	uint32_t ret = (uint32_t)b->strslen;
+
+	if (b->strslen + len + 1 > b->strssize) {
+		b->strssize = ((b->strslen + len + 1) + BUFSIZE - 1) & -BUFSIZE;
+		b->strssize *= 2;
+		b->strs = xrealloc(b->strs, b->strssize);
+	}
+	memcpy(b->strs + b->strslen, s, len);
+	b->strs[b->strslen + len] = '\0';
+	b->strslen += len + 1;
+
+	return ret;
+}
+
+static struct vdb_index_pkg *
+vdb_index_build_pkg(struct vdb_index_build *b, const char *name,
+		const struct stat *st)
+{
+	struct vdb_index_pkg *ret;
+	size_t k;
+
+	if (b->npkgs == b->pkgssize) {
+		b->pkgssize += 256;
+		b->pkgs = xrealloc(b->pkgs, sizeof(b->pkgs[0]) * b->pkgssize);
+	}
+	ret = &b->pkgs[b->npkgs++];
+	vdb_index_mtime_set(st, b->start, &ret->mtime_sec, &ret->mtime_nsec);
+	ret->name = vdb_index_build_str(b, name, strlen(name));
+	for (k = 0; k < VDB_INDEX_NKEYS; k++)
+		ret->keys[k] = VDB_INDEX_ABSENT;
+
+	return ret;
+}
+
+/* reads a single key file from the VDB, mimicking what
+ * tree_pkg_meta_get does: trailing whitespace is not retained */
+static bool
+vdb_index_read_key(int pkg_fd, const char *key, char **buf, size_t *buflen,
+		size_t *len)
+{
+	struct stat st;
+	ssize_t rlen;
+	int fd;
+
+	fd = openat(pkg_fd, key, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	if (*buflen < (size_t)st.st_size + 1) {
+		*buflen = (((size_t)st.st_size + 1) + BUFSIZE - 1) & -BUFSIZE;
+		*buf = xrealloc(*buf, *buflen);
+	}
+	rlen = read(fd, *buf, st.st_size);
+	close(fd);
+	if (rlen != (ssize_t)st.st_size)
+		return false;
+
+	while (rlen > 0 && isspace((int)(*buf)[rlen - 1]))
+		rlen--;
+	*len = (size_t)rlen;
+
+	return true;
+}
+
+static int
+vdb_index_name_compar(const struct dirent **l, const struct dirent **r)
+{
+	return strcmp((*l)->d_name, (*r)->d_name);
+}
+
+static void
+vdb_index_build_cat(
+		struct vdb_index_build *b,
+		vdb_index *old,
+		int vdb_fd,
+		const char *name,
+		vdb_index_filter pkgfilter)
+{
+	struct vdb_index_cat *cat;
+	struct vdb_index_pkg *pkg;
+	const struct vdb_index_pkg *opkg;
+	struct dirent **de = NULL;
+	struct stat st;
+	const char *pname;
+	size_t ocat;
+	size_t npkgs;
+	size_t n;
+	size_t k;
+	size_t len;
+	char *buf = NULL;
+	size_t buflen = 0;
+	int cnt = 0;
+	int cat_fd;
+	int pkg_fd;
+
+	/* grab the mtime before reading anything, such that changes
+	 * happening while we read will be noticed next time */
+	if (fstatat(vdb_fd, name, &st, 0) != 0 || !S_ISDIR(st.st_mode))
+		return;
+	cat_fd = openat(vdb_fd, name, O_RDONLY | O_CLOEXEC | O_DIRECTORY);
+	if (cat_fd == -1)
+		return;
+
+	if (b->ncats == b->catssize) {
+		b->catssize += 64;
+		b->cats = xrealloc(b->cats, sizeof(b->cats[0]) * b->catssize);
+	}
+	cat = &b->cats[b->ncats++];
+	cat->name = vdb_index_build_str(b, name, strlen(name));
+	cat->pkgs = (uint32_t)b->npkgs;
+	cat->npkgs = 0;
+	cat->pad = 0;
+	vdb_index_mtime_set(&st, b->start, &cat->mtime_sec, &cat->mtime_nsec);
+
+	/* the packages are what we have if this category didn't change */
+	ocat = old == NULL ? VDB_INDEX_NOTFOUND : vdb_index_cat_find(old, name);
+	if (ocat != VDB_INDEX_NOTFOUND &&
+			vdb_index_mtime_eq(&st,
+				old->cats[ocat].mtime_sec, old->cats[ocat].mtime_nsec))
+	{
+		npkgs = old->cats[ocat].npkgs;
+	} else {
+		cnt = scandirat(cat_fd, ".", &de, pkgfilter, vdb_index_name_compar);
+		npkgs = cnt > 0 ? (size_t)cnt : 0;
+	}
+
+	for (n = 0; n < npkgs; n++) {
+		pname = de == NULL ?
+			old->strs + old->pkgs[old->cats[ocat].pkgs + n].name :
+			de[n]->d_name;
+		if (fstatat(cat_fd, pname, &st, 0) != 0)
+			continue;
+		pkg = vdb_index_build_pkg(b, pname, &st);
+		b->cats[b->ncats - 1].npkgs++;
+
+		/* reuse what we have if this package didn't change */
+		k = ocat == VDB_INDEX_NOTFOUND ?
+			VDB_INDEX_NOTFOUND : vdb_index_pkg_find(old, ocat, pname);
+		if (k != VDB_INDEX_NOTFOUND) {
+			opkg = &old->pkgs[old->cats[ocat].pkgs + k];
+			if (vdb_index_mtime_eq(&st, opkg->mtime_sec, opkg->mtime_nsec)) {
+				for (k = 0; k < VDB_INDEX_NKEYS; k++) {
+					if (opkg->keys[k] == VDB_INDEX_ABSENT)
+						continue;
+					pkg->keys[k] = vdb_index_build_str(b,
+							old->strs + opkg->keys[k],
+							strlen(old->strs + opkg->keys[k]));
+				}
+				continue;
+			}
+		}
+
+		pkg_fd = openat(cat_fd, pname, O_RDONLY | O_CLOEXEC | O_PATH);
+		if (pkg_fd == -1)
+			continue;
+		for (k = 0; k < VDB_INDEX_NKEYS; k++) {
+			if (vdb_index_read_key(pkg_fd, vdb_index_keys[k],
+						&buf, &buflen, &len))
+				pkg->keys[k] = vdb_index_build_str(b, buf, len);
+		}
+		close(pkg_fd);
+	}
+	if (cnt > 0)
+		scandir_free(de, cnt);
+	close(cat_fd);
+	free(buf);
+}
+
+static vdb_index *
+vdb_index_build(vdb_index *old, int vdb_fd, const struct stat *vst,
+		vdb_index_filter catfilter, vdb_index_filter pkgfilter)
+{
+	struct vdb_index_build b;
+	struct vdb_index_hdr hdr;
+	vdb_index *ret;
+	size_t n;
+	size_t off;
+
+	memset(&b, 0, sizeof(b));
+	b.start = time(NULL);
+	vdb_index_build_str(&b, "", 0);  /* avoid an empty string table */
+
+	if (old != NULL &&
+			vdb_index_mtime_eq(vst, old->hdr->mtime_sec, old->hdr->mtime_nsec))
+	{
+		/* no categories were added or removed */
+		for (n = 0; n < old->hdr->ncats; n++)
+			vdb_index_build_cat(&b, old, vdb_fd,
+					old->strs + old->cats[n].name, pkgfilter);
+	} else {
+		struct dirent **de;
+		int cnt;
+
+		cnt = scandirat(vdb_fd, ".", &de, catfilter, alphasort);
+		for (n = 0; cnt > 0 && n < (size_t)cnt; n++)
+			vdb_index_build_cat(&b, old, vdb_fd, de[n]->d_name, pkgfilter);
+		if (cnt > 0)
+			scandir_free(de, cnt);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, VDB_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = VDB_INDEX_VERSION;
+	hdr.nkeys = VDB_INDEX_NKEYS;
+	hdr.ncats = (uint32_t)b.ncats;
+	hdr.npkgs = (uint32_t)b.npkgs;
+	vdb_index_mtime_set(vst, b.start, &hdr.mtime_sec, &hdr.mtime_nsec);
+	hdr.size = sizeof(hdr) + (sizeof(b.cats[0]) * b.ncats) +
+		(sizeof(b.pkgs[0]) * b.npkgs) + b.strslen;
+
+	/* serialise into the same layout as the file uses */
+	ret = xzalloc(sizeof(*ret));
+	ret->len = hdr.size;
+	ret->data = xmalloc(ret->len);
+	ret->mapped = false;
+	off = 0;
+	memcpy(ret->data + off, &hdr, sizeof(hdr));
+	off += sizeof(hdr);
+	memcpy(ret->data + off, b.cats, sizeof(b.cats[0]) * b.ncats);
+	off += sizeof(b.cats[0]) * b.ncats;
+	memcpy(ret->data + off, b.pkgs, sizeof(b.pkgs[0]) * b.npkgs);
+	off += sizeof(b.pkgs[0]) * b.npkgs;
+	memcpy(ret->data + off, b.strs, b.strslen);
+
+	free(b.cats);
+	free(b.pkgs);
+	free(b.strs);
+
+	if (!vdb_index_setup(ret)) {
+		/* should be impossible */
+		vdb_index_close(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+/* opens the index for the VDB opened at vdb_fd, the index is only used
+ * when cachedir (relative to portroot_fd) exists, and is brought up to
+ * date when necessary (and possible) */
+vdb_index *
+vdb_index_open(
+		int portroot_fd,
+		const char *cachedir,
+		int vdb_fd,
+		vdb_index_filter catfilter,
+		vdb_index_filter pkgfilter)
+{
+	vdb_index *old;
+	vdb_index *ret;
+	struct stat vst;
+	int cache_fd;
+
+	cache_fd = cache_dir_open(portroot_fd, cachedir);
+	if (cache_fd == -1)
+		return NULL;
+
+	if (fstat(vdb_fd, &vst) != 0) {
+		close(cache_fd);
+		return NULL;
+	}
+
+	old = vdb_index_load(cache_fd);
+	if (old != NULL && vdb_index_fresh(old, vdb_fd, &vst)) {
+		close(cache_fd);
+		return old;
+	}
+
+	/* if we cannot store the result, rebuilding doesn't make sense, as
+	 * it costs more than just reading the VDB directly */
+	if (faccessat(cache_fd, ".", W_OK, AT_EACCESS) != 0) {
+		if (old != NULL)
+			vdb_index_close(old);
+		close(cache_fd);
+		return NULL;
+	}
+
+	ret = vdb_index_build(old, vdb_fd, &vst, catfilter, pkgfilter);
+	if (old != NULL)
+		vdb_index_close(old);
+	if (ret != NULL)
+		cache_file_write(cache_fd, VDB_INDEX_FILE, ret->data, ret->len);
+	close(cache_fd);
+
+	return ret;
+}
+
+size_t
+vdb_index_cat_cnt(vdb_index *idx)
+{
+	return idx->hdr->ncats;
+}
+
+const char *
+vdb_index_cat_name(vdb_index *idx, size_t cat)
+{
+	return idx->strs + idx->cats[cat].name;
+}
+
+size_t
+vdb_index_cat_find(vdb_index *idx, const char *name)
+{
+	size_t n;
+
+	for (n = 0; n < idx->hdr->ncats; n++)
+		if (strcmp(idx->strs + idx->cats[n].name, name) == 0)
+			return n;
+
+	return VDB_INDEX_NOTFOUND;
+}
+
+size_t
+vdb_index_pkg_cnt(vdb_index *idx, size_t cat)
+{
+	return idx->cats[cat].npkgs;
+}
+
+const char *
+vdb_index_pkg_name(vdb_index *idx, size_t cat, size_t pkg)
+{
+	return idx->strs + idx->pkgs[idx->cats[cat].pkgs + pkg].name;
+}
+
+size_t
+vdb_index_pkg_find(vdb_index *idx, size_t cat, const char *name)
+{
+	const struct vdb_index_pkg *pkgs = &idx->pkgs[idx->cats[cat].pkgs];
+	size_t lo = 0;
+	size_t hi = idx->cats[cat].npkgs;
+	size_t mid;
+	int cmp;
+
+	/* packages are stored in strcmp order */
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		cmp = strcmp(name, idx->strs + pkgs[mid].name);
+		if (cmp == 0)
+			return mid;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return VDB_INDEX_NOTFOUND;
+}
+
+/* returns true if key is covered by the index, in which case val is set
+ * to the value of key, or NULL when the package doesn't have key */
+bool
+vdb_index_pkg_get(
+		vdb_index *idx,
+		size_t cat,
+		size_t pkg,
+		const char *key,
+		const char **val)
+{
+	const struct vdb_index_pkg *p = &idx->pkgs[idx->cats[cat].pkgs + pkg];
+	size_t k;
+
+	for (k = 0; k < VDB_INDEX_NKEYS; k++) {
+		if (strcmp(vdb_index_keys[k], key) == 0) {
+			*val = p->keys[k] == VDB_INDEX_ABSENT ?
+				NULL : idx->strs + p->keys[k];
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#ifndef _VDB_INDEX_H
+#define _VDB_INDEX_H 1
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct vdb_index vdb_index;
+
+/* filter functions as used for scandirat() on categories and packages */
+typedef int (vdb_index_filter)(const struct dirent *);
+
+vdb_index *vdb_index_open(int portroot_fd, const char *cachedir, int vdb_fd,
+		vdb_index_filter catfilter, vdb_index_filter pkgfilter);
+void vdb_index_close(vdb_index *idx);
+size_t vdb_index_cat_cnt(vdb_index *idx);
+const char *vdb_index_cat_name(vdb_index *idx, size_t cat);
+size_t vdb_index_cat_find(vdb_index *idx, const char *name);
+size_t vdb_index_pkg_cnt(vdb_index *idx, size_t cat);
+const char *vdb_index_pkg_name(vdb_index *idx, size_t cat, size_t pkg);
+size_t vdb_index_pkg_find(vdb_index *idx, size_t cat, const char *name);
+bool vdb_index_pkg_get(vdb_index *idx, size_t cat, size_t pkg,
+		const char *key, const char **val);
+
+#define VDB_INDEX_NOTFOUND ((size_t)-1)
+
+#endif
@@ -22,6 +22,7 @@
 #include "rmspace.h"
 #include "scandirat.h"
 #include "set.h"
+#include "tree.h"
 #include "xasprintf.h"
 
 /* variables to control runtime behavior */
@@ -29,6 +30,7 @@ char *main_overlay;
 char *module_name = NULL;
 int verbose = 0;
 int quiet = 0;
+int jobs = 0;
 int twidth;
 char pretend = 0;
 char *portarch;
@@ -36,6 +38,7 @@ char *portroot;
 char *config_protect;
 char *config_protect_mask;
 char *portvdb;
+char *portcachedir;
 char *portlogdir;
 char *pkg_install_mask;
 char *binhost;
@@ -87,6 +90,27 @@ setup_quiet(void)
 	++quiet;
 }
 
+/* the number of jobs in arg, for --jobs */
+int
+parse_jobs(const char *arg)
+{
+	char *p;
+	long ret;
+
+	errno = 0;
+	ret = strtol(arg, &p, 10);
+	if (errno != 0)
+		errp("%s: not a valid integer", arg);
+	else if (p == arg || *p != '\0')
+		err("%s: not a valid integer", arg);
+	if (ret < 1)
+		err("%s: need at least one job", arg);
+	if (ret > 1024)
+		err("%s: silly value!", arg);
+
+	return (int)ret;
+}
+
 /* display usage and exit */
 void
 usage(int status, const char *flags, struct option const opts[],
@@ -624,6 +648,7 @@ env_vars vars_to_read[] = {
 	_Q_EVS(STR,  PKGDIR,              pkgdir,              CONFIG_EPREFIX "var/cache/binpkgs/")
 	_Q_EVS(STR,  Q_VDB,               portvdb,             CONFIG_EPREFIX "var/db/pkg")
 	_Q_EVS(STR,  Q_EDB,               portedb,             CONFIG_EPREFIX "var/cache/edb")
+	_Q_EVS(STR,  Q_CACHEDIR,          portcachedir,        CONFIG_EPREFIX "var/cache/q")
 	{ NULL, 0, _Q_BOOL, { NULL }, 0, NULL, NULL, }
 
 #undef _Q_EV
@@ -1024,6 +1049,9 @@ initialize_portage_env(void)
 	if (getenv("PORTAGE_QUIET") != NULL)
 		setup_quiet();
 
+	/* the index is only used when this dir exists */
+	tree_cachedir = portcachedir;
+
 	if (nocolor)
 		no_colors();
 	else
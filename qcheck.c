@@ -19,6 +19,7 @@
 #include "contents.h"
 #include "copy_file.h"
 #include "hash.h"
+#include "hash_cache.h"
 #include "prelink.h"
 #include "tree.h"
 #include "xarray.h"
@@ -28,7 +29,7 @@
 #define QCHECK_FORMAT "%[CATEGORY]%[PN]"
 #define QCHECK_FORMAT_VERBOSE "%[CATEGORY]%[PF]"
 
-#define QCHECK_FLAGS "F:s:uABHTPp" COMMON_FLAGS
+#define QCHECK_FLAGS "F:s:uABHTPpD" COMMON_FLAGS
 static struct option const qcheck_long_opts[] = {
 	{"format",          a_argument, NULL, 'F'},
 	{"skip",            a_argument, NULL, 's'},
@@ -39,6 +40,8 @@ static struct option const qcheck_long_opts[] = {
 	{"nomtime",        no_argument, NULL, 'T'},
 	{"skip-protected", no_argument, NULL, 'P'},
 	{"prelink",        no_argument, NULL, 'p'},
+	{"deep",           no_argument, NULL, 'D'},
+	JOBS_LONG_OPT,
 	COMMON_LONG_OPTS
 };
 static const char * const qcheck_opts_help[] = {
@@ -51,11 +54,14 @@ static const char * const qcheck_opts_help[] = {
 	"Ignore differing file mtimes",
 	"Ignore files in CONFIG_PROTECT-ed paths",
 	"Undo prelink when calculating checksums",
+	"Calculate all checksums, don't trust cached ones",
+	JOBS_OPT_HELP,
 	COMMON_OPTS_HELP
 };
 #define qcheck_usage(ret) usage(ret, QCHECK_FLAGS, qcheck_long_opts, qcheck_opts_help, NULL, lookup_applet_idx("qcheck"))
 
-#define qcprintf(fmt, args...) do { if (!state->bad_only) printf(_(fmt), ## args); } while (0)
+#define qcprintf(fmt, args...) \
+	do { if (!state->bad_only) fprintf(out, _(fmt), ## args); } while (0)
 
 struct qcheck_opt_state {
 	array_t *atoms;
@@ -67,19 +73,84 @@ struct qcheck_opt_state {
 	bool chk_mtime;
 	bool chk_config_protect;
 	bool undo_prelink;
+	bool deep;
+	hash_cache *hcache;
 	const char *fmt;
 };
 
+/* a CONTENTS entry, with what was found about the file it lists */
+struct qcheck_line {
+	char *buffer;           /* the line as it was, for updating CONTENTS */
+	contents_entry entry;
+	bool skip;              /* matched one of the --skip expressions */
+	int stat_errno;
+	struct stat st;
+	bool hashed;            /* digest was computed up front */
+	bool cached;            /* or taken from the hash cache */
+	char digest[40 + 1];    /* said digest, empty if that failed */
+};
+
+/* returns the hash algorithm a CONTENTS digest was made with, or 0 */
+static uint8_t
+qcheck_digest_algo(const char *digest)
+{
+	switch (strlen(digest)) {
+		case 32: return HASH_MD5;
+		case 40: return HASH_SHA1;
+		default: return 0;
+	}
+}
+
+/* number of files hashed in one batch */
+#define QCHECK_HASH_BATCH 256
+
+static void
+qcheck_hash_batch(int portroot_fd, hash_cache *hcache,
+		struct qcheck_line **todo, hash_file_ent *hents, size_t cnt,
+		int hashes)
+{
+	struct qcheck_line *l;
+	size_t i;
+
+	hash_multiple_files(portroot_fd, hents, cnt, hashes);
+	for (i = 0; i < cnt; i++) {
+		l = todo[i];
+		l->hashed = true;
+		l->digest[0] = '\0';
+		if (hents[i].ret != 0)
+			continue;
+		if (qcheck_digest_algo(l->entry.digest) == HASH_MD5) {
+			snprintf(l->digest, sizeof(l->digest), "%s", hents[i].md5);
+			hash_cache_store(hcache, l->entry.name, &l->st,
+					l->digest, NULL, NULL, NULL, NULL, NULL, HASH_MD5);
+		} else {
+			snprintf(l->digest, sizeof(l->digest), "%s", hents[i].sha1);
+			hash_cache_store(hcache, l->entry.name, &l->st,
+					NULL, l->digest, NULL, NULL, NULL, NULL, HASH_SHA1);
+		}
+	}
+}
+
 static int
 qcheck_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 {
 	struct qcheck_opt_state *state = priv;
+	int portroot_fd = pkg_ctx->cat_ctx->ctx->portroot_fd;
+	FILE *out = pkg_ctx->cat_ctx->out;
 	FILE *fp_contents_update;
 	size_t num_files;
 	size_t num_files_ok;
 	size_t num_files_unknown;
 	size_t num_files_ignored;
-	struct stat st;
+	size_t num_files_cached;
+	struct qcheck_line *lines;
+	struct qcheck_line *l;
+	struct qcheck_line *todo[QCHECK_HASH_BATCH];
+	hash_file_ent hents[QCHECK_HASH_BATCH];
+	size_t nlines;
+	size_t nhents;
+	size_t idx;
+	int hashes;
 	char *buffer;
 	char *line;
 	char *savep;
@@ -98,6 +169,7 @@ qcheck_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 
 	atom = tree_get_atom(pkg_ctx, false);
 	num_files = num_files_ok = num_files_unknown = num_files_ignored = 0;
+	num_files_cached = 0;
 	qcprintf("%sing %s ...\n",
 		(state->qc_update ? "Updat" : "Check"),
 		atom_format(state->fmt, atom));
@@ -108,9 +180,13 @@ qcheck_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 		mode_t mask;
 		int fd;
 
-		mask = umask(0077);
-		fd = mkstemp(tempfile);
-		umask(mask);
+		/* the umask is shared by all threads */
+#pragma omp critical(qcheck_umask)
+		{
+			mask = umask(0077);
+			fd = mkstemp(tempfile);
+			umask(mask);
+		}
 		if (fd == -1 || (fp_contents_update = fdopen(fd, "w+")) == NULL) {
 			if (fd >= 0)
 				close(fd);
@@ -126,18 +202,32 @@ qcheck_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 		makeargv(config_protect_mask, &cpm_argc, &cpm_argv);
 	}
 
-	buffer = NULL;
+	/* collect the entries and stat the files first, such that all
+	 * digests can be computed in one go, which allows reading the
+	 * files in batches, and hashing them as they come in */
+	for (nlines = 1, buffer = line; (buffer = strchr(buffer, '\n')); buffer++)
+		nlines++;
+	lines = xmalloc(sizeof(lines[0]) * nlines);
+	nlines = nhents = 0;
+	hashes = 0;
 	for (; (line = strtok_r(line, "\n", &savep)) != NULL; line = NULL) {
 		contents_entry *entry;
-		free(buffer);
-		buffer = xstrdup(line);
+		uint8_t hash_algo;
 
+		l = &lines[nlines];
+		l->buffer = xstrdup(line);
 		entry = contents_parse_line(line);
-		if (!entry)
+		if (!entry) {
+			free(l->buffer);
 			continue;
+		}
+		nlines++;
+		l->entry = *entry;
+		l->skip = false;
+		l->stat_errno = 0;
+		l->hashed = false;
+		l->cached = false;
 
-		/* run initial checks */
-		++num_files;
 		if (array_cnt(state->regex_arr)) {
 			size_t n;
 			regex_t *regex;
@@ -145,21 +235,70 @@ qcheck_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 				if (!regexec(regex, entry->name, 0, NULL, 0))
 					break;
 			if (n < array_cnt(state->regex_arr)) {
-				--num_files;
-				++num_files_ignored;
+				l->skip = true;
 				continue;
 			}
 		}
-		if (fstatat(pkg_ctx->cat_ctx->ctx->portroot_fd, entry->name + 1,
-					&st, AT_SYMLINK_NOFOLLOW))
+		if (fstatat(portroot_fd, entry->name + 1,
+					&l->st, AT_SYMLINK_NOFOLLOW) != 0)
 		{
+			l->stat_errno = errno;
+			continue;
+		}
+
+		/* prelink undoing runs an external command per file, which
+		 * is left to the serial path below */
+		hash_algo = entry->digest ? qcheck_digest_algo(entry->digest) : 0;
+		if (hash_algo && S_ISREG(l->st.st_mode) && !state->undo_prelink) {
+			/* the digest of a file that didn't change since it was
+			 * last computed needn't be computed again */
+			if (hash_cache_lookup(state->hcache, entry->name, &l->st,
+						l->digest, l->digest, NULL, NULL, NULL, NULL,
+						hash_algo))
+			{
+				l->hashed = true;
+				l->cached = true;
+				continue;
+			}
+			hents[nhents].name = entry->name + 1;
+			todo[nhents++] = l;
+			hashes |= hash_algo;
+			if (nhents == QCHECK_HASH_BATCH) {
+				qcheck_hash_batch(portroot_fd, state->hcache,
+						todo, hents, nhents, hashes);
+				nhents = 0;
+				hashes = 0;
+			}
+		}
+	}
+	if (nhents > 0)
+		qcheck_hash_batch(portroot_fd, state->hcache,
+				todo, hents, nhents, hashes);
+
+	for (idx = 0; idx < nlines; idx++) {
+		contents_entry *entry;
+		struct stat st;
+
+		l = &lines[idx];
+		entry = &l->entry;
+		buffer = l->buffer;
+		st = l->st;
+
+		/* run initial checks */
+		++num_files;
+		if (l->skip) {
+			--num_files;
+			++num_files_ignored;
+			continue;
+		}
+		if (l->stat_errno != 0) {
 			/* make sure file exists */
 			if (state->chk_afk) {
-				if (errno == ENOENT)
+				if (l->stat_errno == ENOENT)
 					qcprintf(" %sAFK%s: %s\n", RED, NORM, entry->name);
 				else
 					qcprintf(" %sERROR (%s)%s: %s\n", RED,
-							strerror(errno), NORM, entry->name);
+							strerror(l->stat_errno), NORM, entry->name);
 			} else {
 				--num_files;
 				++num_files_ignored;
@@ -211,12 +350,7 @@ qcheck_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 			 * Digest-check 1/3:
 			 * Should we check digests? */
 			char *f_digest;
-			uint8_t hash_algo;
-			switch (strlen(entry->digest)) {
-				case 32: hash_algo = HASH_MD5; break;
-				case 40: hash_algo = HASH_SHA1; break;
-				default: hash_algo = 0; break;
-			}
+			uint8_t hash_algo = qcheck_digest_algo(entry->digest);
 
 			if (!hash_algo) {
 				if (state->chk_hash) {
@@ -232,11 +366,16 @@ qcheck_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 				continue;
 			}
 
-			hash_cb_t hash_cb =
-				state->undo_prelink ? hash_cb_prelink_undo : NULL;
-			f_digest = hash_file_at_cb(
-					pkg_ctx->cat_ctx->ctx->portroot_fd,
-					entry->name + 1, hash_algo, hash_cb);
+			if (l->hashed) {
+				f_digest = l->digest[0] != '\0' ? l->digest : NULL;
+			} else {
+				hash_cb_t hash_cb =
+					state->undo_prelink ? hash_cb_prelink_undo : NULL;
+				/* serialise the forking off of prelink */
+#pragma omp critical(qcheck_prelink)
+				f_digest = hash_file_at_cb(portroot_fd,
+						entry->name + 1, hash_algo, hash_cb);
+			}
 
 			/* Digest-check 2/3:
 			 * Can we get a digest of the file? */
@@ -314,8 +453,12 @@ qcheck_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 			fprintf(fp_contents_update, "%s\n", buffer);
 
 		num_files_ok++;
+		if (l->cached)
+			num_files_cached++;
 	}
-	free(buffer);
+	for (idx = 0; idx < nlines; idx++)
+		free(lines[idx].buffer);
+	free(lines);
 
 	if (!state->chk_config_protect) {
 		freeargv(cp_argc, cp_argv);
@@ -349,10 +492,13 @@ qcheck_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 	}
 
 	if (state->bad_only && num_files_ok != num_files)
-		printf("%s\n", atom_format(state->fmt, atom));
+		fprintf(out, "%s\n", atom_format(state->fmt, atom));
 	qcprintf("  %2$s*%1$s %3$s%4$zu%1$s out of %3$s%5$zu%1$s file%6$s are good",
 		NORM, BOLD, BLUE, num_files_ok, num_files,
 		(num_files != 1 ? "s" : ""));
+	if (num_files_cached)
+		qcprintf(" (%2$s%3$zu%1$s verified by metadata)",
+			NORM, BLUE, num_files_cached);
 	if (num_files_unknown)
 		qcprintf(" (Unable to digest %2$s%3$zu%1$s file%4$s)",
 			NORM, BLUE, num_files_unknown,
@@ -387,11 +533,14 @@ int qcheck_main(int argc, char **argv)
 		.chk_mtime = true,
 		.chk_config_protect = true,
 		.undo_prelink = false,
+		.deep = false,
+		.hcache = NULL,
 		.fmt = NULL,
 	};
 
 	while ((ret = GETOPT_LONG(QCHECK, qcheck, "")) != -1) {
 		switch (ret) {
+		JOBS_GETOPTS_CASE
 		COMMON_GETOPTS_CASES(qcheck)
 		case 's': {
 			regex_t preg;
@@ -406,6 +555,7 @@ int qcheck_main(int argc, char **argv)
 		case 'T': state.chk_mtime = false;                   break;
 		case 'P': state.chk_config_protect = false;          break;
 		case 'p': state.undo_prelink = prelink_available();  break;
+		case 'D': state.deep = true;                         break;
 		case 'F': state.fmt = optarg;                        break;
 		}
 	}
@@ -426,14 +576,22 @@ int qcheck_main(int argc, char **argv)
 	vdb = tree_open_vdb(portroot, portvdb);
 	ret = -1;
 	if (vdb != NULL) {
+		/* when just checking some packages, the cache entries for the
+		 * rest must be retained */
+		if (!state.undo_prelink)
+			state.hcache = hash_cache_open(vdb->portroot_fd, portcachedir,
+					portvdb, state.deep, array_cnt(atoms) != 0);
 		if (array_cnt(atoms) != 0) {
 			ret = 0;
 			array_for_each(atoms, i, atom) {
-				ret |= tree_foreach_pkg_sorted(vdb, qcheck_cb, &state, atom);
+				ret |= tree_foreach_pkg_parallel(vdb, qcheck_cb, &state,
+						true, atom, jobs);
 			}
 		} else {
-			ret = tree_foreach_pkg_sorted(vdb, qcheck_cb, &state, NULL);
+			ret = tree_foreach_pkg_parallel(vdb, qcheck_cb, &state,
+					true, NULL, jobs);
 		}
+		hash_cache_close(state.hcache);
 		tree_close(vdb);
 	}
 	if (array_cnt(regex_arr) > 0) {
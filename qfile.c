@@ -18,10 +18,12 @@
 #include "atom.h"
 #include "basename.h"
 #include "contents.h"
+#include "contents_index.h"
 #include "rmspace.h"
+#include "set.h"
 #include "tree.h"
 
-#define QFILE_FLAGS "F:doRx:SP" COMMON_FLAGS
+#define QFILE_FLAGS "F:doRx:SPr" COMMON_FLAGS
 static struct option const qfile_long_opts[] = {
 	{"format",       a_argument, NULL, 'F'},
 	{"slots",       no_argument, NULL, 'S'},
@@ -30,6 +32,7 @@ static struct option const qfile_long_opts[] = {
 	{"orphans",     no_argument, NULL, 'o'},
 	{"exclude",      a_argument, NULL, 'x'},
 	{"skip-plibreg",no_argument, NULL, 'P'},
+	{"reindex",     no_argument, NULL, 'r'},
 	COMMON_LONG_OPTS
 };
 static const char * const qfile_opts_help[] = {
@@ -40,6 +43,7 @@ static const char * const qfile_opts_help[] = {
 	"List orphan files",
 	"Don't look in package <arg> (used with --orphans)",
 	"Don't look in the prunelib registry",
+	"Rebuild the file index, if enabled",
 	COMMON_OPTS_HELP
 };
 #define qfile_usage(ret) usage(ret, QFILE_FLAGS, qfile_long_opts, qfile_opts_help, NULL, lookup_applet_idx("qfile"))
@@ -74,8 +78,10 @@ struct qfile_opt_state {
 	bool orphans;
 	bool assume_root_prefix;
 	bool skip_plibreg;
+	bool reindex;
 	const char *format;
 	bool need_full_atom;
+	set *pkgs;
 };
 
 /*
@@ -176,6 +182,14 @@ static int qfile_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 	int found = 0;
 	size_t len;
 
+	/* with the file index, only packages that have a file with one of
+	 * the basenames we look for need to be checked */
+	if (state->pkgs != NULL) {
+		snprintf(state->buf, state->buflen, "%s/%s", catname, pkg_ctx->name);
+		if (contains_set(state->buf, state->pkgs) == NULL)
+			goto qlist_done;
+	}
+
 	/* If exclude_pkg is not NULL, check it.  We are looking for files
 	 * collisions, and must exclude one package. */
 	if (state->exclude_pkg) {
@@ -487,7 +501,9 @@ int qfile_main(int argc, char **argv)
 		.orphans = false,
 		.assume_root_prefix = false,
 		.skip_plibreg = false,
+		.reindex = false,
 		.format = NULL,
+		.pkgs = NULL,
 	};
 	int i, nb_of_queries, found = 0;
 	char *p;
@@ -501,6 +517,7 @@ int qfile_main(int argc, char **argv)
 			case 'o': state.orphans = true;             break;
 			case 'R': state.assume_root_prefix = true;  break;
 			case 'P': state.skip_plibreg = true;        break;
+			case 'r': state.reindex = true;             break;
 			case 'x':
 				if (state.exclude_pkg)
 					err("--exclude can only be used once.");
@@ -574,6 +591,20 @@ int qfile_main(int argc, char **argv)
 	if (nb_of_queries > 0) {
 		tree_ctx *vdb = tree_open_vdb(portroot, portvdb);
 		if (vdb != NULL) {
+			contents_index *cidx;
+
+			cidx = contents_index_open(vdb, portcachedir, state.reindex);
+			if (cidx != NULL) {
+				state.pkgs = create_set();
+				for (i = 0; i < state.args.length; i++) {
+					if (state.args.basenames[i] == NULL)
+						continue;
+					state.pkgs = contents_index_find(cidx,
+							state.args.basenames[i], state.pkgs);
+				}
+				contents_index_close(cidx);
+			}
+
 			found += tree_foreach_pkg_sorted(vdb, qfile_cb, &state, NULL);
 			tree_close(vdb);
 		}
@@ -605,6 +636,8 @@ int qfile_main(int argc, char **argv)
 	}
 
 	destroy_qfile_args(&state.args);
+	if (state.pkgs != NULL)
+		free_set(state.pkgs);
 	free(state.buf);
 	free(state.root);
 	free(state.real_root);
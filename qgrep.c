@@ -11,7 +11,9 @@
 #include "main.h"
 #include "applets.h"
 
+#include <ctype.h>
 #include <stdio.h>
+#include <string.h>
 #include <xalloc.h>
 #include <dirent.h>
 #include <sys/types.h>
@@ -63,67 +65,15 @@ static const char * const qgrep_opts_help[] = {
 };
 #define qgrep_usage(ret) usage(ret, QGREP_FLAGS, qgrep_long_opts, qgrep_opts_help, NULL, lookup_applet_idx("qgrep"))
 
-/* Circular list of line buffers for --before */
-typedef struct qgrep_buf {
-	char valid;
-	/* 1 when the line should be included in
-	 * a leading context, and 0 when it has already
-	 * been displayed, or is from a previous file. */
-	char buf[BUFSIZ];
-	struct qgrep_buf *next;
-} qgrep_buf_t;
-
-/* Allocate <length> buffers in a circular list.
- * <length> must be at least 1. */
-static qgrep_buf_t *
-qgrep_buf_list_alloc(const char length)
-{
-	char i;
-	qgrep_buf_t *head, *current;
-	current = head = xmalloc(sizeof(qgrep_buf_t));
-	for (i = 1; i < length; i++) {
-		current->next = xmalloc(sizeof(qgrep_buf_t));
-		current = current->next;
-	}
-	current->next = head;
-	return head;
-}
-
-/* Free a circular buffers list. */
-static void
-qgrep_buf_list_free(qgrep_buf_t *head)
-{
-	qgrep_buf_t *current, *next;
-	next = head;
-	do {
-		current = next;
-		next = current->next;
-		free(current);
-	} while (next != head);
-}
-
-/* Set valid=0 in the whole list. */
-static void
-qgrep_buf_list_invalidate(qgrep_buf_t *head)
-{
-	qgrep_buf_t *current;
-	current = head;
-	do {
-		current->valid = 0;
-		current = current->next;
-	} while (current != head);
-}
-
 /* Type for the str(case)str search functions */
 typedef char *(*QGREP_STR_FUNC) (const char *, const char *);
 
-/* Display a buffer, with an optionnal prefix. */
+/* Display a line, with an optionnal prefix. */
 static void
-qgrep_print_line(qgrep_buf_t *current, const char *label,
+qgrep_print_line(const char *p, const char *label,
 	const int line_number, const char zig, const regex_t* preg,
 	const QGREP_STR_FUNC searchfunc, const char* searchstr)
 {
-	char *p = current->buf;
 	/* Print line prefix, when in verbose mode */
 	if (label != NULL) {
 		printf("%s", label);
@@ -152,7 +102,7 @@ qgrep_print_line(qgrep_buf_t *current, const char *label,
 		}
 	} else if (searchfunc != NULL && searchstr != NULL) {
 		/* Iteration over substring matches, for color output. */
-		char *q;
+		const char *q;
 		int searchlen = strlen(searchstr);
 		while (searchlen && ((q = searchfunc(p, searchstr)) != NULL)) {
 			if (p < q)
@@ -164,33 +114,203 @@ qgrep_print_line(qgrep_buf_t *current, const char *label,
 	/* No color output (for context lines, or trailing portion
 	 * of matching lines). */
 	printf("%s\n", p);
-	/* Once a line has been displayed, it is not valid anymore */
-	current->valid = 0;
 }
-#define qgrep_print_context_line(buf, label, lineno) \
-	qgrep_print_line(buf, label, lineno, '-', NULL, NULL, NULL)
-#define qgrep_print_matching_line_nocolor(buf, label, lineno) \
-	qgrep_print_line(buf, label, lineno, ':', NULL, NULL, NULL)
-#define qgrep_print_matching_line_regcolor(buf, label, lineno, preg) \
-	qgrep_print_line(buf, label, lineno, ':', preg, NULL, NULL)
-#define qgrep_print_matching_line_strcolor(buf, label, lineno, searchfunc, searchstr) \
-	qgrep_print_line(buf, label, lineno, ':', NULL, searchfunc, searchstr)
-
-/* Display a leading context (valid lines of the buffers list, but the matching one). */
+#define qgrep_print_context_line(line, label, lineno) \
+	qgrep_print_line(line, label, lineno, '-', NULL, NULL, NULL)
+#define qgrep_print_matching_line_nocolor(line, label, lineno) \
+	qgrep_print_line(line, label, lineno, ':', NULL, NULL, NULL)
+#define qgrep_print_matching_line_regcolor(line, label, lineno, preg) \
+	qgrep_print_line(line, label, lineno, ':', preg, NULL, NULL)
+#define qgrep_print_matching_line_strcolor(line, label, lineno, searchfunc, searchstr) \
+	qgrep_print_line(line, label, lineno, ':', NULL, searchfunc, searchstr)
+
+/* Find the end of the line starting at p, and the start of the next.
+ * Like the fgets based reading this replaced, the end is the newline,
+ * or the last carriage return before it. */
+static char *
+qgrep_line_end(char *p, char *end, char **next)
+{
+	char *q;
+	char *r;
+
+	if ((q = memchr(p, '\n', end - p)) == NULL) {
+		q = end;
+		*next = end;
+	} else {
+		*next = q + 1;
+	}
+	if ((r = memrchr(p, '\r', q - p)) != NULL)
+		q = r;
+
+	return q;
+}
+
+/* Count the lines between p and q. */
+static int
+qgrep_count_lines(const char *p, const char *q)
+{
+	int n = 0;
+
+	while ((p = memchr(p, '\n', q - p)) != NULL) {
+		n++;
+		p++;
+	}
+
+	return n;
+}
+
+/* Display a leading context: the lines before the one at p, but those
+ * before shown (the start of the first line not displayed yet). */
 static void
-qgrep_print_before_context(qgrep_buf_t *current, const char num_lines_before,
+qgrep_print_before_context(char *p, char *shown, const char num_lines_before,
 	const char *label, const int match_line_number)
 {
-	int line_number;
-	line_number = match_line_number - num_lines_before;
-	while ((current = current->next)
-			&& (line_number < match_line_number)) {
-		if (current->valid)
-			qgrep_print_context_line(current, label, line_number);
-		line_number++;
+	char *starts[256];
+	char *match = p;
+	char *q;
+	char *eol;
+	char c;
+	int n;
+
+	for (n = 0; n < num_lines_before && p > shown; n++) {
+		q = memrchr(shown, '\n', (p - 1) - shown);
+		p = q == NULL ? shown : q + 1;
+		starts[n] = p;
+	}
+	while (n-- > 0) {
+		eol = qgrep_line_end(starts[n], match, &q);
+		c = *eol;
+		*eol = '\0';
+		qgrep_print_context_line(starts[n], label,
+				match_line_number > 0 ? match_line_number - n - 1 : -1);
+		*eol = c;
 	}
 }
 
+/* Extract the longest string any match of the regular expression re
+ * must contain, for lines without it need not be tried.  Only plain
+ * characters outside of groups count, those that are made optional by
+ * a repetition are dropped.  Returns the length of the string, or 0 when
+ * re has alternatives or is not understood. */
+static size_t
+qgrep_regex_literal(const char *re, int reflags, char *ret, size_t retsize)
+{
+	bool ere = (reflags & REG_EXTENDED) != 0;
+	bool icase = (reflags & REG_ICASE) != 0;
+	char run[BUFSIZ];
+	size_t runlen = 0;
+	size_t retlen = 0;
+	int depth = 0;
+	const char *p;
+	char c;
+	enum { LITERAL, REPEAT, OTHER } tok;
+
+	/* alternatives make for strings that are not required */
+	if (ere ? strchr(re, '|') != NULL : strstr(re, "\\|") != NULL)
+		return 0;
+
+	for (p = re; true; p++) {
+		c = *p;
+		tok = OTHER;
+		switch (c) {
+		case '\0':
+			break;
+		case '\\':
+			c = *++p;
+			if (c == '\0' || isalnum((int)c) || strchr("<>`'", c) != NULL)
+				return 0;  /* back-references and GNU extensions */
+			if (ere || strchr("()+?{}", c) == NULL) {
+				tok = LITERAL;
+			} else if (c == '(') {
+				depth++;
+			} else if (c == ')') {
+				depth--;
+			} else {
+				tok = REPEAT;
+				if (c == '{') {
+					if ((p = strstr(p, "\\}")) == NULL)
+						return 0;
+					p++;
+				}
+			}
+			break;
+		case '[':
+			/* bracket expression: [^]...] with [:class:] and alike */
+			p++;
+			if (*p == '^')
+				p++;
+			if (*p == ']')
+				p++;
+			for (; *p != ']'; p++) {
+				if (*p == '\0')
+					return 0;
+				if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+					char close[3] = { p[1], ']', '\0' };
+					if ((p = strstr(p + 2, close)) == NULL)
+						return 0;
+					p++;
+				}
+			}
+			break;
+		case '.':
+		case '^':
+		case '$':
+			break;
+		case '*':
+			tok = REPEAT;
+			break;
+		case '(':
+		case ')':
+		case '{':
+		case '+':
+		case '?':
+			if (!ere) {
+				tok = LITERAL;
+			} else if (c == '(') {
+				depth++;
+			} else if (c == ')') {
+				depth--;
+			} else {
+				tok = REPEAT;
+				if (c == '{' && (p = strchr(p, '}')) == NULL)
+					return 0;
+			}
+			break;
+		default:
+			tok = LITERAL;
+			break;
+		}
+
+		/* case-insensitive matching of multibyte characters is
+		 * beyond strcasestr */
+		if (tok == LITERAL && depth == 0 && runlen < sizeof(run) &&
+				!(icase && (c & 0x80)))
+		{
+			run[runlen++] = c;
+			continue;
+		}
+
+		/* the character before a repetition is optional, as are all
+		 * bytes of a multibyte one */
+		if (tok == REPEAT && runlen > 0) {
+			while (runlen > 1 && (run[runlen - 1] & 0xc0) == 0x80)
+				runlen--;
+			runlen--;
+		}
+		if (runlen > retlen && runlen < retsize) {
+			memcpy(ret, run, runlen);
+			retlen = runlen;
+			ret[retlen] = '\0';
+		}
+		runlen = 0;
+
+		if (*p == '\0')
+			break;
+	}
+
+	return retlen;
+}
+
 struct qgrep_grepargs {
 	bool do_count:1;
 	bool do_regex:1;
@@ -204,106 +324,185 @@ struct qgrep_grepargs {
 	char *skip_pattern;
 	char num_lines_before;
 	char num_lines_after;
-	qgrep_buf_t *buf_list;
 	regex_t skip_preg;
 	regex_t preg;
 	const char *query;
 	QGREP_STR_FUNC strfunc;
+	const char *needle;  /* what all matching lines contain, if known */
+	size_t needlelen;
+	char *data;          /* the file being searched */
+	size_t datasize;
 	depend_atom **include_atoms;
 	const char *portdir;
 };
 
+/* Read file (at fd) as a whole into the buffer kept in a. */
+static bool
+qgrep_read(int fd, const char *file, struct qgrep_grepargs *a, size_t *len)
+{
+	struct stat st;
+	ssize_t rlen;
+	int sfd;
+
+	sfd = openat(fd >= 0 ? fd : AT_FDCWD, file, O_RDONLY|O_CLOEXEC);
+	if (sfd < 0)
+		return false;
+	if (fstat(sfd, &st) != 0) {
+		close(sfd);
+		return false;
+	}
+
+	if (a->data == NULL || a->datasize <= (size_t)st.st_size) {
+		a->datasize = ((size_t)st.st_size + BUFSIZ) & ~(BUFSIZ - 1);
+		a->data = xrealloc(a->data, a->datasize);
+	}
+	for (*len = 0; *len < (size_t)st.st_size; *len += rlen) {
+		rlen = read(sfd, a->data + *len, (size_t)st.st_size - *len);
+		if (rlen <= 0)
+			break;
+	}
+	a->data[*len] = '\0';
+	close(sfd);
+
+	return true;
+}
+
+/* Find the needle from p on, returns end when it isn't there, or p when
+ * there is no needle and every line needs to be tried. */
+static char *
+qgrep_find(struct qgrep_grepargs *a, char *p, char *end)
+{
+	char *q;
+
+	if (a->needle == NULL)
+		return p;
+	if (a->strfunc == strstr) {
+		q = memmem(p, end - p, a->needle, a->needlelen);
+		return q == NULL ? end : q;
+	}
+	/* strcasestr stops at NUL bytes, search past them */
+	for (; p < end; p += strlen(p) + 1)
+		if ((q = strcasestr(p, a->needle)) != NULL)
+			return q;
+	return end;
+}
+
+/* Tell whether the line at p is to be reported, candidate is false when
+ * it is known not to contain the needle. */
+static bool
+qgrep_line_match(struct qgrep_grepargs *a, const char *p, bool candidate)
+{
+	const char *q;
+	bool found;
+
+	if (a->skip_comments) {
+		/* reject comments line ("^[ \t]*#") */
+		for (q = p; *q == ' ' || *q == '\t'; q++)
+			;
+		if (*q == '#')
+			return false;
+	}
+
+	if (a->skip_pattern) {
+		/* reject some other lines which match an
+		 * optional pattern */
+		if (!a->do_regex) {
+			if (a->strfunc(p, a->skip_pattern) != NULL)
+				return false;
+		} else {
+			if (regexec(&a->skip_preg, p, 0, NULL, 0) == 0)
+				return false;
+		}
+	}
+
+	/* four ways to match a line (with/without inversion
+	 * and regexp) */
+	if (!candidate)
+		found = false;
+	else if (a->do_regex == 0)
+		found = a->strfunc(p, a->query) != NULL;
+	else
+		found = regexec(&a->preg, p, 0, NULL, 0) == 0;
+
+	return found != a->invert_match;
+}
+
 static int
 qgrep_grepat(int fd, const char *file, const char *label,
 		struct qgrep_grepargs *a)
 {
-	FILE *newfp;
 	int need_separator = 0;
 	int count = 0;
 	int lineno = 0;
+	int n;
 	char remaining_after_context = 0;
 	char status = 1;
 	char *p;
+	char *q;
+	char *end;
+	char *eol;
+	char *next;
+	char *hit;
+	char *shown;
+	char c;
+	size_t len;
 	bool per_file_output;
+	bool do_lineno;
 
 	/* do we report results once per file or per line ? */
 	per_file_output =
 		a->do_count || (a->do_list && (!verbose || a->invert_list));
+	/* line numbers are only needed to print them, or context */
+	do_lineno = verbose > 1 || a->num_lines_before || a->num_lines_after;
 
-	if (fd >= 0) {
-		int sfd = openat(fd, file, O_RDONLY|O_CLOEXEC);
-		newfp = sfd >= 0 ? fdopen(sfd, "r") : NULL;
-	} else {
-		newfp = fopen(file, "r");
-	}
-	if (newfp == NULL)
+	if (!qgrep_read(fd, file, a, &len))
 		return status;
 
-	count = 0;
-	need_separator = 0;
-	/* whatever is in the circular buffers list is no more a
-	 * valid context */
-	qgrep_buf_list_invalidate(a->buf_list);
-
-	/* reading a new line always happen in the next buffer
-	 * of the list */
-	while ((a->buf_list = a->buf_list->next) &&
-			fgets(a->buf_list->buf, sizeof(a->buf_list->buf), newfp))
-	{
-		lineno++;
-		a->buf_list->valid = 1;
-
-		/* cleanup EOL */
-		if ((p = strrchr(a->buf_list->buf, '\n')) != NULL)
-			*p = 0;
-		if ((p = strrchr(a->buf_list->buf, '\r')) != NULL)
-			*p = 0;
-
-		if (a->skip_comments) {
-			/* reject comments line ("^[ \t]*#") */
-			p = a->buf_list->buf;
-			while (*p == ' ' || *p == '\t') p++;
-			if (*p == '#')
-				goto print_after_context;
-		}
-
-		if (a->skip_pattern) {
-			/* reject some other lines which match an
-			 * optional pattern */
-			if (!a->do_regex) {
-				if (a->strfunc(a->buf_list->buf, a->skip_pattern) != NULL)
-					goto print_after_context;
-			} else {
-				if (regexec(&a->skip_preg, a->buf_list->buf,
-							0, NULL, 0) == 0)
-					goto print_after_context;
+	/* the file is searched as a whole for the needle, lines are only
+	 * looked at where it is found, unless all lines are of interest
+	 * such as for inverted matches and trailing context */
+	p = shown = a->data;
+	end = p + len;
+	hit = NULL;
+	while (p < end) {
+		if (hit == NULL || hit < p)
+			hit = qgrep_find(a, p, end);
+		if (!a->invert_match && remaining_after_context == 0 && hit > p) {
+			if (hit == end)
+				break;
+			q = memrchr(p, '\n', hit - p);
+			if (q != NULL) {
+				q++;
+				if (do_lineno) {
+					n = qgrep_count_lines(p, q);
+					lineno += n;
+					if (!status)
+						need_separator += n;
+				}
+				p = q;
 			}
 		}
 
-		/* four ways to match a line (with/without inversion
-		 * and regexp) */
-		if (!a->invert_match) {
-			if (a->do_regex == 0) {
-				if (a->strfunc(a->buf_list->buf, a->query) == NULL)
-					goto print_after_context;
-			} else {
-				if (regexec(&a->preg, a->buf_list->buf, 0, NULL, 0) != 0)
-					goto print_after_context;
-			}
-		} else {
-			if (a->do_regex == 0) {
-				if (a->strfunc(a->buf_list->buf, a->query) != NULL)
-					goto print_after_context;
-			} else {
-				if (regexec(&a->preg, a->buf_list->buf, 0, NULL, 0) == 0)
-					goto print_after_context;
-			}
-		}
+		eol = qgrep_line_end(p, end, &next);
+		lineno++;
+		c = *eol;
+		*eol = '\0';
+
+		/* an empty needle is found at the end of an empty line too */
+		if (!qgrep_line_match(a, p,
+					hit < eol || (hit == eol && a->needlelen == 0)))
+			goto print_after_context;
 
 		count++;
 		status = 0; /* got a match, exit status should be 0 */
-		if (per_file_output)
-			continue;
+		if (per_file_output) {
+			/* the first match decides for --list */
+			if (!a->do_count) {
+				*eol = c;
+				break;
+			}
+			goto next_line;
+		}
 		/* matching files are listed out of this loop */
 
 		if ((need_separator > 0)
@@ -314,18 +513,18 @@ qgrep_grepat(int fd, const char *file, const char *label,
 		need_separator = 0 - a->num_lines_before;
 		if (!a->do_list) {
 			/* print the leading context */
-			qgrep_print_before_context(a->buf_list,
+			qgrep_print_before_context(p, shown,
 					a->num_lines_before, label,
 					((verbose > 1) ? lineno : -1));
 			/* print matching line */
 			if (a->invert_match || *RED == '\0')
-				qgrep_print_matching_line_nocolor(a->buf_list, label,
+				qgrep_print_matching_line_nocolor(p, label,
 						((verbose > 1) ? lineno : -1));
 			else if (a->do_regex)
-				qgrep_print_matching_line_regcolor(a->buf_list, label,
+				qgrep_print_matching_line_regcolor(p, label,
 						((verbose > 1) ? lineno : -1), &a->preg);
 			else
-				qgrep_print_matching_line_strcolor(a->buf_list, label,
+				qgrep_print_matching_line_strcolor(p, label,
 						((verbose > 1) ? lineno : -1), a->strfunc,
 						a->query);
 		} else {
@@ -336,9 +535,10 @@ qgrep_grepat(int fd, const char *file, const char *label,
 				printf(":%d", lineno);
 			putchar('\n');
 		}
+		shown = next;
 		/* init count down of trailing context lines */
 		remaining_after_context = a->num_lines_after;
-		continue;
+		goto next_line;
 
 print_after_context:
 		/* print some trailing context lines when needed */
@@ -349,12 +549,16 @@ print_after_context:
 				 * the next one */
 				++need_separator;
 		} else {
-			qgrep_print_context_line(a->buf_list, label,
+			qgrep_print_context_line(p, label,
 					((verbose > 1) ? lineno : -1));
+			shown = next;
 			--remaining_after_context;
 		}
+
+next_line:
+		*eol = c;
+		p = next;
 	}
-	fclose(newfp);
 	if (per_file_output) {
 		/* matches were already displayed, line per line */
 		if (a->do_count && count) {
@@ -445,6 +649,7 @@ int qgrep_main(int argc, char **argv)
 	char status = 1;
 	size_t n;
 	char *overlay;
+	char needle[BUFSIZ];
 
 	struct qgrep_grepargs args = {
 		.do_count = false,
@@ -458,9 +663,12 @@ int qgrep_main(int argc, char **argv)
 		.skip_pattern = NULL,
 		.num_lines_before = 0,
 		.num_lines_after = 0,
-		.buf_list = NULL,
 		.query = NULL,
 		.strfunc = strstr,
+		.needle = NULL,
+		.needlelen = 0,
+		.data = NULL,
+		.datasize = 0,
 		.include_atoms = NULL,
 		.portdir = NULL,
 	};
@@ -582,8 +790,16 @@ int qgrep_main(int argc, char **argv)
 	}
 	args.query = argv[optind];
 
-	/* allocate a circular buffers list for --before */
-	args.buf_list = qgrep_buf_list_alloc(args.num_lines_before + 1);
+	/* what to search files for, before looking at lines */
+	if (!args.do_regex) {
+		args.needle = args.query;
+		args.needlelen = strlen(args.query);
+	} else {
+		args.needlelen = qgrep_regex_literal(args.query, reflags,
+				needle, sizeof(needle));
+		if (args.needlelen > 0)
+			args.needle = needle;
+	}
 
 	array_for_each(overlays, n, overlay) {
 		args.portdir = overlay;
@@ -652,7 +868,7 @@ int qgrep_main(int argc, char **argv)
 				atom_implode(args.include_atoms[i]);
 		free(args.include_atoms);
 	}
-	qgrep_buf_list_free(args.buf_list);
+	free(args.data);
 
 	return status;
 }
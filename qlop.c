@@ -16,10 +16,15 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "atom.h"
 #include "eat_file.h"
+#include "emerge_log.h"
+#include "emerge_stats.h"
+#include "rmspace.h"
 #include "scandirat.h"
 #include "set.h"
 #include "xarray.h"
@@ -27,7 +32,7 @@
 
 #define QLOP_DEFAULT_LOGFILE "emerge.log"
 
-#define QLOP_FLAGS "ctaHMmuUsElerd:f:w:F:" COMMON_FLAGS
+#define QLOP_FLAGS "ctaHMmuUsElerpGd:f:w:F:" COMMON_FLAGS
 static struct option const qlop_long_opts[] = {
 	{"summary",   no_argument, NULL, 'c'},
 	{"time",      no_argument, NULL, 't'},
@@ -41,11 +46,14 @@ static struct option const qlop_long_opts[] = {
 	{"emerge",    no_argument, NULL, 'E'},
 	{"endtime",   no_argument, NULL, 'e'},
 	{"running",   no_argument, NULL, 'r'},
+	{"predict",   no_argument, NULL, 'p'},
+	{"group",     no_argument, NULL, 'G'},
 	{"date",       a_argument, NULL, 'd'},
 	{"lastmerge", no_argument, NULL, 'l'},
 	{"logfile",    a_argument, NULL, 'f'},
 	{"atoms",      a_argument, NULL, 'w'},
 	{"format",     a_argument, NULL, 'F'},
+	JOBS_LONG_OPT,
 	COMMON_LONG_OPTS
 };
 static const char * const qlop_opts_help[] = {
@@ -61,11 +69,15 @@ static const char * const qlop_opts_help[] = {
 	"Show last merge similar to how emerge(1) -v would show it",
 	"Report time at which the operation finished (iso started)",
 	"Show current emerging packages",
+	"Predict merge times of atoms (read from stdin if none given)",
+	"Report -a, -c or -p per logfile when reading multiple logfiles",
 	"Limit selection to this time (1st -d is start, 2nd -d is end)",
 	"Limit selection to last Portage emerge action",
-	"Read emerge logfile instead of $EMERGE_LOG_DIR/" QLOP_DEFAULT_LOGFILE,
+	"Read emerge logfile(s) or directory of logfiles instead of "
+		"$EMERGE_LOG_DIR/" QLOP_DEFAULT_LOGFILE,
 	"Read package atoms to report from file",
 	"Print matched atom using given format string",
+	JOBS_OPT_HELP,
 	COMMON_OPTS_HELP
 };
 static const char qlop_desc[] =
@@ -91,6 +103,8 @@ struct qlop_mode {
 	char do_endtime:1;
 	char show_lastmerge:1;
 	char show_emerge:1;
+	char do_predict:1;
+	char do_group:1;
 	const char *fmt;
 };
 
@@ -358,7 +372,106 @@ portage never got interrupted in a way where it could not write its
 interruption to the log.  Unfortunately these scenarios happen a lot.
 As such, we can try to remedy this somewhat by using a rule of thumb
 that currently merging packages need to be withinin the last 10 days.
+
+To avoid reading and parsing the entire log each time, the lines of
+interest are kept in an index when possible (see libq/emerge_log.c).
+Those are taken from the index, only reading the line itself when it
+is necessary, after which the remainder of the log not yet covered by
+the index is read as usual.
 */
+
+/* returns whether a (un)merge of pkg (CAT/PN) can be of interest given
+ * the atoms searched for, such that the line doesn't need reading */
+static bool
+qlop_pkg_wanted(const char *pkg, array_t *atoms, set *atomset)
+{
+	depend_atom *atomw;
+	const char *pn;
+	size_t i;
+
+	if (pkg == NULL)
+		return false;
+	if (atomset != NULL)
+		return get_set(pkg, atomset) != NULL;
+
+	pn = strrchr(pkg, '/');
+	pn = pn == NULL ? pkg : pn + 1;
+	array_for_each(atoms, i, atomw) {
+		/* blockers invert matching, so leave it to atom_compare */
+		if (atomw->blocker != ATOM_BL_NONE || atomw->PN == NULL ||
+				strcmp(atomw->PN, pn) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* returns a reader for the log open at fd from offset off on, compressed
+ * logs are read from the start by running the decompressor on them */
+static emerge_log_reader *
+qlop_log_reader(int fd, const char *zcmd, FILE **zfp, off_t off)
+{
+	char cmd[64];
+
+	if (zcmd == NULL)
+		return emerge_log_reader_open(fd, off);
+
+	if (*zfp != NULL)
+		pclose(*zfp);
+	*zfp = NULL;
+	if (lseek(fd, 0, SEEK_SET) != 0)
+		return NULL;
+	/* shells need not support multi-digit descriptors in redirections,
+	 * which are common when reading logs in parallel */
+	if (fd < 10)
+		snprintf(cmd, sizeof(cmd), "%s <&%d", zcmd, fd);
+	else
+		snprintf(cmd, sizeof(cmd), "%s </dev/fd/%d", zcmd, fd);
+	/* logs are opened close-on-exec, such that the decompressors run
+	 * for other logs in parallel don't inherit them, only this one may
+	 * see fd while it is started */
+#pragma omp critical(qlop_popen)
+	{
+		fcntl(fd, F_SETFD, 0);
+		*zfp = popen(cmd, "r");
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	if (*zfp == NULL)
+		return NULL;
+
+	return emerge_log_reader_open(fileno(*zfp), 0);
+}
+
+/* retrieves the expected and longest duration of an operation on atom,
+ * known as pkg in averages, or from the merge statistics if available */
+static bool
+qlop_durations(
+		emerge_stats *stats,
+		enum emerge_stats_kind kind,
+		depend_atom *atom,
+		set *averages,
+		const char *pkg,
+		time_t *avgtime,
+		time_t *longtime)
+{
+	const emerge_stats_ent *e;
+	struct pkg_match *pm;
+
+	if (stats != NULL) {
+		if ((e = emerge_stats_get(stats, kind, atom)) == NULL)
+			return false;
+		*avgtime = (time_t)emerge_stats_predict(e);
+		*longtime = (time_t)e->max;
+	} else {
+		if ((pm = get_set(pkg, averages)) == NULL)
+			return false;
+		*avgtime = pm->time / pm->cnt;
+		*longtime = pm->tbegin;
+	}
+
+	return true;
+}
+
 static int do_emerge_log(
 		const char *log,
 		struct qlop_mode *flags,
@@ -366,7 +479,9 @@ static int do_emerge_log(
 		time_t tbegin,
 		time_t tend)
 {
-	FILE *fp;
+	int fd;
+	FILE *zfp = NULL;
+	const char *zcmd;
 	char buf[BUFSIZ];
 	char *p;
 	char *q;
@@ -393,6 +508,22 @@ static int do_emerge_log(
 	char afmt[BUFSIZ];
 	struct pkg_match *pkg;
 	struct pkg_match *pkgw;
+	emerge_log_index *idx = NULL;
+	emerge_stats *stats = NULL;
+	emerge_log_reader *rd;
+	const emerge_log_ev *ev = NULL;
+	const char *evpkg;
+	const char *line;
+	const char *rest;
+	size_t len;
+	int64_t ltime;
+	enum emerge_log_ev_type type;
+	size_t evn;
+	size_t evcnt = 0;
+	off_t logend = 0;
+	int64_t lasttime;
+	int root_fd;
+	int ret = 0;
 #define strpfx(X, Y)  strncmp(X, Y, sizeof(Y) - 1)
 
 	/* support relative path in here and now, when using ROOT, stick to
@@ -401,64 +532,99 @@ static int do_emerge_log(
 		snprintf(buf, sizeof(buf), "%s", log);
 	else
 		snprintf(buf, sizeof(buf), "%s%s", portroot, log);
-	if ((fp = fopen(buf, "r")) == NULL)
+	if ((fd = open(buf, O_RDONLY | O_CLOEXEC)) == -1)
 	{
 		warnp("Could not open logfile '%s'", log);
 		return 1;
 	}
 
+	/* rotated logs may be compressed, which can only be streamed,
+	 * plain logs can be indexed */
+	zcmd = emerge_log_decompressor(fd);
+	root_fd = -1;
+	if (zcmd == NULL)
+		root_fd = open(portroot, O_RDONLY | O_CLOEXEC | O_PATH);
+	if (root_fd != -1) {
+		idx = emerge_log_index_open(root_fd, portcachedir, buf, fd);
+		/* predict running merges from the statistics */
+		if (flags->do_predict && flags->do_running)
+			stats = emerge_stats_open(root_fd, portcachedir, buf, fd);
+		close(root_fd);
+	}
+	if (idx != NULL) {
+		evcnt = emerge_log_index_cnt(idx);
+		logend = emerge_log_index_end(idx);
+	}
+	if ((rd = qlop_log_reader(fd, zcmd, &zfp, logend)) == NULL) {
+		warnp("Could not read logfile '%s'", log);
+		if (idx != NULL)
+			emerge_log_index_close(idx);
+		close(fd);
+		return 1;
+	}
+
+	/* without atoms, the list of packages is only of use when reporting
+	 * (un)merges */
 	all_atoms = array_cnt(atoms) == 0;
-	if (all_atoms || flags->show_lastmerge) {
+	if ((all_atoms && (flags->do_merge ||
+					flags->do_unmerge || flags->do_autoclean)) ||
+			flags->show_lastmerge)
+	{
 		atomset = create_set();
 
+		/* the indexed part of the log, only lines from tbegin on can
+		 * pass the date selection */
+		evn = idx == NULL ? 0 : emerge_log_index_find(idx, tbegin);
+
 		/* assemble list of atoms */
-		while (fgets(buf, sizeof(buf), fp) != NULL) {
-			if ((p = strchr(buf, ':')) == NULL)
-				continue;
-			*p++ = '\0';
+		while (true) {
+			if (evn < evcnt) {
+				ev = emerge_log_index_ev(idx, evn++);
+				tstart = (time_t)ev->time;
+				type = (enum emerge_log_ev_type)ev->type;
+				evpkg = emerge_log_index_pkg(idx, ev);
+			} else {
+				if (idx != NULL && evn++ == evcnt &&
+						emerge_log_index_lasttime(idx, &lasttime))
+					tstart = (time_t)lasttime;  /* last line of index */
+				if (!emerge_log_reader_next(rd, &line, &len))
+					break;
+				if (!emerge_log_line_time(line, len, &ltime, &rest))
+					continue;
 
-			tstart = atol(buf);
+				tstart = (time_t)ltime;
+				len -= rest - line;
+				type = emerge_log_line_type(rest, len);
+				evpkg = NULL;
+				if (tstart >= tbegin && tstart <= tend &&
+						(type == EMERGE_LOG_MERGE_START ||
+						 type == EMERGE_LOG_UNMERGE_START ||
+						 type == EMERGE_LOG_AUTOCLEAN_START))
+				{
+					memcpy(buf, rest, len);
+					buf[len] = '\0';
+					if (emerge_log_line_pkg(buf, type, afmt, sizeof(afmt)))
+						evpkg = afmt;
+				}
+			}
 			if (tstart < tbegin || tstart > tend)
 				continue;
 
 			if (flags->show_lastmerge) {
-				if (strpfx(p, "  *** emerge ") == 0)
+				if (type == EMERGE_LOG_EMERGE)
 					tstart_emerge = tstart;
 				if (!all_atoms)
 					continue;
 			}
 
-			atom = NULL;
-			if (strpfx(p, "  >>> emerge ") == 0 &&
-					(q = strchr(p + 13, ')')) != NULL)
-			{
-				p = q + 2;
-				q = strchr(p, ' ');
-				if (q != NULL) {
-					*q = '\0';
-					atom = atom_explode(p);
-				}
-			} else if (strpfx(p, "  === Unmerging... (") == 0 ||
-					strpfx(p, " === Unmerging... (") == 0)
+			if (evpkg != NULL && (type == EMERGE_LOG_MERGE_START ||
+						type == EMERGE_LOG_UNMERGE_START ||
+						type == EMERGE_LOG_AUTOCLEAN_START))
 			{
-				if (p[1] == ' ')
-					p++;
-				p += 19;
-				q = strchr(p, ')');
-				if (q != NULL) {
-					*q = '\0';
-					atom = atom_explode(p);
-				}
-			}
-			if (atom != NULL) {
-				/* strip off version info, if we generate a list
-				 * ourselves, we will always print everything, so as
-				 * well can keep memory footprint a bit lower by only
-				 * having package matches */
-				atom->PV = NULL;
-				atom->PVR = NULL;
-				atom->PR_int = 0;
-				snprintf(afmt, sizeof(afmt), "%s/%s", atom->CATEGORY, atom->PN);
+				/* if we generate a list ourselves, we will always
+				 * print everything, so only package matches (without
+				 * version) are kept */
+				atom = atom_intern(evpkg);
 
 				/* now we found a package, register this merge as a
 				 * "valid" one, such that dummy emerge calls (e.g.
@@ -475,13 +641,15 @@ static int do_emerge_log(
 					last_merge = tstart_emerge;
 				}
 
-				atomw = add_set_value(afmt, atom, atomset);
+				atomw = add_set_value(evpkg, atom, atomset);
 				if (atomw != NULL)
 					atom_implode(atom);
 			}
 		}
 
-		rewind(fp);
+		emerge_log_reader_close(rd);
+		if ((rd = qlop_log_reader(fd, zcmd, &zfp, logend)) == NULL)
+			warnp("Could not read logfile '%s'", log);
 	}
 
 	if (flags->show_lastmerge) {
@@ -489,28 +657,50 @@ static int do_emerge_log(
 		tend = tstart;
 	}
 
-	/* loop over lines searching for atoms */
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		if ((p = strchr(buf, ':')) == NULL)
-			continue;
-		*p++ = '\0';
+	/* loop over lines searching for atoms, unless we need to track
+	 * running merges, indexed lines before tbegin don't matter */
+	evn = idx == NULL || flags->do_running ?
+		0 : emerge_log_index_find(idx, tbegin);
+	while (true) {
+		if (evn < evcnt) {
+			ev = emerge_log_index_ev(idx, evn++);
+			/* account for the lines not in the index */
+			if (ev->maxprev > tlast)
+				tlast = (time_t)ev->maxprev;
+			/* from here on, no line can pass the date selection */
+			if (tlast > tend && !flags->do_running)
+				break;
+			tstart = (time_t)ev->time;
+			type = (enum emerge_log_ev_type)ev->type;
+		} else {
+			if (idx != NULL && evn++ == evcnt &&
+					emerge_log_index_maxtime(idx) > tlast)
+				tlast = (time_t)emerge_log_index_maxtime(idx);
+			if (rd == NULL || !emerge_log_reader_next(rd, &line, &len))
+				break;
+			if (!emerge_log_line_time(line, len, &ltime, &rest))
+				continue;
 
-		tstart = atol(buf);
+			ev = NULL;
+			tstart = (time_t)ltime;
+			type = emerge_log_line_type(rest, len - (rest - line));
+		}
 
 		/* keeping track of parallel merges needs to be done before
 		 * applying dates, for a subset of the log might show emerge
 		 * finished without knowledge of another instance */
 		if (flags->do_running &&
-				(strpfx(p, "  *** emerge ") == 0 ||
-				 strpfx(p, "  *** exiting ") == 0 ||
-				 strpfx(p, "  *** terminating.") == 0))
+				(type == EMERGE_LOG_EMERGE ||
+				 type == EMERGE_LOG_EXITING ||
+				 type == EMERGE_LOG_TERMINATING))
 		{
-			if (p[7] == 'm') {
+			if (type == EMERGE_LOG_EMERGE) {
 				parallel_emerge++;
 			} else if (parallel_emerge > 0) {
-				if (p[7] != 'e' || (tstart - 4) <= last_exit)
+				if (type != EMERGE_LOG_TERMINATING ||
+						(tstart - 4) <= last_exit)
 					parallel_emerge--;
-				if (p[7] == 'x')
+				if (type == EMERGE_LOG_EXITING)
 					last_exit = tstart;
 			}
 
@@ -542,8 +732,74 @@ static int do_emerge_log(
 		if (tstart < tlast)
 			continue;
 		tlast = tstart;
-		if (tstart < tbegin || tstart > tend)
+		if (tstart > tend) {
+			/* all that follows is either older than this, or beyond
+			 * tend as well, a decompressor wants to finish though */
+			if (!flags->do_running && zfp == NULL)
+				break;
+			continue;
+		}
+		if (tstart < tbegin)
+			continue;
+
+		/* retrieve lines only when they can be of use, for indexed
+		 * lines we know what package they are about without reading
+		 * them */
+		evpkg = ev == NULL ? NULL : emerge_log_index_pkg(idx, ev);
+		switch (type) {
+			case EMERGE_LOG_EMERGE:
+				if (!flags->show_emerge || !verbose)
+					continue;
+				break;
+			case EMERGE_LOG_SYNC_START:
+			case EMERGE_LOG_SYNC_END:
+				if (!flags->do_sync)
+					continue;
+				break;
+			case EMERGE_LOG_MERGE_START:
+				if (!flags->do_merge || (ev != NULL &&
+							!qlop_pkg_wanted(evpkg, atoms, atomset)))
+					continue;
+				break;
+			case EMERGE_LOG_MERGE_END:
+				if (!flags->do_merge || array_cnt(merge_matches) == 0 ||
+						(ev != NULL &&
+						 !qlop_pkg_wanted(evpkg, atoms, atomset)))
+					continue;
+				break;
+			case EMERGE_LOG_UNMERGE_START:
+				if (!flags->do_unmerge || (ev != NULL &&
+							!qlop_pkg_wanted(evpkg, atoms, atomset)))
+					continue;
+				break;
+			case EMERGE_LOG_AUTOCLEAN_START:
+				if (!flags->do_autoclean || (ev != NULL &&
+							(evpkg == NULL || (!flags->show_emerge &&
+								!qlop_pkg_wanted(evpkg, atoms, atomset)))))
+					continue;
+				break;
+			case EMERGE_LOG_UNMERGE_END:
+				if ((!flags->do_unmerge && !flags->do_autoclean) ||
+						array_cnt(unmerge_matches) == 0 ||
+						(ev != NULL &&
+						 !qlop_pkg_wanted(evpkg, atoms, atomset)))
+					continue;
+				break;
+			default:
+				continue;
+		}
+
+		if (ev != NULL) {
+			len = ev->len;
+			if (pread(fd, buf, len, (off_t)ev->off) != (ssize_t)len)
+				continue;
+		} else {
+			memcpy(buf, line, len);
+		}
+		buf[len] = '\0';
+		if ((p = strchr(buf, ':')) == NULL)
 			continue;
+		*p++ = '\0';
 
 		/* are we interested in this line? */
 		if (flags->show_emerge && verbose && (strpfx(p, "  *** emerge ") == 0))
@@ -697,7 +953,7 @@ static int do_emerge_log(
 					continue;
 
 				*p = '\0';
-				atom = atom_explode(q);
+				atom = atom_intern(q);
 				*p = ' ';
 				if (atom == NULL)
 					continue;
@@ -832,7 +1088,7 @@ static int do_emerge_log(
 					continue;
 
 				*q = '\0';
-				atom = atom_explode(p);
+				atom = atom_intern(p);
 				if (atom == NULL)
 					continue;
 
@@ -946,9 +1202,22 @@ static int do_emerge_log(
 			}
 		}
 	}
-	fclose(fp);
+	if (rd != NULL)
+		emerge_log_reader_close(rd);
+	if (zfp != NULL && pclose(zfp) != 0) {
+		warn("Could not decompress logfile '%s' using %s", log, zcmd);
+		ret = 1;
+	}
+	close(fd);
+	if (idx != NULL)
+		emerge_log_index_close(idx);
 	if (flags->do_running) {
 		time_t cutofftime;
+		time_t avgtime;
+		time_t longtime;
+		time_t critical = 0;
+		size_t ncritical = 0;
+		size_t nrunning = 0;
 		set *pkgs_seen = create_set();
 
 		tstart = time(NULL);
@@ -999,14 +1268,15 @@ static int do_emerge_log(
 				continue;
 
 			elapsed = tstart - pkgw->tbegin;
-			pkg = get_set(afmt, merge_averages);
-			if (pkg != NULL) {
-				maxtime = pkg->time / pkg->cnt;
+			if (qlop_durations(stats, EMERGE_STATS_MERGE, pkgw->atom,
+						merge_averages, afmt, &avgtime, &longtime))
+			{
+				maxtime = avgtime;
 				/* add 14% of the diff between avg and max, to avoid
 				 * frequently swapping to maxtime */
-				maxtime += (pkg->tbegin - maxtime) / 7;
+				maxtime += (longtime - maxtime) / 7;
 				if (elapsed >= maxtime) {
-					maxtime = pkg->tbegin;
+					maxtime = longtime;
 					if (elapsed >= maxtime)
 						maxtime -= elapsed;
 					isMax = true;
@@ -1033,6 +1303,14 @@ static int do_emerge_log(
 						fmt_date(flags, pkgw->tbegin, 0),
 						atom_format(flags->fmt, pkgw->atom));
 			}
+			/* running merges happen in parallel, so all of them are
+			 * done when the one that takes longest is */
+			nrunning++;
+			if (maxtime > 0) {
+				if (maxtime - elapsed > critical)
+					critical = maxtime - elapsed;
+				ncritical++;
+			}
 			if (maxtime < 0)
 				printf("... +%s\n", fmt_elapsedtime(flags, -maxtime));
 			else
@@ -1061,11 +1339,12 @@ static int do_emerge_log(
 				continue;
 
 			elapsed = tstart - pkgw->tbegin;
-			pkg = get_set(afmt, unmerge_averages);
-			if (pkg != NULL) {
-				maxtime = pkg->time / pkg->cnt;
+			if (qlop_durations(stats, EMERGE_STATS_UNMERGE, pkgw->atom,
+						unmerge_averages, afmt, &avgtime, &longtime))
+			{
+				maxtime = avgtime;
 				if (elapsed >= maxtime) {
-					maxtime = pkg->tbegin;
+					maxtime = longtime;
 					if (elapsed >= maxtime)
 						maxtime -= elapsed;
 					isMax = true;
@@ -1082,6 +1361,12 @@ static int do_emerge_log(
 						fmt_date(flags, pkgw->tbegin, 0),
 						atom_format(flags->fmt, pkgw->atom));
 			}
+			nrunning++;
+			if (maxtime > 0) {
+				if (maxtime - elapsed > critical)
+					critical = maxtime - elapsed;
+				ncritical++;
+			}
 			if (maxtime < 0)
 				printf("... +%s\n", fmt_elapsedtime(flags, -maxtime));
 			else
@@ -1092,6 +1377,10 @@ static int do_emerge_log(
 							isMax ? " (longest run)" : " (average run)" : "");
 		}
 		free_set(pkgs_seen);
+		if (flags->do_predict && nrunning > 0)
+			printf("%stotal%s: ETA: %s\n", BLUE, NORM,
+					ncritical == 0 ? "unknown" :
+						fmt_elapsedtime(flags, critical));
 	} else if (flags->do_average) {
 		size_t total_merges = 0;
 		size_t total_unmerges = 0;
@@ -1165,6 +1454,7 @@ static int do_emerge_log(
 	}
 	free_set(merge_averages);
 	free_set(unmerge_averages);
+	emerge_stats_close(stats);
 	array_for_each_rev(merge_matches, i, pkgw) {
 		atom_implode(pkgw->atom);
 		xarraydelete(merge_matches, i);
@@ -1183,7 +1473,399 @@ static int do_emerge_log(
 		xarrayfree_int(t);
 		free_set(atomset);
 	}
-	return 0;
+	return ret;
+}
+
+/* computes the statistics of the (un)merges and syncs in log, which are
+ * kept up to date in Q_CACHEDIR when possible, returns NULL when the
+ * log cannot be read */
+static emerge_stats *
+qlop_log_stats(const char *log, int root_fd)
+{
+	int fd;
+	FILE *zfp = NULL;
+	const char *zcmd;
+	char buf[BUFSIZ];
+	emerge_stats *stats = NULL;
+	emerge_log_reader *rd;
+	const char *line;
+	size_t len;
+
+	if (portroot[1] == '\0')
+		snprintf(buf, sizeof(buf), "%s", log);
+	else
+		snprintf(buf, sizeof(buf), "%s%s", portroot, log);
+	if ((fd = open(buf, O_RDONLY | O_CLOEXEC)) == -1)
+	{
+		warnp("Could not open logfile '%s'", log);
+		return NULL;
+	}
+
+	zcmd = emerge_log_decompressor(fd);
+	if (zcmd == NULL)
+		stats = emerge_stats_open(root_fd, portcachedir, buf, fd);
+	if (stats == NULL) {
+		/* compressed logs and pipes can only be read in full */
+		if ((rd = qlop_log_reader(fd, zcmd, &zfp, 0)) == NULL) {
+			warnp("Could not read logfile '%s'", log);
+		} else {
+			stats = emerge_stats_new();
+			while (emerge_log_reader_next(rd, &line, &len))
+				emerge_stats_line(stats, line, len);
+			emerge_log_reader_close(rd);
+		}
+		if (zfp != NULL && pclose(zfp) != 0) {
+			warn("Could not decompress logfile '%s' using %s", log, zcmd);
+			emerge_stats_close(stats);
+			stats = NULL;
+		}
+	}
+	close(fd);
+
+	return stats;
+}
+
+/* predicts how long merging each of atoms takes, and all of them one
+ * after the other, from the statistics of the merges in the log(s),
+ * the lines printed are prefixed with host if set */
+static void
+qlop_print_predict(
+		emerge_stats *stats,
+		struct qlop_mode *flags,
+		array_t *atoms,
+		const char *host)
+{
+	const emerge_stats_ent *e;
+	depend_atom *atom;
+	size_t i;
+	size_t known = 0;
+	size_t unknown = 0;
+	time_t predicted;
+	time_t total = 0;
+
+	array_for_each(atoms, i, atom) {
+		if (host != NULL)
+			printf("%s: ", host);
+		e = emerge_stats_get(stats, EMERGE_STATS_MERGE, atom);
+		if (e == NULL) {
+			printf("%s: unknown\n", atom_format(flags->fmt, atom));
+			unknown++;
+			continue;
+		}
+
+		predicted = (time_t)emerge_stats_predict(e);
+		printf("%s: %s estimate from %s%zd%s merge%s",
+				atom_format(flags->fmt, atom),
+				fmt_elapsedtime(flags, predicted),
+				GREEN, e->cnt, NORM, e->cnt == 1 ? "" : "s");
+		if (verbose) {
+			/* fmt_elapsedtime uses a static buffer */
+			printf(" (average %s",
+					fmt_elapsedtime(flags, (time_t)emerge_stats_mean(e)));
+			printf(", deviation %s",
+					fmt_elapsedtime(flags, (time_t)emerge_stats_stddev(e)));
+			printf(", longest %s)", fmt_elapsedtime(flags, (time_t)e->max));
+		}
+		printf("\n");
+		total += predicted;
+		known++;
+	}
+
+	if (host != NULL)
+		printf("%s: ", host);
+	printf("%stotal%s: %s for %s%zd%s package%s",
+			BLUE, NORM, fmt_elapsedtime(flags, total),
+			GREEN, known, NORM, known == 1 ? "" : "s");
+	if (unknown > 0)
+		printf(", %s%zd%s unknown", GREEN, unknown, NORM);
+	printf("\n");
+}
+
+struct qlop_avg {
+	depend_atom *atom;
+	time_t time;
+	size_t cnt;
+};
+
+static int
+qlop_avg_sort_cb(const void *l, const void *r)
+{
+	struct qlop_avg *al = *(struct qlop_avg **)l;
+	struct qlop_avg *ar = *(struct qlop_avg **)r;
+
+	return atom_compar_cb(al->atom, ar->atom);
+}
+
+/* prints the averages of the (un)merges of kind, the way -a does,
+ * returns the number of (un)merges and adds their time to total */
+static size_t
+qlop_print_stats_averages(
+		emerge_stats *stats,
+		enum emerge_stats_kind kind,
+		struct qlop_mode *flags,
+		array_t *atoms,
+		const char *host,
+		time_t *total)
+{
+	const char *what = kind == EMERGE_STATS_MERGE ? "merge" : "unmerge";
+	const emerge_stats_ent *e;
+	struct qlop_avg *pkg;
+	struct qlop_avg *pkgw;
+	depend_atom *atom;
+	depend_atom *atomw;
+	set *pkgs = create_set();
+	char afmt[BUFSIZ];
+	size_t ret = 0;
+	size_t i;
+	size_t j;
+	DECLARE_ARRAY(ents);
+	DECLARE_ARRAY(avgs);
+
+	/* selecting atoms needs the versions, which -v reports anyway */
+	emerge_stats_values(stats, kind, verbose || array_cnt(atoms) > 0, ents);
+	array_for_each(ents, i, e) {
+		if ((atom = atom_explode(e->pkg)) == NULL)
+			continue;
+		if (array_cnt(atoms) > 0) {
+			array_for_each(atoms, j, atomw) {
+				if (atom_compare(atom, atomw) == EQUAL)
+					break;
+				atomw = NULL;
+			}
+			if (atomw == NULL) {
+				atom_implode(atom);
+				continue;
+			}
+		}
+
+		snprintf(afmt, sizeof(afmt), "%s/%s", atom->CATEGORY,
+				verbose ? atom->PF : atom->PN);
+		pkg = xmalloc(sizeof(*pkg));
+		pkg->atom = atom;
+		pkg->time = (time_t)e->sum;
+		pkg->cnt = e->cnt;
+		if ((pkgw = add_set_value(afmt, pkg, pkgs)) != NULL) {
+			pkgw->time += pkg->time;
+			pkgw->cnt += pkg->cnt;
+			atom_implode(atom);
+			free(pkg);
+		}
+	}
+	xarrayfree_int(ents);
+
+	values_set(pkgs, avgs);
+	xarraysort(avgs, qlop_avg_sort_cb);
+	array_for_each(avgs, i, pkg) {
+		if (host != NULL)
+			printf("%s: ", host);
+		printf("%s: %s average for %s%zd%s %s%s\n",
+				atom_format(flags->fmt, pkg->atom),
+				fmt_elapsedtime(flags, pkg->time / pkg->cnt),
+				GREEN, pkg->cnt, NORM, what, pkg->cnt == 1 ? "" : "s");
+		ret += pkg->cnt;
+		*total += pkg->time;
+		atom_implode(pkg->atom);
+		free(pkg);
+	}
+	xarrayfree_int(avgs);
+	free_set(pkgs);
+
+	return ret;
+}
+
+/* prints the averages of the (un)merges and syncs in the log(s) exactly
+ * like -a does for a single log, the lines printed are prefixed with
+ * host if set */
+static void
+qlop_print_averages(
+		emerge_stats *stats,
+		struct qlop_mode *flags,
+		array_t *atoms,
+		const char *host)
+{
+	const emerge_stats_ent *e;
+	size_t total_merges = 0;
+	size_t total_unmerges = 0;
+	size_t sync_cnt = 0;
+	time_t total_time = (time_t)0;
+	time_t sync_time = (time_t)0;
+	DECLARE_ARRAY(syncs);
+
+	if (flags->do_merge)
+		total_merges = qlop_print_stats_averages(stats, EMERGE_STATS_MERGE,
+				flags, atoms, host, &total_time);
+	if (flags->do_unmerge)
+		total_unmerges = qlop_print_stats_averages(stats,
+				EMERGE_STATS_UNMERGE, flags, atoms, host, &total_time);
+
+	if (flags->do_sync &&
+			emerge_stats_values(stats, EMERGE_STATS_SYNC, false, syncs) > 0)
+	{
+		e = xarrayget(syncs, 0);
+		sync_cnt = e->cnt;
+		sync_time = (time_t)e->sum;
+		if (host != NULL)
+			printf("%s: ", host);
+		printf("%ssync%s: %s average for %s%zd%s sync%s\n",
+				BLUE, NORM, fmt_elapsedtime(flags, sync_time / sync_cnt),
+				GREEN, sync_cnt, NORM, sync_cnt == 1 ? "" : "s");
+		total_time += sync_time;
+	}
+	xarrayfree_int(syncs);
+
+	if (flags->do_summary) {
+		/* 123 seconds for 5 merges, 3 unmerges, 1 sync */
+		if (host != NULL)
+			printf("%s: ", host);
+		printf("%stotal%s: %s for ",
+				BLUE, NORM, fmt_elapsedtime(flags, total_time));
+		if (total_merges > 0)
+			printf("%s%zd%s merge%s",
+				GREEN, total_merges, NORM, total_merges == 1 ? "" : "s");
+		if (total_unmerges > 0)
+			printf("%s%s%zd%s unmerge%s",
+					total_merges == 0 ? "" : ", ",
+					GREEN, total_unmerges, NORM,
+					total_unmerges == 1 ? "" : "s");
+		if (sync_cnt > 0)
+			printf("%s%s%zd%s sync%s",
+					total_merges + total_unmerges == 0 ? "" : ", ",
+					GREEN, sync_cnt, NORM, sync_cnt == 1 ? "" : "s");
+		printf("\n");
+	}
+}
+
+/* logs read ahead of the one to deal with next, per thread */
+#define QLOP_STATS_AHEAD 4
+
+/* reports the averages (-a) or predictions (-p) for logs, which are
+ * read in parallel, either per log (-G) or for all of them together,
+ * each log is dealt with in the order of logs as soon as it and those
+ * before it are read, the logs are read a window at a time, such that
+ * no more than a window of statistics are kept next to those of all
+ * logs, at the expense of threads idling at the end of a window when
+ * one log in it takes much longer than the others */
+static int
+qlop_stats(array_t *logs, struct qlop_mode *flags, array_t *atoms)
+{
+	struct qlop_stats_slot {
+		emerge_stats *stats;
+		bool done;
+	} *slots;
+	emerge_stats *total = NULL;
+	ssize_t i;
+	ssize_t start;
+	ssize_t end;
+	ssize_t window;
+	size_t next = 0;
+	int nthreads = jobs > 1 ? jobs : 1;
+	int root_fd;
+	int ret = 0;
+
+	root_fd = open(portroot, O_RDONLY | O_CLOEXEC | O_PATH);
+	slots = xzalloc(sizeof(*slots) * (array_cnt(logs) + 1));
+	if (!flags->do_group)
+		total = emerge_stats_new();
+
+	window = (ssize_t)nthreads * QLOP_STATS_AHEAD;
+	for (start = 0; start < (ssize_t)array_cnt(logs); start = end) {
+		end = start + window;
+		if (end > (ssize_t)array_cnt(logs))
+			end = (ssize_t)array_cnt(logs);
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads) reduction(|:ret)
+		for (i = start; i < end; i++) {
+			emerge_stats *stats =
+				qlop_log_stats(array_get_elem(logs, i), root_fd);
+
+			if (stats == NULL)
+				ret |= 1;
+
+			/* fold in or report all logs that are complete and next
+			 * in line, which keeps the result independent of the
+			 * threads */
+#pragma omp critical(qlop_stats)
+			{
+				slots[i].stats = stats;
+				slots[i].done = true;
+				while (slots[next].done) {
+					stats = slots[next].stats;
+					if (stats != NULL && total != NULL) {
+						emerge_stats_merge(total, stats);
+					} else if (stats != NULL) {
+						if (flags->do_predict)
+							qlop_print_predict(stats, flags, atoms,
+									array_get_elem(logs, next));
+						else
+							qlop_print_averages(stats, flags, atoms,
+									array_get_elem(logs, next));
+					}
+					emerge_stats_close(stats);
+					slots[next].stats = NULL;
+					next++;
+				}
+			}
+		}
+	}
+
+	if (total != NULL) {
+		if (flags->do_predict)
+			qlop_print_predict(total, flags, atoms, NULL);
+		else
+			qlop_print_averages(total, flags, atoms, NULL);
+		emerge_stats_close(total);
+	}
+
+	free(slots);
+	if (root_fd != -1)
+		close(root_fd);
+
+	return ret;
+}
+
+/* adds log to logs, or when it is a directory, the logs in it and its
+ * subdirectories in alphabetical order, such that the logs collected
+ * from many hosts can be given at once, each log is added only once,
+ * returns seen, the logs added so far */
+static set *
+qlop_add_logs(array_t *logs, set *seen, const char *log)
+{
+	struct dirent **de;
+	struct stat st;
+	char buf[_Q_PATH_MAX];
+	char *path;
+	bool unique;
+	int len = (int)strlen(log);
+	int cnt;
+	int i;
+
+	if (portroot[1] == '\0')
+		snprintf(buf, sizeof(buf), "%s", log);
+	else
+		snprintf(buf, sizeof(buf), "%s%s", portroot, log);
+
+	/* anything else is reported when it fails to open */
+	if (stat(buf, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		seen = add_set_unique(log, seen, &unique);
+		if (unique)
+			xarraypush_str(logs, log);
+		return seen;
+	}
+
+	if ((cnt = scandir(buf, &de, filter_hidden, alphasort)) < 0) {
+		warnp("Could not read directory '%s'", log);
+		return seen;
+	}
+	while (len > 1 && log[len - 1] == '/')
+		len--;
+	for (i = 0; i < cnt; i++) {
+		xasprintf(&path, "%.*s/%s", len, log, de[i]->d_name);
+		seen = qlop_add_logs(logs, seen, path);
+		free(path);
+	}
+	scandir_free(de, cnt);
+
+	return seen;
 }
 
 /* scan through /proc for running merges, this requires portage user
@@ -1387,11 +2069,13 @@ int qlop_main(int argc, char **argv)
 	time_t end_time;
 	struct qlop_mode m;
 	char *logfile = NULL;
+	set *logseen = NULL;
 	char *atomfile = NULL;
 	char *p;
 	char *q;
 	depend_atom *atom;
 	DECLARE_ARRAY(atoms);
+	DECLARE_ARRAY(logs);
 	int runningmode = 0;
 
 	start_time = 0;
@@ -1409,10 +2093,13 @@ int qlop_main(int argc, char **argv)
 	m.do_endtime = 0;
 	m.show_lastmerge = 0;
 	m.show_emerge = 0;
+	m.do_predict = 0;
+	m.do_group = 0;
 	m.fmt = NULL;
 
 	while ((ret = GETOPT_LONG(QLOP, qlop, "")) != -1) {
 		switch (ret) {
+			JOBS_GETOPTS_CASE
 			COMMON_GETOPTS_CASES(qlop)
 
 			case 't': m.do_time = 1;        break;
@@ -1427,6 +2114,8 @@ int qlop_main(int argc, char **argv)
 					  m.show_emerge = 1;    break;
 			case 'r': m.do_running = 1;
 					  runningmode++;        break;
+			case 'p': m.do_predict = 1;     break;
+			case 'G': m.do_group = 1;       break;
 			case 'a': m.do_average = 1;     break;
 			case 'c': m.do_summary = 1;     break;
 			case 'H': m.do_human = 1;       break;
@@ -1445,9 +2134,12 @@ int qlop_main(int argc, char **argv)
 					err("too many -d options");
 				break;
 			case 'f':
-				if (logfile != NULL)
-					err("Only use -f once");
-				logfile = xstrdup(optarg);
+				if (logseen == NULL)
+					logseen = create_set();
+				i = array_cnt(logs);
+				logseen = qlop_add_logs(logs, logseen, optarg);
+				if (array_cnt(logs) == i)
+					warn("no (new) logfiles found in %s", optarg);
 				break;
 			case 'w':
 				if (atomfile != NULL)
@@ -1458,8 +2150,15 @@ int qlop_main(int argc, char **argv)
 		}
 	}
 
-	if (logfile == NULL)
+	if (logseen == NULL) {
 		xasprintf(&logfile, "%s/%s", portlogdir, QLOP_DEFAULT_LOGFILE);
+		xarraypush_str(logs, logfile);
+		free(logfile);
+	} else {
+		free_set(logseen);
+		if (array_cnt(logs) == 0)
+			err("no logfiles to read");
+	}
 
 	argc -= optind;
 	argv += optind;
@@ -1487,6 +2186,46 @@ int qlop_main(int argc, char **argv)
 	if (atomfile)
 		free(atomfile);
 
+	/* set format if none given */
+	if (m.fmt == NULL) {
+		if (verbose)
+			m.fmt = "%[CATEGORY]%[PF]";
+		else
+			m.fmt = "%[CATEGORY]%[PN]";
+	}
+
+	/* predictions are not about what is in the log, but about what is
+	 * to be merged, which is taken from stdin if not given */
+	if (m.do_predict && !m.do_running) {
+		if (start_time != 0)
+			warn("-p and -d cannot be used together, dropping -d");
+		if (array_cnt(atoms) == 0) {
+			char *line = NULL;
+			size_t linelen = 0;
+
+			while (getline(&line, &linelen, stdin) != -1) {
+				p = rmspace(line);
+				if (*p == '\0')
+					continue;
+				atom = atom_explode(p);
+				if (!atom)
+					warn("invalid atom: %s", p);
+				else
+					xarraypush_ptr(atoms, atom);
+			}
+			free(line);
+		}
+
+		ret = qlop_stats(logs, &m, atoms);
+
+		array_for_each(atoms, i, atom)
+			atom_implode(atom);
+		xarrayfree_int(atoms);
+		xarrayfree(logs);
+
+		return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	/* default operation: -slumt */
 	if (
 			m.do_time == 0 &&
@@ -1538,6 +2277,17 @@ int qlop_main(int argc, char **argv)
 		m.do_sync = 0;
 	}
 
+	/* handle -a over multiple logs, which is about all of them */
+	if (m.do_average && array_cnt(logs) > 1 &&
+			(start_time != 0 || end_time != LONG_MAX || m.show_lastmerge))
+	{
+		warn("-a (or -c) over multiple logfiles cannot be used with "
+				"-d or -l, dropping -d and -l");
+		start_time = 0;
+		end_time = LONG_MAX;
+		m.show_lastmerge = 0;
+	}
+
 	/* handle -l / -d conflict */
 	if (start_time != 0 && m.show_lastmerge) {
 		if (!m.show_emerge)
@@ -1555,14 +2305,6 @@ int qlop_main(int argc, char **argv)
 			m.do_sync = 1;
 	}
 
-	/* set format if none given */
-	if (m.fmt == NULL) {
-		if (verbose)
-			m.fmt = "%[CATEGORY]%[PF]";
-		else
-			m.fmt = "%[CATEGORY]%[PN]";
-	}
-
 	if (m.do_running) {
 		array_t *new_atoms = NULL;
 
@@ -1579,13 +2321,20 @@ int qlop_main(int argc, char **argv)
 		/* NOTE: new_atoms == atoms when new_atoms != NULL */
 	}
 
-	if (start_time < LONG_MAX)
-		do_emerge_log(logfile, &m, atoms, start_time, end_time);
+	/* averages over multiple logs are computed from their statistics,
+	 * anything else is reported for each log in turn */
+	ret = 0;
+	if (m.do_average && array_cnt(logs) > 1) {
+		ret = qlop_stats(logs, &m, atoms);
+	} else if (start_time < LONG_MAX) {
+		array_for_each(logs, i, logfile)
+			do_emerge_log(logfile, &m, atoms, start_time, end_time);
+	}
 
 	array_for_each(atoms, i, atom)
 		atom_implode(atom);
 	xarrayfree_int(atoms);
-	free(logfile);
+	xarrayfree(logs);
 
-	return EXIT_SUCCESS;
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -31,28 +31,39 @@
 #include <sys/time.h>
 #include <openssl/sha.h>
 #include <openssl/whrlpool.h>
-#include <blake2.h>
 #include <zlib.h>
 #include <gpgme.h>
+#ifdef _OPENMP
+# include <omp.h>
+#else
+# define omp_get_max_threads() 1
+#endif
 
 #include "eat_file.h"
 #include "hash.h"
+#include "hash_blake2b.h"
+#include "hash_cache.h"
+#include "xasprintf.h"
 
-#define QMANIFEST_FLAGS "gs:pdo" COMMON_FLAGS
+#define QMANIFEST_FLAGS "grs:pdo" COMMON_FLAGS
 static struct option const qmanifest_long_opts[] = {
 	{"generate",   no_argument, NULL, 'g'},
+	{"rehash",     no_argument, NULL, 'r'},
 	{"signas",      a_argument, NULL, 's'},
 	{"passphrase", no_argument, NULL, 'p'},
 	{"dir",        no_argument, NULL, 'd'},
 	{"overlay",    no_argument, NULL, 'o'},
+	JOBS_LONG_OPT,
 	COMMON_LONG_OPTS
 };
 static const char * const qmanifest_opts_help[] = {
 	"Generate thick Manifests",
+	"Rehash all files, ignoring the hash cache",
 	"Sign generated Manifest using GPG key",
 	"Ask for GPG key password (instead of relying on gpg-agent)",
 	"Treat arguments as directories",
 	"Treat arguments as overlay names",
+	JOBS_OPT_HELP,
 	COMMON_OPTS_HELP
 };
 #define qmanifest_usage(ret) usage(ret, QMANIFEST_FLAGS, qmanifest_long_opts, qmanifest_opts_help, NULL, lookup_applet_idx("qmanifest"))
@@ -60,6 +71,26 @@ static const char * const qmanifest_opts_help[] = {
 static int hashes = HASH_DEFAULT;
 static char *gpg_sign_key = NULL;
 static bool gpg_get_password = false;
+static bool rehash = false;
+static hash_cache *hcache = NULL;
+
+/* --jobs takes precedence over OpenMP's default (OMP_NUM_THREADS),
+ * which is used when it isn't given */
+static int
+qmanifest_threads(void)
+{
+	return jobs > 0 ? jobs : omp_get_max_threads();
+}
+
+static const char *str_manifest = "Manifest";
+static const char *str_manifest_gz = "Manifest.gz";
+static const char *str_manifest_files_gz = "Manifest.files.gz";
+enum type_manifest {
+	GLOBAL_MANIFEST,   /* Manifest.files.gz + Manifest */
+	SUBTREE_MANIFEST,  /* Manifest.gz for recursive list of files */
+	EBUILD_MANIFEST,   /* Manifest thick from thin */
+	CATEGORY_MANIFEST  /* Manifest.gz with Manifest entries */
+};
 
 /* linked list structure to hold verification complaints */
 typedef struct verify_msg {
@@ -88,6 +119,18 @@ char verify_manifest(const char *dir, const char *manifest, verify_msg **msgs);
  * - app-crypt/gpgme (for signing/verifying the top level manifest)
  */
 
+static inline void
+merge_times(struct timeval *tv, const struct timeval *ntv)
+{
+	if (tv[1].tv_sec < ntv[1].tv_sec ||
+			(tv[1].tv_sec == ntv[1].tv_sec &&
+			 tv[1].tv_usec < ntv[1].tv_usec))
+	{
+		tv[0] = ntv[0];
+		tv[1] = ntv[1];
+	}
+}
+
 static inline void
 update_times(struct timeval *tv, struct stat *s)
 {
@@ -95,15 +138,13 @@ update_times(struct timeval *tv, struct stat *s)
 # define st_mtim st_mtimespec
 # define st_atim st_atimespec
 #endif
-	if (tv[1].tv_sec < s->st_mtim.tv_sec ||
-			(tv[1].tv_sec == s->st_mtim.tv_sec &&
-			 tv[1].tv_usec < s->st_mtim.tv_nsec / 1000))
-	{
-		tv[0].tv_sec = s->st_atim.tv_sec;
-		tv[0].tv_usec = s->st_atim.tv_nsec / 1000;
-		tv[1].tv_sec = s->st_mtim.tv_sec;
-		tv[1].tv_usec = s->st_mtim.tv_nsec / 1000;
-	}
+	struct timeval ntv[2];
+
+	ntv[0].tv_sec = s->st_atim.tv_sec;
+	ntv[0].tv_usec = s->st_atim.tv_nsec / 1000;
+	ntv[1].tv_sec = s->st_mtim.tv_sec;
+	ntv[1].tv_usec = s->st_mtim.tv_nsec / 1000;
+	merge_times(tv, ntv);
 }
 
 #define LISTSZ 64
@@ -171,53 +212,105 @@ list_dir(char ***retlist, size_t *retcnt, const char *path)
 }
 
 /**
- * Write hashes in Manifest format to the file open for writing m, or
- * gzipped file open for writing gm.  The hashes written are for a file
- * in root found by name.  The Manifest entry will be using type as
- * first component.
+ * Format a Manifest entry of type for the file name of flen bytes with
+ * the given digests into data of size len, returns its length.
  */
-static void
-write_hashes(
+static size_t
+format_entry(
+		const char *type,
+		const char *name,
+		size_t flen,
+		const char *sha256,
+		const char *sha512,
+		const char *whrlpl,
+		const char *blak2b,
+		char *data,
+		size_t size)
+{
+	size_t len;
+
+	len = snprintf(data, size, "%s %s %zd", type, name, flen);
+	if (hashes & HASH_BLAKE2B)
+		len += snprintf(data + len, size - len,
+				" BLAKE2B %s", blak2b);
+	if (hashes & HASH_SHA256)
+		len += snprintf(data + len, size - len,
+				" SHA256 %s", sha256);
+	if (hashes & HASH_SHA512)
+		len += snprintf(data + len, size - len,
+				" SHA512 %s", sha512);
+	if (hashes & HASH_WHIRLPOOL)
+		len += snprintf(data + len, size - len,
+				" WHIRLPOOL %s", whrlpl);
+	len += snprintf(data + len, size - len, "\n");
+
+	return len;
+}
+
+/**
+ * Format hashes in Manifest format into data of size len.  The hashes
+ * are for a file in root found by name.  The Manifest entry will be
+ * using type as first component.  Returns the length of the entry, or
+ * 0 if the file could not be found.
+ */
+static size_t
+format_hashes(
 		struct timeval *tv,
 		const char *root,
 		const char *name,
 		const char *type,
-		FILE *m,
-		gzFile gm)
+		char *data,
+		size_t size)
 {
 	size_t flen = 0;
 	char sha256[(SHA256_DIGEST_LENGTH * 2) + 1];
 	char sha512[(SHA512_DIGEST_LENGTH * 2) + 1];
 	char whrlpl[(WHIRLPOOL_DIGEST_LENGTH * 2) + 1];
-	char blak2b[(BLAKE2B_OUTBYTES * 2) + 1];
-	char data[8192];
+	char blak2b[(HASH_BLAKE2B_OUTBYTES * 2) + 1];
 	char fname[8192];
-	size_t len;
 	struct stat s;
 
 	snprintf(fname, sizeof(fname), "%s/%s", root, name);
 
 	if (stat(fname, &s) != 0)
-		return;
+		return 0;
 
 	update_times(tv, &s);
 
-	hash_compute_file(fname, sha256, sha512, whrlpl, blak2b, &flen, hashes);
+	/* reuse the digests of files that didn't change since last time */
+	if (hash_cache_lookup(hcache, fname, &s,
+				NULL, NULL, sha256, sha512, whrlpl, blak2b, hashes)) {
+		flen = (size_t)s.st_size;
+	} else {
+		if (hash_compute_file(fname, sha256, sha512, whrlpl, blak2b,
+					&flen, hashes) == 0 && flen == (size_t)s.st_size)
+			hash_cache_store(hcache, fname, &s,
+					NULL, NULL, sha256, sha512, whrlpl, blak2b, hashes);
+	}
 
-	len = snprintf(data, sizeof(data), "%s %s %zd", type, name, flen);
-	if (hashes & HASH_BLAKE2B)
-		len += snprintf(data + len, sizeof(data) - len,
-				" BLAKE2B %s", blak2b);
-	if (hashes & HASH_SHA256)
-		len += snprintf(data + len, sizeof(data) - len,
-				" SHA256 %s", sha256);
-	if (hashes & HASH_SHA512)
-		len += snprintf(data + len, sizeof(data) - len,
-				" SHA512 %s", sha512);
-	if (hashes & HASH_WHIRLPOOL)
-		len += snprintf(data + len, sizeof(data) - len,
-				" WHIRLPOOL %s", whrlpl);
-	len += snprintf(data + len, sizeof(data) - len, "\n");
+	return format_entry(type, name, flen,
+			sha256, sha512, whrlpl, blak2b, data, size);
+}
+
+/**
+ * Write hashes in Manifest format to the file open for writing m, or
+ * gzipped file open for writing gm, see format_hashes.
+ */
+static void
+write_hashes(
+		struct timeval *tv,
+		const char *root,
+		const char *name,
+		const char *type,
+		FILE *m,
+		gzFile gm)
+{
+	char data[8192];
+	size_t len;
+
+	len = format_hashes(tv, root, name, type, data, sizeof(data));
+	if (len == 0)
+		return;
 
 	if (m != NULL)
 		fwrite(data, len, 1, m);
@@ -225,17 +318,204 @@ write_hashes(
 		fprintf(stderr, "failed to write to compressed stream\n");
 }
 
+/* Manifest entries are hashed in parallel tasks, and written out in the
+ * order they were added once all of them are done, such that the
+ * resulting Manifest is identical to that of a serial run. */
+typedef struct gen_entry {
+	char *name;                /* path relative to root */
+	const char *type;          /* first component of the entry */
+	bool generate;             /* generate the sub-Manifest in name */
+	enum type_manifest mtype;  /* type of said sub-Manifest */
+	char *line;                /* the resulting Manifest entry */
+	size_t len;
+	struct timeval tv[2];
+	bool failed;
+} gen_entry;
+
+static const char *generate_dir(const char *dir, enum type_manifest mtype);
+
+static gen_entry *
+gen_add(array_t *batch, const char *name, const char *type)
+{
+	gen_entry *e = xzalloc(sizeof(*e));
+
+	e->name = xstrdup(name);
+	e->type = type;
+	return xarraypush_ptr(batch, e);
+}
+
+/* adds a MANIFEST entry for the sub-Manifest to be generated in name */
+static void
+gen_add_manifest(array_t *batch, const char *name, enum type_manifest mtype)
+{
+	gen_entry *e = gen_add(batch, name, "MANIFEST");
+
+	e->generate = true;
+	e->mtype = mtype;
+}
+
+static void
+gen_hash(const char *root, gen_entry *e)
+{
+	char path[8192];
+	char data[8192];
+	const char *name = e->name;
+	const char *mfest;
+
+	if (e->generate) {
+		snprintf(path, sizeof(path), "%s/%s", root, e->name);
+		mfest = generate_dir(path, e->mtype);
+		if (mfest == NULL) {
+			fprintf(stderr, "generating Manifest for %s failed!\n", path);
+			e->failed = true;
+			return;
+		}
+		snprintf(path, sizeof(path), "%s/%s", e->name, mfest);
+		name = path;
+	}
+
+	e->len = format_hashes(e->tv, root, name, e->type, data, sizeof(data));
+	if (e->len > 0)
+		e->line = xstrdup(data);
+}
+
+/* number of plain files hashed together by a single task, files in a
+ * tree are mostly small, for which hashing a few of them at the same
+ * time is cheaper than one after the other */
+#define GEN_HASH_GROUP 16
+
+/* like gen_hash, for cnt entries none of which is a sub-Manifest */
+static void
+gen_hash_many(const char *root, void **ents, size_t cnt)
+{
+	hash_file_ent res[GEN_HASH_GROUP];
+	hash_file_ent miss[GEN_HASH_GROUP];
+	struct stat st[GEN_HASH_GROUP];
+	char *fname[GEN_HASH_GROUP];
+	size_t idx[GEN_HASH_GROUP];
+	char data[8192];
+	hash_file_ent *h;
+	gen_entry *e;
+	size_t nmiss = 0;
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		e = ents[i];
+		h = &res[i];
+		xasprintf(&fname[i], "%s/%s", root, e->name);
+		h->ret = -1;
+		if (stat(fname[i], &st[i]) != 0)
+			continue;
+		update_times(e->tv, &st[i]);
+
+		/* reuse the digests of files that didn't change since last time */
+		h->ret = 0;
+		h->flen = (size_t)st[i].st_size;
+		if (hash_cache_lookup(hcache, fname[i], &st[i], NULL, NULL,
+					h->sha256, h->sha512, h->whrlpl, h->blak2b, hashes))
+			continue;
+		miss[nmiss].name = fname[i];
+		idx[nmiss++] = i;
+	}
+
+	hash_multiple_files(AT_FDCWD, miss, nmiss, hashes);
+	for (i = 0; i < nmiss; i++) {
+		h = &miss[i];
+		if (h->ret != 0) {
+			/* like hash_compute_file failing, list it without size */
+			h->flen = 0;
+			h->ret = 0;
+		} else if (h->flen == (size_t)st[idx[i]].st_size) {
+			hash_cache_store(hcache, fname[idx[i]], &st[idx[i]], NULL, NULL,
+					h->sha256, h->sha512, h->whrlpl, h->blak2b, hashes);
+		}
+		res[idx[i]] = *h;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		e = ents[i];
+		h = &res[i];
+		free(fname[i]);
+		if (h->ret != 0)
+			continue;
+		e->len = format_entry(e->type, e->name, h->flen,
+				h->sha256, h->sha512, h->whrlpl, h->blak2b,
+				data, sizeof(data));
+		e->line = xstrdup(data);
+	}
+}
+
 /**
- * Walk through a directory recursively and write hashes for each file
- * found to the gzipped open stream for writing zm.  The Manifest
- * entries generated will all be of DATA type.
+ * Compute the hashes for all entries in batch, relative to root, and
+ * write them to the file open for writing m, or gzipped file open for
+ * writing gm.  Entries for which a sub-Manifest could not be generated
+ * are skipped, and reset the access time in tv, like the serial code
+ * always did.  Returns non-zero if that happened.  The batch is emptied.
  */
 static char
-write_hashes_dir(
+write_hashes_batch(
 		struct timeval *tv,
+		const char *root,
+		array_t *batch,
+		FILE *m,
+		gzFile gm)
+{
+	gen_entry *e;
+	void **grp;
+	size_t n;
+	size_t cnt;
+	size_t start = 0;
+	char ret = 0;
+
+	/* sub-Manifests are generated by a task each, runs of other
+	 * entries are hashed in groups, by a task per group */
+	for (n = 0; n <= array_cnt(batch); n++) {
+		e = n < array_cnt(batch) ? array_get_elem(batch, n) : NULL;
+		if (e != NULL && !e->generate && n - start < GEN_HASH_GROUP)
+			continue;
+		if (n > start) {
+			grp = &array_get_elem(batch, start);
+			cnt = n - start;
+#pragma omp task firstprivate(grp, cnt)
+			gen_hash_many(root, grp, cnt);
+		}
+		start = n;
+		if (e != NULL && e->generate) {
+#pragma omp task firstprivate(e)
+			gen_hash(root, e);
+			start = n + 1;
+		}
+	}
+#pragma omp taskwait
+
+	array_for_each(batch, n, e) {
+		if (e->failed) {
+			tv[0].tv_sec = 0;
+			ret = 1;
+		} else if (e->line != NULL) {
+			merge_times(tv, e->tv);
+			if (m != NULL)
+				fwrite(e->line, e->len, 1, m);
+			if (gm != NULL && gzwrite(gm, e->line, e->len) == 0)
+				fprintf(stderr, "failed to write to compressed stream\n");
+		}
+		free(e->name);
+		free(e->line);
+	}
+	xarrayfree(batch);
+
+	return ret;
+}
+
+/**
+ * Walk through a directory recursively and add each file found to
+ * batch.  The Manifest entries generated will all be of DATA type.
+ */
+static char
+add_hashes_dir(
 		const char *root,
 		const char *name,
-		gzFile zm)
+		array_t *batch)
 {
 	char path[8192];
 	char **dentries;
@@ -247,10 +527,10 @@ write_hashes_dir(
 		for (i = 0; i < dentrieslen; i++) {
 			snprintf(path, sizeof(path), "%s/%s", name, dentries[i]);
 			free(dentries[i]);
-			if (write_hashes_dir(tv, root, path, zm) == 0)
+			if (add_hashes_dir(root, path, batch) == 0)
 				continue;
 			/* regular file */
-			write_hashes(tv, root, path, "DATA", NULL, zm);
+			gen_add(batch, path, "DATA");
 		}
 		free(dentries);
 		return 0;
@@ -260,12 +540,12 @@ write_hashes_dir(
 }
 
 /**
- * Walk through directory recursively and write hashes for each file
- * found to the open stream for writing m.  All files will not use the
- * "files/" prefix and Manifest entries will be of AUX type.
+ * Walk through directory recursively and add each file found to batch.
+ * All files will not use the "files/" prefix and Manifest entries will
+ * be of AUX type.
  */
 static char
-process_files(struct timeval *tv, const char *dir, const char *off, FILE *m)
+process_files(const char *dir, const char *off, array_t *batch)
 {
 	char path[8192];
 	char **dentries;
@@ -278,10 +558,10 @@ process_files(struct timeval *tv, const char *dir, const char *off, FILE *m)
 			snprintf(path, sizeof(path), "%s%s%s",
 					off, *off == '\0' ? "" : "/", dentries[i]);
 			free(dentries[i]);
-			if (process_files(tv, dir, path, m) == 0)
+			if (process_files(dir, path, batch) == 0)
 				continue;
 			/* regular file */
-			write_hashes(tv, dir, path, "AUX", m, NULL);
+			gen_add(batch, path, "AUX");
 		}
 		free(dentries);
 		return 0;
@@ -377,15 +657,6 @@ parse_layout_conf(const char *path)
 	return HASH_DEFAULT;
 }
 
-static const char *str_manifest = "Manifest";
-static const char *str_manifest_gz = "Manifest.gz";
-static const char *str_manifest_files_gz = "Manifest.files.gz";
-enum type_manifest {
-	GLOBAL_MANIFEST,   /* Manifest.files.gz + Manifest */
-	SUBTREE_MANIFEST,  /* Manifest.gz for recursive list of files */
-	EBUILD_MANIFEST,   /* Manifest thick from thin */
-	CATEGORY_MANIFEST  /* Manifest.gz with Manifest entries */
-};
 static const char *
 generate_dir(const char *dir, enum type_manifest mtype)
 {
@@ -396,6 +667,7 @@ generate_dir(const char *dir, enum type_manifest mtype)
 	char **dentries;
 	size_t dentrieslen;
 	size_t i;
+	DECLARE_ARRAY(batch);
 
 	/* our timestamp strategy is as follows:
 	 * - when a Manifest exists, use its timestamp
@@ -411,7 +683,6 @@ generate_dir(const char *dir, enum type_manifest mtype)
 	tv[1].tv_usec = 0;
 
 	if (mtype == GLOBAL_MANIFEST) {
-		const char *mfest;
 		size_t len;
 		gzFile mf;
 		time_t rtime;
@@ -452,7 +723,6 @@ generate_dir(const char *dir, enum type_manifest mtype)
 
 			snprintf(path, sizeof(path), "%s/%s", dir, dentries[i]);
 
-			mfest = NULL;
 			if (!stat(path, &s)) {
 				if (s.st_mode & S_IFDIR) {
 					if (
@@ -463,26 +733,12 @@ generate_dir(const char *dir, enum type_manifest mtype)
 							strcmp(dentries[i], "scripts")  == 0
 					   )
 					{
-						mfest = generate_dir(path, SUBTREE_MANIFEST);
+						gen_add_manifest(batch, dentries[i], SUBTREE_MANIFEST);
 					} else {
-						mfest = generate_dir(path, CATEGORY_MANIFEST);
-					}
-
-					if (mfest == NULL) {
-						fprintf(stderr, "generating Manifest for %s failed!\n",
-								path);
-						gzclose(mf);
-						for (; i < dentrieslen; i++)
-							free(dentries[i]);
-						free(dentries);
-						return NULL;
+						gen_add_manifest(batch, dentries[i], CATEGORY_MANIFEST);
 					}
-
-					snprintf(path, sizeof(path), "%s/%s",
-							dentries[i], mfest);
-					write_hashes(tv, dir, path, "MANIFEST", NULL, mf);
 				} else if (s.st_mode & S_IFREG) {
-					write_hashes(tv, dir, dentries[i], "DATA", NULL, mf);
+					gen_add(batch, dentries[i], "DATA");
 				} /* ignore other "things" (like symlinks) as they
 					 don't belong in a tree */
 			} else {
@@ -492,6 +748,12 @@ generate_dir(const char *dir, enum type_manifest mtype)
 			free(dentries[i]);
 		}
 		free(dentries);
+
+		/* the Manifests for all subdirs are generated in parallel */
+		if (write_hashes_batch(tv, dir, batch, NULL, mf) != 0) {
+			gzclose(mf);
+			return NULL;
+		}
 		gzclose(mf);
 
 		if (tv[0].tv_sec != 0) {
@@ -559,12 +821,13 @@ generate_dir(const char *dir, enum type_manifest mtype)
 				continue;
 			}
 
-			if (write_hashes_dir(tv, dir, dentries[i], mf) != 0)
-				write_hashes(tv, dir, dentries[i], "DATA", NULL, mf);
+			if (add_hashes_dir(dir, dentries[i], batch) != 0)
+				gen_add(batch, dentries[i], "DATA");
 			free(dentries[i]);
 		}
 
 		free(dentries);
+		write_hashes_batch(tv, dir, batch, NULL, mf);
 		gzclose(mf);
 
 		if (tv[0].tv_sec != 0) {
@@ -576,7 +839,6 @@ generate_dir(const char *dir, enum type_manifest mtype)
 
 		return str_manifest_gz;
 	} else if (mtype == CATEGORY_MANIFEST) {
-		const char *mfest;
 		gzFile mf;
 		const char *ret = str_manifest_gz;
 
@@ -602,20 +864,9 @@ generate_dir(const char *dir, enum type_manifest mtype)
 			snprintf(path, sizeof(path), "%s/%s", dir, dentries[i]);
 			if (!stat(path, &s)) {
 				if (s.st_mode & S_IFDIR) {
-					mfest = generate_dir(path, EBUILD_MANIFEST);
-
-					if (mfest == NULL) {
-						fprintf(stderr, "generating Manifest for %s failed!\n",
-								path);
-						tv[0].tv_sec = 0;
-						ret = NULL;
-					} else {
-						snprintf(path, sizeof(path), "%s/%s",
-								dentries[i], mfest);
-						write_hashes(tv, dir, path, "MANIFEST", NULL, mf);
-					}
+					gen_add_manifest(batch, dentries[i], EBUILD_MANIFEST);
 				} else if (s.st_mode & S_IFREG) {
-					write_hashes(tv, dir, dentries[i], "DATA", NULL, mf);
+					gen_add(batch, dentries[i], "DATA");
 				} /* ignore other "things" (like symlinks) as they
 					 don't belong in a tree */
 			} else {
@@ -626,6 +877,10 @@ generate_dir(const char *dir, enum type_manifest mtype)
 		}
 
 		free(dentries);
+
+		/* the package Manifests are generated in parallel */
+		if (write_hashes_batch(tv, dir, batch, NULL, mf) != 0)
+			ret = NULL;
 		gzclose(mf);
 
 		if (tv[0].tv_sec != 0) {
@@ -651,7 +906,8 @@ generate_dir(const char *dir, enum type_manifest mtype)
 		 * prefixed with AUX, hence, if it exists, we need to do it
 		 * first */
 		snprintf(path, sizeof(path), "%s/files", dir);
-		process_files(tv, path, "", m);
+		process_files(path, "", batch);
+		write_hashes_batch(tv, path, batch, m, NULL);
 
 		/* the Manifest file may be missing in case there are no DIST
 		 * entries to be stored */
@@ -684,14 +940,15 @@ generate_dir(const char *dir, enum type_manifest mtype)
 					free(dentries[i]);
 					continue;
 				}
-				write_hashes(tv, dir, dentries[i], "EBUILD", m, NULL);
+				gen_add(batch, dentries[i], "EBUILD");
 				free(dentries[i]);
 			}
 			free(dentries);
 		}
 
-		write_hashes(tv, dir, "ChangeLog", "MISC", m, NULL);
-		write_hashes(tv, dir, "metadata.xml", "MISC", m, NULL);
+		gen_add(batch, "ChangeLog", "MISC");
+		gen_add(batch, "metadata.xml", "MISC");
+		write_hashes_batch(tv, dir, batch, m, NULL);
 
 		fflush(m);
 		fclose(m);
@@ -745,6 +1002,7 @@ process_dir_gen(void)
 	int newhashes;
 	struct termios termio;
 	char *gpg_pass;
+	const char *mfest;
 
 	if ((newhashes = parse_layout_conf("metadata/layout.conf")) != 0) {
 		hashes = newhashes;
@@ -752,7 +1010,26 @@ process_dir_gen(void)
 		return "generation must be done on a full tree";
 	}
 
-	if (generate_dir(".\0", GLOBAL_MANIFEST) == NULL)
+	/* the cache is keyed on the tree's location, since it stores paths
+	 * relative to it */
+	if (getcwd(path, sizeof(path)) != NULL) {
+		int root_fd = open(portroot, O_RDONLY | O_CLOEXEC | O_PATH);
+		if (root_fd != -1) {
+			hcache = hash_cache_open(root_fd, portcachedir, path, rehash,
+					false);
+			close(root_fd);
+		}
+	}
+
+	mfest = NULL;
+#pragma omp parallel num_threads(qmanifest_threads())
+#pragma omp single
+	mfest = generate_dir(".\0", GLOBAL_MANIFEST);
+
+	hash_cache_close(hcache);
+	hcache = NULL;
+
+	if (mfest == NULL)
 		return "generation failed";
 
 	if (gpg_sign_key != NULL) {
@@ -1033,7 +1310,7 @@ verify_file(const char *dir, char *mfline, const char *mfest, verify_msg **msgs)
 	char sha256[(SHA256_DIGEST_LENGTH * 2) + 1];
 	char sha512[(SHA512_DIGEST_LENGTH * 2) + 1];
 	char whrlpl[(WHIRLPOOL_DIGEST_LENGTH * 2) + 1];
-	char blak2b[(BLAKE2B_OUTBYTES * 2) + 1];
+	char blak2b[(HASH_BLAKE2B_OUTBYTES * 2) + 1];
 	char ret = 0;
 
 	/* mfline is a Manifest file line with type and leading path
@@ -1072,6 +1349,7 @@ verify_file(const char *dir, char *mfline, const char *mfest, verify_msg **msgs)
 		return 1;
 	}
 
+#pragma omp atomic
 	checked_files++;
 
 	if (flen != (size_t)fsize) {
@@ -1080,6 +1358,7 @@ verify_file(const char *dir, char *mfline, const char *mfest, verify_msg **msgs)
 				"     got: %zd\n"
 				"expected: %lld",
 				flen, fsize);
+#pragma omp atomic
 		failed_files++;
 		return 1;
 	}
@@ -1184,6 +1463,7 @@ verify_file(const char *dir, char *mfline, const char *mfest, verify_msg **msgs)
 		ret = 1;
 	}
 
+#pragma omp atomic
 	failed_files += ret;
 	return ret;
 }
@@ -1212,6 +1492,51 @@ struct subdir_workload {
 	char **elems;
 };
 
+/* Files and subdirs are verified in parallel tasks, each of which
+ * records its complaints in a slot of its own.  The slots are chained in
+ * the order a serial run would produce the messages, such that the
+ * report doesn't depend on the number of threads used. */
+typedef struct verify_slot {
+	verify_msg top;
+	verify_msg *walk;
+	char ret;
+	struct verify_slot *next;
+} verify_slot;
+
+static verify_slot *
+verify_slot_new(verify_slot **tail)
+{
+	verify_slot *ret = xzalloc(sizeof(*ret));
+
+	ret->walk = &ret->top;
+	if (*tail != NULL)
+		(*tail)->next = ret;
+	*tail = ret;
+
+	return ret;
+}
+
+/* appends the messages from all slots to msgs, and returns the combined
+ * result of the slots, which are freed */
+static char
+verify_slot_flush(verify_slot *slot, verify_msg **msgs)
+{
+	verify_slot *next;
+	char ret = 0;
+
+	for (; slot != NULL; slot = next) {
+		next = slot->next;
+		if (slot->top.next != NULL) {
+			(*msgs)->next = slot->top.next;
+			*msgs = slot->walk;
+		}
+		ret |= slot->ret;
+		free(slot);
+	}
+
+	return ret;
+}
+
 static char
 verify_dir(
 		const char *dir,
@@ -1234,6 +1559,9 @@ verify_dir(
 	size_t subdirsize = 0;
 	size_t subdirlen = 0;
 	size_t elem;
+	verify_slot *slots;
+	verify_slot *slot = NULL;
+	verify_slot *wslot;
 
 	/* shortcut a single Manifest entry pointing to the same dir
 	 * (happens at top-level) */
@@ -1265,6 +1593,7 @@ verify_dir(
 	 * anything.
 	 */
 	if (list_dir(&dentries, &dentrieslen, dir) == 0) {
+		slots = verify_slot_new(&slot);
 		while (curdentry < dentrieslen) {
 			if (strcmp(dentries[curdentry], str_manifest) == 0 ||
 					strcmp(dentries[curdentry], str_manifest_gz) == 0 ||
@@ -1336,7 +1665,11 @@ verify_dir(
 			if (cmp == 0) {
 				/* equal, so yay */
 				if (etpe == 'D') {
-					ret |= verify_file(dir, entry, mfest, msgs);
+					wslot = verify_slot_new(&slot);
+#pragma omp task firstprivate(wslot, entry)
+					wslot->ret = verify_file(dir, entry, mfest, &wslot->walk);
+					/* anything after this file goes into a new slot */
+					verify_slot_new(&slot);
 				}
 				/* else this is I(GNORE) or S(ubdir), which means it is
 				 * ok in any way (M shouldn't happen) */
@@ -1347,23 +1680,26 @@ verify_dir(
 				if (etpe == 'I') {
 					/* right, we can ignore this */
 				} else {
-					ret |= 1;
+					slot->ret |= 1;
 					slash = strchr(entry, ' ');
 					if (slash != NULL)
 						*slash = '\0';
-					msgs_add(msgs, mfest, entry, "%s file listed in Manifest, "
-							"but not found", etpe == 'M' ? "MANIFEST" : "DATA");
+					msgs_add(&slot->walk, mfest, entry,
+							"%s file listed in Manifest, but not found",
+							etpe == 'M' ? "MANIFEST" : "DATA");
 					if (slash != NULL)
 						*slash = ' ';
+#pragma omp atomic
 					failed_files++;
 				}
 				curelem++;
 			} else if (cmp > 0) {
 				/* dir has extra element */
-				ret |= 1;
-				msgs_add(msgs, mfest, NULL,
+				slot->ret |= 1;
+				msgs_add(&slot->walk, mfest, NULL,
 						"file not listed: %s", dentries[curdentry]);
 				curdentry++;
+#pragma omp atomic
 				failed_files++;
 			}
 		}
@@ -1372,40 +1708,51 @@ verify_dir(
 			free(dentries[dentrieslen]);
 		free(dentries);
 
-#pragma omp parallel for shared(ret) private(entry, etpe, slash)
 		for (elem = 0; elem < subdirlen; elem++) {
-			char ndir[8192];
-
-			entry = subdir[elem]->elems[0] + 2 + skippath;
-			etpe = subdir[elem]->elems[0][0];
-
-			/* restore original entry format */
-			subdir[elem]->elems[subdir[elem]->elemslen - 1]
-				[2 + skippath + subdir[elem]->subdirlen] = '/';
-
-			if (etpe == 'M') {
-				size_t skiplen = strlen(dir) + 1 + subdir[elem]->subdirlen;
-				/* sub-Manifest, we need to do a proper recurse */
-				slash = strrchr(entry, '/');  /* cannot be NULL */
-				snprintf(ndir, sizeof(ndir), "%s/%s", dir, entry);
-				ndir[skiplen] = '\0';
-				slash = strchr(ndir + skiplen + 1, ' ');
-				if (slash != NULL)  /* path should fit in ndir ... */
-					*slash = '\0';
-				if (verify_file(dir, entry, mfest, msgs) != 0 ||
-						verify_manifest(ndir, ndir + skiplen + 1, msgs) != 0)
-					ret |= 1;
-			} else {
-				snprintf(ndir, sizeof(ndir), "%s/%.*s", dir,
-						(int)subdir[elem]->subdirlen, entry);
-				ret |= verify_dir(ndir, subdir[elem]->elems,
-						subdir[elem]->elemslen,
-						skippath + subdir[elem]->subdirlen + 1, mfest, msgs);
-			}
+			wslot = verify_slot_new(&slot);
+#pragma omp task firstprivate(wslot, elem) private(entry, etpe, slash)
+			{
+				char ndir[8192];
+
+				entry = subdir[elem]->elems[0] + 2 + skippath;
+				etpe = subdir[elem]->elems[0][0];
+
+				/* restore original entry format */
+				subdir[elem]->elems[subdir[elem]->elemslen - 1]
+					[2 + skippath + subdir[elem]->subdirlen] = '/';
+
+				if (etpe == 'M') {
+					size_t skiplen =
+						strlen(dir) + 1 + subdir[elem]->subdirlen;
+					/* sub-Manifest, we need to do a proper recurse */
+					slash = strrchr(entry, '/');  /* cannot be NULL */
+					snprintf(ndir, sizeof(ndir), "%s/%s", dir, entry);
+					ndir[skiplen] = '\0';
+					slash = strchr(ndir + skiplen + 1, ' ');
+					if (slash != NULL)  /* path should fit in ndir ... */
+						*slash = '\0';
+					if (verify_file(dir, entry, mfest, &wslot->walk) != 0 ||
+							verify_manifest(ndir, ndir + skiplen + 1,
+								&wslot->walk) != 0)
+						wslot->ret = 1;
+				} else {
+					snprintf(ndir, sizeof(ndir), "%s/%.*s", dir,
+							(int)subdir[elem]->subdirlen, entry);
+					wslot->ret = verify_dir(ndir, subdir[elem]->elems,
+							subdir[elem]->elemslen,
+							skippath + subdir[elem]->subdirlen + 1, mfest,
+							&wslot->walk);
+				}
 
-			free(subdir[elem]);
+				free(subdir[elem]);
+			}
 		}
 
+		/* wait for the files and subdirs in this dir to be verified
+		 * before handing back their messages */
+#pragma omp taskwait
+		ret = verify_slot_flush(slots, msgs);
+
 		if (subdir)
 			free(subdir);
 
@@ -1504,6 +1851,7 @@ verify_manifest(
 		qsort(elems, elemslen, sizeof(elems[0]), compare_elems);
 	snprintf(buf, sizeof(buf), "%s/%s", dir, manifest);
 	ret = verify_dir(dir, elems, elemslen, 0, buf + 2, msgs);
+#pragma omp atomic
 	checked_manifests++;
 
 	while (elemslen-- > 0)
@@ -1566,6 +1914,7 @@ process_dir_vrfy(void)
 	struct timeval finisht;
 	double etime;
 	char *timestamp;
+	char vret;
 	verify_msg topmsg;
 	verify_msg *walk = &topmsg;
 	verify_msg *next;
@@ -1621,8 +1970,14 @@ process_dir_vrfy(void)
 	 *   entries - verify them, check there are no files which shouldn't
 	 *   be there
 	 * - recurse into directories for which Manifest files are defined
+	 * the verification of files and sub-Manifests is done in tasks,
+	 * which are picked up by the threads started here
 	 */
-	if (verify_manifest(".\0", str_manifest, &walk) != 0)
+	vret = 0;
+#pragma omp parallel num_threads(qmanifest_threads())
+#pragma omp single
+	vret = verify_manifest(".\0", str_manifest, &walk);
+	if (vret != 0)
 		ret = "manifest verification failed";
 
 	gettimeofday(&finisht, NULL);
@@ -1744,8 +2099,10 @@ qmanifest_main(int argc, char **argv)
 
 	while ((ret = GETOPT_LONG(QMANIFEST, qmanifest, "")) != -1) {
 		switch (ret) {
+			JOBS_GETOPTS_CASE
 			COMMON_GETOPTS_CASES(qmanifest)
 			case 'g': runfunc = process_dir_gen;  break;
+			case 'r': rehash = true;              break;
 			case 's': gpg_sign_key = optarg;      break;
 			case 'p': gpg_get_password = true;    break;
 			case 'd': isdir = true;               break;
@@ -1763,6 +2120,10 @@ qmanifest_main(int argc, char **argv)
 		/* default mode: verify */
 		runfunc = process_dir_vrfy;
 
+	if (verbose)
+		printf("using %d thread%s\n", qmanifest_threads(),
+				qmanifest_threads() == 1 ? "" : "s");
+
 	gpgme_check_version(NULL);
 
 	if (isoverlay || (!isdir && !isoverlay)) {
@@ -34,6 +34,7 @@ static struct option const qsearch_long_opts[] = {
 	{"homepage",  no_argument, NULL, 'H'},
 	{"repo",      no_argument, NULL, 'R'},
 	{"format",     a_argument, NULL, 'F'},
+	JOBS_LONG_OPT,
 	COMMON_LONG_OPTS
 };
 static const char * const qsearch_opts_help[] = {
@@ -44,6 +45,7 @@ static const char * const qsearch_opts_help[] = {
 	"Show homepage info instead of description",
 	"Show repository the ebuild originates from",
 	"Print matched atom using given format string",
+	JOBS_OPT_HELP,
 	COMMON_OPTS_HELP
 };
 #define qsearch_usage(ret) usage(ret, QSEARCH_FLAGS, qsearch_long_opts, qsearch_opts_help, NULL, lookup_applet_idx("qsearch"))
@@ -55,16 +57,19 @@ struct qsearch_state {
 	bool search_desc:1;
 	bool search_name:1;
 	bool need_full_atom:1;
-	regex_t search_expr;
+	/* per worker, regexec serialises on a shared regex_t */
+	regex_t *search_expr;
+	depend_atom **last_atom;
 	const char *fmt;
 };
 
 static int
 qsearch_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 {
-	static depend_atom *last_atom;
-
 	struct qsearch_state *state = (struct qsearch_state *)priv;
+	int worker = pkg_ctx->cat_ctx->worker;
+	regex_t *search_expr = &state->search_expr[worker];
+	depend_atom *last_atom = state->last_atom[worker];
 	depend_atom *atom;
 	char *desc;
 	bool match;
@@ -73,13 +78,15 @@ qsearch_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 	if (atom == NULL)
 		return 0;
 
-	/* skip duplicate packages (we never report version) */
-	if (last_atom != NULL && strcmp(last_atom->PN, atom->PN) == 0)
+	/* skip duplicate packages (we never report version), a worker may
+	 * have handled another category in between */
+	if (last_atom != NULL && strcmp(last_atom->PN, atom->PN) == 0 &&
+			strcmp(last_atom->CATEGORY, atom->CATEGORY) == 0)
 		return 0;
 
 	match = false;
 	if (state->search_name &&
-			regexec(&state->search_expr, atom->PN, 0, NULL, 0) == 0)
+			regexec(search_expr, atom->PN, 0, NULL, 0) == 0)
 		match = true;
 
 	desc = NULL;
@@ -93,12 +100,12 @@ qsearch_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 	}
 
 	if (!match && state->search_desc && desc != NULL &&
-			regexec(&state->search_expr, desc, 0, NULL, 0) == 0)
+			regexec(search_expr, desc, 0, NULL, 0) == 0)
 		match = true;
 
 	if (match) {
 		atom = tree_get_atom(pkg_ctx, state->need_full_atom);
-		printf("%s%s%s\n",
+		fprintf(pkg_ctx->cat_ctx->out, "%s%s%s\n",
 				atom_format(state->fmt, atom),
 				(state->show_name ? "" : ": "),
 				(state->show_name ? "" : desc ? desc : ""));
@@ -106,7 +113,7 @@ qsearch_cb(tree_pkg_ctx *pkg_ctx, void *priv)
 
 	if (last_atom != NULL)
 		atom_implode(last_atom);
-	last_atom = atom;
+	state->last_atom[worker] = atom;
 	pkg_ctx->atom = NULL;  /* we stole the atom, make sure it won't get freed */
 
 	return EXIT_SUCCESS;
@@ -119,6 +126,7 @@ int qsearch_main(int argc, char **argv)
 	int i;
 	const char *overlay;
 	size_t n;
+	int nworkers;
 	struct qsearch_state state = {
 		.show_homepage  = false,
 		.show_name      = false,
@@ -131,6 +139,7 @@ int qsearch_main(int argc, char **argv)
 
 	while ((i = GETOPT_LONG(QSEARCH, qsearch, "")) != -1) {
 		switch (i) {
+		JOBS_GETOPTS_CASE
 		COMMON_GETOPTS_CASES(qsearch)
 		case 'a': search_me            = ".*";   break;
 		case 's': state.search_name    = true;   break;
@@ -154,7 +163,11 @@ int qsearch_main(int argc, char **argv)
 			qsearch_usage(EXIT_FAILURE);
 		search_me = argv[optind];
 	}
-	xregcomp(&state.search_expr, search_me, REG_EXTENDED | REG_ICASE);
+	nworkers = jobs > 1 ? jobs : 1;
+	state.search_expr = xcalloc(nworkers, sizeof(state.search_expr[0]));
+	state.last_atom = xcalloc(nworkers, sizeof(state.last_atom[0]));
+	for (i = 0; i < nworkers; i++)
+		xregcomp(&state.search_expr[i], search_me, REG_EXTENDED | REG_ICASE);
 
 	/* set default format */
 	if (state.fmt == NULL) {
@@ -174,11 +187,18 @@ int qsearch_main(int argc, char **argv)
 	array_for_each(overlays, n, overlay) {
 		tree_ctx *t = tree_open(portroot, overlay);
 		if (t != NULL) {
-			ret |= tree_foreach_pkg_sorted(t, qsearch_cb, &state, NULL);
+			ret |= tree_foreach_pkg_parallel(t, qsearch_cb, &state,
+					true, NULL, jobs);
 			tree_close(t);
 		}
 	}
 
-	regfree(&state.search_expr);
+	for (i = 0; i < nworkers; i++) {
+		regfree(&state.search_expr[i]);
+		if (state.last_atom[i] != NULL)
+			atom_implode(state.last_atom[i]);
+	}
+	free(state.search_expr);
+	free(state.last_atom);
 	return ret;
 }
@@ -10,7 +10,10 @@
 
 #include "main.h"
 #include "applets.h"
+#include "libq/cache_file.h"
 #include "libq/hash.h"
+#include "libq/set.h"
+#include "libq/xarray.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -20,23 +23,29 @@
 #include <signal.h>
 #include <fcntl.h>
 
-#define QTEGRITY_FLAGS "a:is" COMMON_FLAGS
+#define QTEGRITY_FLAGS "a:isIf:" COMMON_FLAGS
 static struct option const qtegrity_long_opts[] = {
 	{"add",			a_argument, NULL, 'a'},
 	{"ignore-non-existent", no_argument, NULL, 'i'},
 	{"show-matches", no_argument, NULL, 's'},
+	{"incremental", no_argument, NULL, 'I'},
+	{"measurements", a_argument, NULL, 'f'},
 /* TODO, add this functionality
 	{"convert", a_argument, NULL, 'c'}
 */
+	JOBS_LONG_OPT,
 	COMMON_LONG_OPTS
 };
 static const char * const qtegrity_opts_help[] = {
 	"Add file to store of known-good digests",
 	"Be silent if recorded file no longer exists",
 	"Show recorded digests that match with known-good digests",
+	"Only verify what was recorded since the previous incremental run",
+	"Read the IMA measurements from <arg> instead of securityfs",
 /* TODO
 	"Convert known good digests to different hash function",
 */
+	JOBS_OPT_HELP,
 	COMMON_OPTS_HELP
 };
 #define qtegrity_usage(ret) usage(ret, QTEGRITY_FLAGS, qtegrity_long_opts, qtegrity_opts_help, NULL, lookup_applet_idx("qtegrity"))
@@ -47,6 +56,8 @@ struct qtegrity_opt_state {
 	char* add_file;
 	bool ignore_non_exist;
 	bool show_matches;
+	bool incremental;
+	const char *fn_ima;
 /* TODO
 	bool convert;
 */
@@ -119,11 +130,30 @@ static void get_digest_from_line(char * line, char * ret, int digest_size, int o
 	}
 }
 
-static void get_known_good_digest(const char * fn_store, char * recorded_fname, char * ret, int recorded_digest_size)
+/* a store of known good digests, indexed by filename on first use,
+ * since the filename is found depending on the digest size, there is
+ * an index per size */
+struct known_good_store {
+	const char *fn_store;
+	set *digests[3];    /* SHA1, SHA256, SHA512 */
+};
+
+static set **get_known_good_index(struct known_good_store *store, int recorded_digest_size)
+{
+	switch (recorded_digest_size) {
+		case SHA1_DIGEST_LENGTH:   return &store->digests[0];
+		case SHA256_DIGEST_LENGTH: return &store->digests[1];
+		case SHA512_DIGEST_LENGTH: return &store->digests[2];
+	}
+	return NULL;
+}
+
+static set *load_known_good_digests(const char * fn_store, int recorded_digest_size)
 {
 	/* Open file with known good hashes */
 	int fd_store;
 	FILE *fp_store;
+	set *ret;
 
 	fd_store = open(fn_store, O_RDONLY|O_CLOEXEC, 0);
 	if (fd_store == -1) {
@@ -136,16 +166,14 @@ static void get_known_good_digest(const char * fn_store, char * recorded_fname,
 		exit(0);
 	}
 
-	char *buffered_line, *line, *fname;
+	char *line, *fname, *digest;
 	size_t linelen;
 
-	/* Iterate over lines in known-good-hashes-file; per line: if fname
-	 * matches, grab hash. */
-	buffered_line = line = fname = NULL;
+	/* Iterate over lines in known-good-hashes-file; per line: record
+	 * fname with its hash, the first one listed for fname wins. */
+	ret = create_set();
+	line = fname = NULL;
 	while (getline(&line, &linelen, fp_store) != -1) {
-		free(buffered_line);
-		buffered_line = xstrdup(line);
-
 		get_fname_from_line(line, &fname, recorded_digest_size, 15);
 
 		if (fname == NULL) {
@@ -153,27 +181,63 @@ static void get_known_good_digest(const char * fn_store, char * recorded_fname,
 			continue;
 		}
 
-		if (strcmp(recorded_fname, fname) == 0) {
-			get_digest_from_line(line, ret, recorded_digest_size, 9);
-
-			free(fname);
-			break;
-		}
+		digest = xmalloc(recorded_digest_size+1);
+		digest[0] = '\0';
+		get_digest_from_line(line, digest, recorded_digest_size, 9);
+		if (add_set_value(fname, digest, ret) != NULL)
+			free(digest);
 
 		free(fname);
 	}
 
 	free(line);
-	free(buffered_line);
 
-	close(fd_store);
 	fclose(fp_store);
+
+	return ret;
 }
 
-static int get_size_digest(char * line)
+/* returns the known good digest for recorded_fname, an empty string
+ * when the store lists it without one, or NULL if it isn't listed */
+static const char *get_known_good_digest(struct known_good_store *store, char * recorded_fname, int recorded_digest_size)
+{
+	set **digests = get_known_good_index(store, recorded_digest_size);
+
+	if (digests == NULL)
+		return NULL;
+	if (*digests == NULL)
+		*digests = load_known_good_digests(store->fn_store,
+				recorded_digest_size);
+
+	return get_set(recorded_fname, *digests);
+}
+
+static void free_known_good_store(struct known_good_store *store)
+{
+	DECLARE_ARRAY(digests);
+	size_t i;
+	size_t n;
+	char *digest;
+
+	for (i = 0; i < ARRAY_SIZE(store->digests); i++) {
+		if (store->digests[i] == NULL)
+			continue;
+		values_set(store->digests[i], digests);
+		array_for_each(digests, n, digest)
+			free(digest);
+		xarrayfree_int(digests);
+		free_set(store->digests[i]);
+	}
+}
+
+/* like get_size_digest, but instead of printing an unexpected hash
+ * func, returns it in unexpected_algo for the caller to report */
+static int get_size_digest_quiet(char * line, char **unexpected_algo)
 {
 	int ret = 0;
 
+	*unexpected_algo = NULL;
+
 	char *pfound;
 	/* find colon; it is boundary between end of hash func & begin of
 	 * digest */
@@ -205,7 +269,8 @@ static int get_size_digest(char * line)
 		} else if (strcmp(line_segment, "sha256") == 0) {
 			ret = SHA256_DIGEST_LENGTH;
 		} else {
-			printf("Expected sha algo, got %s", line_segment);
+			*unexpected_algo = line_segment;
+			line_segment = NULL;
 		}
 
 		free(line_segment);
@@ -214,6 +279,19 @@ static int get_size_digest(char * line)
 	return ret;
 }
 
+static int get_size_digest(char * line)
+{
+	char *unexpected_algo;
+	int ret = get_size_digest_quiet(line, &unexpected_algo);
+
+	if (unexpected_algo != NULL) {
+		printf("Expected sha algo, got %s", unexpected_algo);
+		free(unexpected_algo);
+	}
+
+	return ret;
+}
+
 static int check_file(char * filename)
 {
 	if (strlen(filename) > _Q_PATH_MAX)
@@ -226,6 +304,68 @@ static int check_file(char * filename)
 	return FILE_SUCCESS;
 }
 
+/* The IMA measurements only grow while the system is up, so after an
+ * incremental run, how far they were read is remembered together with
+ * the boot they belong to, such that the next run can continue there. */
+#define QTEGRITY_POS_FILE "qtegrity.pos"
+
+static void get_boot_id(char *ret, size_t retlen)
+{
+	FILE *fp;
+
+	snprintf(ret, retlen, "-");
+	if ((fp = fopen("/proc/sys/kernel/random/boot_id", "re")) != NULL) {
+		if (fgets(ret, retlen, fp) != NULL)
+			ret[strcspn(ret, "\n")] = '\0';
+		fclose(fp);
+	}
+}
+
+static off_t load_ima_pos(int cache_fd, const char *boot_id)
+{
+	char id[64];
+	long long pos;
+	FILE *fp;
+	int fd;
+	off_t ret = 0;
+
+	fd = openat(cache_fd, QTEGRITY_POS_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return 0;
+	}
+	if (fscanf(fp, "%63s %lld", id, &pos) == 2 &&
+			strcmp(id, boot_id) == 0 && pos > 0)
+		ret = (off_t)pos;
+	fclose(fp);
+
+	return ret;
+}
+
+static void save_ima_pos(int cache_fd, const char *boot_id, off_t pos)
+{
+	char buf[128];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%s %lld\n", boot_id, (long long)pos);
+	if (!cache_file_write(cache_fd, QTEGRITY_POS_FILE, buf, (size_t)len))
+		warnp("unable to record position in %s/%s",
+				portcachedir, QTEGRITY_POS_FILE);
+}
+
+/* a line from the IMA measurements, with what was found about it */
+struct ima_entry {
+	char *line;
+	char *unexpected_algo;
+	char *recorded_fname;
+	char *recorded_digest;
+	int recorded_digest_size;
+	bool accessible;
+	bool executable;
+};
+
 int qtegrity_main(int argc, char **argv)
 {
 	int i;
@@ -235,6 +375,8 @@ int qtegrity_main(int argc, char **argv)
 		.add = false,
 		.ignore_non_exist = false,
 		.show_matches = false,
+		.incremental = false,
+		.fn_ima = "/sys/kernel/security/ima/ascii_runtime_measurements",
 /* TODO
 		.convert = false;
 */
@@ -242,6 +384,7 @@ int qtegrity_main(int argc, char **argv)
 
 	while ((i = GETOPT_LONG(QTEGRITY, qtegrity, "")) != -1) {
 		switch (i) {
+			JOBS_GETOPTS_CASE
 			COMMON_GETOPTS_CASES(qtegrity)
 			case 'a':
 				state.ima = false;
@@ -254,15 +397,29 @@ int qtegrity_main(int argc, char **argv)
 				break;
 			case 'i': state.ignore_non_exist = true; break;
 			case 's': state.show_matches = true; break;
+			case 'I': state.incremental = true; break;
+			case 'f': state.fn_ima = optarg; break;
 		}
 	}
 
 	if (state.ima) {
-		const char *fn_ima =
-			"/sys/kernel/security/ima/ascii_runtime_measurements";
+		const char *fn_ima = state.fn_ima;
 		int fd_ima;
 		FILE *fp_ima;
-		struct stat st;
+		struct known_good_store store_custom = {
+			.fn_store = "/var/db/QTEGRITY_custom",
+		};
+		struct known_good_store store_os = {
+			.fn_store = "/var/db/QTEGRITY",
+		};
+		char boot_id[64];
+		int cache_fd = -1;
+		off_t pos = 0;
+		ssize_t len;
+		size_t n;
+		int nthreads = jobs > 1 ? jobs : 1;
+		DECLARE_ARRAY(entries);
+		struct ima_entry *e;
 
 		fd_ima = open(fn_ima, O_RDONLY|O_CLOEXEC, 0);
 		if (fd_ima == -1) {
@@ -277,113 +434,142 @@ int qtegrity_main(int argc, char **argv)
 			exit(0);
 		}
 
-		char *buffered_line, *line, *recorded_fname;
-		int recorded_digest_size = 0;
+		/* like the other caches, the position is kept relative to
+		 * ROOT, without it, all measurements are verified */
+		if (state.incremental) {
+			int root_fd = open(portroot, O_RDONLY | O_CLOEXEC | O_PATH);
+
+			if (root_fd != -1) {
+				cache_fd = cache_dir_open(root_fd, portcachedir);
+				close(root_fd);
+			}
+		}
+		if (cache_fd != -1) {
+			get_boot_id(boot_id, sizeof(boot_id));
+			pos = load_ima_pos(cache_fd, boot_id);
+			if (pos > 0 && fseeko(fp_ima, pos, SEEK_SET) != 0)
+				pos = 0;
+		}
+
+		char *line;
 		size_t linelen;
 
-		/* Iterate over IMA file, grab fname and digest, get known good
-		 * digest for fname and compare */
-		buffered_line = line = recorded_fname = NULL;
-		while (getline(&line, &linelen, fp_ima) != -1) {
-			char *recorded_digest;
-			char *digest;
+		/* Iterate over IMA file, grab fname and digest */
+		line = NULL;
+		while ((len = getline(&line, &linelen, fp_ima)) != -1) {
+			struct ima_entry ent;
 
-			free(buffered_line);
-			buffered_line = xstrdup(line);
+			pos += len;
 
-			if (buffered_line[0] != '1' || buffered_line[1] != '0')
+			if (line[0] != '1' || line[1] != '0')
 				continue;
 
-			recorded_digest_size = get_size_digest(buffered_line);
-			recorded_digest = xmalloc(recorded_digest_size+1);
-			recorded_digest[0] = '\0';
+			memset(&ent, 0, sizeof(ent));
+			ent.line = xstrdup(line);
+			ent.recorded_digest_size =
+				get_size_digest_quiet(ent.line, &ent.unexpected_algo);
+			ent.recorded_digest = xmalloc(ent.recorded_digest_size+1);
+			ent.recorded_digest[0] = '\0';
 
 			/* grab fname from IMA file line */
-			get_fname_from_line(buffered_line, &recorded_fname,
-					recorded_digest_size, 51);
+			get_fname_from_line(ent.line, &ent.recorded_fname,
+					ent.recorded_digest_size, 51);
 			/* grab digest from IMA file line, @TODO, check whether
 			 * digest == 000etc */
-			get_digest_from_line(buffered_line, recorded_digest,
-					recorded_digest_size, 50);
+			get_digest_from_line(ent.line, ent.recorded_digest,
+					ent.recorded_digest_size, 50);
+
+			xarraypush_struct(entries, &ent);
+		}
+		free(line);
+
+		/* look at the recorded files in parallel, what is found is
+		 * reported in order below */
+#pragma omp parallel for schedule(dynamic, 64) num_threads(nthreads)
+		for (n = 0; n < array_cnt(entries); n++) {
+			struct ima_entry *ie = array_get_elem(entries, n);
+			struct stat st;
+
+			if (ie->recorded_fname == NULL ||
+					*ie->recorded_digest == '\0' ||
+					ie->recorded_fname[0] != '/' ||
+					stat(ie->recorded_fname, &st) < 0)
+				continue;
 
-			if (recorded_fname == NULL || *recorded_digest == '\0') {
-				printf("Empty recorded filename: %s\n", line);
+			ie->accessible = true;
+			ie->executable = (st.st_mode & S_IXUSR ||
+					st.st_mode & S_IXGRP ||
+					st.st_mode & S_IXOTH);
+		}
 
-				if (recorded_fname != NULL)
-					free(recorded_fname);
+		/* compare recorded digests to known good digests for fname */
+		array_for_each(entries, n, e) {
+			const char *digest;
 
-				free(recorded_digest);
+			if (e->unexpected_algo != NULL)
+				printf("Expected sha algo, got %s", e->unexpected_algo);
 
+			if (e->recorded_fname == NULL || *e->recorded_digest == '\0') {
+				printf("Empty recorded filename: %s\n", e->line);
 				continue;
 			}
 
-			if (check_file(recorded_fname) == FILE_RELATIVE) {
-				printf("Seems like a kernel process: %s\n", recorded_fname);
-
-				free(recorded_fname);
-				free(recorded_digest);
+			if (check_file(e->recorded_fname) == FILE_RELATIVE) {
+				printf("Seems like a kernel process: %s\n",
+						e->recorded_fname);
 				continue;
 			}
 
-			if (stat(recorded_fname, &st) < 0) {
+			if (!e->accessible) {
 				if (!state.ignore_non_exist)
 					printf("Couldn't access recorded file '%s'\n",
-							recorded_fname);
-
-				free(recorded_fname);
-				free(recorded_digest);
+							e->recorded_fname);
 				continue;
 			}
 
-			if (!(st.st_mode & S_IXUSR ||
-						st.st_mode & S_IXGRP ||
-						st.st_mode & S_IXOTH))
-			{
-				free(recorded_fname);
-				free(recorded_digest);
+			if (!e->executable)
 				continue;
-			}
-
-			digest = xmalloc(recorded_digest_size+1);
-			digest[0] = '\0';
 
 			/* first try custom known good digests for fname */
-			get_known_good_digest("/var/db/QTEGRITY_custom",
-					recorded_fname, digest, recorded_digest_size);
+			digest = get_known_good_digest(&store_custom,
+					e->recorded_fname, e->recorded_digest_size);
 
-			if (digest[0] == '\0') {
-				digest[0] = '\0';
+			if (digest == NULL || digest[0] == '\0') {
 				/* then try from OS source */
-				get_known_good_digest("/var/db/QTEGRITY",
-						recorded_fname, digest, recorded_digest_size);
-
-				if (digest[0] == '\0') {
-					printf("No digest found for: %s\n", line);
+				digest = get_known_good_digest(&store_os,
+						e->recorded_fname, e->recorded_digest_size);
 
-					free(recorded_fname);
-					free(recorded_digest);
-					free(digest);
+				if (digest == NULL || digest[0] == '\0') {
+					printf("No digest found for: %s\n", e->line);
 					continue;
 				}
 			}
 
-			if (strcmp(recorded_digest, digest) != 0) {
-				printf("Digest didn't match for %s\n", recorded_fname);
+			if (strcmp(e->recorded_digest, digest) != 0) {
+				printf("Digest didn't match for %s\n", e->recorded_fname);
 				printf("Known-good: '%s'...\nRecorded: '%s'\n\n",
-						digest, recorded_digest);
+						digest, e->recorded_digest);
 			} else if (state.show_matches) {
-				printf("Success! Digest matched for %s\n", recorded_fname);
+				printf("Success! Digest matched for %s\n",
+						e->recorded_fname);
 			}
+		}
 
-			free(recorded_fname);
-			free(recorded_digest);
-			free(digest);
+		if (cache_fd != -1) {
+			save_ima_pos(cache_fd, boot_id, pos);
+			close(cache_fd);
 		}
 
-		free(line);
-		free(buffered_line);
+		array_for_each(entries, n, e) {
+			free(e->line);
+			free(e->unexpected_algo);
+			free(e->recorded_fname);
+			free(e->recorded_digest);
+		}
+		xarrayfree(entries);
+		free_known_good_store(&store_custom);
+		free_known_good_store(&store_os);
 
-		close(fd_ima);
 		fclose(fp_ima);
 	} else if (state.add) {
 		/* Add a single executable file+digest to the custom digest store */
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#include "main.h"
+#include "atom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+const char *argv0;
+FILE *warnout;
+
+#define MAXATOMS 1024
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double)(end.tv_sec - start->tv_sec) * 1e9 +
+		(double)(end.tv_nsec - start->tv_nsec);
+}
+
+/* times atom_compare on all pairs of the atoms from the given tests
+ * files, such as static.tests, both on atoms exploded once, and on
+ * freshly exploded atoms compared once, as most callers do, this only
+ * uses atom_explode and atom_compare, so it can be built against older
+ * trees for comparison */
+int main(int argc, char *argv[])
+{
+	static char *strs[MAXATOMS];
+	static depend_atom *atoms[MAXATOMS];
+	struct timespec start;
+	char buf[BUFSIZ];
+	char *tok;
+	char *p;
+	FILE *fp;
+	size_t natoms = 0;
+	size_t rounds;
+	size_t r;
+	size_t i;
+	size_t j;
+	size_t eq = 0;
+	double ns;
+	int a;
+
+	argv0 = argv[0];
+	warnout = stderr;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <tests file>...\n", argv0);
+		return 1;
+	}
+
+	for (a = 1; a < argc; a++) {
+		if ((fp = fopen(argv[a], "r")) == NULL) {
+			fprintf(stderr, "cannot open %s\n", argv[a]);
+			return 1;
+		}
+		while (fgets(buf, sizeof(buf), fp) != NULL) {
+			if ((p = strchr(buf, '#')) != NULL)
+				*p = '\0';
+			for (tok = strtok(buf, " \t\n"); tok != NULL;
+					tok = strtok(NULL, " \t\n"))
+				if (natoms < MAXATOMS)
+					strs[natoms++] = strdup(tok);
+		}
+		fclose(fp);
+	}
+
+	/* about a few seconds of work */
+	rounds = 20000000 / (natoms * natoms + 1) + 1;
+
+	for (i = 0; i < natoms; i++)
+		atoms[i] = atom_explode(strs[i]);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < natoms; i++)
+			for (j = 0; j < natoms; j++)
+				eq += atom_compare(atoms[i], atoms[j]) == EQUAL;
+	ns = elapsed(&start);
+	printf("%-24s %8.1f ns/compare\n", "compare",
+			ns / (double)(rounds * natoms * natoms));
+	for (i = 0; i < natoms; i++)
+		atom_implode(atoms[i]);
+
+	rounds = rounds * natoms / 2 + 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i + 1 < natoms; i += 2) {
+			depend_atom *a1 = atom_explode(strs[i]);
+			depend_atom *a2 = atom_explode(strs[i + 1]);
+			eq += atom_compare(a1, a2) == EQUAL;
+			atom_implode(a1);
+			atom_implode(a2);
+		}
+	}
+	ns = elapsed(&start);
+	printf("%-24s %8.1f ns/pair\n", "explode+compare",
+			ns / (double)(rounds * (natoms / 2)));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < natoms; i++)
+			atom_implode(atom_explode(strs[i]));
+	ns = elapsed(&start);
+	printf("%-24s %8.1f ns/atom\n", "explode",
+			ns / (double)(rounds * natoms));
+
+	/* keep the comparisons from being optimised away */
+	if (eq == 0)
+		printf("no atoms compared equal\n");
+
+	for (i = 0; i < natoms; i++)
+		free(strs[i]);
+	return 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#include "main.h"
+#include "bulk_read.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char *argv0;
+FILE *warnout;
+
+/* more files than operations in flight, to see they're refilled */
+#define NFILES  150
+#define MAXSIZE 4096
+
+static const enum bulk_read_impl impls[] = {
+	BULK_READ_SYNC,
+	BULK_READ_URING,
+	BULK_READ_AUTO,
+};
+static const char *impl_names[] = {
+	"sync",
+	"uring",
+	"auto",
+};
+
+struct result {
+	int seen;
+	int err;
+	int isreg;
+	size_t len;
+	unsigned int sum;
+	int streamed;
+};
+
+/* files are named after their index, of which the contents depend,
+ * the last few are special: a directory, and one that doesn't exist */
+#define F_DIR     (NFILES - 2)
+#define F_MISSING (NFILES - 1)
+
+static size_t
+file_len(size_t i)
+{
+	/* some files are larger than MAXSIZE */
+	return (i * 97) % (MAXSIZE + 512);
+}
+
+static unsigned int
+file_sum(size_t i)
+{
+	unsigned int sum = 0;
+	size_t j;
+
+	for (j = 0; j < file_len(i); j++)
+		sum = sum * 31 + (unsigned char)(i + j);
+	return sum;
+}
+
+/* small files come with their data, larger ones are read by cb */
+static int
+file_ok(const struct result *r, size_t i)
+{
+	return r->err == 0 &&
+		r->len == file_len(i) &&
+		r->sum == file_sum(i) &&
+		r->streamed == (file_len(i) > MAXSIZE);
+}
+
+static void
+cb(bulk_read_file *f, void *priv)
+{
+	struct result *r = &((struct result *)priv)[f->idx];
+	unsigned char buf[MAXSIZE + 512];
+	ssize_t rlen;
+	size_t j;
+
+	r->seen++;
+	r->err = f->err;
+	if (f->err != 0)
+		return;
+	r->isreg = S_ISREG(f->st.st_mode);
+	if (f->data == NULL) {
+		if (!r->isreg)
+			return;
+		rlen = read(f->fd, buf, sizeof(buf));
+		if (rlen < 0)
+			return;
+		r->streamed = 1;
+		r->len = (size_t)rlen;
+	} else {
+		memcpy(buf, f->data, f->len);
+		r->len = f->len;
+	}
+	for (j = 0; j < r->len; j++)
+		r->sum = r->sum * 31 + buf[j];
+}
+
+static int
+check(const char *impl, struct result *res)
+{
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < NFILES; i++) {
+		if (res[i].seen != 1) {
+			printf("FAIL bulk_read %s f%zu: seen %d times\n",
+					impl, i, res[i].seen);
+			ret = 1;
+		} else if (i == F_MISSING) {
+			if (res[i].err != ENOENT) {
+				printf("FAIL bulk_read %s f%zu: err %d\n",
+						impl, i, res[i].err);
+				ret = 1;
+			}
+		} else if (i == F_DIR) {
+			if (res[i].err != 0 || res[i].isreg) {
+				printf("FAIL bulk_read %s f%zu: not a directory\n",
+						impl, i);
+				ret = 1;
+			}
+		} else if (!file_ok(&res[i], i)) {
+			printf("FAIL bulk_read %s f%zu: len %zu/%zu%s\n",
+					impl, i, res[i].len, file_len(i),
+					res[i].streamed ? " (streamed)" : "");
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+/* puts /dev/null in place of the io_uring of this thread, if it has one */
+static int
+break_ring(void)
+{
+	DIR *d;
+	struct dirent *de;
+	char path[64];
+	char link[64];
+	ssize_t len;
+	int fd = -1;
+	int nfd;
+
+	if ((d = opendir("/proc/self/fd")) == NULL)
+		return 0;
+	while ((de = readdir(d)) != NULL) {
+		snprintf(path, sizeof(path), "/proc/self/fd/%s", de->d_name);
+		len = readlink(path, link, sizeof(link) - 1);
+		if (len < 0)
+			continue;
+		link[len] = '\0';
+		if (strcmp(link, "anon_inode:[io_uring]") == 0)
+			fd = atoi(de->d_name);
+	}
+	closedir(d);
+	if (fd == -1)
+		return 0;
+
+	nfd = open("/dev/null", O_RDONLY);
+	if (nfd == -1 || dup2(nfd, fd) == -1)
+		return 0;
+	close(nfd);
+	return 1;
+}
+
+/* files in sysfs claim a size of a page, but hold less, such short
+ * reads must be left to the callback too */
+static int
+check_short(void)
+{
+	const char *name = "online";
+	struct result res[1];
+	char buf[64];
+	ssize_t len;
+	int dfd;
+	int fd;
+	int ret = 0;
+	size_t j;
+
+	if ((dfd = open("/sys/devices/system/cpu", O_RDONLY)) == -1)
+		return 0;
+	if ((fd = openat(dfd, name, O_RDONLY)) == -1) {
+		close(dfd);
+		return 0;
+	}
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	for (j = 0; len > 0 && j < ARRAY_SIZE(impls); j++) {
+		memset(res, 0, sizeof(res));
+		if (!bulk_read_files_impl(dfd, &name, 1, MAXSIZE,
+					cb, res, impls[j]))
+			continue;
+		if (res[0].seen != 1 || res[0].err != 0 ||
+				!res[0].streamed || res[0].len != (size_t)len) {
+			printf("FAIL bulk_read %s short: len %zu/%zd%s\n",
+					impl_names[j], res[0].len, len,
+					res[0].streamed ? " (streamed)" : "");
+			ret = 1;
+		}
+	}
+	close(dfd);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "bulk_read.XXXXXX";
+	char names[NFILES][16];
+	const char *pnames[NFILES];
+	struct result res[NFILES];
+	unsigned char buf[MAXSIZE + 512];
+	size_t i;
+	size_t j;
+	int dfd;
+	int fd;
+	int ret = 0;
+
+	(void)argc;
+	argv0 = argv[0];
+	warnout = stderr;
+
+	if (mkdtemp(dir) == NULL || (dfd = open(dir, O_RDONLY)) == -1) {
+		printf("FAIL: cannot create %s\n", dir);
+		return 1;
+	}
+	for (i = 0; i < NFILES; i++) {
+		snprintf(names[i], sizeof(names[i]), "f%zu", i);
+		pnames[i] = names[i];
+		if (i == F_MISSING)
+			continue;
+		if (i == F_DIR) {
+			mkdirat(dfd, names[i], 0755);
+			continue;
+		}
+		for (j = 0; j < file_len(i); j++)
+			buf[j] = (unsigned char)(i + j);
+		fd = openat(dfd, names[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1 || write(fd, buf, file_len(i)) != (ssize_t)file_len(i)) {
+			printf("FAIL: cannot write %s\n", names[i]);
+			return 1;
+		}
+		close(fd);
+	}
+
+	for (j = 0; j < ARRAY_SIZE(impls); j++) {
+		memset(res, 0, sizeof(res));
+		if (!bulk_read_files_impl(dfd, pnames, NFILES, MAXSIZE,
+					cb, res, impls[j])) {
+			printf("SKIP bulk_read %s: not supported\n", impl_names[j]);
+			continue;
+		}
+		ret |= check(impl_names[j], res);
+	}
+
+	ret |= check_short();
+
+	/* a ring that breaks down must not lose any files, replacing its fd
+	 * makes io_uring_enter fail, after which reads are done without it */
+	if (break_ring()) {
+		memset(res, 0, sizeof(res));
+		bulk_read_files_impl(dfd, pnames, NFILES, MAXSIZE,
+				cb, res, BULK_READ_AUTO);
+		ret |= check("broken uring", res);
+	}
+
+	for (i = 0; i < NFILES; i++)
+		unlinkat(dfd, names[i], i == F_DIR ? AT_REMOVEDIR : 0);
+	close(dfd);
+	rmdir(dir);
+
+	return ret;
+}
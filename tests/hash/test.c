@@ -0,0 +1,261 @@
+/*
+ * Copyright 2020 Gentoo Foundation
+ * Distributed under the terms of the GNU General Public License v2
+ */
+
+#include "main.h"
+#include "hash.h"
+#include "hash_blake2b.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+const char *argv0;
+FILE *warnout;
+
+/* RFC 7693 and reference implementation test vectors */
+static const struct {
+	const char *in;
+	const char *out;
+} vectors[] = {
+	{ "",
+	  "786a02f742015903c6c6fd852552d272912f4740e15847618a86e217f71f5419"
+	  "d25e1031afee585313896444934eb04b903a685b1448b755d56f701afe9be2ce" },
+	{ "abc",
+	  "ba80a53f981c4d0d6a2797b69f12f6e94c212f14685ac4b74b12bb6fdbffa2d1"
+	  "7d87c5392aab792dc252d5de4533cc9518d38aa8dbf1925ab92386edd4009923" },
+	{ "The quick brown fox jumps over the lazy dog",
+	  "a8add4bdddfd93e4877d2746e62817b116364a1fa7bc148d95090bc7333b3673"
+	  "f82401cf7aa2e4cb1ecd90296e3f14cb5413f8ed77be73045b13914cdcd6a918" },
+};
+
+static const enum hash_blake2b_impl impls[] = {
+	HASH_BLAKE2B_REF,
+	HASH_BLAKE2B_SSSE3,
+	HASH_BLAKE2B_AVX2,
+	HASH_BLAKE2B_AUTO,
+};
+static const char *impl_names[] = {
+	"ref",
+	"ssse3",
+	"avx2",
+	"auto",
+};
+
+static void
+digest(enum hash_blake2b_impl impl, const unsigned char *data, size_t len,
+		size_t chunk, char *out)
+{
+	hash_blake2b_ctx ctx;
+	unsigned char buf[HASH_BLAKE2B_OUTBYTES];
+	size_t n;
+
+	hash_blake2b_init_impl(&ctx, HASH_BLAKE2B_OUTBYTES, impl);
+	for (; len > 0; data += n, len -= n) {
+		n = len < chunk ? len : chunk;
+		hash_blake2b_update(&ctx, data, n);
+	}
+	hash_blake2b_final(&ctx, buf);
+	for (n = 0; n < sizeof(buf); n++)
+		snprintf(out + n * 2, 3, "%02x", buf[n]);
+}
+
+/* sizes timed by bench when none are given */
+static const size_t bench_sizes[] = {
+	100,
+	1024,
+	64 * 1024,
+	1024 * 1024,
+	64 * 1024 * 1024,
+};
+
+/* times hashing files of the given sizes with SHA256 and SHA512, the
+ * way qmanifest and qcheck do, reported in microseconds per file, this
+ * only uses hash_multiple_file_fd, so it can be built against older
+ * trees for comparison, set OMP_NUM_THREADS to vary the threads */
+static int
+bench(int argc, char *argv[])
+{
+	static unsigned char data[64 * 1024];
+	char fname[] = "hash-bench.XXXXXX";
+	char sha256[64 + 1];
+	char sha512[128 + 1];
+	struct timespec start;
+	struct timespec end;
+	unsigned int seed = 1;
+	size_t sizes[32];
+	size_t nsizes;
+	size_t size;
+	size_t flen;
+	size_t runs;
+	size_t i;
+	size_t j;
+	double us;
+	char *p;
+	int fd;
+
+	for (i = 0; i < sizeof(data); i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (unsigned char)(seed >> 16);
+	}
+
+	if (argc > 0) {
+		for (nsizes = 0; nsizes < (size_t)argc &&
+				nsizes < ARRAY_SIZE(sizes); nsizes++)
+		{
+			sizes[nsizes] = (size_t)strtoull(argv[nsizes], &p, 10);
+			if (p == argv[nsizes] || *p != '\0') {
+				fprintf(stderr, "%s: not a size\n", argv[nsizes]);
+				return 1;
+			}
+		}
+	} else {
+		nsizes = ARRAY_SIZE(bench_sizes);
+		memcpy(sizes, bench_sizes, sizeof(bench_sizes));
+	}
+
+	if ((fd = mkstemp(fname)) == -1) {
+		fprintf(stderr, "cannot create %s\n", fname);
+		return 1;
+	}
+	close(fd);
+
+	printf("%12s %12s %8s\n", "bytes", "us/file", "runs");
+	for (i = 0; i < nsizes; i++) {
+		fd = open(fname, O_WRONLY | O_TRUNC);
+		for (size = 0; fd != -1 && size < sizes[i]; size += j) {
+			j = sizes[i] - size;
+			if (j > sizeof(data))
+				j = sizeof(data);
+			if (write(fd, data, j) != (ssize_t)j)
+				break;
+		}
+		if (fd == -1 || close(fd) != 0 || size != sizes[i]) {
+			fprintf(stderr, "cannot write %s\n", fname);
+			unlink(fname);
+			return 1;
+		}
+
+		/* about a second of work, from the page cache */
+		runs = (size_t)(256 * 1024 * 1024) / (sizes[i] + 1);
+		if (runs > 100000)
+			runs = 100000;
+		if (runs < 3)
+			runs = 3;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < runs; j++) {
+			fd = open(fname, O_RDONLY);
+			if (fd == -1 || hash_multiple_file_fd(fd, NULL, NULL,
+						sha256, sha512, NULL, NULL, &flen,
+						HASH_SHA256 | HASH_SHA512) != 0)
+			{
+				fprintf(stderr, "cannot hash %s\n", fname);
+				unlink(fname);
+				return 1;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		us = (double)(end.tv_sec - start.tv_sec) * 1e6 +
+			(double)(end.tv_nsec - start.tv_nsec) / 1e3;
+		printf("%12zu %12.1f %8zu\n", sizes[i], us / (double)runs, runs);
+	}
+
+	unlink(fname);
+	return 0;
+}
+
+/* without arguments this checks the BLAKE2b implementations, with
+ * "bench [size...]" it times hashing of files instead */
+int main(int argc, char *argv[])
+{
+	static unsigned char data[4096];
+	char ref[HASH_BLAKE2B_OUTBYTES * 2 + 1];
+	char got[HASH_BLAKE2B_OUTBYTES * 2 + 1];
+	hash_blake2b_ctx ctx;
+	unsigned int seed = 1;
+	size_t i;
+	size_t j;
+	size_t len;
+	size_t chunk;
+	const unsigned char *mdata[9];
+	size_t mlen[9];
+	unsigned char mout[9][HASH_BLAKE2B_OUTBYTES];
+	size_t n;
+	int ret = 0;
+
+	argv0 = argv[0];
+	warnout = stderr;
+
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+		return bench(argc - 2, argv + 2);
+
+	for (i = 0; i < sizeof(data); i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (unsigned char)(seed >> 16);
+	}
+
+	for (j = 0; j < ARRAY_SIZE(impls); j++) {
+		if (!hash_blake2b_init_impl(&ctx, HASH_BLAKE2B_OUTBYTES, impls[j])) {
+			printf("SKIP blake2b %s: not supported by this CPU\n",
+					impl_names[j]);
+			continue;
+		}
+
+		/* known answers */
+		for (i = 0; i < ARRAY_SIZE(vectors); i++) {
+			digest(impls[j], (const unsigned char *)vectors[i].in,
+					strlen(vectors[i].in), 1, got);
+			if (strcmp(got, vectors[i].out) != 0) {
+				printf("FAIL blake2b %s \"%s\": %s\n",
+						impl_names[j], vectors[i].in, got);
+				ret = 1;
+			}
+		}
+
+		/* the same as the scalar reference, for lengths around block
+		 * boundaries, fed in various chunk sizes */
+		for (len = 0; len <= sizeof(data); len += len < 300 ? 1 : 127) {
+			digest(HASH_BLAKE2B_REF, data, len, len + 1, ref);
+			for (chunk = 1; chunk <= 257; chunk += 64) {
+				digest(impls[j], data, len, chunk, got);
+				if (strcmp(got, ref) != 0) {
+					printf("FAIL blake2b %s len=%zu chunk=%zu\n",
+							impl_names[j], len, chunk);
+					ret = 1;
+				}
+			}
+		}
+	}
+
+	/* batches of messages, of mixed lengths such that lanes finish at
+	 * different blocks, must give the same as one by one */
+	for (n = 1; n <= ARRAY_SIZE(mdata); n++) {
+		for (len = 0; len <= 1100; len += 61) {
+			for (i = 0; i < n; i++) {
+				mlen[i] = (len * (i + 1) + i * 37) % 1200;
+				if (i % 3 == 2)
+					mlen[i] = len;
+				mdata[i] = data + i * 300;
+			}
+			hash_blake2b_many(mdata, mlen, n, mout);
+			for (i = 0; i < n; i++) {
+				digest(HASH_BLAKE2B_REF, mdata[i], mlen[i], 128, ref);
+				for (j = 0; j < HASH_BLAKE2B_OUTBYTES; j++)
+					snprintf(got + j * 2, 3, "%02x", mout[i][j]);
+				if (strcmp(got, ref) != 0) {
+					printf("FAIL blake2b many n=%zu msg=%zu len=%zu\n",
+							n, i, mlen[i]);
+					ret = 1;
+				}
+			}
+		}
+	}
+
+	return ret;
+}